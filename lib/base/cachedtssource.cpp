@@ -1,47 +1,255 @@
 #include <lib/base/cachedtssource.h>
+#include <lib/base/eerror.h>
+#include <errno.h>
+#include <string.h>
 
-static const unsigned int CACHE_SIZE = 32*1024;
+static const size_t DEFAULT_CACHE_SIZE = 1024*1024;
 
 DEFINE_REF(eCachedSource);
 
-eCachedSource::eCachedSource(ePtr<iTsSource>& source)
+void eCachedSourcePrefetcher::thread()
+{
+	hasStarted();
+	m_cache.prefetchThread();
+}
+
+eCachedSource::eCachedSource(ePtr<iTsSource>& source, size_t cachesize)
 	: iTsSource(source->getPacketSize())
 	, m_source(source)
-	, m_cache_buffer((char*)malloc(CACHE_SIZE))
-	, m_cache_offset(0)
-	, m_cache_bytes(0)
+	, m_max_blocks((cachesize ? cachesize : DEFAULT_CACHE_SIZE) / BLOCK_SIZE)
+	, m_last_offset(0)
+	, m_next_block(-1)
+	, m_sequential(0)
+	, m_stop(0)
+	, m_prefetcher(NULL)
 {
+	if (m_max_blocks < MIN_BLOCKS)
+		m_max_blocks = MIN_BLOCKS;
 }
 
 eCachedSource::~eCachedSource()
 {
-	free(m_cache_buffer);
+	if (m_prefetcher)
+	{
+		{
+			eSingleLocker l(m_lock);
+			m_stop = 1;
+			m_work.signal();
+		}
+		m_prefetcher->kill();
+		delete m_prefetcher;
+	}
+	for (std::map<off_t, block*>::iterator i(m_blocks.begin()); i != m_blocks.end(); ++i)
+	{
+		free(i->second->data);
+		delete i->second;
+	}
+}
+
+	/* with m_lock held. a new block, or the least recently used one that isn't being loaded */
+eCachedSource::block *eCachedSource::allocBlock(off_t offset)
+{
+	block *b = NULL;
+	if (m_blocks.size() < m_max_blocks)
+	{
+		char *data = (char*)malloc(BLOCK_SIZE);
+		if (!data)
+			return NULL;
+		b = new block;
+		b->data = data;
+	}
+	else
+	{
+		for (std::list<block*>::iterator i(m_lru.end()); i != m_lru.begin();)
+		{
+			--i;
+			if (!(*i)->loading)
+			{
+				b = *i;
+				m_lru.erase(i);
+				m_blocks.erase(b->offset);
+				break;
+			}
+		}
+		if (!b)
+			return NULL;
+	}
+	b->offset = offset;
+	b->bytes = 0;
+	b->loading = 1;
+	m_lru.push_front(b);
+	b->lru = m_lru.begin();
+	m_blocks[offset] = b;
+	return b;
+}
+
+void eCachedSource::freeBlock(block *b)
+{
+	m_lru.erase(b->lru);
+	m_blocks.erase(b->offset);
+	free(b->data);
+	delete b;
+}
+
+	/* with m_lock held, which is released while reading. -1 with errno set on error */
+int eCachedSource::loadBlock(block *b)
+{
+	off_t offset = b->offset;
+	char *data = b->data;
+	ssize_t bytes = 0, r = 0;
+
+	m_lock.unlock();
+		/* the source may return less than asked for */
+	while (bytes < BLOCK_SIZE)
+	{
+		r = m_source->read(offset + bytes, data + bytes, BLOCK_SIZE - bytes);
+		if (r <= 0)
+			break;
+		bytes += r;
+	}
+	int error = errno;
+	m_lock.lock();
+
+	b->loading = 0;
+	b->bytes = bytes;
+	m_loaded.signal();
+	if (r < 0 && !bytes)
+	{
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+	/* with m_lock held. the (complete) block at @offset, loading it if needed */
+eCachedSource::block *eCachedSource::getBlock(off_t offset)
+{
+	block *b;
+	while (1)
+	{
+		std::map<off_t, block*>::iterator i = m_blocks.find(offset);
+		if (i == m_blocks.end())
+		{
+			b = allocBlock(offset);
+			if (!b)
+			{
+				errno = ENOMEM;
+				return NULL;
+			}
+			break;
+		}
+		b = i->second;
+		if (b->loading)
+		{
+				/* by the prefetcher, look again when it's done */
+			m_loaded.wait(m_lock);
+			continue;
+		}
+		if (b->bytes == BLOCK_SIZE)
+		{
+			m_lru.splice(m_lru.begin(), m_lru, b->lru);
+			return b;
+		}
+			/* the end of the file when it was read, it may have grown since */
+		b->loading = 1;
+		break;
+	}
+	if (loadBlock(b) < 0)
+	{
+		freeBlock(b);
+		return NULL;
+	}
+	return b;
+}
+
+	/* with m_lock held */
+void eCachedSource::requestPrefetch(off_t offset)
+{
+	if (m_blocks.find(offset) != m_blocks.end())
+		return;
+	for (std::list<off_t>::const_iterator i(m_prefetch_queue.begin()); i != m_prefetch_queue.end(); ++i)
+		if (*i == offset)
+			return;
+	m_prefetch_queue.push_back(offset);
+		/* after a seek the old requests are of no use anymore */
+	if (m_prefetch_queue.size() > READAHEAD_BLOCKS * 2)
+		m_prefetch_queue.pop_front();
+	if (!m_prefetcher)
+	{
+		m_prefetcher = new eCachedSourcePrefetcher(*this);
+		m_prefetcher->runAsync();
+	}
+	m_work.signal();
+}
+
+void eCachedSource::prefetchThread()
+{
+	eSingleLocker l(m_lock);
+	while (!m_stop)
+	{
+		if (m_prefetch_queue.empty())
+		{
+			m_work.wait(m_lock);
+			continue;
+		}
+		off_t offset = m_prefetch_queue.front();
+		m_prefetch_queue.pop_front();
+		if (m_blocks.find(offset) != m_blocks.end())
+			continue;
+		block *b = allocBlock(offset);
+		if (b && loadBlock(b) < 0)
+			freeBlock(b);
+	}
 }
 
 ssize_t eCachedSource::read(off_t offset, void *buf, size_t count)
 {
-	/* Not quite optimal, but just enough to read bit more efficient than tiny 188 byte chunks */
-	if (count >= CACHE_SIZE)
+	/* large reads gain nothing from the cache, and a stream can't seek */
+	if (count >= BLOCK_SIZE || m_source->isStream())
 		return m_source->read(offset, buf, count);
-	if ((offset < m_cache_offset) || (offset+count >= m_cache_offset + m_cache_bytes))
+
+	eSingleLocker l(m_lock);
+	m_last_offset = offset;
+	size_t done = 0;
+	while (done < count)
 	{
-		/* Update the cache */
-		ssize_t bytes = m_source->read(offset, m_cache_buffer, CACHE_SIZE);
-		if (bytes <= 0)
-			return bytes;
-		if ((size_t)bytes < count)
-			count = bytes; /* probably past EOF */
-		m_cache_offset = offset;
-		m_cache_bytes = bytes;
+		off_t pos = offset + done;
+		off_t start = pos - pos % BLOCK_SIZE;
+		block *b = getBlock(start);
+		if (!b)
+			return done ? (ssize_t)done : -1;
+
+		if (start != m_next_block - BLOCK_SIZE)
+		{
+			if (start == m_next_block)
+			{
+					/* reading on into the next block, have the ones after it read too */
+				if (++m_sequential >= 2)
+					for (int i = 1; i <= READAHEAD_BLOCKS; ++i)
+						requestPrefetch(start + i * BLOCK_SIZE);
+			}
+			else
+				m_sequential = 0;
+			m_next_block = start + BLOCK_SIZE;
+		}
+
+		size_t skip = pos - start;
+		if (skip >= b->bytes)
+			break; /* past EOF */
+		size_t n = b->bytes - skip;
+		if (n > count - done)
+			n = count - done;
+		memcpy((char*)buf + done, b->data + skip, n);
+		done += n;
+		if (b->bytes < BLOCK_SIZE)
+			break;
 	}
-	unsigned int cache_index = offset - m_cache_offset;
-	memcpy(buf, m_cache_buffer + cache_index, count);
-	return count;
+	return done;
 }
 
 int eCachedSource::valid()
 {
-	return (m_cache_buffer != NULL) && m_source->valid();
+	return m_source->valid();
 }
 
 off_t eCachedSource::length()
@@ -51,5 +259,5 @@ off_t eCachedSource::length()
 
 off_t eCachedSource::offset()
 {
-	return m_cache_offset;
+	return m_last_offset;
 }
@@ -1,13 +1,39 @@
 #ifndef __lib_base_cachedtssource_h
 #define __lib_base_cachedtssource_h
 
+#include <list>
+#include <map>
 #include <lib/base/itssource.h>
+#include <lib/base/elock.h>
+#include <lib/base/thread.h>
 
+class eCachedSource;
+
+	/* reads the blocks eCachedSource expects to be read next */
+class eCachedSourcePrefetcher: public eThread
+{
+	eCachedSource &m_cache;
+public:
+	eCachedSourcePrefetcher(eCachedSource &cache): m_cache(cache) {}
+	void thread();
+};
+
+	/* Block cache for small reads (like those of eDVBTSTools) from a source:
+	   the source is read in aligned blocks of BLOCK_SIZE, the least recently
+	   used block is dropped when the memory budget is used up. When a reader
+	   moves through the source block after block, the next READAHEAD_BLOCKS
+	   blocks are read in the background.
+
+	   Streams can't seek, so they're read directly. */
 class eCachedSource: public iTsSource
 {
 	DECLARE_REF(eCachedSource);
+	friend class eCachedSourcePrefetcher;
 public:
-	eCachedSource(ePtr<iTsSource>& source);
+	enum { BLOCK_SIZE = 64*1024, READAHEAD_BLOCKS = 4, MIN_BLOCKS = READAHEAD_BLOCKS * 2 };
+
+		/* @cachesize in bytes, 0 for the default (1MB) */
+	eCachedSource(ePtr<iTsSource>& source, size_t cachesize = 0);
 	~eCachedSource();
 
 	// iTsSource
@@ -16,11 +42,37 @@ public:
 	off_t offset();
 	int valid();
 	bool isStream() { return m_source->isStream(); };
+	off_t begin() { return m_source->begin(); }
+	void prefetch(off_t offset, size_t size) { m_source->prefetch(offset, size); }
 private:
+	struct block
+	{
+		off_t offset;
+		size_t bytes;
+		char *data;
+		int loading;
+		std::list<block*>::iterator lru;
+	};
 	ePtr<iTsSource> m_source;
-	char* m_cache_buffer;
-	off_t m_cache_offset;
-	unsigned int m_cache_bytes;
+	unsigned int m_max_blocks;
+	off_t m_last_offset;
+	off_t m_next_block; /* where a sequential reader continues */
+	int m_sequential; /* blocks read in sequence */
+
+	eSingleLock m_lock;
+	eCondition m_loaded, m_work;
+	std::map<off_t, block*> m_blocks;
+	std::list<block*> m_lru; /* most recently used first */
+	std::list<off_t> m_prefetch_queue;
+	int m_stop;
+	eCachedSourcePrefetcher *m_prefetcher;
+
+	block *getBlock(off_t offset);
+	block *allocBlock(off_t offset);
+	void freeBlock(block *b);
+	int loadBlock(block *b);
+	void requestPrefetch(off_t offset);
+	void prefetchThread();
 };
 
 #endif
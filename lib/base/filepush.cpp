@@ -1,11 +1,36 @@
 #include <lib/base/filepush.h>
 #include <lib/base/eerror.h>
+#include <lib/base/metrics.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/ioctl.h>
 
 //#define SHOW_WRITE_TIME
 
+static eMetricCounter playback_bytes("playback.bytes");
+static eMetricCounter playback_underruns("playback.underruns");
+static eMetricHistogram playback_read_us("playback.read_us");
+static eMetricHistogram playback_write_us("playback.write_us");
+static eMetricGauge playback_buffered("playback.buffered_blocks");
+static eMetricGauge record_active("record.active");
+static eMetricCounter record_bytes("record.bytes");
+static eMetricCounter record_overflows("record.overflows");
+static eMetricHistogram record_write_us("record.write_us");
+
+static long long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void eFilePushReader::thread()
+{
+	hasStarted();
+	m_parent.readerThread();
+}
+
 eFilePushThread::eFilePushThread(int io_prio_class, int io_prio_level, int blocksize, size_t buffersize)
 	:prio_class(io_prio_class),
 	 prio(io_prio_level),
@@ -15,18 +40,28 @@ eFilePushThread::eFilePushThread(int io_prio_class, int io_prio_level, int block
 	 m_stream_mode(0),
 	 m_blocksize(blocksize),
 	 m_buffersize(buffersize),
-	 m_buffer((unsigned char *)malloc(buffersize)),
+	 m_ring((unsigned char *)malloc(buffersize * RING_BLOCKS)),
+	 m_ring_head(0),
+	 m_ring_count(0),
+	 m_ring_target(RING_BLOCKS / 4),
+	 m_reader_done(0),
+	 m_reader_eof(0),
+	 m_underruns(0),
+	 m_rate_start(0),
+	 m_rate_bytes(0),
+	 m_rate(0),
+	 m_reader(*this),
 	 m_messagepump(eApp, 0),
 	 m_run_state(0)
 {
-	if (m_buffer == NULL)
-		eFatal("Failed to allocate %d bytes", buffersize);
+	if (m_ring == NULL)
+		eFatal("Failed to allocate %d bytes", buffersize * RING_BLOCKS);
 	CONNECT(m_messagepump.recv_msg, eFilePushThread::recvEvent);
 }
 
 eFilePushThread::~eFilePushThread()
 {
-	free(m_buffer);
+	free(m_ring);
 }
 
 static void signal_handler(int x)
@@ -42,20 +77,16 @@ static void ignore_but_report_signals()
 	sigaction(SIGUSR1, &act, 0);
 }
 
-void eFilePushThread::thread()
+void eFilePushThread::readerThread()
 {
-	ignore_but_report_signals();
-	hasStarted(); /* "start()" blocks until we get here */
 	setIoPrio(prio_class, prio);
-	eDebug("FILEPUSH THREAD START");
 
-	do
-	{
 	int eofcount = 0;
 	int buf_end = 0;
 	size_t bytes_read = 0;
 	off_t current_span_offset = 0;
 	size_t current_span_remaining = 0;
+	off_t hinted_end = -1;
 
 	while (!m_stop)
 	{
@@ -65,6 +96,7 @@ void eFilePushThread::thread()
 			ASSERT(!(current_span_remaining % m_blocksize));
 			m_current_position = current_span_offset;
 			bytes_read = 0;
+			hinted_end = -1;
 		}
 
 		size_t maxread = m_buffersize;
@@ -76,6 +108,29 @@ void eFilePushThread::thread()
 			/* align to blocksize */
 		maxread -= maxread % m_blocksize;
 
+		unsigned char *buffer;
+		int target;
+		{
+			eSingleLocker lock(m_ring_lock);
+			while (!m_stop && m_ring_count >= m_ring_target)
+				m_ring_drained.wait(m_ring_lock);
+			if (m_stop)
+				break;
+			buffer = m_ring + ((m_ring_head + m_ring_count) % RING_BLOCKS) * m_buffersize;
+			target = m_ring_target;
+		}
+
+			/* tell the source what we're going to read next, so the
+			   disk (or the network) can work while we're waiting. */
+		if (maxread && m_current_position + (off_t)maxread > hinted_end)
+		{
+			size_t window = target * m_buffersize;
+			if (m_sg && window > current_span_remaining)
+				window = current_span_remaining;
+			m_source->prefetch(m_current_position, window);
+			hinted_end = m_current_position + window;
+		}
+
 		if (maxread)
 		{
 #ifdef SHOW_WRITE_TIME
@@ -83,7 +138,9 @@ void eFilePushThread::thread()
 			struct timeval now;
 			gettimeofday(&starttime, NULL);
 #endif
-			buf_end = m_source->read(m_current_position, m_buffer, maxread);
+			long long start = eMetricTimer::now_us();
+			buf_end = m_source->read(m_current_position, buffer, maxread);
+			playback_read_us.add(eMetricTimer::now_us() - start);
 #ifdef SHOW_WRITE_TIME
 			gettimeofday(&now, NULL);
 			suseconds_t diff = (1000000 * (now.tv_sec - starttime.tv_sec)) + now.tv_usec - starttime.tv_usec;
@@ -107,6 +164,12 @@ void eFilePushThread::thread()
 				eWarning("OVERFLOW while playback?");
 				continue;
 			}
+			if (errno == ENODATA && m_sg)
+			{
+					/* a ring dropped the data here, the next span starts where there is some */
+				current_span_remaining = 0;
+				continue;
+			}
 			eDebug("eFilePushThread *read error* (%m) - not yet handled");
 		}
 
@@ -117,6 +180,14 @@ void eFilePushThread::thread()
 
 		if (buf_end == 0)
 		{
+				/* everything before the EOF must have been written first. */
+			{
+				eSingleLocker lock(m_ring_lock);
+				m_reader_eof = 1;
+				while (!m_stop && m_ring_count)
+					m_ring_drained.wait(m_ring_lock);
+			}
+
 				/* on EOF, try COMMITting once. */
 			if (m_send_pvr_commit)
 			{
@@ -149,7 +220,8 @@ void eFilePushThread::thread()
 				   in stream_mode, think of evtEOF as "buffer underrun occurred". */
 			sendEvent(evtEOF);
 
-			if (m_stream_mode)
+				/* an http source is a stream until it turns out to be seekable */
+			if (m_stream_mode && m_source->isStream())
 			{
 				eDebug("reached EOF, but we are in stream mode. delaying 1 second.");
 				sleep(1);
@@ -164,29 +236,14 @@ void eFilePushThread::thread()
 			break;
 		} else
 		{
-			/* Write data to mux */
-			int buf_start = 0;
-			filterRecordData(m_buffer, buf_end);
-			while ((buf_start != buf_end) && !m_stop)
 			{
-				int w = write(m_fd_dest, m_buffer + buf_start, buf_end - buf_start);
-
-				if (w <= 0)
-				{
-					/* Check m_stop after interrupted syscall. */
-					if (m_stop) {
-						w = 0;
-						buf_start = 0;
-						buf_end = 0;
-						break;
-					}
-					if (w < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
-						continue;
-					eDebug("eFilePushThread WRITE ERROR");
-					sendEvent(evtWriteError);
-					break;
-				}
-				buf_start += w;
+				eSingleLocker lock(m_ring_lock);
+				block &b = m_blocks[(m_ring_head + m_ring_count) % RING_BLOCKS];
+				b.offset = m_current_position;
+				b.len = buf_end;
+				++m_ring_count;
+				m_reader_eof = 0;
+				m_ring_filled.signal();
 			}
 
 			eofcount = 0;
@@ -196,6 +253,135 @@ void eFilePushThread::thread()
 				current_span_remaining -= buf_end;
 		}
 	}
+
+	eSingleLocker lock(m_ring_lock);
+	m_reader_done = 1;
+	m_ring_filled.signal();
+}
+
+void eFilePushThread::startReader()
+{
+	{
+		eSingleLocker lock(m_ring_lock);
+		m_ring_head = m_ring_count = 0;
+		m_reader_done = m_reader_eof = 0;
+		m_rate_start = now_ms();
+		m_rate_bytes = 0;
+	}
+	m_reader.run();
+}
+
+void eFilePushThread::stopReader()
+{
+	wakeUp();
+	m_reader.sendSignal(SIGUSR1);
+	m_reader.kill();
+		/* what's left in the ring is dropped, the next start continues after
+		   the last block read (like the buffers flushed after a pause) */
+	eSingleLocker lock(m_ring_lock);
+	m_ring_head = m_ring_count = 0;
+}
+
+void eFilePushThread::wakeUp()
+{
+	eSingleLocker lock(m_ring_lock);
+	m_ring_filled.signal();
+	m_ring_drained.signal();
+}
+
+	/* called with m_ring_lock held after @len bytes were written */
+void eFilePushThread::updateReadahead(int len)
+{
+	m_rate_bytes += len;
+	long long elapsed = now_ms() - m_rate_start;
+	if (elapsed < 1000)
+		return;
+	size_t rate = m_rate_bytes * 1000LL / elapsed;
+	m_rate = m_rate ? (m_rate * 3 + rate) / 4 : rate;
+	m_rate_start += elapsed;
+	m_rate_bytes = 0;
+
+	int target = m_rate * READAHEAD_TIME / m_buffersize + 1;
+	if (target < MIN_READAHEAD_BLOCKS)
+		target = MIN_READAHEAD_BLOCKS;
+	if (target > RING_BLOCKS)
+		target = RING_BLOCKS;
+	if (target > m_ring_target)
+		m_ring_drained.signal();
+	m_ring_target = target;
+}
+
+void eFilePushThread::thread()
+{
+	ignore_but_report_signals();
+	hasStarted(); /* "start()" blocks until we get here */
+	setIoPrio(prio_class, prio);
+	eDebug("FILEPUSH THREAD START");
+
+	do
+	{
+	int playing = 0;
+
+	startReader();
+
+	while (!m_stop)
+	{
+		const unsigned char *buffer;
+		int buf_end;
+		{
+			eSingleLocker lock(m_ring_lock);
+			if (!m_ring_count && playing && !m_reader_done && !m_reader_eof && !m_stop)
+			{
+				++m_underruns;
+				playback_underruns.inc();
+				eDebug("[eFilePushThread] buffer underrun %u, readahead %d blocks at %zu bytes/s", m_underruns, m_ring_target, m_rate);
+			}
+			while (!m_ring_count && !m_reader_done && !m_stop)
+				m_ring_filled.wait(m_ring_lock);
+				/* the reader stopped (EOF) and everything is written */
+			if (!m_ring_count || m_stop)
+				break;
+			buffer = m_ring + m_ring_head * m_buffersize;
+			buf_end = m_blocks[m_ring_head].len;
+			playback_buffered.set(m_ring_count);
+		}
+
+		/* Write data to mux */
+		int buf_start = 0;
+		filterRecordData(buffer, buf_end);
+		while ((buf_start != buf_end) && !m_stop)
+		{
+			long long start = eMetricTimer::now_us();
+			int w = write(m_fd_dest, buffer + buf_start, buf_end - buf_start);
+			playback_write_us.add(eMetricTimer::now_us() - start);
+
+			if (w <= 0)
+			{
+				/* Check m_stop after interrupted syscall. */
+				if (m_stop) {
+					w = 0;
+					buf_start = 0;
+					buf_end = 0;
+					break;
+				}
+				if (w < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+					continue;
+				eDebug("eFilePushThread WRITE ERROR");
+				sendEvent(evtWriteError);
+				break;
+			}
+			buf_start += w;
+			playback_bytes.add(w);
+		}
+
+		eSingleLocker lock(m_ring_lock);
+		m_ring_head = (m_ring_head + 1) % RING_BLOCKS;
+		--m_ring_count;
+		m_ring_drained.signal();
+		updateReadahead(buf_end);
+		playing = 1;
+	}
+	stopReader();
 	sendEvent(evtStopped);
 
 	{ /* mutex lock scope */
@@ -211,7 +397,7 @@ void eFilePushThread::thread()
 	}
 
 	} while (m_stop == 0);
-	eDebug("FILEPUSH THREAD STOP");
+	eDebug("FILEPUSH THREAD STOP (%u underruns)", m_underruns);
 }
 
 void eFilePushThread::start(ePtr<iTsSource> &source, int fd_dest)
@@ -232,6 +418,7 @@ void eFilePushThread::stop()
 	m_stop = 1;
 	eDebug("eFilePushThread stopping thread");
 	m_run_cond.signal(); /* Break out of pause if needed */
+	wakeUp();
 	sendSignal(SIGUSR1);
 	kill(0); /* Kill means join actually */
 }
@@ -247,6 +434,7 @@ void eFilePushThread::pause()
 	 * for the thread to acknowledge that */
 	eSingleLocker lock(m_run_mutex);
 	m_stop = 2;
+	wakeUp();
 	sendSignal(SIGUSR1);
 	m_run_cond.signal(); /* Trigger if in weird state */
 	while (m_run_state) {
@@ -254,7 +442,6 @@ void eFilePushThread::pause()
 		m_run_cond.wait(m_run_mutex);
 	}
 }
-
 void eFilePushThread::resume()
 {
 	if (!sync())
@@ -284,6 +471,15 @@ void eFilePushThread::setScatterGather(iFilePushScatterGather *sg)
 	m_sg = sg;
 }
 
+void eFilePushThread::getBufferStats(int &fill, int &target, int &size, unsigned int &underruns)
+{
+	eSingleLocker lock(m_ring_lock);
+	fill = m_ring_count;
+	target = m_ring_target;
+	size = RING_BLOCKS;
+	underruns = m_underruns;
+}
+
 void eFilePushThread::sendEvent(int evt)
 {
 	m_messagepump.send(evt);
@@ -325,6 +521,7 @@ void eFilePushThreadRecorder::thread()
 	sigaction(SIGUSR1, &act, 0);
 
 	hasStarted();
+	record_active.inc();
 
 	/* m_stop must be evaluated after each syscall. */
 	while (!m_stop)
@@ -339,6 +536,7 @@ void eFilePushThreadRecorder::thread()
 			{
 				eWarning("[eFilePushThreadRecorder] OVERFLOW while recording");
 				++m_overflow_count;
+				record_overflows.inc();
 				continue;
 			}
 			eDebug("[eFilePushThreadRecorder] *read error* (%m) - aborting thread because i don't know what else to do.");
@@ -351,7 +549,9 @@ void eFilePushThreadRecorder::thread()
 		struct timeval now;
 		gettimeofday(&starttime, NULL);
 #endif
+		long long start = eMetricTimer::now_us();
 		int w = writeData(bytes);
+		record_write_us.add(eMetricTimer::now_us() - start);
 #ifdef SHOW_WRITE_TIME
 		gettimeofday(&now, NULL);
 		suseconds_t diff = (1000000 * (now.tv_sec - starttime.tv_sec)) + now.tv_usec - starttime.tv_usec;
@@ -363,8 +563,10 @@ void eFilePushThreadRecorder::thread()
 			sendEvent(evtWriteError);
 			break;
 		}
+		record_bytes.add(bytes);
 	}
 	flush();
+	record_active.dec();
 	sendEvent(evtStopped);
 	eDebug("[eFilePushThreadRecorder] THREAD STOP");
 }
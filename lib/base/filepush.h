@@ -15,8 +15,28 @@ public:
 	virtual ~iFilePushScatterGather() {}
 };
 
+class eFilePushThread;
+
+	/* the read stage of eFilePushThread, see there. */
+class eFilePushReader: public eThread
+{
+	eFilePushThread &m_parent;
+public:
+	eFilePushReader(eFilePushThread &parent): m_parent(parent) {}
+	void thread();
+};
+
+	/* playback is split into two threads: a reader that fills a ring of
+	   blocks from the source, following the spans of the scatter/gather
+	   interface, and a writer (this thread) that feeds the blocks to the
+	   destination. so a slow read doesn't stall the decoder as long as
+	   the ring has data. the reader stays about READAHEAD_TIME ahead of
+	   the rate the writer gets rid of the data. */
 class eFilePushThread: public eThread, public Object
 {
+	friend class eFilePushReader;
+	enum { RING_BLOCKS = 64, MIN_READAHEAD_BLOCKS = 4, READAHEAD_TIME = 2 /* s */ };
+
 public:
 	eFilePushThread(int prio_class=IOPRIO_CLASS_BE, int prio_level=0, int blocksize=188, size_t buffersize=188*1024);
 	~eFilePushThread();
@@ -31,6 +51,9 @@ public:
 	/* stream mode will wait on EOF until more data is available. */
 	void setStreamMode(int);
 	void setScatterGather(iFilePushScatterGather *);
+		/* blocks in the ring, how many the reader tries to keep there, the size
+		   of the ring, and how often the writer found it empty while playing. */
+	void getBufferStats(int &fill, int &target, int &size, unsigned int &underruns);
 
 	enum { evtEOF, evtReadError, evtWriteError, evtUser, evtStopped };
 	Signal1<void,int> m_event;
@@ -49,11 +72,33 @@ private:
 	int m_stream_mode;
 	int m_blocksize;
 	size_t m_buffersize;
-	unsigned char* m_buffer;
 	off_t m_current_position;
 
 	ePtr<iTsSource> m_source;
 
+	struct block
+	{
+		off_t offset;
+		int len;
+	};
+		/* RING_BLOCKS blocks of m_buffersize, filled by the reader */
+	unsigned char* m_ring;
+	block m_blocks[RING_BLOCKS];
+	int m_ring_head, m_ring_count, m_ring_target;
+	int m_reader_done, m_reader_eof;
+	unsigned int m_underruns;
+	long long m_rate_start; /* ms */
+	size_t m_rate_bytes, m_rate; /* bytes/s */
+	eSingleLock m_ring_lock;
+	eCondition m_ring_filled, m_ring_drained;
+	eFilePushReader m_reader;
+
+	void readerThread();
+	void startReader();
+	void stopReader();
+	void wakeUp();
+	void updateReadahead(int len);
+
 	eFixedMessagePump<int> m_messagepump;
 	eSingleLock m_run_mutex;
 	eCondition m_run_cond;
@@ -1,5 +1,7 @@
 #include <cstdio>
 #include <openssl/evp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include <lib/base/httpstream.h>
 #include <lib/base/eerror.h>
@@ -16,13 +18,42 @@ eHttpStream::eHttpStream()
 	partialPktSz = 0;
 	tmpBufSize = 32;
 	tmpBuf = (char*)malloc(tmpBufSize);
+	m_seekable = false;
+	m_length = -1;
+	m_port = 80;
+	m_ring_filled = eventfd(0, EFD_NONBLOCK);
+	m_ring = NULL;
+	m_ring_start = m_ring_end = 0;
+	m_consumer = 0;
+	m_ring_generation = 0;
+	m_failures = 0;
+	m_stop = 0;
+	m_abort = eventfd(0, EFD_NONBLOCK);
+	m_direct_fd = -1;
 }
 
 eHttpStream::~eHttpStream()
 {
-	free(tmpBuf);
-	kill(true);
+	{
+		eSingleLocker lock(m_ring_lock);
+		m_stop = 1;
+		m_ring_space.signal();
+	}
+	/* the range requests of a seekable stream give up at once */
+	uint64_t one = 1;
+	if (m_abort >= 0 && ::write(m_abort, &one, sizeof(one)) < 0)
+		eDebug("eHttpStream: can't interrupt the thread (%m)");
+	/* connecting might block for up to 10 seconds, don't wait for that */
+	kill(connectionStatus == BUSY);
 	close();
+	if (m_direct_fd >= 0)
+		::close(m_direct_fd);
+	if (m_ring_filled >= 0)
+		::close(m_ring_filled);
+	if (m_abort >= 0)
+		::close(m_abort);
+	free(m_ring);
+	free(tmpBuf);
 }
 
 int eHttpStream::openUrl(const std::string &url, std::string &newurl)
@@ -39,6 +70,9 @@ int eHttpStream::openUrl(const std::string &url, std::string &newurl)
 	char statusmsg[100];
 	bool playlist = false;
 	bool contenttypeparsed = false;
+	off_t contentlength = -1;
+	bool acceptranges = false;
+	bool chunked = false;
 
 	close();
 
@@ -127,7 +161,7 @@ int eHttpStream::openUrl(const std::string &url, std::string &newurl)
 		if (!contenttypeparsed)
 		{
 			char contenttype[32];
-			if (sscanf(linebuf, "Content-Type: %32s", contenttype) == 1)
+			if (sscanf(linebuf, "Content-Type: %31s", contenttype) == 1)
 			{
 				contenttypeparsed = true;
 				if (!strcasecmp(contenttype, "application/text")
@@ -158,12 +192,28 @@ int eHttpStream::openUrl(const std::string &url, std::string &newurl)
 		{
 			isChunked = true;
 		}
+		if (!strncasecmp(linebuf, "content-length:", 15))
+			contentlength = strtoll(linebuf + 15, NULL, 10);
+		else if (!strncasecmp(linebuf, "accept-ranges:", 14) && strstr(linebuf + 14, "bytes"))
+			acceptranges = true;
+		else if (!strncasecmp(linebuf, "transfer-encoding:", 18) && strcasestr(linebuf + 18, "chunked"))
+			chunked = true;
 		if (!playlist && result == 0)
 			break;
 		if (result < 0)
 			break;
 	}
 
+	if (newurl.empty() && !playlist && statuscode == 200 && contentlength > 0 && acceptranges && !chunked)
+	{
+		/* a file rather than a live stream, we can seek in it */
+		m_seekable = true;
+		m_length = contentlength;
+		m_host = hostname;
+		m_port = port;
+		m_uri = uri;
+	}
+
 	free(linebuf);
 	return 0;
 error:
@@ -201,6 +251,22 @@ void eHttpStream::thread()
 			connectionStatus = FAILED;
 			return;
 		}
+		if (newurl == "" && m_seekable)
+		{
+			/* from here on, the data is fetched with range requests */
+			close();
+			m_ring = (unsigned char*)malloc(RING_SIZE);
+			if (!m_ring || m_ring_filled < 0)
+			{
+				eDebug("eHttpStream::Thread end NO ring buffer");
+				connectionStatus = FAILED;
+				return;
+			}
+			eDebug("eHttpStream::Thread seekable stream, %lld bytes", (long long)m_length);
+			connectionStatus = CONNECTED;
+			fillRing();
+			return;
+		}
 		if (newurl == "")
 		{
 			/* we have a valid stream connection */
@@ -319,12 +385,282 @@ ssize_t eHttpStream::httpChunkedRead(void *buf, size_t count)
 	return ret;
 }
 
+	/* send a request for [from, to) on the keep-alive connection @fd, opening it
+	   when needed. 0 when the body follows, -1 on error (with @fd closed) */
+int eHttpStream::rangeRequest(int &fd, off_t from, off_t to)
+{
+	char range[64];
+	snprintf(range, sizeof(range), "Range: bytes=%lld-%lld\r\n", (long long)from, (long long)to - 1);
+	std::string request = "GET ";
+	request.append(m_uri).append(" HTTP/1.1\r\n");
+	request.append("Host: ").append(m_host).append("\r\n");
+	request.append("User-Agent: ").append("Enigma2").append("\r\n");
+	if (authorizationData != "")
+	{
+		request.append("Authorization: Basic ").append(authorizationData).append("\r\n");
+	}
+	request.append("Accept: */*\r\n");
+	request.append(range);
+	request.append("Connection: keep-alive\r\n");
+	request.append("\r\n");
+
+	for (int attempt = 0; attempt < 2; ++attempt)
+	{
+		bool reused = fd >= 0;
+		if (!reused)
+		{
+			fd = Connect(m_host.c_str(), m_port, 10, m_abort);
+			if (fd < 0)
+				return -1;
+		}
+		if (writeAll(fd, request.c_str(), request.length()) == (ssize_t)request.length()
+			&& !readRangeResponse(fd, from, to))
+			return 0;
+		::close(fd);
+		fd = -1;
+		/* the server may have closed an idle connection, that's worth a retry */
+		if (!reused)
+			break;
+	}
+	return -1;
+}
+
+int eHttpStream::readRangeResponse(int fd, off_t from, off_t to)
+{
+	size_t buflen = 0;
+	char *linebuf = NULL;
+	char proto[100];
+	int statuscode = 0;
+	off_t contentlength = -1;
+	long long start = -1;
+	bool chunked = false;
+	int res = -1;
+
+	if (readLine(fd, &linebuf, &buflen, m_abort) > 0 && sscanf(linebuf, "%99s %d", proto, &statuscode) == 2)
+	{
+		while (readLine(fd, &linebuf, &buflen, m_abort) > 0)
+		{
+			if (!strncasecmp(linebuf, "content-length:", 15))
+				contentlength = strtoll(linebuf + 15, NULL, 10);
+			else if (!strncasecmp(linebuf, "content-range:", 14))
+				sscanf(linebuf + 14, " bytes %lld", &start);
+			else if (!strncasecmp(linebuf, "transfer-encoding:", 18) && strcasestr(linebuf + 18, "chunked"))
+				chunked = true;
+		}
+		/* an empty line ends the header, anything else is an error */
+		if (linebuf && !*linebuf)
+		{
+			if (statuscode == 206 && start == from && contentlength == to - from && !chunked)
+				res = 0;
+			else
+				eDebug("eHttpStream: unexpected response to range %lld-%lld: %d, %lld bytes from %lld", (long long)from, (long long)to, statuscode, (long long)contentlength, start);
+		}
+	}
+	free(linebuf);
+	return res;
+}
+
+	/* the thread of a seekable stream: keeps the ring filled ahead of the reader */
+void eHttpStream::fillRing()
+{
+	int fd = -1;
+	off_t fd_pos = 0, fd_end = 0; /* the part of the file still to come on fd */
+
+	eSingleLocker lock(m_ring_lock);
+	while (!m_stop)
+	{
+		/* drop what the reader is done with */
+		off_t keep = m_consumer - KEEP_BEHIND;
+		if (keep > m_ring_end)
+			keep = m_ring_end;
+		if (keep > m_ring_start)
+			m_ring_start = keep;
+
+		off_t pos = m_ring_end;
+		size_t space = RING_SIZE - (m_ring_end - m_ring_start);
+		if (pos >= m_length || !space)
+		{
+			m_ring_space.wait(m_ring_lock);
+			continue;
+		}
+		size_t n = PIECE_SIZE;
+		if (n > space)
+			n = space;
+		size_t left = RING_SIZE - (size_t)(pos % RING_SIZE);
+		if (n > left)
+			n = left;
+		unsigned char *dst = m_ring + pos % RING_SIZE;
+		int generation = m_ring_generation;
+
+		/* only this thread writes to the ring, past its end nobody reads */
+		m_ring_lock.unlock();
+		ssize_t r = -1;
+		if (fd < 0 || fd_pos != pos || fd_pos >= fd_end)
+		{
+			/* after the ring was moved, the rest of the response is of no use */
+			if (fd >= 0 && fd_pos < fd_end)
+			{
+				::close(fd);
+				fd = -1;
+			}
+			fd_pos = pos;
+			fd_end = pos + CHUNK_SIZE;
+			if (fd_end > m_length)
+				fd_end = m_length;
+			if (rangeRequest(fd, fd_pos, fd_end) < 0)
+				fd_end = fd_pos;
+		}
+		if (fd_pos < fd_end)
+		{
+			if ((off_t)n > fd_end - fd_pos)
+				n = fd_end - fd_pos;
+			r = timedRead(fd, dst, n, READ_TIMEOUT, 100, m_abort);
+		}
+		m_ring_lock.lock();
+
+		if (r > 0)
+		{
+			fd_pos += r;
+			m_failures = 0;
+			if (generation == m_ring_generation)
+				m_ring_end += r;
+		}
+		else
+		{
+			/* a timeout, or the connection is gone: start over */
+			if (fd >= 0)
+			{
+				::close(fd);
+				fd = -1;
+			}
+			fd_end = fd_pos;
+			if (generation == m_ring_generation && ++m_failures >= MAX_FAILURES)
+				eDebug("eHttpStream: %d requests failed at %lld", m_failures, (long long)pos);
+			struct timespec timeout;
+			clock_gettime(CLOCK_REALTIME, &timeout);
+			timeout.tv_sec += 1;
+			if (!m_stop)
+				pthread_cond_timedwait(&(pthread_cond_t&)m_ring_space, &(pthread_mutex_t&)m_ring_lock, &timeout);
+		}
+		uint64_t one = 1;
+		if (::write(m_ring_filled, &one, sizeof(one)) < 0)
+			eDebug("eHttpStream: can't wake up the reader (%m)");
+	}
+	if (fd >= 0)
+		::close(fd);
+}
+
+	/* reads outside of the ring, with a range request of their own */
+ssize_t eHttpStream::directRead(off_t offset, void *buf, size_t count)
+{
+	eSingleLocker lock(m_direct_lock);
+	if (rangeRequest(m_direct_fd, offset, offset + count) < 0)
+	{
+		errno = EIO;
+		return -1;
+	}
+	ssize_t r = timedRead(m_direct_fd, buf, count, READ_TIMEOUT, 1000, m_abort);
+	if (r != (ssize_t)count)
+	{
+		/* the rest of the response would be taken for the next one */
+		::close(m_direct_fd);
+		m_direct_fd = -1;
+	}
+	if (r <= 0)
+	{
+		errno = EIO;
+		return -1;
+	}
+	return r;
+}
+
+ssize_t eHttpStream::seekableRead(off_t offset, void *buf, size_t count)
+{
+	if (offset >= m_length)
+		return 0;
+	if ((off_t)count > m_length - offset)
+		count = m_length - offset;
+	{
+		eSingleLocker lock(m_ring_lock);
+		int waited = 0;
+		while (offset >= m_ring_start && offset <= m_ring_end + WAIT_WINDOW)
+		{
+			if (offset < m_ring_end)
+			{
+				size_t n = m_ring_end - offset;
+				if (n > count)
+					n = count;
+				size_t pos = offset % RING_SIZE;
+				size_t first = n;
+				if (first > RING_SIZE - pos)
+					first = RING_SIZE - pos;
+				memcpy(buf, m_ring + pos, first);
+				memcpy((unsigned char*)buf + first, m_ring, n - first);
+				if (offset + (off_t)n > m_consumer)
+				{
+					m_consumer = offset + n;
+					m_ring_space.signal();
+				}
+				return n;
+			}
+			if (m_failures >= MAX_FAILURES)
+			{
+				errno = EIO;
+				return -1;
+			}
+			if (waited >= READ_TIMEOUT)
+			{
+				errno = EAGAIN;
+				return -1;
+			}
+			if (offset > m_consumer)
+			{
+				m_consumer = offset;
+				m_ring_space.signal();
+			}
+			/* like a read from a socket, a signal interrupts the wait */
+			m_ring_lock.unlock();
+			struct pollfd pfd;
+			pfd.fd = m_ring_filled;
+			pfd.events = POLLIN;
+			int res = ::poll(&pfd, 1, WAIT_SLICE);
+			uint64_t value;
+			if (res > 0 && ::read(m_ring_filled, &value, sizeof(value)) < 0)
+				res = 0;
+			m_ring_lock.lock();
+			if (res < 0)
+				return -1;
+			if (!res)
+				waited += WAIT_SLICE;
+		}
+	}
+	return directRead(offset, buf, count);
+}
+
+void eHttpStream::prefetch(off_t offset, size_t size)
+{
+	if (!m_seekable)
+		return;
+	eSingleLocker lock(m_ring_lock);
+	if (offset < m_ring_start || offset > m_ring_end + WAIT_WINDOW)
+	{
+		/* the reader jumped, the ring follows it */
+		m_ring_start = m_ring_end = offset;
+		++m_ring_generation;
+		m_failures = 0;
+	}
+	m_consumer = offset;
+	m_ring_space.signal();
+}
+
 ssize_t eHttpStream::read(off_t offset, void *buf, size_t count)
 {
 	if (connectionStatus == BUSY)
 		return 0;
 	else if (connectionStatus == FAILED)
 		return -1;
+	if (m_seekable)
+		return seekableRead(offset, buf, count);
 	return httpChunkedRead(buf, count);
 }
 
@@ -332,15 +668,24 @@ int eHttpStream::valid()
 {
 	if (connectionStatus == BUSY)
 		return 0;
+	if (m_seekable)
+		return connectionStatus == CONNECTED;
 	return streamSocket >= 0;
 }
 
 off_t eHttpStream::length()
 {
+	if (m_seekable)
+		return m_length;
 	return (off_t)-1;
 }
 
 off_t eHttpStream::offset()
 {
+	if (m_seekable)
+	{
+		eSingleLocker lock(m_ring_lock);
+		return m_consumer;
+	}
 	return 0;
 }
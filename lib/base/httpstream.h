@@ -3,9 +3,18 @@
 
 #include <string>
 #include <lib/base/ebase.h>
+#include <lib/base/elock.h>
 #include <lib/base/itssource.h>
 #include <lib/base/thread.h>
 
+/*
+ * A live stream is read from the socket as it comes in. When the server
+ * reports the length of the content and accepts range requests (a
+ * recording served over http), the stream is seekable: the thread keeps a
+ * ring buffer ahead of the reader filled, with range requests on a
+ * keep-alive connection, and reads elsewhere in the file are done with a
+ * range request of their own.
+ */
 class eHttpStream: public iTsSource, public Object, public eThread
 {
 	DECLARE_REF(eHttpStream);
@@ -21,17 +30,54 @@ class eHttpStream: public iTsSource, public Object, public eThread
 	char* tmpBuf;
 	size_t tmpBufSize;
 
+	enum {
+		RING_SIZE = 4 * 1024 * 1024,
+		KEEP_BEHIND = 256 * 1024, /* kept for small steps back */
+		WAIT_WINDOW = 1024 * 1024, /* reads this far ahead of the ring wait for it */
+		CHUNK_SIZE = 1024 * 1024, /* requested at once */
+		PIECE_SIZE = 64 * 1024, /* read from the socket at once */
+		READ_TIMEOUT = 5000, /* ms */
+		WAIT_SLICE = 50, /* ms */
+		MAX_FAILURES = 5 /* requests in a row, before reads fail */
+	};
+
+	bool m_seekable;
+	off_t m_length;
+	std::string m_host, m_uri;
+	int m_port;
+
+	eSingleLock m_ring_lock;
+	eCondition m_ring_space;
+	int m_ring_filled; /* eventfd, so a waiting reader can be interrupted */
+	unsigned char *m_ring;
+	off_t m_ring_start, m_ring_end; /* the part of the file in the ring */
+	off_t m_consumer; /* where the sequential reader is */
+	int m_ring_generation; /* changes when the ring is moved */
+	int m_failures;
+	int m_stop;
+	int m_abort; /* eventfd, set to interrupt the requests of the thread */
+
+	eSingleLock m_direct_lock;
+	int m_direct_fd;
+
 	int openUrl(const std::string &url, std::string &newurl);
 	void thread();
 	ssize_t httpChunkedRead(void *buf, size_t count);
 	ssize_t syncNextRead(void *buf, ssize_t count);
 
+	int rangeRequest(int &fd, off_t from, off_t to);
+	int readRangeResponse(int fd, off_t from, off_t to);
+	void fillRing();
+	ssize_t seekableRead(off_t offset, void *buf, size_t count);
+	ssize_t directRead(off_t offset, void *buf, size_t count);
+
 	/* iTsSource */
 	ssize_t read(off_t offset, void *buf, size_t count);
 	off_t length();
 	off_t offset();
 	int valid();
-	bool isStream() { return true; };
+	bool isStream() { return !m_seekable; };
+	void prefetch(off_t offset, size_t size);
 
 public:
 	eHttpStream();
@@ -19,6 +19,10 @@ public:
 	virtual int valid()=0;
 	virtual off_t offset() = 0;
 	virtual bool isStream() { return false; }
+	/* the first offset that can be read, a ring (timeshift) drops its oldest data */
+	virtual off_t begin() { return 0; }
+	/* hint that @size bytes at @offset will be read soon, without side-effects */
+	virtual void prefetch(off_t offset, size_t size) {}
 	int getPacketSize() const { return packetSize; }
 };
 
@@ -0,0 +1,183 @@
+#include <lib/base/metrics.h>
+#include <lib/base/eerror.h>
+
+#include <stdio.h>
+#include <time.h>
+
+eMetric::eMetric(const char *name, int type)
+	:m_name(name), m_type(type)
+{
+	eMetrics::getInstance()->add(this);
+}
+
+eMetric::~eMetric()
+{
+	eMetrics::getInstance()->remove(this);
+}
+
+void eMetricCounter::sample(std::vector<std::pair<std::string, long long> > &values) const
+{
+	values.push_back(std::make_pair(std::string(), get()));
+}
+
+void eMetricGauge::sample(std::vector<std::pair<std::string, long long> > &values) const
+{
+	values.push_back(std::make_pair(std::string(), get()));
+}
+
+eMetricHistogram::eMetricHistogram(const char *name)
+	:eMetric(name, typeHistogram), m_count(0), m_sum(0), m_max(0)
+{
+	for (int i = 0; i < BUCKETS; ++i)
+		m_buckets[i] = 0;
+}
+
+void eMetricHistogram::add(eMetricValue value)
+{
+	if (value < 0)
+		value = 0;
+	int bucket = 0;
+	for (unsigned long long v = value; v && bucket < BUCKETS - 1; v >>= 1)
+		++bucket;
+	__atomic_fetch_add(&m_buckets[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m_count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m_sum, value, __ATOMIC_RELAXED);
+	eMetricValue max = __atomic_load_n(&m_max, __ATOMIC_RELAXED);
+	while (value > max && !__atomic_compare_exchange_n(&m_max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+long long eMetricHistogram::count() const
+{
+	return __atomic_load_n(&m_count, __ATOMIC_RELAXED);
+}
+
+long long eMetricHistogram::percentile(int percent) const
+{
+	long long buckets[BUCKETS], total = 0;
+	/* the buckets are read one by one while others add to them, count them again instead of using m_count */
+	for (int i = 0; i < BUCKETS; ++i)
+		total += buckets[i] = __atomic_load_n(&m_buckets[i], __ATOMIC_RELAXED);
+	if (!total)
+		return 0;
+	long long wanted = (total * percent + 99) / 100, seen = 0;
+	if (wanted < 1)
+		wanted = 1;
+	for (int i = 0; i < BUCKETS; ++i)
+	{
+		seen += buckets[i];
+		if (seen >= wanted)
+			return i ? (1LL << i) - 1 : 0;
+	}
+	return (1LL << (BUCKETS - 1)) - 1;
+}
+
+void eMetricHistogram::sample(std::vector<std::pair<std::string, long long> > &values) const
+{
+	values.push_back(std::make_pair(std::string(".count"), count()));
+	values.push_back(std::make_pair(std::string(".sum"), (long long)__atomic_load_n(&m_sum, __ATOMIC_RELAXED)));
+	values.push_back(std::make_pair(std::string(".max"), (long long)__atomic_load_n(&m_max, __ATOMIC_RELAXED)));
+	values.push_back(std::make_pair(std::string(".p50"), percentile(50)));
+	values.push_back(std::make_pair(std::string(".p90"), percentile(90)));
+	values.push_back(std::make_pair(std::string(".p99"), percentile(99)));
+}
+
+eMetricTimer::eMetricTimer(eMetricHistogram &histogram)
+	:m_histogram(histogram), m_start(now_us())
+{
+}
+
+eMetricTimer::~eMetricTimer()
+{
+	m_histogram.add(now_us() - m_start);
+}
+
+long long eMetricTimer::now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+eMetrics::eMetrics()
+{
+}
+
+eMetrics *eMetrics::getInstance()
+{
+		/* the metrics are static objects of other files, which may be constructed before this one */
+	static eMetrics instance;
+	return &instance;
+}
+
+void eMetrics::add(eMetric *metric)
+{
+	eSingleLocker l(m_lock);
+	if (!m_metrics.insert(std::make_pair(std::string(metric->name()), metric)).second)
+		eDebug("[eMetrics] %s exists already, ignoring the second one", metric->name());
+}
+
+void eMetrics::remove(eMetric *metric)
+{
+	eSingleLocker l(m_lock);
+	std::map<std::string, eMetric*>::iterator it = m_metrics.find(metric->name());
+	if (it != m_metrics.end() && it->second == metric)
+		m_metrics.erase(it);
+}
+
+void eMetrics::snapshot(std::map<std::string, long long> &values)
+{
+	long long now = eMetricTimer::now_us();
+	std::vector<std::pair<std::string, long long> > sampled;
+	eSingleLocker l(m_lock);
+	for (std::map<std::string, eMetric*>::iterator it = m_metrics.begin(); it != m_metrics.end(); ++it)
+	{
+		sampled.clear();
+		it->second->sample(sampled);
+		for (std::vector<std::pair<std::string, long long> >::iterator i = sampled.begin(); i != sampled.end(); ++i)
+			values[it->first + i->first] = i->second;
+		if (it->second->type() != eMetric::typeCounter)
+			continue;
+
+			/* the rate since the begin of the window before this one, so it always covers at least RATE_WINDOW seconds */
+		long long value = sampled.front().second;
+		std::map<std::string, rate>::iterator r = m_rates.find(it->first);
+		if (r == m_rates.end())
+		{
+			rate first = { value, now, value, now };
+			r = m_rates.insert(std::make_pair(it->first, first)).first;
+		}
+		else if (now - r->second.time >= RATE_WINDOW * 1000000LL)
+		{
+			r->second.last_value = r->second.value;
+			r->second.last_time = r->second.time;
+			r->second.value = value;
+			r->second.time = now;
+		}
+		long long elapsed = now - r->second.last_time;
+		values[it->first + ".rate"] = elapsed > 0 ? (value - r->second.last_value) * 1000000LL / elapsed : 0;
+	}
+}
+
+std::string eMetrics::text()
+{
+	std::map<std::string, long long> values;
+	snapshot(values);
+	std::string text;
+	for (std::map<std::string, long long>::iterator it = values.begin(); it != values.end(); ++it)
+	{
+		char value[24];
+		snprintf(value, sizeof(value), " %lld\n", it->second);
+		text += it->first;
+		text += value;
+	}
+	return text;
+}
+
+long long eMetrics::value(const std::string &name)
+{
+	std::map<std::string, long long> values;
+	snapshot(values);
+	std::map<std::string, long long>::iterator it = values.find(name);
+	return it != values.end() ? it->second : 0;
+}
@@ -0,0 +1,139 @@
+#ifndef __lib_base_metrics_h
+#define __lib_base_metrics_h
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <lib/base/elock.h>
+
+/*
+ * Live figures of recordings, playback, section readers and the stream
+ * server, for watching a box while it works instead of reading the debug
+ * log after a recording went wrong.
+ *
+ * A metric is a static object in the file that updates it, it registers
+ * itself by name:
+ *
+ *   static eMetricCounter record_bytes("record.bytes");
+ *   ...
+ *   record_bytes.add(len);
+ *
+ * Updates don't take a lock, so the realtime threads can update them on
+ * every buffer. eMetrics takes snapshots of all of them, for C++, python
+ * (eMetrics.getInstance().text()) and the metrics socket.
+ */
+
+#ifndef SWIG
+#if defined(__GCC_ATOMIC_LLONG_LOCK_FREE) && __GCC_ATOMIC_LLONG_LOCK_FREE == 2
+typedef long long eMetricValue;
+#else
+	/* no 64 bit atomics without a lock on this cpu, counters wrap at 2G */
+typedef long eMetricValue;
+#endif
+
+class eMetric
+{
+public:
+	enum { typeCounter, typeGauge, typeHistogram };
+	eMetric(const char *name, int type);
+	virtual ~eMetric();
+	const char *name() const { return m_name; }
+	int type() const { return m_type; }
+	/* name and value pairs, name relative to the name of the metric */
+	virtual void sample(std::vector<std::pair<std::string, long long> > &values) const = 0;
+private:
+	const char *m_name;
+	int m_type;
+	eMetric(const eMetric &);
+	eMetric &operator=(const eMetric &);
+};
+
+/* goes up only, eMetrics adds the rate per second */
+class eMetricCounter: public eMetric
+{
+	eMetricValue m_value;
+public:
+	eMetricCounter(const char *name): eMetric(name, typeCounter), m_value(0) {}
+	void add(eMetricValue n) { __atomic_fetch_add(&m_value, n, __ATOMIC_RELAXED); }
+	void inc() { add(1); }
+	long long get() const { return __atomic_load_n(&m_value, __ATOMIC_RELAXED); }
+	void sample(std::vector<std::pair<std::string, long long> > &values) const;
+};
+
+/* a level, like buffers in use or clients connected */
+class eMetricGauge: public eMetric
+{
+	eMetricValue m_value;
+public:
+	eMetricGauge(const char *name): eMetric(name, typeGauge), m_value(0) {}
+	void set(eMetricValue n) { __atomic_store_n(&m_value, n, __ATOMIC_RELAXED); }
+	void add(eMetricValue n) { __atomic_fetch_add(&m_value, n, __ATOMIC_RELAXED); }
+	void inc() { add(1); }
+	void dec() { add(-1); }
+	long long get() const { return __atomic_load_n(&m_value, __ATOMIC_RELAXED); }
+	void sample(std::vector<std::pair<std::string, long long> > &values) const;
+};
+
+/*
+ * Distribution of a value, usually a time in us: bucket n counts the values
+ * from 2^(n-1) up to 2^n - 1, bucket 0 the zeros. Percentiles are reported
+ * as the upper end of their bucket, so they are at most twice too high.
+ */
+class eMetricHistogram: public eMetric
+{
+public:
+	enum { BUCKETS = 32 };
+	eMetricHistogram(const char *name);
+	void add(eMetricValue value);
+	/* the percentile @percent (0..100) of what was added so far */
+	long long percentile(int percent) const;
+	long long count() const;
+	void sample(std::vector<std::pair<std::string, long long> > &values) const;
+private:
+	eMetricValue m_buckets[BUCKETS];
+	eMetricValue m_count, m_sum, m_max;
+};
+
+/* adds the us from its construction to its end to @histogram */
+class eMetricTimer
+{
+	eMetricHistogram &m_histogram;
+	long long m_start;
+public:
+	eMetricTimer(eMetricHistogram &histogram);
+	~eMetricTimer();
+	static long long now_us();
+};
+#endif
+
+class eMetrics
+{
+#ifndef SWIG
+	friend class eMetric;
+	enum { RATE_WINDOW = 10 }; // seconds the rates of counters are averaged over
+	struct rate
+	{
+		long long value, time; // at the begin of the window, time in us
+		long long last_value, last_time; // the window before
+	};
+	eSingleLock m_lock;
+	std::map<std::string, eMetric*> m_metrics;
+	std::map<std::string, rate> m_rates;
+	void add(eMetric *metric);
+	void remove(eMetric *metric);
+#endif
+	eMetrics();
+public:
+	static eMetrics *getInstance();
+#ifndef SWIG
+	/* all values, counters with a .rate per second, histograms with .count, .sum, .max, .p50, .p90 and .p99 */
+	void snapshot(std::map<std::string, long long> &values);
+#endif
+	/* the snapshot as "name value" lines, sorted by name */
+	std::string text();
+	/* a single value of the snapshot, 0 when there is no such value */
+	long long value(const std::string &name);
+};
+
+#endif
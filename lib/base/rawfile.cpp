@@ -1,6 +1,8 @@
 #include <cstdio>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <lib/base/rawfile.h>
 #include <lib/base/eerror.h>
 
@@ -10,14 +12,19 @@ eRawFile::eRawFile(int packetsize)
 	: iTsSource(packetsize)
 	, m_lock()
 	, m_fd(-1)
+	, m_use_count(0)
 	, m_nrfiles(0)
 	, m_splitsize(0)
 	, m_totallength(0)
-	, m_current_offset(0)
-	, m_base_offset(0)
 	, m_last_offset(0)
-	, m_current_file(0)
 {
+	for (int i = 0; i < MAX_OPEN_PARTS; ++i)
+	{
+		m_parts[i].nr = -1;
+		m_parts[i].fd = -1;
+		m_parts[i].users = 0;
+		m_parts[i].used = 0;
+	}
 }
 
 eRawFile::~eRawFile()
@@ -30,25 +37,12 @@ int eRawFile::open(const char *filename)
 	close();
 	m_basename = filename;
 	scan();
-	m_current_offset = 0;
 	m_last_offset = 0;
 	m_fd = ::open(filename, O_RDONLY | O_LARGEFILE);
 	posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 	return m_fd;
 }
 
-off_t eRawFile::lseek_internal(off_t offset)
-{
-//	eDebug("lseek: %lld, %d", offset, whence);
-		/* if there is only one file, use the native lseek - the file could be growing! */
-	if (m_nrfiles < 2)
-	{
-		return ::lseek(m_fd, offset, SEEK_SET);
-	}
-	m_current_offset = offset;
-	return m_current_offset;
-}
-
 int eRawFile::close()
 {
 	int ret = 0;
@@ -58,41 +52,85 @@ int eRawFile::close()
 		ret = ::close(m_fd);
 		m_fd = -1;
 	}
+	for (int i = 0; i < MAX_OPEN_PARTS; ++i)
+	{
+		if (m_parts[i].fd >= 0)
+		{
+			posix_fadvise(m_parts[i].fd, 0, 0, POSIX_FADV_DONTNEED);
+			::close(m_parts[i].fd);
+		}
+		m_parts[i].nr = -1;
+		m_parts[i].fd = -1;
+		m_parts[i].users = 0;
+	}
 	return ret;
 }
 
 ssize_t eRawFile::read(off_t offset, void *buf, size_t count)
 {
-	eSingleLocker l(m_lock);
-
-	if (offset != m_current_offset)
+	ssize_t ret;
+	if (m_nrfiles < 2)
 	{
-		m_current_offset = lseek_internal(offset);
-		if (m_current_offset < 0)
-			return m_current_offset;
+			/* there is only one file, it could be growing */
+		ret = ::pread(m_fd, buf, count, offset);
 	}
-
-	switchOffset(m_current_offset);
-
-	if (m_nrfiles >= 2)
+	else
 	{
-		if (m_current_offset + count > m_totallength)
-			count = m_totallength - m_current_offset;
-		if (count < 0)
+		if (offset >= m_totallength)
+			return 0;
+		if ((off_t)count > m_totallength - offset)
+			count = m_totallength - offset;
+		int nr = offset / m_splitsize;
+		if (nr >= m_nrfiles)
+			nr = m_nrfiles - 1;
+		off_t base = m_splitsize * nr;
+		if (offset >= base + m_part_size[nr])
 			return 0;
+			/* a short read at the end of a part, the caller reads on from the next */
+		if ((off_t)count > base + m_part_size[nr] - offset)
+			count = base + m_part_size[nr] - offset;
+		int fd = acquirePart(nr);
+		if (fd < 0)
+			return -1;
+		ret = ::pread(fd, buf, count, offset - base);
+		releasePart(nr, fd);
 	}
 
-	int ret;
-
-	ret = ::read(m_fd, buf, count);
-
 	if (ret > 0)
 	{
-		m_current_offset = m_last_offset += ret;
+		eSingleLocker l(m_lock);
+		m_last_offset = offset + ret;
 	}
 	return ret;
 }
 
+void eRawFile::prefetch(off_t offset, size_t size)
+{
+	if (m_fd < 0)
+		return;
+	if (m_nrfiles < 2)
+	{
+		posix_fadvise(m_fd, offset, size, POSIX_FADV_WILLNEED);
+		return;
+	}
+	if (offset >= m_totallength)
+		return;
+	int nr = offset / m_splitsize;
+	if (nr >= m_nrfiles)
+		nr = m_nrfiles - 1;
+	off_t base = m_splitsize * nr;
+	if (offset >= base + m_part_size[nr])
+		return;
+		/* only within one part */
+	if (offset + (off_t)size > base + m_part_size[nr])
+		size = base + m_part_size[nr] - offset;
+	int fd = acquirePart(nr);
+	if (fd < 0)
+		return;
+	posix_fadvise(fd, offset - base, size, POSIX_FADV_WILLNEED);
+	releasePart(nr, fd);
+}
+
 int eRawFile::valid()
 {
 	return m_fd != -1;
@@ -102,49 +140,81 @@ void eRawFile::scan()
 {
 	m_nrfiles = 0;
 	m_totallength = 0;
+	m_part_size.clear();
 	while (m_nrfiles < 1000) /* .999 is the last possible */
 	{
-		int f = openFileUncached(m_nrfiles);
-		if (f < 0)
+		struct stat st;
+		if (::stat(partName(m_nrfiles).c_str(), &st) < 0)
 			break;
 		if (!m_nrfiles)
-			m_splitsize = ::lseek(f, 0, SEEK_END);
-		m_totallength += ::lseek(f, 0, SEEK_END);
-		::close(f);
+			m_splitsize = st.st_size;
+		m_part_size.push_back(st.st_size);
+		m_totallength += st.st_size;
 		++m_nrfiles;
 	}
 //	eDebug("found %d files, splitsize: %llx, totallength: %llx", m_nrfiles, m_splitsize, m_totallength);
 }
 
-int eRawFile::switchOffset(off_t off)
+	/* the descriptor of part @nr, to be given back with releasePart. The
+	   parts that were read last stay open, so jumping between parts doesn't
+	   open and close them every time. */
+int eRawFile::acquirePart(int nr)
 {
-	if (m_splitsize)
+	if (nr == 0)
+		return m_fd;
+	eSingleLocker l(m_lock);
+	Part *lru = NULL;
+	for (int i = 0; i < MAX_OPEN_PARTS; ++i)
 	{
-		int filenr = off / m_splitsize;
-		if (filenr >= m_nrfiles)
-			filenr = m_nrfiles - 1;
-		if (filenr != m_current_file)
+		Part &part = m_parts[i];
+		if (part.nr == nr)
 		{
-//			eDebug("-> %d", filenr);
-			close();
-			m_fd = openFileUncached(filenr);
-			m_last_offset = m_base_offset = m_splitsize * filenr;
-			m_current_file = filenr;
+			++part.users;
+			part.used = ++m_use_count;
+			return part.fd;
 		}
-	} else
-		m_base_offset = 0;
-
-	if (off != m_last_offset)
+		if (part.users)
+			continue;
+		if (!lru || part.fd < 0 || (lru->fd >= 0 && part.used < lru->used))
+			lru = &part;
+	}
+	int fd = openFileUncached(nr);
+	if (fd < 0)
 	{
-		m_last_offset = ::lseek(m_fd, off - m_base_offset, SEEK_SET) + m_base_offset;
-		return m_last_offset;
-	} else
+		eDebug("[eRawFile] can't open part %d of %s: %m", nr, m_basename.c_str());
+		return -1;
+	}
+	if (!lru)
+		return fd; /* all are being read, this one is closed again after the read */
+	if (lru->fd >= 0)
 	{
-		return m_last_offset;
+		posix_fadvise(lru->fd, 0, 0, POSIX_FADV_DONTNEED);
+		::close(lru->fd);
 	}
+	lru->nr = nr;
+	lru->fd = fd;
+	lru->users = 1;
+	lru->used = ++m_use_count;
+	return fd;
 }
 
-int eRawFile::openFileUncached(int nr)
+void eRawFile::releasePart(int nr, int fd)
+{
+	if (nr == 0)
+		return;
+	eSingleLocker l(m_lock);
+	for (int i = 0; i < MAX_OPEN_PARTS; ++i)
+	{
+		if (m_parts[i].nr == nr && m_parts[i].fd == fd)
+		{
+			--m_parts[i].users;
+			return;
+		}
+	}
+	::close(fd);
+}
+
+std::string eRawFile::partName(int nr)
 {
 	std::string filename = m_basename;
 	if (nr)
@@ -153,7 +223,12 @@ int eRawFile::openFileUncached(int nr)
 		snprintf(suffix, 5, ".%03d", nr);
 		filename += suffix;
 	}
-	return ::open(filename.c_str(), O_RDONLY | O_LARGEFILE);
+	return filename;
+}
+
+int eRawFile::openFileUncached(int nr)
+{
+	return ::open(partName(nr).c_str(), O_RDONLY | O_LARGEFILE);
 }
 
 off_t eRawFile::length()
@@ -173,5 +248,6 @@ off_t eRawFile::length()
 
 off_t eRawFile::offset()
 {
+	eSingleLocker l(m_lock);
 	return m_last_offset;
 }
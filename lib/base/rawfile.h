@@ -2,6 +2,7 @@
 #define __lib_base_rawfile_h
 
 #include <string>
+#include <vector>
 #include <lib/base/itssource.h>
 
 class eRawFile: public iTsSource
@@ -18,21 +19,32 @@ public:
 	off_t length();
 	off_t offset();
 	int valid();
+	void prefetch(off_t offset, size_t size);
 private:
-	int m_fd;
+	enum { MAX_OPEN_PARTS = 4 };
+		/* an open part of a split recording (.001 and up) */
+	struct Part
+	{
+		int nr;
+		int fd;
+		int users; /* reads going on, it isn't closed while there are any */
+		unsigned int used;
+	};
+	int m_fd; /* the first part, open as long as the file is */
+	Part m_parts[MAX_OPEN_PARTS];
+	unsigned int m_use_count;
 	int m_nrfiles;
 	off_t m_splitsize;
 	off_t m_totallength;
-	off_t m_current_offset;
-	off_t m_base_offset;
 	off_t m_last_offset;
-	int m_current_file;
+	std::vector<off_t> m_part_size;
 	std::string m_basename;
 
 	int close();
 	void scan();
-	int switchOffset(off_t off);
-	off_t lseek_internal(off_t offset);
+	int acquirePart(int nr);
+	void releasePart(int nr, int fd);
+	std::string partName(int nr);
 	int openFileUncached(int nr);
 };
 
@@ -0,0 +1,238 @@
+#include <lib/base/recordio.h>
+#include <lib/base/eerror.h>
+#include <lib/base/ioprio.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+
+static long long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+eRecordIOStream::eRecordIOStream(eRecordIOWriter *writer, int fd, int priority, int slots)
+	:m_writer(writer), m_fd(fd), m_priority(priority), m_busy(slots, false),
+	m_busy_count(0), m_max_busy(0), m_error(0)
+{
+}
+
+int eRecordIOStream::write(int slot, const void *data, size_t len, off_t offset)
+{
+	eSingleLocker l(m_writer->m_lock);
+	if (m_error)
+	{
+		errno = m_error;
+		return -1;
+	}
+	request r;
+	r.slot = slot;
+	r.data = (const unsigned char *)data;
+	r.len = len;
+	r.offset = offset;
+	r.queued = now_ms();
+	m_queue.push_back(r);
+	m_busy[slot] = true;
+	if (++m_busy_count > m_max_busy)
+		m_max_busy = m_busy_count;
+	if (!m_writer->m_queued++)
+		m_writer->m_work.signal();
+	return 0;
+}
+
+int eRecordIOStream::wait(int slot)
+{
+	eSingleLocker l(m_writer->m_lock);
+	while (m_busy[slot])
+		m_done.wait(m_writer->m_lock);
+	if (m_error)
+	{
+		errno = m_error;
+		return -1;
+	}
+	return 0;
+}
+
+int eRecordIOStream::flush()
+{
+	eSingleLocker l(m_writer->m_lock);
+	while (m_busy_count)
+		m_done.wait(m_writer->m_lock);
+	if (m_error)
+	{
+		errno = m_error;
+		return -1;
+	}
+	return 0;
+}
+
+int eRecordIOStream::busy()
+{
+	eSingleLocker l(m_writer->m_lock);
+	return m_busy_count;
+}
+
+int eRecordIOStream::maxBusy()
+{
+	eSingleLocker l(m_writer->m_lock);
+	return m_max_busy;
+}
+
+eRecordIOWriter::eRecordIOWriter()
+	:m_queued(0)
+{
+}
+
+eRecordIOStream *eRecordIOWriter::pick()
+{
+	// oldest buffer first, timeshift buffers count as TIMESHIFT_DELAY younger
+	eRecordIOStream *best = NULL;
+	long long best_key = 0;
+	for (std::list<eRecordIOStream*>::iterator it(m_streams.begin()); it != m_streams.end(); ++it)
+	{
+		eRecordIOStream *s = *it;
+		if (s->m_queue.empty())
+			continue;
+		long long key = s->m_queue.front().queued;
+		if (s->m_priority == eRecordIOScheduler::priorityTimeshift)
+			key += eRecordIOScheduler::TIMESHIFT_DELAY;
+		if (!best || key < best_key)
+		{
+			best = s;
+			best_key = key;
+		}
+	}
+	return best;
+}
+
+int eRecordIOWriter::writeBatch(int fd, struct iovec *iov, int count, off_t offset)
+{
+	while (count)
+	{
+		ssize_t wr = ::pwritev(fd, iov, count, offset);
+		if (wr < 0 && errno == EINTR)
+			continue;
+		if (wr < 0)
+			return -1;
+		if (wr == 0)
+		{
+			errno = ENOSPC;
+			return -1;
+		}
+		offset += wr;
+		while (count && (size_t)wr >= iov->iov_len)
+		{
+			wr -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count)
+		{
+			iov->iov_base = (unsigned char *)iov->iov_base + wr;
+			iov->iov_len -= wr;
+		}
+	}
+	return 0;
+}
+
+void eRecordIOWriter::thread()
+{
+	setIoPrio(IOPRIO_CLASS_RT, 7);
+	hasStarted();
+	eSingleLocker l(m_lock);
+	while (1)
+	{
+		while (!m_queued)
+			m_work.wait(m_lock);
+		eRecordIOStream *s = pick();
+		// take the adjacent buffers at the head of its queue
+		struct iovec iov[MAX_IOV];
+		int slots[MAX_IOV];
+		int count = 0;
+		size_t total = 0;
+		off_t offset = s->m_queue.front().offset;
+		while (count < MAX_IOV && !s->m_queue.empty() && total < MAX_BATCH)
+		{
+			eRecordIOStream::request &r = s->m_queue.front();
+			if (r.offset != offset + (off_t)total)
+				break;
+			iov[count].iov_base = (void *)r.data;
+			iov[count].iov_len = r.len;
+			slots[count] = r.slot;
+			total += r.len;
+			++count;
+			s->m_queue.pop_front();
+		}
+		m_queued -= count;
+		int fd = s->m_fd;
+
+		m_lock.unlock();
+		int res = writeBatch(fd, iov, count, offset);
+		int error = res < 0 ? errno : 0;
+		m_lock.lock();
+
+		if (error && !s->m_error)
+		{
+			errno = error;
+			eDebug("[eRecordIOWriter] writing %zu bytes at %lld failed: %m", total, (long long)offset);
+			s->m_error = error;
+		}
+		for (int i = 0; i < count; ++i)
+			s->m_busy[slots[i]] = false;
+		s->m_busy_count -= count;
+		// only the thread feeding the stream waits for it
+		s->m_done.signal();
+	}
+}
+
+eRecordIOScheduler *eRecordIOScheduler::getInstance()
+{
+	// never destroyed, the writers run until the process ends
+	static eRecordIOScheduler *instance = new eRecordIOScheduler;
+	return instance;
+}
+
+eRecordIOStream *eRecordIOScheduler::attach(int fd, int priority, int slots)
+{
+	struct stat st;
+	if (::fstat(fd, &st) < 0)
+	{
+		eDebug("[eRecordIOScheduler] fstat failed: %m");
+		return NULL;
+	}
+	eRecordIOWriter *writer;
+	{
+		eSingleLocker l(m_lock);
+		std::map<dev_t, eRecordIOWriter*>::iterator it = m_writers.find(st.st_dev);
+		if (it != m_writers.end())
+			writer = it->second;
+		else
+		{
+			writer = new eRecordIOWriter;
+			m_writers[st.st_dev] = writer;
+			eDebug("[eRecordIOScheduler] new writer for device %x:%x", major(st.st_dev), minor(st.st_dev));
+			writer->run();
+		}
+	}
+	eRecordIOStream *stream = new eRecordIOStream(writer, fd, priority, slots);
+	eSingleLocker l(writer->m_lock);
+	writer->m_streams.push_back(stream);
+	return stream;
+}
+
+void eRecordIOScheduler::detach(eRecordIOStream *stream)
+{
+	stream->flush();
+	eRecordIOWriter *writer = stream->m_writer;
+	{
+		eSingleLocker l(writer->m_lock);
+		writer->m_streams.remove(stream);
+	}
+	delete stream;
+}
@@ -0,0 +1,100 @@
+#ifndef __lib_base_recordio_h
+#define __lib_base_recordio_h
+
+#include <deque>
+#include <list>
+#include <map>
+#include <vector>
+#include <sys/types.h>
+
+#include <lib/base/elock.h>
+#include <lib/base/thread.h>
+
+class eRecordIOWriter;
+
+/*
+ * Shared writer for recordings: instead of every recording writing its own
+ * file from its own realtime thread, the recordings queue their filled
+ * buffers here and one writer thread per filesystem writes them, a batch of
+ * adjacent buffers of one file at a time. The disk then sees a few large
+ * sequential writes in turn instead of many small interleaved ones.
+ *
+ * A stream owns a fixed number of buffers ("slots") and may only refill a
+ * slot after wait() returned for it, which limits how much of a stream can
+ * be queued and lets a slow disk push back on its reader.
+ *
+ * Timeshift buffers are written after the recording buffers that were
+ * queued up to TIMESHIFT_DELAY later, so recordings keep their buffers free
+ * when the disk can't keep up with everything.
+ */
+class eRecordIOStream
+{
+	friend class eRecordIOWriter;
+	friend class eRecordIOScheduler;
+public:
+	// queue @len bytes at @data for @offset of the file as buffer @slot
+	int write(int slot, const void *data, size_t len, off_t offset);
+	// wait until buffer @slot is written, -1 with errno set when a write of this stream failed
+	int wait(int slot);
+	// wait until all buffers are written
+	int flush();
+	// buffers queued or being written, and the most there ever were
+	int busy();
+	int maxBusy();
+private:
+	struct request
+	{
+		int slot;
+		const unsigned char *data;
+		size_t len;
+		off_t offset;
+		long long queued; // ms
+	};
+	eRecordIOWriter *m_writer;
+	int m_fd, m_priority;
+	// all below are guarded by the lock of m_writer
+	std::deque<request> m_queue;
+	std::vector<bool> m_busy;
+	int m_busy_count, m_max_busy;
+	int m_error;
+	eCondition m_done;
+
+	eRecordIOStream(eRecordIOWriter *writer, int fd, int priority, int slots);
+	eRecordIOStream(const eRecordIOStream &);
+	eRecordIOStream &operator=(const eRecordIOStream &);
+};
+
+class eRecordIOWriter: public eThread
+{
+	friend class eRecordIOStream;
+	friend class eRecordIOScheduler;
+	// at most that much of one stream is written with one call
+	enum { MAX_BATCH = 2 * 1024 * 1024, MAX_IOV = 32 };
+	eSingleLock m_lock;
+	eCondition m_work;
+	std::list<eRecordIOStream*> m_streams;
+	int m_queued;
+
+	eRecordIOWriter();
+	void thread();
+	eRecordIOStream *pick();
+	static int writeBatch(int fd, struct iovec *iov, int count, off_t offset);
+};
+
+class eRecordIOScheduler
+{
+	eSingleLock m_lock;
+	std::map<dev_t, eRecordIOWriter*> m_writers;
+	eRecordIOScheduler() {}
+public:
+	enum { priorityRecording, priorityTimeshift };
+	enum { TIMESHIFT_DELAY = 250 }; // ms
+
+	static eRecordIOScheduler *getInstance();
+	// start writing @fd through the writer of its filesystem with @slots buffers, NULL on error
+	eRecordIOStream *attach(int fd, int priority, int slots);
+	// wait for the queued buffers of @stream and free it
+	void detach(eRecordIOStream *stream);
+};
+
+#endif
@@ -0,0 +1,191 @@
+#include <lib/base/ringfile.h>
+#include <lib/base/eerror.h>
+#include <map>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+	eSingleLock rings_lock;
+	std::map<std::string, eRingFileState*> rings;
+}
+
+DEFINE_REF(eRingFileState);
+
+eRingFileState::eRingFileState(const std::string &filename, off_t size, int structure_entries, int packetsize)
+	: m_filename(filename)
+	, m_size(size)
+	, m_structure_entries(structure_entries)
+	, m_packetsize(packetsize)
+	, m_head(0)
+	, m_end(0)
+	, m_structure_head(0)
+	, m_structure_end(0)
+{
+	eSingleLocker l(rings_lock);
+	rings[m_filename] = this;
+}
+
+eRingFileState::~eRingFileState()
+{
+	eSingleLocker l(rings_lock);
+	std::map<std::string, eRingFileState*>::iterator i = rings.find(m_filename);
+	if (i != rings.end() && i->second == this)
+		rings.erase(i);
+}
+
+int eRingFileState::lookup(const std::string &filename, ePtr<eRingFileState> &ptr)
+{
+	eSingleLocker l(rings_lock);
+	std::map<std::string, eRingFileState*>::iterator i = rings.find(filename);
+	if (i == rings.end())
+		return -1;
+	ptr = i->second;
+	return 0;
+}
+
+void eRingFileState::setPosition(off_t head, off_t end)
+{
+	eSingleLocker l(m_lock);
+	m_head = head;
+	m_end = end > 0 ? end : 0;
+}
+
+off_t eRingFileState::begin()
+{
+	eSingleLocker l(m_lock);
+	off_t begin = m_head + MARGIN - m_size;
+	if (begin <= 0)
+		return 0;
+	return begin + (m_packetsize - begin % m_packetsize) % m_packetsize;
+}
+
+off_t eRingFileState::end()
+{
+	eSingleLocker l(m_lock);
+	return m_end;
+}
+
+void eRingFileState::setStructurePosition(int head, int end)
+{
+	eSingleLocker l(m_lock);
+	m_structure_head = head;
+	m_structure_end = end;
+}
+
+int eRingFileState::structureBegin()
+{
+	eSingleLocker l(m_lock);
+	/* a sixteenth of the entries as margin, and whole pages, so a window
+	   of entries that is mapped never reaches into the part being written */
+	const int page = 4096 / 16;
+	int begin = m_structure_head + m_structure_entries / 16 - m_structure_entries;
+	if (begin <= 0)
+		return 0;
+	return begin + (page - begin % page) % page;
+}
+
+int eRingFileState::structureEnd()
+{
+	eSingleLocker l(m_lock);
+	return m_structure_end;
+}
+
+DEFINE_REF(eRingFile);
+
+eRingFile::eRingFile(int packetsize)
+	: iTsSource(packetsize)
+	, m_fd(-1)
+	, m_last_offset(0)
+{
+}
+
+eRingFile::~eRingFile()
+{
+	if (m_fd >= 0)
+	{
+		posix_fadvise(m_fd, 0, 0, POSIX_FADV_DONTNEED);
+		::close(m_fd);
+	}
+}
+
+int eRingFile::open(const char *filename)
+{
+	if (eRingFileState::lookup(filename, m_state) < 0)
+		return -1;
+	m_fd = ::open(filename, O_RDONLY | O_LARGEFILE);
+	if (m_fd < 0)
+	{
+		eDebug("[eRingFile] can't open %s: %m", filename);
+		m_state = 0;
+	}
+	return m_fd;
+}
+
+ssize_t eRingFile::read(off_t offset, void *buf, size_t count)
+{
+	if (m_fd < 0)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	if (offset < m_state->begin())
+	{
+		errno = ENODATA; /* the writer went past it */
+		return -1;
+	}
+	off_t end = m_state->end();
+	if (offset >= end)
+		return 0;
+	if ((off_t)count > end - offset)
+		count = end - offset;
+		/* a short read at the end of the file, the caller reads on from the start */
+	off_t size = m_state->size();
+	off_t pos = offset % size;
+	if ((off_t)count > size - pos)
+		count = size - pos;
+	ssize_t ret = ::pread(m_fd, buf, count, pos);
+	if (ret > 0 && offset < m_state->begin())
+	{
+		errno = ENODATA; /* overwritten while it was read */
+		return -1;
+	}
+	if (ret > 0)
+		m_last_offset = offset + ret;
+	return ret;
+}
+
+off_t eRingFile::length()
+{
+	return m_state ? m_state->end() : 0;
+}
+
+off_t eRingFile::offset()
+{
+	return m_last_offset;
+}
+
+int eRingFile::valid()
+{
+	return m_fd != -1;
+}
+
+off_t eRingFile::begin()
+{
+	return m_state ? m_state->begin() : 0;
+}
+
+void eRingFile::prefetch(off_t offset, size_t size)
+{
+	if (m_fd < 0)
+		return;
+	off_t ring = m_state->size();
+	off_t pos = offset % ring;
+	if ((off_t)size > ring - pos)
+	{
+		posix_fadvise(m_fd, 0, size - (ring - pos), POSIX_FADV_WILLNEED);
+		size = ring - pos;
+	}
+	posix_fadvise(m_fd, pos, size, POSIX_FADV_WILLNEED);
+}
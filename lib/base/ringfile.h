@@ -0,0 +1,80 @@
+#ifndef __lib_base_ringfile_h
+#define __lib_base_ringfile_h
+
+#include <string>
+#include <lib/base/itssource.h>
+#include <lib/base/elock.h>
+
+/*
+ * A ring file keeps only the last part of a recording (a timeshift): the
+ * file has a fixed size and the recorder writes it over and over. Offsets
+ * keep growing as if the file grew, the data of offset o is at o % size in
+ * the file. The structure file (.sc) next to it is a ring of entries the
+ * same way.
+ *
+ * The recorder and the readers of a ring run in the same process, so
+ * instead of a header in the file they share this state, which is found by
+ * the name of the file.
+ */
+class eRingFileState: public iObject
+{
+	DECLARE_REF(eRingFileState);
+public:
+	/* data that is kept away from the writer, so a reader that checked the
+	   begin isn't overtaken while it reads */
+	enum { MARGIN = 16 * 1024 * 1024 };
+
+	/* @size bytes of data and @structure_entries entries in the .sc, both
+	   written from the start. replaces a previous state for @filename */
+	eRingFileState(const std::string &filename, off_t size, int structure_entries, int packetsize);
+	~eRingFileState();
+	/* the ring that is written to @filename, -1 when there is none */
+	static int lookup(const std::string &filename, ePtr<eRingFileState> &ptr);
+
+	off_t size() const { return m_size; }
+	int structureSize() const { return m_structure_entries; }
+
+	/* from the recorder: data up to @head is being written, up to @end it is on disk */
+	void setPosition(off_t head, off_t end);
+	/* the first offset that is still there, and the end of the data */
+	off_t begin();
+	off_t end();
+
+	/* the same for structure entries, counted from the first one ever written */
+	void setStructurePosition(int head, int end);
+	int structureBegin();
+	int structureEnd();
+private:
+	std::string m_filename;
+	off_t m_size;
+	int m_structure_entries;
+	int m_packetsize;
+	eSingleLock m_lock;
+	off_t m_head, m_end;
+	int m_structure_head, m_structure_end;
+};
+
+	/* reads a ring file through its growing offsets */
+class eRingFile: public iTsSource
+{
+	DECLARE_REF(eRingFile);
+public:
+	eRingFile(int packetsize = 188);
+	~eRingFile();
+	/* -1 when no ring is being written to @filename */
+	int open(const char *filename);
+
+	// iTsSource
+	ssize_t read(off_t offset, void *buf, size_t count);
+	off_t length();
+	off_t offset();
+	int valid();
+	off_t begin();
+	void prefetch(off_t offset, size_t size);
+private:
+	int m_fd;
+	ePtr<eRingFileState> m_state;
+	off_t m_last_offset;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include <lib/base/uring.h>
+#include <lib/base/eerror.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+
+eIOUring::eIOUring()
+	:m_fd(-1), m_entries(0), m_sq_ring(MAP_FAILED), m_cq_ring(MAP_FAILED),
+	m_sq_ring_size(0), m_cq_ring_size(0), m_sqes(0), m_iov(0), m_queued(0),
+	m_registered(0), m_registered_size(0)
+{
+}
+
+eIOUring::~eIOUring()
+{
+	close();
+}
+
+#ifdef HAVE_IO_URING
+
+bool eIOUring::init(unsigned int entries)
+{
+	close();
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	m_fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (m_fd < 0)
+	{
+		eDebug("[eIOUring] io_uring_setup failed: %m");
+		return false;
+	}
+	m_entries = p.sq_entries;
+	m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	m_sq_ring = ::mmap(NULL, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	m_cq_ring = ::mmap(NULL, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+	void *sqes = ::mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+	m_sqes = sqes == MAP_FAILED ? NULL : (struct io_uring_sqe *)sqes;
+	if (m_sq_ring == MAP_FAILED || m_cq_ring == MAP_FAILED || !m_sqes)
+	{
+		eDebug("[eIOUring] mapping the rings failed: %m");
+		close();
+		return false;
+	}
+	unsigned char *sq = (unsigned char *)m_sq_ring, *cq = (unsigned char *)m_cq_ring;
+	m_sq_head = (unsigned *)(sq + p.sq_off.head);
+	m_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	m_sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	m_sq_array = (unsigned *)(sq + p.sq_off.array);
+	m_cq_head = (unsigned *)(cq + p.cq_off.head);
+	m_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	m_cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	m_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	m_iov = new struct iovec[m_entries];
+	m_queued = 0;
+	return true;
+}
+
+void eIOUring::close()
+{
+	if (m_sqes)
+		::munmap(m_sqes, m_entries * sizeof(struct io_uring_sqe));
+	if (m_sq_ring != MAP_FAILED)
+		::munmap(m_sq_ring, m_sq_ring_size);
+	if (m_cq_ring != MAP_FAILED)
+		::munmap(m_cq_ring, m_cq_ring_size);
+	if (m_fd >= 0)
+		::close(m_fd); // also drops the registered buffer
+	delete [] m_iov;
+	m_iov = NULL;
+	m_sqes = NULL;
+	m_sq_ring = m_cq_ring = MAP_FAILED;
+	m_fd = -1;
+	m_registered = NULL;
+	m_registered_size = 0;
+}
+
+bool eIOUring::registerBuffer(void *base, size_t size)
+{
+	struct iovec iov;
+	iov.iov_base = base;
+	iov.iov_len = size;
+	if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+	{
+		// usually RLIMIT_MEMLOCK, plain writes work as well
+		eDebug("[eIOUring] registering %zu bytes failed: %m", size);
+		return false;
+	}
+	m_registered = (unsigned char *)base;
+	m_registered_size = size;
+	return true;
+}
+
+bool eIOUring::write(int fd, const void *buf, size_t len, off_t offset, __u64 user_data)
+{
+	unsigned tail = *m_sq_tail;
+	if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_entries)
+		return false;
+	unsigned index = tail & *m_sq_mask;
+	struct io_uring_sqe *sqe = &m_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	const unsigned char *p = (const unsigned char *)buf;
+	if (m_registered && p >= m_registered && p + len <= m_registered + m_registered_size)
+	{
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->buf_index = 0;
+		sqe->addr = (unsigned long)buf;
+		sqe->len = len;
+	}
+	else
+	{
+		// IORING_OP_WRITE needs 5.6, writev works on every io_uring kernel
+		sqe->opcode = IORING_OP_WRITEV;
+		m_iov[index].iov_base = (void *)buf;
+		m_iov[index].iov_len = len;
+		sqe->addr = (unsigned long)&m_iov[index];
+		sqe->len = 1;
+	}
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	m_sq_array[index] = index;
+	__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++m_queued;
+	return true;
+}
+
+int eIOUring::submit()
+{
+	while (m_queued)
+	{
+		int r = syscall(__NR_io_uring_enter, m_fd, m_queued, 0, 0, NULL, _NSIG / 8);
+		if (r < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			eDebug("[eIOUring] io_uring_enter failed: %m");
+			return -1;
+		}
+		m_queued -= r;
+	}
+	return 0;
+}
+
+int eIOUring::complete(__u64 &user_data, int &res, bool wait)
+{
+	unsigned head = *m_cq_head;
+	while (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+	{
+		if (!wait)
+			return 0;
+		if (syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, _NSIG / 8) < 0 && errno != EINTR)
+		{
+			eDebug("[eIOUring] waiting for completions failed: %m");
+			return -1;
+		}
+	}
+	struct io_uring_cqe *cqe = &m_cqes[head & *m_cq_mask];
+	user_data = cqe->user_data;
+	res = cqe->res;
+	__atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+#else
+
+bool eIOUring::init(unsigned int entries)
+{
+	eDebug("[eIOUring] built without io_uring support");
+	return false;
+}
+
+void eIOUring::close()
+{
+}
+
+bool eIOUring::registerBuffer(void *base, size_t size)
+{
+	return false;
+}
+
+bool eIOUring::write(int fd, const void *buf, size_t len, off_t offset, __u64 user_data)
+{
+	return false;
+}
+
+int eIOUring::submit()
+{
+	return -1;
+}
+
+int eIOUring::complete(__u64 &user_data, int &res, bool wait)
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef __lib_base_uring_h
+#define __lib_base_uring_h
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <asm/types.h>
+
+/*
+ * Minimal io_uring wrapper for writing files, talking to the kernel
+ * directly so no liburing is needed. Only one thread may use a ring.
+ *
+ * Without io_uring support in the kernel headers at build time or in the
+ * running kernel, init() fails and the caller is expected to fall back to
+ * another way of writing.
+ */
+class eIOUring
+{
+public:
+	eIOUring();
+	~eIOUring();
+
+	// set up a ring for @entries requests in flight
+	bool init(unsigned int entries);
+	void close();
+	bool isOpen() const { return m_fd >= 0; }
+
+	// register @size bytes at @base for fixed writes, writes from inside
+	// that area then skip mapping the pages for every request
+	bool registerBuffer(void *base, size_t size);
+	bool hasRegisteredBuffer() const { return m_registered != NULL; }
+
+	// queue a write of @len bytes from @buf to @fd at @offset, the
+	// completion returns @user_data. false if the ring is full.
+	bool write(int fd, const void *buf, size_t len, off_t offset, __u64 user_data);
+	// pass the queued requests to the kernel, returns their count or -1
+	int submit();
+	// fetch a completion into @user_data and @res (bytes written or
+	// -errno), optionally waiting for one. returns 1 when one was fetched,
+	// 0 when there is none (yet) and -1 on error.
+	int complete(__u64 &user_data, int &res, bool wait);
+private:
+	int m_fd;
+	unsigned int m_entries;
+	void *m_sq_ring, *m_cq_ring;
+	size_t m_sq_ring_size, m_cq_ring_size;
+	struct io_uring_sqe *m_sqes;
+	unsigned *m_sq_head, *m_sq_tail, *m_sq_mask, *m_sq_array;
+	unsigned *m_cq_head, *m_cq_tail, *m_cq_mask;
+	struct io_uring_cqe *m_cqes;
+	struct iovec *m_iov; // one per submission slot for the writev fallback
+	unsigned int m_queued;
+	unsigned char *m_registered;
+	size_t m_registered_size;
+
+	eIOUring(const eIOUring &);
+	eIOUring &operator=(const eIOUring &);
+};
+
+#endif
@@ -7,6 +7,7 @@
 
 #include <vector>
 #include <string>
+#include <algorithm>
 
 #include "wrappers.h"
 
@@ -69,7 +70,7 @@ ssize_t singleRead(int fd, void *buf, size_t count)
 	}
 }
 
-ssize_t timedRead(int fd, void *buf, size_t count, int initialtimeout, int interbytetimeout)
+ssize_t timedRead(int fd, void *buf, size_t count, int initialtimeout, int interbytetimeout, int abortfd)
 {
 	fd_set rset;
 	struct timeval timeout;
@@ -80,6 +81,8 @@ ssize_t timedRead(int fd, void *buf, size_t count, int initialtimeout, int inter
 	{
 		FD_ZERO(&rset);
 		FD_SET(fd, &rset);
+		if (abortfd >= 0)
+			FD_SET(abortfd, &rset);
 		if (totalread == 0)
 		{
 			timeout.tv_sec = initialtimeout/1000;
@@ -90,8 +93,9 @@ ssize_t timedRead(int fd, void *buf, size_t count, int initialtimeout, int inter
 			timeout.tv_sec = interbytetimeout / 1000;
 			timeout.tv_usec = (interbytetimeout%1000) * 1000;
 		}
-		if ((result = select(fd + 1, &rset, NULL, NULL, &timeout)) < 0) return -1; /* error */
+		if ((result = select(std::max(fd, abortfd) + 1, &rset, NULL, NULL, &timeout)) < 0) return -1; /* error */
 		if (result == 0) break;
+		if (abortfd >= 0 && FD_ISSET(abortfd, &rset)) return -1; /* aborted */
 		if ((result = singleRead(fd, ((char*)buf) + totalread, count - totalread)) < 0)
 		{
 			return -1;
@@ -102,7 +106,7 @@ ssize_t timedRead(int fd, void *buf, size_t count, int initialtimeout, int inter
 	return totalread;
 }
 
-ssize_t readLine(int fd, char** buffer, size_t* bufsize)
+ssize_t readLine(int fd, char** buffer, size_t* bufsize, int abortfd)
 {
 	size_t i = 0;
 	int result;
@@ -116,7 +120,7 @@ ssize_t readLine(int fd, char** buffer, size_t* bufsize)
 			*buffer = newbuf;
 			*bufsize = (*bufsize) + 1024;
 		}
-		result = timedRead(fd, (*buffer) + i, 1, 3000, 100);
+		result = timedRead(fd, (*buffer) + i, 1, 3000, 100, abortfd);
 		if (result <= 0 || (*buffer)[i] == '\n')
 		{
 			(*buffer)[i] = '\0';
@@ -127,7 +131,7 @@ ssize_t readLine(int fd, char** buffer, size_t* bufsize)
 	return -1;
 }
 
-int Connect(const char *hostname, int port, int timeoutsec)
+int Connect(const char *hostname, int port, int timeoutsec, int abortfd)
 {
 	int sd = -1;
 	std::vector<struct addrinfo *> addresses;
@@ -153,7 +157,8 @@ int Connect(const char *hostname, int port, int timeoutsec)
 		ptr = ptr->ai_next;
 	}
 
-	for (unsigned int i = 0; i < addresses.size(); i++)
+	bool aborted = false;
+	for (unsigned int i = 0; i < addresses.size() && !aborted; i++)
 	{
 		sd = ::socket(addresses[i]->ai_family, addresses[i]->ai_socktype, addresses[i]->ai_protocol);
 		if (sd < 0) break;
@@ -189,14 +194,23 @@ int Connect(const char *hostname, int port, int timeoutsec)
 					int error;
 					socklen_t len = sizeof(error);
 					timeval timeout;
-					fd_set wset;
+					fd_set rset, wset;
+					FD_ZERO(&rset);
 					FD_ZERO(&wset);
 					FD_SET(sd, &wset);
+					if (abortfd >= 0)
+						FD_SET(abortfd, &rset);
 
 					timeout.tv_sec = timeoutsec;
 					timeout.tv_usec = 0;
 
-					if (select(sd + 1, NULL, &wset, NULL, &timeout) <= 0) break;
+					if (select(std::max(sd, abortfd) + 1, &rset, &wset, NULL, &timeout) <= 0) break;
+
+					if (abortfd >= 0 && FD_ISSET(abortfd, &rset))
+					{
+						aborted = true;
+						break;
+					}
 
 					if (getsockopt(sd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) break;
 
@@ -2,10 +2,11 @@
 #define __wrappers_h
 
 ssize_t singleRead(int fd, void *buf, size_t count);
-ssize_t timedRead(int fd, void *buf, size_t count, int initialtimeout, int interbytetimeout);
-ssize_t readLine(int fd, char** buffer, size_t* bufsize);
+/* timedRead, readLine and Connect fail at once when @abortfd becomes readable */
+ssize_t timedRead(int fd, void *buf, size_t count, int initialtimeout, int interbytetimeout, int abortfd = -1);
+ssize_t readLine(int fd, char** buffer, size_t* bufsize, int abortfd = -1);
 ssize_t writeAll(int fd, const void *buf, size_t count);
 int Select(int maxfd, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
-int Connect(const char *hostname, int port, int timeoutsec);
+int Connect(const char *hostname, int port, int timeoutsec, int abortfd = -1);
 
 #endif
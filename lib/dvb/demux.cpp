@@ -6,6 +6,7 @@
 #include <signal.h>
 #include <sys/sysinfo.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 //#define SHOW_WRITE_TIME
 static int determineBufferCount()
@@ -35,11 +36,20 @@ static int recordingBufferCount = determineBufferCount();
 #include "crc32.h"
 
 #include <lib/base/eerror.h>
+#include <lib/base/metrics.h>
+#include <lib/base/nconfig.h>
 #include <lib/dvb/idvb.h>
 #include <lib/dvb/demux.h>
 #include <lib/dvb/esection.h>
 #include <lib/dvb/decoder.h>
 
+static eMetricCounter section_count("section.sections");
+static eMetricCounter section_bytes("section.bytes");
+static eMetricCounter section_crc_errors("section.crc_errors");
+static eMetricCounter pes_bytes("pes.bytes");
+	/* buffers of a recording still being written after a write was queued, summed over all recordings */
+static eMetricHistogram record_buffers_busy("record.buffers_busy");
+
 eDVBDemux::eDVBDemux(int adapter, int demux):
 	adapter(adapter),
 	demux(demux),
@@ -185,10 +195,13 @@ void eDVBSectionReader::data(int)
 		unsigned int c;
 		if ((c = crc32((unsigned)-1, data, r)))
 		{
+			section_crc_errors.inc();
 			eDebug("crc32 failed! is %x\n", c);
 			return;
 		}
 	}
+	section_count.inc();
+	section_bytes.add(r);
 	if (active)
 		read(data);
 	else
@@ -295,6 +308,7 @@ void eDVBPESReader::data(int)
 			return;
 		}
 
+		pes_bytes.add(r);
 		if (m_active)
 			m_read(buffer, r);
 		else
@@ -389,7 +403,18 @@ eDVBRecordFileThread::eDVBRecordFileThread(int packetsize, int bufferCount):
 	 m_fd_dest(-1),
 	 m_aio(bufferCount),
 	 m_current_buffer(m_aio.begin()),
-	 m_buffer_use_histogram(bufferCount+1, 0)
+	 m_buffer_use_histogram(bufferCount+1, 0),
+	 m_want_writer(writerAIO),
+	 m_writer(writerAIO),
+	 m_want_direct(false),
+	 m_direct(false),
+	 m_want_preallocate(false),
+	 m_preallocate(false),
+	 m_preallocated(0),
+	 m_fill(0),
+	 m_write_priority(eRecordIOScheduler::priorityRecording),
+	 m_io_stream(NULL),
+	 m_ring_size(0)
 {
 	if (m_buffer == MAP_FAILED)
 		eFatal("Failed to allocate filepush buffer, contact MiLo\n");
@@ -397,6 +422,7 @@ eDVBRecordFileThread::eDVBRecordFileThread(int packetsize, int bufferCount):
 	// move around during writes, so we must remember where the "head" is.
 	m_allocated_buffer = m_buffer;
 	// m_buffersize is thus the size of a single buffer in the queue
+	m_slot_size = m_buffersize;
 	// Initialize the buffer pointers
 	int index = 0;
 	for (AsyncIOvector::iterator it = m_aio.begin(); it != m_aio.end(); ++it)
@@ -408,7 +434,82 @@ eDVBRecordFileThread::eDVBRecordFileThread(int packetsize, int bufferCount):
 
 eDVBRecordFileThread::~eDVBRecordFileThread()
 {
-	::munmap(m_allocated_buffer, m_aio.size() * m_buffersize);
+	::munmap(m_allocated_buffer, m_aio.size() * m_slot_size);
+}
+
+void eDVBRecordFileThread::setWriter(int writer, bool direct, bool preallocate)
+{
+	m_want_writer = writer;
+	m_want_direct = direct;
+	m_want_preallocate = preallocate;
+}
+
+void eDVBRecordFileThread::setWritePriority(int priority)
+{
+	m_write_priority = priority;
+}
+
+void eDVBRecordFileThread::thread()
+{
+	m_writer = writerAIO;
+	m_direct = false;
+	if (m_want_writer == writerShared && m_fd_dest >= 0)
+	{
+		m_io_stream = eRecordIOScheduler::getInstance()->attach(m_fd_dest, m_write_priority, m_aio.size());
+		if (m_io_stream)
+			m_writer = writerShared;
+	}
+	if (m_want_writer == writerURing)
+	{
+		if (m_uring.init(m_aio.size()))
+		{
+			m_writer = writerURing;
+			// one buffer registration covers all slots, they are a single mapping
+			m_uring.registerBuffer(m_allocated_buffer, m_aio.size() * m_slot_size);
+		}
+		else
+			eDebug("[eDVBRecordFileThread] io_uring unavailable, writing with aio");
+	}
+	if (m_writer != writerAIO && m_want_direct && m_fd_dest >= 0)
+	{
+		// the slots are page aligned and their size is a multiple of 4096 for
+		// both packet sizes, so full slots at slot multiples suit any block size
+		int flags = ::fcntl(m_fd_dest, F_GETFL);
+		if (m_current_offset % 4096)
+			eDebug("[eDVBRecordFileThread] file offset unaligned, not using O_DIRECT");
+		else if (flags < 0 || ::fcntl(m_fd_dest, F_SETFL, flags | O_DIRECT) < 0)
+			eDebug("[eDVBRecordFileThread] O_DIRECT not supported (%m)");
+		else
+			m_direct = true;
+	}
+	m_ring_size = m_ring ? m_ring->size() : 0;
+	// a ring file is allocated as a whole before it's written
+	m_preallocate = m_want_preallocate && m_fd_dest >= 0 && !m_ring_size;
+	m_preallocated = m_current_offset;
+	const char *writer = "aio";
+	if (m_writer == writerURing)
+		writer = m_uring.hasRegisteredBuffer() ? "io_uring (registered buffers)" : "io_uring";
+	else if (m_writer == writerShared)
+		writer = m_write_priority == eRecordIOScheduler::priorityTimeshift ? "shared writer (timeshift)" : "shared writer";
+	eDebug("[eDVBRecordFileThread] writing with %s%s%s%s", writer,
+		m_direct ? ", O_DIRECT" : "", m_preallocate ? ", preallocated" : "", m_ring_size ? ", as a ring" : "");
+	eFilePushThreadRecorder::thread();
+}
+
+void eDVBRecordFileThread::preallocate(off_t end)
+{
+	// reserve the next extent while half of the current one is left, so the
+	// filesystem hands out large contiguous blocks and never has to grow
+	// the file in small steps under the writes
+	if (end + PREALLOCATE_EXTENT / 2 <= m_preallocated)
+		return;
+	if (::fallocate(m_fd_dest, FALLOC_FL_KEEP_SIZE, m_preallocated, PREALLOCATE_EXTENT) < 0)
+	{
+		eDebug("[eDVBRecordFileThread] fallocate failed (%m), not preallocating");
+		m_preallocate = false;
+		return;
+	}
+	m_preallocated += PREALLOCATE_EXTENT;
 }
 
 void eDVBRecordFileThread::setTimingPID(int pid, iDVBTSRecorder::timing_pid_type pidtype, int streamtype)
@@ -416,9 +517,9 @@ void eDVBRecordFileThread::setTimingPID(int pid, iDVBTSRecorder::timing_pid_type
 	m_ts_parser.setPid(pid, pidtype, streamtype);
 }
 
-void eDVBRecordFileThread::startSaveMetaInformation(const std::string &filename)
+void eDVBRecordFileThread::startSaveMetaInformation(const std::string &filename, eRingFileState *ring)
 {
-	m_ts_parser.startSave(filename);
+	m_ts_parser.startSave(filename, ring);
 }
 
 void eDVBRecordFileThread::stopSaveMetaInformation()
@@ -517,7 +618,7 @@ int eDVBRecordFileThread::asyncWrite(int len)
 	gettimeofday(&starttime, NULL);
 #endif
 
-	int r = m_current_buffer->start(m_fd_dest, m_current_offset, len, m_buffer);
+	int r = m_current_buffer->start(m_fd_dest, fileOffset(m_current_offset), len, m_buffer);
 	if (r < 0)
 	{
 		eDebug("[eDVBRecordFileThread] aio_write failed: %m");
@@ -551,6 +652,7 @@ int eDVBRecordFileThread::asyncWrite(int len)
 			return r;
 	}
 	++m_buffer_use_histogram[busy_count];
+	record_buffers_busy.add(busy_count);
 
 	++m_current_buffer;
 	if (m_current_buffer == m_aio.end())
@@ -559,15 +661,117 @@ int eDVBRecordFileThread::asyncWrite(int len)
 	return len;
 }
 
-int eDVBRecordFileThread::writeData(int len)
+int eDVBRecordFileThread::uringReap(bool wait)
 {
-	len = asyncWrite(len);
-	if (len < 0)
+	__u64 index;
+	int res, r;
+	while ((r = m_uring.complete(index, res, wait)) > 0)
+	{
+		AsyncIO &io = m_aio[index];
+		size_t expected = io.inflight;
+		io.inflight = 0;
+		if (res < 0 || (size_t)res != expected)
+		{
+			// a short write to a regular file means the disk is full
+			errno = res < 0 ? -res : ENOSPC;
+			eDebug("[eDVBRecordFileThread] io_uring write failed: %m");
+			return -1;
+		}
+		wait = false;
+	}
+	return r;
+}
+
+int eDVBRecordFileThread::slotWrite(int len)
+{
+	m_ts_parser.parseData(m_current_offset, m_buffer, len);
+	m_current_offset += len;
+	m_fill += len;
+	if (m_direct && m_fill < m_slot_size)
+	{
+		// O_DIRECT needs aligned offsets and sizes, read into the rest of this buffer
+		m_buffer += len;
+		m_buffersize -= len;
 		return len;
-	// Wait for previous aio to complete on this buffer before returning
-	int r = m_current_buffer->wait();
-	if (r < 0)
-		return -1;
+	}
+	if (!m_fill)
+		return len;
+
+	int index = m_current_buffer - m_aio.begin();
+	int busy_count = 0;
+	if (m_writer == writerShared)
+	{
+		if (m_io_stream->write(index, m_current_buffer->buffer, m_fill, fileOffset(m_current_offset - m_fill)) < 0)
+			return -1;
+		m_fill = 0;
+		busy_count = m_io_stream->busy();
+	}
+	else
+	{
+		if (!m_uring.write(m_fd_dest, m_current_buffer->buffer, m_fill, fileOffset(m_current_offset - m_fill), index) || m_uring.submit() < 0)
+		{
+			eDebug("[eDVBRecordFileThread] io_uring submit failed");
+			return -1;
+		}
+		m_current_buffer->inflight = m_fill;
+		m_fill = 0;
+		if (uringReap(false) < 0)
+			return -1;
+		for (AsyncIOvector::iterator it = m_aio.begin(); it != m_aio.end(); ++it)
+		{
+			if (it->inflight)
+				++busy_count;
+		}
+	}
+	++m_buffer_use_histogram[busy_count];
+	record_buffers_busy.add(busy_count);
+
+	++m_current_buffer;
+	if (m_current_buffer == m_aio.end())
+		m_current_buffer = m_aio.begin();
+	m_buffer = m_current_buffer->buffer;
+	m_buffersize = m_slot_size;
+	// Wait for the previous write of this buffer before it is read into again
+	if (m_writer == writerShared)
+		return m_io_stream->wait(m_current_buffer - m_aio.begin()) < 0 ? -1 : len;
+	while (m_current_buffer->inflight)
+	{
+		if (uringReap(true) < 0)
+			return -1;
+	}
+	return len;
+}
+
+void eDVBRecordFileThread::ringAdvance()
+{
+	// all buffers may still be on their way, the data before them is on disk
+	m_ring->setPosition(m_current_offset, m_current_offset - (off_t)(m_aio.size() * m_slot_size));
+	// a write must not run across the end of the ring file, so neither may the next read. the
+	// ring is a multiple of the slot size, a full O_DIRECT slot never gets shortened here
+	off_t left = m_ring_size - m_current_offset % m_ring_size;
+	m_buffersize = m_slot_size - m_fill;
+	if ((off_t)m_buffersize > left)
+		m_buffersize = left;
+}
+
+int eDVBRecordFileThread::writeData(int len)
+{
+	if (m_preallocate)
+		preallocate(m_current_offset + len);
+	if (m_writer != writerAIO)
+		len = slotWrite(len);
+	else
+	{
+		len = asyncWrite(len);
+		if (len < 0)
+			return len;
+		// Wait for previous aio to complete on this buffer before returning
+		int r = m_current_buffer->wait();
+		if (r < 0)
+			return -1;
+	}
+	if (len >= 0 && m_ring_size)
+		ringAdvance();
 	return len;
 }
 
@@ -578,8 +782,74 @@ void eDVBRecordFileThread::flush()
 	{
 		it->wait();
 	}
+	if (m_writer == writerShared)
+	{
+		m_io_stream->flush();
+		eDebug("[eDVBRecordFileThread] at most %d buffers were queued", m_io_stream->maxBusy());
+	}
+	if (m_writer == writerURing)
+	{
+		int busy = 0;
+		for (AsyncIOvector::iterator it = m_aio.begin(); it != m_aio.end(); ++it)
+		{
+			if (it->inflight)
+				++busy;
+		}
+		__u64 index;
+		int res;
+		while (busy && m_uring.complete(index, res, true) > 0)
+		{
+			if (res < 0)
+				eDebug("[eDVBRecordFileThread] io_uring write failed: %s", strerror(-res));
+			m_aio[index].inflight = 0;
+			--busy;
+		}
+	}
+	if (m_direct)
+	{
+		// the tail of the recording is not aligned, write it through the page cache
+		int flags = ::fcntl(m_fd_dest, F_GETFL);
+		if (flags >= 0)
+			::fcntl(m_fd_dest, F_SETFL, flags & ~O_DIRECT);
+		unsigned char *p = m_current_buffer->buffer;
+		off_t offset = m_current_offset - m_fill;
+		while (m_fill)
+		{
+			ssize_t wr = ::pwrite(m_fd_dest, p, m_fill, fileOffset(offset));
+			if (wr < 0 && errno == EINTR)
+				continue;
+			if (wr <= 0)
+			{
+				eDebug("[eDVBRecordFileThread] writing the last %zu bytes failed: %m", m_fill);
+				break;
+			}
+			p += wr;
+			offset += wr;
+			m_fill -= wr;
+		}
+		m_fill = 0;
+		m_direct = false;
+		m_buffer = m_current_buffer->buffer;
+		m_buffersize = m_slot_size;
+	}
+	if (m_writer == writerURing)
+		m_uring.close();
+	if (m_writer == writerShared)
+	{
+		eRecordIOScheduler::getInstance()->detach(m_io_stream);
+		m_io_stream = NULL;
+	}
+	m_writer = writerAIO;
+	if (m_preallocate)
+	{
+		// drop the reserved blocks beyond the end of the recording
+		struct stat st;
+		if (!::fstat(m_fd_dest, &st) && st.st_size < m_preallocated)
+			::ftruncate(m_fd_dest, st.st_size);
+		m_preallocate = false;
+	}
 	int bufferCount = m_aio.size();
-	eDebug("[eDVBRecordFileThread] buffer usage histogram (%d buffers of %d kB)", bufferCount, m_buffersize>>10);
+	eDebug("[eDVBRecordFileThread] buffer usage histogram (%d buffers of %d kB)", bufferCount, (int)(m_slot_size>>10));
 	for (int i=0; i <= bufferCount; ++i)
 	{
 		if (m_buffer_use_histogram[i] != 0) eDebug("     %2d: %6d", i, m_buffer_use_histogram[i]);
@@ -588,6 +858,8 @@ void eDVBRecordFileThread::flush()
 	{
 		eDebug("[eDVBRecordFileThread] Demux buffer overflows: %d", m_overflow_count);
 	}
+	if (m_ring)
+		m_ring->setPosition(m_current_offset, m_current_offset);
 	if (m_fd_dest >= 0)
 	{
 		posix_fadvise(m_fd_dest, 0, 0, POSIX_FADV_DONTNEED);
@@ -663,9 +935,17 @@ eDVBTSRecorder::eDVBTSRecorder(eDVBDemux *demux, int packetsize, bool streaming)
 	m_running(0),
 	m_target_fd(-1),
 	m_thread(streaming ? new eDVBRecordStreamThread(packetsize) : new eDVBRecordFileThread(packetsize, recordingBufferCount)),
+	m_ring_size(0),
 	m_packetsize(packetsize)
 {
 	CONNECT(m_thread->m_event, eDVBTSRecorder::filepushEvent);
+	if (!streaming)
+	{
+		std::string writer = eConfigManager::getConfigValue("config.recording.io_writer");
+		m_thread->setWriter(writer == "io_uring" ? eDVBRecordFileThread::writerURing : writer == "shared" ? eDVBRecordFileThread::writerShared : eDVBRecordFileThread::writerAIO,
+			eConfigManager::getConfigBoolValue("config.recording.direct_io"),
+			eConfigManager::getConfigBoolValue("config.recording.preallocate"));
+	}
 }
 
 eDVBTSRecorder::~eDVBTSRecorder()
@@ -719,7 +999,19 @@ RESULT eDVBTSRecorder::start()
 	::ioctl(m_source_fd, DMX_START);
 
 	if (!m_target_filename.empty())
-		m_thread->startSaveMetaInformation(m_target_filename);
+	{
+		if (m_ring_size)
+		{
+			// whole write slots, and a .sc of 1/64 of that, which is more
+			// than even low bitrate video needs
+			off_t size = m_ring_size - m_ring_size % (m_packetsize * 1024);
+			int entries = size / 64 / 16;
+			entries -= entries % 256;
+			m_ring = new eRingFileState(m_target_filename, size, entries > 4096 ? entries : 4096, m_packetsize);
+			m_thread->setRing(m_ring);
+		}
+		m_thread->startSaveMetaInformation(m_target_filename, m_ring);
+	}
 
 	m_thread->start(m_source_fd);
 	m_running = 1;
@@ -788,11 +1080,25 @@ RESULT eDVBTSRecorder::enableAccessPoints(bool enable)
 	return 0;
 }
 
+RESULT eDVBTSRecorder::setWritePriority(write_priority priority)
+{
+	m_thread->setWritePriority(priority == priorityTimeshift ? eRecordIOScheduler::priorityTimeshift : eRecordIOScheduler::priorityRecording);
+	return 0;
+}
+
 RESULT eDVBTSRecorder::setBoundary(off_t max)
 {
 	return -1; // not yet implemented
 }
 
+RESULT eDVBTSRecorder::setRingSize(off_t size)
+{
+	if (m_running || (size && size < eRingFileState::MARGIN * 4))
+		return -1;
+	m_ring_size = size;
+	return 0;
+}
+
 RESULT eDVBTSRecorder::stop()
 {
 	int state=3;
@@ -5,6 +5,9 @@
 #include <lib/dvb/idvb.h>
 #include <lib/dvb/idemux.h>
 #include <lib/base/filepush.h>
+#include <lib/base/recordio.h>
+#include <lib/base/uring.h>
+#include <lib/base/ringfile.h>
 #include <lib/dvb/pvrparse.h>
 
 class eDVBDemux: public iDVBDemux
@@ -94,25 +97,46 @@ public:
 	eDVBRecordFileThread(int packetsize, int bufferCount);
 	~eDVBRecordFileThread();
 	void setTimingPID(int pid, iDVBTSRecorder::timing_pid_type pidtype, int streamtype);
-	void startSaveMetaInformation(const std::string &filename);
+	void startSaveMetaInformation(const std::string &filename, eRingFileState *ring = NULL);
 	void stopSaveMetaInformation();
 	int getLastPTS(pts_t &pts);
 	int getFirstPTS(pts_t &pts);
 	void setTargetFD(int fd) { m_fd_dest = fd; }
 	void enableAccessPoints(bool enable) { m_ts_parser.enableAccessPoints(enable); }
+	// write the target as the data of @ring, NULL for a normal file
+	void setRing(eRingFileState *ring) { m_ring = ring; }
+
+	enum { writerAIO, writerURing, writerShared };
+	// how the next recording is written: @writer falls back to AIO when io_uring
+	// is unavailable, @direct uses O_DIRECT (not with AIO), @preallocate reserves
+	// the file in PREALLOCATE_EXTENT steps ahead of the data
+	void setWriter(int writer, bool direct, bool preallocate);
+	// eRecordIOScheduler::priorityRecording or priorityTimeshift for the shared writer
+	void setWritePriority(int priority);
+	const std::vector<int> &getBufferUseHistogram() const { return m_buffer_use_histogram; }
 protected:
+	enum { PREALLOCATE_EXTENT = 64 * 1024 * 1024 };
+
 	int asyncWrite(int len);
+	int slotWrite(int len);
+	int uringReap(bool wait);
+	void preallocate(off_t end);
+	off_t fileOffset(off_t offset) const { return m_ring_size ? offset % m_ring_size : offset; }
+	void ringAdvance();
 	/* override */ int writeData(int len);
 	/* override */ void flush();
+	/* override */ void thread();
 
 	struct AsyncIO
 	{
 		struct aiocb aio;
 		unsigned char* buffer;
+		size_t inflight; // bytes of the io_uring write of this buffer, 0 when idle
 		AsyncIO()
 		{
 			memset(&aio, 0, sizeof(struct aiocb));
 			buffer = NULL;
+			inflight = 0;
 		}
 		int wait();
 		int start(int fd, off_t offset, size_t nbytes, void* buffer);
@@ -127,6 +151,17 @@ protected:
 	AsyncIOvector m_aio;
 	AsyncIOvector::iterator m_current_buffer;
 	std::vector<int> m_buffer_use_histogram;
+	size_t m_slot_size; // m_buffersize as allocated, m_buffersize shrinks while a buffer fills up
+	int m_want_writer, m_writer;
+	bool m_want_direct, m_direct;
+	bool m_want_preallocate, m_preallocate;
+	off_t m_preallocated; // end of the reserved part of the file
+	size_t m_fill; // O_DIRECT: bytes in the current buffer that still wait for the rest of it
+	eIOUring m_uring;
+	int m_write_priority;
+	eRecordIOStream *m_io_stream;
+	ePtr<eRingFileState> m_ring;
+	off_t m_ring_size; // of m_ring, 0 when writing a normal file
 };
 
 class eDVBRecordStreamThread: public eDVBRecordFileThread
@@ -158,7 +193,9 @@ public:
 	RESULT setTargetFD(int fd);
 	RESULT setTargetFilename(const std::string& filename);
 	RESULT setBoundary(off_t max);
+	RESULT setRingSize(off_t size);
 	RESULT enableAccessPoints(bool enable);
+	RESULT setWritePriority(write_priority priority);
 
 	RESULT stop();
 
@@ -182,6 +219,8 @@ private:
 	int m_source_fd;
 	eDVBRecordFileThread *m_thread;
 	std::string m_target_filename;
+	off_t m_ring_size;
+	ePtr<eRingFileState> m_ring;
 	int m_packetsize;
 };
 
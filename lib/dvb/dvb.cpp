@@ -2,15 +2,18 @@
 #include <linux/dvb/dmx.h>
 #include <linux/dvb/version.h>
 
+#include <lib/base/cachedtssource.h>
 #include <lib/base/cfile.h>
 #include <lib/base/eerror.h>
 #include <lib/base/filepush.h>
+#include <lib/base/nconfig.h>
 #include <lib/base/wrappers.h>
 #include <lib/dvb/cahandler.h>
 #include <lib/dvb/idvb.h>
 #include <lib/dvb/dvb.h>
 #include <lib/dvb/sec.h>
 #include <lib/dvb/specs.h>
+#include <lib/dvb/trickplan.h>
 
 #include <errno.h>
 #include <sys/types.h>
@@ -1485,6 +1488,7 @@ eDVBChannel::eDVBChannel(eDVBResourceManager *mgr, eDVBAllocatedFrontend *fronte
 
 	m_pvr_thread = 0;
 	m_pvr_fd_dst = -1;
+	m_trick_planner = 0;
 
 	m_skipmode_n = m_skipmode_m = m_skipmode_frames = 0;
 
@@ -1615,12 +1619,20 @@ void eDVBChannel::cueSheetEvent(int event)
 					eWarning("something is wrong with this calculation");
 					m_skipmode_frames = m_skipmode_n = m_skipmode_m = 0;
 				}
+				else if (!m_trick_planner && !m_streaminfo_file.empty())
+				{
+					eDVBTrickPlanner *planner = new eDVBTrickPlanner(m_streaminfo_file);
+					planner->run();
+					m_trick_planner = planner;
+				}
 			} else
 			{
 				eDebug("[eDVBChannel] skipmode ratio is 0, normal play");
 				m_skipmode_frames = m_skipmode_n = m_skipmode_m = 0;
 			}
 		}
+		if (m_trick_planner && !m_skipmode_m)
+			m_trick_planner->stop();
 		m_pvr_thread->setIFrameSearch(m_skipmode_n != 0);
 		if (m_cue->m_skipmode_ratio != 0)
 			m_pvr_thread->setTimebaseChange(0x10000 * 9000 / (m_cue->m_skipmode_ratio / 10)); /* negative values are also ok */
@@ -1698,7 +1710,19 @@ void eDVBChannel::getNextSourceSpan(off_t current_offset, size_t bytes_read, off
 	//eDebug("[eDVBChannel] getNextSourceSpan, current offset is %08llx, m_skipmode_m = %d!", current_offset, m_skipmode_m);
 	int frame_skip_success = 0;
 
-	if (m_skipmode_m)
+	if (m_skipmode_m && m_trick_planner)
+	{
+		size_t iframe_len;
+		off_t iframe_start;
+		if (!m_trick_planner->next(current_offset, m_skipmode_frames, iframe_start, iframe_len))
+		{
+			current_offset = align(iframe_start, blocksize);
+			max = align(iframe_len + 187, blocksize);
+			frame_skip_success = 1;
+		}
+	}
+
+	if (m_skipmode_m && !frame_skip_success)
 	{
 		int frames_to_skip = m_skipmode_frames + m_skipmode_frames_remainder;
 		//eDebug("[eDVBChannel] we are at %llu, and we try to skip %d+%d frames from here", current_offset, m_skipmode_frames, m_skipmode_frames_remainder);
@@ -1840,6 +1864,14 @@ void eDVBChannel::getNextSourceSpan(off_t current_offset, size_t bytes_read, off
 
 	m_cue->m_lock.Unlock();
 
+		/* a timeshift ring has dropped what is before its begin, playback that fell behind goes on there */
+	off_t source_begin = m_source ? m_source->begin() : 0;
+	if (current_offset < source_begin)
+	{
+		eDebug("[eDVBChannel] %llu was overwritten, continuing at %llu", current_offset, source_begin);
+		current_offset = align(source_begin + blocksize - 1, blocksize);
+	}
+
 	for (std::list<std::pair<off_t, off_t> >::const_iterator i(m_source_span.begin()); i != m_source_span.end(); ++i)
 	{
 		if (current_offset >= i->first)
@@ -1883,7 +1915,7 @@ void eDVBChannel::getNextSourceSpan(off_t current_offset, size_t bytes_read, off
 		}
 	}
 
-	if ((current_offset < -m_skipmode_m) && (m_skipmode_m < 0))
+	if ((current_offset < source_begin - m_skipmode_m) && (m_skipmode_m < 0))
 	{
 		eDebug("[eDVBChannel] reached SOF");
 		m_skipmode_m = 0;
@@ -2114,8 +2146,17 @@ RESULT eDVBChannel::playSource(ePtr<iTsSource> &source, const char *streaminfo_f
 		return -ENOENT;
 	}
 
+	delete m_trick_planner;
+	m_trick_planner = 0;
+	m_streaminfo_file = streaminfo_file ? streaminfo_file : "";
+
 	m_source = source;
-	m_tstools.setSource(m_source, streaminfo_file);
+	{
+			/* tstools does many small reads all over the file. a stream
+			   is read around the cache, until it turns out to be seekable. */
+		ePtr<iTsSource> cached = new eCachedSource(m_source, eConfigManager::getConfigIntValue("config.usage.ts_read_cache", 1024) * 1024);
+		m_tstools.setSource(cached, streaminfo_file);
+	}
 
 		/* DON'T EVEN THINK ABOUT FIXING THIS. FIX THE ATI SOURCES FIRST,
 		   THEN DO A REAL FIX HERE! */
@@ -2178,6 +2219,8 @@ void eDVBChannel::stop()
 		::close(m_pvr_fd_dst);
 		m_pvr_fd_dst = -1;
 	}
+	delete m_trick_planner;
+	m_trick_planner = 0;
 	m_source = NULL;
 	m_tstools.setSource(m_source);
 }
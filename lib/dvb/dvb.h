@@ -259,6 +259,7 @@ SWIG_EXTEND(ePtr<eDVBResourceManager>,
 #ifndef SWIG
 
 class eDVBChannelFilePush;
+class eDVBTrickPlanner;
 
 	/* iDVBPVRChannel includes iDVBChannel. don't panic. */
 class eDVBChannel: public iDVBPVRChannel, public iFilePushScatterGather, public Object
@@ -329,6 +330,9 @@ private:
 	void cueSheetEvent(int event);
 	ePtr<eConnection> m_conn_cueSheetEvent;
 	int m_skipmode_m, m_skipmode_n, m_skipmode_frames, m_skipmode_frames_remainder;
+		/* plans the I-frames of fast forward and rewind, when there is a structure file */
+	eDVBTrickPlanner *m_trick_planner;
+	std::string m_streaminfo_file;
 	
 	std::list<std::pair<off_t, off_t> > m_source_span;
 	void getNextSourceSpan(off_t current_offset, size_t bytes_read, off_t &start, size_t &size);
@@ -11,7 +11,13 @@
 #include <stdio.h>
 #include <fstream>
 #include <unistd.h>  // for usleep
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/vfs.h> // for statfs
+#include <algorithm>
+#include <limits>
+#include <set>
 // #include <libmd5sum.h>
 #include <lib/base/cfile.h>
 #include <lib/base/eerror.h>
@@ -25,10 +31,13 @@
 
 int eventData::CacheSize=0;
 bool eventData::isCacheCorrupt = 0;
-descriptorMap eventData::descriptors;
-__u8 eventData::data[2 * 4096 + 12];
+eEPGDescriptorPool eventData::descriptors;
+eEPGTitleIndex eventData::titles;
+__u8 eventData::data[eventData::MAX_EIT_SIZE];
 extern const uint32_t crc32_table[256];
 
+const static unsigned int EPG_MAGIC = 0x98765432;
+
 const eServiceReference &handleGroup(const eServiceReference &ref)
 {
 	if (ref.flags & eServiceReference::isGroup)
@@ -52,18 +61,108 @@ const eServiceReference &handleGroup(const eServiceReference &ref)
 	return ref;
 }
 
-eventData::eventData(const eit_event_struct* e, int size, int type, int tsidonid)
-	:ByteSize(size&0xFF), type(type&0xFF)
+/*
+ * Arena for the EITdata of the cached events. An EITdata block is 10 header
+ * bytes plus a crc per descriptor, so there are only a few distinct sizes.
+ * Blocks are carved from 64KB pages per size class (rounded up to 4 bytes)
+ * and freed blocks go to an intrusive free list of their class, so the
+ * allocator has no per block overhead and the blocks of a service end up
+ * close to each other. Pages are never returned to the system, the free
+ * lists are reused by later events of the same size.
+ */
+class eventDataArena
 {
-	if (!e)
-		return;
+	enum { PAGE_SIZE = 64 * 1024, GRANULARITY = 4, CLASSES = 256 / GRANULARITY + 1 };
+	struct sizeClass
+	{
+		__u8 *free_list;
+		__u8 *cur;
+		__u8 *end;
+	};
+	sizeClass m_classes[CLASSES];
+public:
+	eventDataArena()
+	{
+		memset(m_classes, 0, sizeof(m_classes));
+	}
+	// the pages are intentionally not released on destruction, events may
+	// still be deleted by the cache after static destructors ran
+	__u8 *alloc(int size)
+	{
+		int index = (size + GRANULARITY - 1) / GRANULARITY;
+		sizeClass &c = m_classes[index];
+		__u8 *block = c.free_list;
+		if (block)
+		{
+			// the free list link lives in the first bytes of a free block
+			memcpy(&c.free_list, block, sizeof(__u8*));
+			return block;
+		}
+		int bytes = index * GRANULARITY;
+		if (bytes < (int)sizeof(__u8*))
+			bytes = sizeof(__u8*);
+		if (c.cur + bytes > c.end)
+		{
+			c.cur = new __u8[PAGE_SIZE];
+			c.end = c.cur + PAGE_SIZE;
+		}
+		block = c.cur;
+		c.cur += bytes;
+		return block;
+	}
+	void free(__u8 *block, int size)
+	{
+		sizeClass &c = m_classes[(size + GRANULARITY - 1) / GRANULARITY];
+		memcpy(block, &c.free_list, sizeof(__u8*));
+		c.free_list = block;
+	}
+};
+
+static eventDataArena eitDataArena;
+
+__u8 *eventData::allocData(int size)
+{
+	return eitDataArena.alloc(size);
+}
 
-	__u32 descr[65];
-	__u32 *pdescr=descr;
+void eventData::freeData(__u8 *data, int size)
+{
+	eitDataArena.free(data, size);
+}
 
+eventData::staged::~staged()
+{
+	for (int i = 0; i < count; ++i)
+		if (owned[i])
+			delete [] (__u8*)descr[i];
+}
+
+void eventData::staged::add(__u32 c, const __u8 *d, bool own)
+{
+	ASSERT(count < 65);
+	crc[count] = c;
+	descr[count] = d;
+	owned[count] = own;
+	++count;
+}
+
+/**
+ * @brief Parse the descriptors of an EIT event, calculate their crcs and
+ * convert the short event descriptor to UTF-8. This is the expensive part of
+ * adding an event and doesn't touch any shared state, so it runs without
+ * holding the cache lock. The result stays valid as long as @p e does.
+ *
+ * @param e the EIT event
+ * @param size size of the event including its descriptors
+ * @param tsidonid transport stream and original network, used for the charset
+ * @param result receives the event header and its descriptors
+ */
+void eventData::parse(const eit_event_struct* e, int size, int tsidonid, staged &result)
+{
 	__u8 *data = (__u8*)e;
 	int ptr=12;
 	size -= 12;
+	memcpy(result.header, data, 10);
 
 	while(size > 1)
 	{
@@ -84,18 +183,7 @@ eventData::eventData(const eit_event_struct* e, int size, int type, int tsidonid
 					int cnt=0;
 					while(cnt++ < descr_len)
 						crc = (crc << 8) ^ crc32_table[((crc >> 24) ^ data[ptr++]) & 0xFF];
-
-					descriptorMap::iterator it = descriptors.find(crc);
-					if ( it == descriptors.end() )
-					{
-						CacheSize+=descr_len;
-						__u8 *d = new __u8[descr_len];
-						memcpy(d, descr, descr_len);
-						descriptors[crc] = descriptorPair(1, d);
-					}
-					else
-						++it->second.first;
-					*pdescr++=crc;
+					result.add(crc, descr, false);
 					break;
 				}
 				case SHORT_EVENT_DESCRIPTOR:
@@ -144,19 +232,7 @@ eventData::eventData(const eit_event_struct* e, int size, int type, int tsidonid
 						title_len += 2; //add 2 the length to include the 2 bytes in the header
 						while(cnt++ < title_len)
 							title_crc = (title_crc << 8) ^ crc32_table[((title_crc >> 24) ^ title_data[tmpPtr++]) & 0xFF];
-
-						descriptorMap::iterator it = descriptors.find(title_crc);
-						if ( it == descriptors.end() )
-						{
-							CacheSize+=title_len;
-							descriptors[title_crc] = descriptorPair(1, title_data);
-						}
-						else
-						{
-							++it->second.first;
-							delete [] title_data;
-						}
-						*pdescr++=title_crc;
+						result.add(title_crc, title_data, true);
 					}
 
 					//save the text
@@ -181,19 +257,7 @@ eventData::eventData(const eit_event_struct* e, int size, int type, int tsidonid
 						text_len += 2; //add 2 the length to include the 2 bytes in the header
 						while(cnt++ < text_len)
 							text_crc = (text_crc << 8) ^ crc32_table[((text_crc >> 24) ^ text_data[tmpPtr++]) & 0xFF];
-
-						descriptorMap::iterator it = descriptors.find(text_crc);
-						if ( it == descriptors.end() )
-						{
-							CacheSize+=text_len;
-							descriptors[text_crc] = descriptorPair(1, text_data);
-						}
-						else
-						{
-							++it->second.first;
-							delete [] text_data;
-						}
-						*pdescr++=text_crc;
+						result.add(text_crc, text_data, true);
 					}
 
 					ptr += descr_len;
@@ -208,12 +272,64 @@ eventData::eventData(const eit_event_struct* e, int size, int type, int tsidonid
 		else
 			break;
 	}
-	ASSERT(pdescr <= &descr[65]);
-	ByteSize = 10+((pdescr-descr)*4);
-	EITdata = new __u8[ByteSize];
+}
+
+/**
+ * @brief Create an event from a parsed EIT event and enter its descriptors
+ * into the shared descriptor map. Hold a writeLock while calling.
+ */
+eventData::eventData(staged &s, int type)
+	:type(type&0xFF), mapped(0)
+{
+	init(s);
+}
+
+eventData::eventData(const eit_event_struct* e, int size, int type, int tsidonid)
+	:ByteSize(size&0xFF), type(type&0xFF), mapped(0)
+{
+	if (!e)
+		return;
+	staged s;
+	parse(e, size, tsidonid, s);
+	init(s);
+}
+
+void eventData::init(staged &s)
+{
+	for (int i = 0; i < s.count; ++i)
+	{
+		if (descriptors.ref(s.crc[i]))
+			continue;
+		const __u8 *d = descriptors.insert(s.crc[i], s.descr[i]);
+		if (!d)
+			continue;
+		CacheSize += d[1] + 2;
+		titles.add(s.crc[i], d);
+	}
+	ByteSize = 10+(s.count*4);
+	EITdata = allocData(ByteSize);
 	CacheSize+=ByteSize;
-	memcpy(EITdata, (__u8*) e, 10);
-	memcpy(EITdata+10, descr, ByteSize-10);
+	memcpy(EITdata, s.header, 10);
+	memcpy(EITdata+10, s.crc, ByteSize-10);
+}
+
+/**
+ * @brief Point @p view at the header and the shared descriptors of the event,
+ * without rebuilding the EIT event like get() does. Hold event_lock or the
+ * cache lock while calling, the view is only valid while it is held.
+ */
+void eventData::getView(eEPGEventView &view) const
+{
+	view.setHeader(EITdata);
+	const __u32 *p = (const __u32*)(EITdata + 10);
+	for (int tmp = ByteSize - 10; tmp > 3; tmp -= 4, ++p)
+	{
+		const __u8 *descr = getDescriptor(*p);
+		if (descr)
+			view.addDescriptor(descr);
+		else
+			cacheCorrupt("eventData::getView");
+	}
 }
 
 const eit_event_struct* eventData::get() const
@@ -225,13 +341,13 @@ const eit_event_struct* eventData::get() const
 	__u32 *p = (__u32*)(EITdata + 10);
 	while (tmp > 3)
 	{
-		descriptorMap::iterator it = descriptors.find(*p++);
-		if (it != descriptors.end())
+		const __u8 *descr = getDescriptor(*p++);
+		if (descr)
 		{
-			unsigned int b = it->second.second[1] + 2;
+			unsigned int b = descr[1] + 2;
 			if (pos + b < sizeof(data))
 			{
-				memcpy(data + pos, it->second.second, b);
+				memcpy(data + pos, descr, b);
 				pos += b;
 				descriptors_length += b;
 			}
@@ -247,75 +363,112 @@ const eit_event_struct* eventData::get() const
 
 eventData::~eventData()
 {
-	if ( ByteSize )
+	// mapped events don't own their data, the image holds the descriptors
+	if ( ByteSize && !mapped )
 	{
+		__u8 size = ByteSize;
 		CacheSize -= ByteSize;
 		__u32 *d = (__u32*)(EITdata+10);
 		ByteSize -= 10;
 		while(ByteSize>3)
 		{
-			descriptorMap::iterator it =
-				descriptors.find(*d++);
-			if ( it != descriptors.end() )
+			bool found;
+			const __u8 *descr = descriptors.unref(*d, found);
+			if (descr) // no more used descriptor
 			{
-				descriptorPair &p = it->second;
-				if (!--p.first) // no more used descriptor
-				{
-					CacheSize -= it->second.second[1];
-					delete [] it->second.second;  	// free descriptor memory
-					descriptors.erase(it);	// remove entry from descriptor map
-				}
+				titles.remove(*d, descr);
+				CacheSize -= descr[1] + 2;
 			}
-			else
+			else if (!found)
 			{
 				cacheCorrupt("eventData::~eventData");
 			}
+			++d;
 			ByteSize -= 4;
 		}
-		delete [] EITdata;
+		freeData(EITdata, size);
+	}
+}
+
+/**
+ * @brief Find a cached descriptor by its crc. Descriptors of events which
+ * were created at runtime live in the descriptor pool, descriptors of
+ * events served from the mmap'ed epg.dat live in the image.
+ *
+ * @param crc the crc the descriptor was stored with
+ * @return pointer to the raw descriptor or NULL when it is unknown
+ */
+const __u8 *eventData::getDescriptor(__u32 crc)
+{
+	const __u8 *descr = descriptors.find(crc);
+	if (descr)
+		return descr;
+	eEPGImage *image = eEPGCache::instance ? eEPGCache::instance->m_image : NULL;
+	return image ? image->findDescriptor(crc) : NULL;
+}
+
+/**
+ * @brief Copy the data of an event which is still served from the mmap'ed
+ * image to the heap, so the image can be unmapped.
+ */
+void eventData::detach()
+{
+	if (!mapped)
+		return;
+	__u8 *d = allocData(ByteSize);
+	memcpy(d, EITdata, ByteSize);
+	EITdata = d;
+	CacheSize += ByteSize;
+	mapped = 0;
+	__u32 *p = (__u32*)(EITdata + 10);
+	for (int tmp = ByteSize - 10; tmp > 3; tmp -= 4, ++p)
+	{
+		if (descriptors.ref(*p))
+			continue;
+		const __u8 *descr = getDescriptor(*p);
+		if (!descr)
+		{
+			cacheCorrupt("eventData::detach");
+			continue;
+		}
+		const __u8 *copy = descriptors.insert(*p, descr);
+		if (!copy)
+			continue;
+		titles.add(*p, copy);
+		CacheSize += descr[1] + 2;
 	}
 }
 
+void eventData::refer(const __u8 *data, int size, int type)
+{
+	EITdata = (__u8*)data;
+	ByteSize = size;
+	this->type = type;
+	mapped = 1;
+}
+
 void eventData::load(FILE *f)
 {
 	int size=0;
 	int id=0;
-	__u8 header[2];
-	descriptorPair p;
+	int refs=0;
+	__u8 descr[257];
 	fread(&size, sizeof(int), 1, f);
 	while(size)
 	{
 		fread(&id, sizeof(__u32), 1, f);
-		fread(&p.first, sizeof(int), 1, f);
-		fread(header, 2, 1, f);
-		int bytes = header[1]+2;
-		p.second = new __u8[bytes];
-		p.second[0] = header[0];
-		p.second[1] = header[1];
-		fread(p.second+2, bytes-2, 1, f);
-		descriptors[id]=p;
+		fread(&refs, sizeof(int), 1, f);
+		fread(descr, 2, 1, f);
+		int bytes = descr[1]+2;
+		fread(descr+2, bytes-2, 1, f);
+		const __u8 *d = descriptors.insert(id, descr, refs);
+		if (d)
+			titles.add(id, d);
 		--size;
 		CacheSize+=bytes;
 	}
 }
 
-void eventData::save(FILE *f)
-{
-	if (isCacheCorrupt)
-		return;
-	int size=descriptors.size();
-	descriptorMap::iterator it(descriptors.begin());
-	fwrite(&size, sizeof(int), 1, f);
-	while(size)
-	{
-		fwrite(&it->first, sizeof(__u32), 1, f);
-		fwrite(&it->second.first, sizeof(int), 1, f);
-		fwrite(it->second.second, it->second.second[1]+2, 1, f);
-		++it;
-		--size;
-	}
-}
-
 void eventData::cacheCorrupt(const char* context)
 {
 
@@ -328,17 +481,472 @@ void eventData::cacheCorrupt(const char* context)
 	}
 }
 
+static const char EPG_IMAGE_VERSION[] = "ENIGMA_EPG_V9";
+
+eEPGImage::eEPGImage()
+	:m_fd(-1), m_base(NULL), m_size(0), m_header(NULL)
+{
+}
+
+eEPGImage::~eEPGImage()
+{
+	if (m_base)
+		munmap(m_base, m_size);
+	if (m_fd >= 0)
+		::close(m_fd);
+}
+
+eEPGImage *eEPGImage::open(int fd, const char *filename)
+{
+	struct stat st;
+	eEPGImage *image = new eEPGImage();
+	image->m_fd = dup(fd);
+	if (image->m_fd < 0 || fstat(image->m_fd, &st) < 0)
+	{
+		eDebug("[EPGC] could not open %s (%m)", filename);
+		delete image;
+		return NULL;
+	}
+	image->m_size = st.st_size;
+	if (image->m_size >= sizeof(epgImageHeader))
+	{
+		void *base = mmap(NULL, image->m_size, PROT_READ, MAP_SHARED, image->m_fd, 0);
+		if (base != MAP_FAILED)
+			image->m_base = (__u8*)base;
+		else
+			eDebug("[EPGC] mmap of %s failed (%m)", filename);
+	}
+	if (!image->m_base || !image->validate())
+	{
+		eDebug("[EPGC] %s is not a valid epg image", filename);
+		delete image;
+		return NULL;
+	}
+	/* the indexes are read with binary searches, only the pages we touch are needed */
+	madvise(image->m_base, image->m_size, MADV_RANDOM);
+	image->m_claimed.resize(image->serviceCount(), false);
+	return image;
+}
+
+bool eEPGImage::validate()
+{
+	static const size_t record_size[EPG_IMAGE_SECTIONS] =
+	{
+		sizeof(epgImageService), sizeof(epgImageEvent), sizeof(uint32_t), 1,
+		sizeof(epgImageDescriptor), 1, 1, sizeof(epgImageTitle)
+	};
+	m_header = (const epgImageHeader*)m_base;
+	if (m_header->magic != EPG_MAGIC || memcmp(m_header->version, EPG_IMAGE_VERSION, 13))
+		return false;
+	if (m_header->sections != EPG_IMAGE_SECTIONS)
+		return false;
+	for (int i = 0; i < EPG_IMAGE_SECTIONS; ++i)
+	{
+		const epgImageSection &sec = m_header->section[i];
+		if (sec.offset > m_size || sec.size > m_size - sec.offset)
+			return false;
+		if (record_size[i] > 1 && sec.size < (uint64_t)sec.count * record_size[i])
+			return false;
+	}
+	if (m_header->section[EPG_IMAGE_EVENTIDS].count != m_header->section[EPG_IMAGE_EVENTS].count)
+		return false;
+	/*
+	 * only the (small) service index is checked here, event and descriptor
+	 * records are checked when they are used. Touching them now would pull
+	 * the whole file into memory and defeat the point of mapping it.
+	 */
+	const epgImageService *svc = services();
+	for (int i = 0; i < serviceCount(); ++i)
+	{
+		if ((uint64_t)svc[i].first_event + svc[i].event_count > (uint64_t)eventCount())
+			return false;
+	}
+	return true;
+}
+
+bool eEPGImage::isValid(const epgImageEvent &ev) const
+{
+	return ev.len >= 10 && (uint64_t)ev.data_offset + ev.len <= sectionSize(EPG_IMAGE_EVENTDATA);
+}
+
+int eEPGImage::findService(const uniqueEPGKey &key) const
+{
+	const epgImageService *svc = services();
+	int lo = 0, hi = serviceCount();
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		uniqueEPGKey k(svc[mid].sid, svc[mid].onid, svc[mid].tsid);
+		if (k < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < serviceCount() && svc[lo].sid == key.sid && svc[lo].onid == key.onid && svc[lo].tsid == key.tsid)
+		return lo;
+	return -1;
+}
+
+struct less_image_event
+{
+	bool operator()(const epgImageEvent &a, time_t b) const { return a.start_time < b; }
+	bool operator()(time_t a, const epgImageEvent &b) const { return a < b.start_time; }
+};
+
+unsigned int eEPGImage::lowerBound(int service, time_t t) const
+{
+	const epgImageService &svc = services()[service];
+	const epgImageEvent *first = events() + svc.first_event;
+	return std::lower_bound(first, first + svc.event_count, t, less_image_event()) - first;
+}
+
+unsigned int eEPGImage::upperBound(int service, time_t t) const
+{
+	const epgImageService &svc = services()[service];
+	const epgImageEvent *first = events() + svc.first_event;
+	return std::upper_bound(first, first + svc.event_count, t, less_image_event()) - first;
+}
+
+const epgImageEvent *eEPGImage::findEventId(int service, __u16 event_id) const
+{
+	const epgImageService &svc = services()[service];
+	const uint32_t *ids = eventIds() + svc.first_event;
+	const epgImageEvent *ev = events();
+	int lo = 0, hi = svc.event_count;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		/* the index is only checked when it is used, like the events */
+		if (ids[mid] - svc.first_event >= svc.event_count)
+			return NULL;
+		if (ev[ids[mid]].event_id < event_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < (int)svc.event_count && ids[lo] - svc.first_event < svc.event_count && ev[ids[lo]].event_id == event_id)
+		return ev + ids[lo];
+	return NULL;
+}
+
+struct less_image_title
+{
+	bool operator()(const epgImageTitle &a, __u32 b) const { return a.crc < b; }
+	bool operator()(__u32 a, const epgImageTitle &b) const { return a < b.crc; }
+};
+
+void eEPGImage::findTitle(__u32 crc, const epgImageTitle *&begin, const epgImageTitle *&end) const
+{
+	std::pair<const epgImageTitle*, const epgImageTitle*> range =
+		std::equal_range(titles(), titles() + titleCount(), crc, less_image_title());
+	begin = range.first;
+	end = range.second;
+}
+
+int eEPGImage::serviceOfEvent(uint32_t event) const
+{
+	// the services are written one after the other, so first_event ascends
+	const epgImageService *svc = services();
+	int lo = 0, hi = serviceCount();
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (svc[mid].first_event + svc[mid].event_count <= event)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < serviceCount() && svc[lo].first_event <= event && event < svc[lo].first_event + svc[lo].event_count)
+		return lo;
+	return -1;
+}
+
+const __u8 *eEPGImage::findDescriptor(__u32 crc) const
+{
+	const epgImageDescriptor *descr = descriptors();
+	int lo = 0, hi = descriptorCount();
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (descr[mid].crc < crc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < descriptorCount() && descr[lo].crc == crc)
+	{
+		size_t size = sectionSize(EPG_IMAGE_DESCRIPTORDATA);
+		if ((uint64_t)descr[lo].data_offset + 2 > size)
+			return NULL;
+		const __u8 *d = descriptorPayload(descr[lo]);
+		if ((uint64_t)descr[lo].data_offset + 2 + d[1] > size)
+			return NULL;
+		return d;
+	}
+	return NULL;
+}
+
+struct less_time_entry
+{
+	bool operator()(const timeEntry &a, time_t b) const { return a.first < b; }
+	bool operator()(time_t a, const timeEntry &b) const { return a < b.first; }
+};
+
+struct less_id_entry
+{
+	bool operator()(const idEntry &a, __u16 b) const { return a.first < b; }
+};
+
+timeMap::iterator eventStore::lowerBound(time_t t)
+{
+	return std::lower_bound(byTime.begin(), byTime.end(), t, less_time_entry());
+}
+
+timeMap::iterator eventStore::upperBound(time_t t)
+{
+	return std::upper_bound(byTime.begin(), byTime.end(), t, less_time_entry());
+}
+
+eventData *eventStore::findTime(time_t t)
+{
+	timeMap::iterator it = lowerBound(t);
+	return (it != byTime.end() && it->first == t) ? it->second : NULL;
+}
+
+eventData *eventStore::findId(__u16 event_id)
+{
+	eventMap::iterator it = std::lower_bound(byId.begin(), byId.end(), event_id, less_id_entry());
+	return (it != byId.end() && it->first == event_id) ? it->second : NULL;
+}
+
+void eventStore::indexTitles(const eventData *evt, bool add)
+{
+	__u64 key = eEPGTitleIndex::eventKey(service.sid, service.onid, service.tsid, (evt->EITdata[0] << 8) | evt->EITdata[1]);
+	const __u32 *p = (const __u32*)(evt->EITdata + 10);
+	for (int tmp = evt->ByteSize - 10; tmp > 3; tmp -= 4, ++p)
+	{
+		if (add)
+			eventData::titles.addEvent(*p, key);
+		else
+			eventData::titles.removeEvent(*p, key);
+	}
+}
+
+void eventStore::insert(time_t t, __u16 event_id, eventData *evt)
+{
+	indexTitles(evt, true);
+	// events mostly arrive in ascending order, so appending is the common case
+	if (byTime.empty() || byTime.back().first < t)
+		byTime.push_back(timeEntry(t, evt));
+	else
+		byTime.insert(lowerBound(t), timeEntry(t, evt));
+	if (byId.empty() || byId.back().first < event_id)
+		byId.push_back(idEntry(event_id, evt));
+	else
+		byId.insert(std::lower_bound(byId.begin(), byId.end(), event_id, less_id_entry()), idEntry(event_id, evt));
+}
+
+void eventStore::replace(time_t t, eventData *evt)
+{
+	timeMap::iterator it = lowerBound(t);
+	if (it == byTime.end() || it->first != t)
+		return;
+	__u16 event_id = it->second->getEventID();
+	indexTitles(it->second, false);
+	indexTitles(evt, true);
+	it->second = evt;
+	eventMap::iterator i = std::lower_bound(byId.begin(), byId.end(), event_id, less_id_entry());
+	if (i != byId.end() && i->first == event_id)
+		i->second = evt;
+}
+
+eventData *eventStore::remove(time_t t)
+{
+	timeMap::iterator it = lowerBound(t);
+	if (it == byTime.end() || it->first != t)
+		return NULL;
+	eventData *evt = it->second;
+	byTime.erase(it);
+	indexTitles(evt, false);
+	__u16 event_id = evt->getEventID();
+	eventMap::iterator i = std::lower_bound(byId.begin(), byId.end(), event_id, less_id_entry());
+	if (i != byId.end() && i->second == evt)
+		byId.erase(i);
+	return evt;
+}
+
+/**
+ * @brief Delete all events which ended before @p now. Only the events which
+ * started before @p now are looked at, so the work depends on the number of
+ * past events and not on the size of the schedule.
+ *
+ * @param now events ending before this time are removed
+ * @return the number of removed events
+ */
+int eventStore::removeExpired(time_t now)
+{
+	std::vector<__u16> expired;
+	timeMap::iterator past = lowerBound(now);
+	timeMap::iterator out = byTime.begin();
+	for (timeMap::iterator it(byTime.begin()); it != past; ++it)
+	{
+		if (now > (it->first + it->second->getDuration()))
+			expired.push_back(it->second->getEventID());
+		else
+			*out++ = *it;
+	}
+	if (expired.empty())
+		return 0;
+	byTime.erase(out, past);
+	std::sort(expired.begin(), expired.end());
+	if (expired.size() < 16)
+	{
+		// the usual case of a run, an event or two per service
+		for (std::vector<__u16>::iterator it(expired.begin()); it != expired.end(); ++it)
+		{
+			eventMap::iterator i = std::lower_bound(byId.begin(), byId.end(), *it, less_id_entry());
+			if (i == byId.end() || i->first != *it)
+				continue;
+			indexTitles(i->second, false);
+			delete i->second;
+			byId.erase(i);
+		}
+		return expired.size();
+	}
+	eventMap::iterator o = byId.begin();
+	for (eventMap::iterator it(byId.begin()); it != byId.end(); ++it)
+	{
+		if (std::binary_search(expired.begin(), expired.end(), it->first))
+		{
+			indexTitles(it->second, false);
+			delete it->second;
+		}
+		else
+			*o++ = *it;
+	}
+	byId.erase(o, byId.end());
+	return expired.size();
+}
+
+time_t eventStore::firstEnd()
+{
+	// events are sorted by start time, only those starting before the end
+	// of the first one can end earlier than it
+	time_t end = byTime.front().first + byTime.front().second->getDuration();
+	for (timeMap::iterator it(byTime.begin() + 1); it != byTime.end() && it->first < end; ++it)
+		end = std::min(end, (time_t)(it->first + it->second->getDuration()));
+	return end;
+}
+
+void eventStore::clear()
+{
+	for (eventMap::iterator it(byId.begin()); it != byId.end(); ++it)
+	{
+		indexTitles(it->second, false);
+		delete it->second;
+	}
+	timeMap().swap(byTime);
+	eventMap().swap(byId);
+}
+
+void serviceEvents::setStore(eventStore *store)
+{
+	m_store = store;
+	m_image = NULL;
+}
+
+void serviceEvents::setImage(const eEPGImage *image, int service)
+{
+	m_store = NULL;
+	m_image = image;
+	m_service = service;
+	m_first = image->services()[service].first_event;
+	m_count = image->services()[service].event_count;
+}
+
+size_t serviceEvents::lowerBound(time_t t) const
+{
+	if (m_store)
+		return m_store->lowerBound(t) - m_store->byTime.begin();
+	return m_image->lowerBound(m_service, t);
+}
+
+size_t serviceEvents::upperBound(time_t t) const
+{
+	if (m_store)
+		return m_store->upperBound(t) - m_store->byTime.begin();
+	return m_image->upperBound(m_service, t);
+}
+
+time_t serviceEvents::startTime(size_t pos) const
+{
+	if (m_store)
+		return m_store->byTime[pos].first;
+	return m_image->events()[m_first + pos].start_time;
+}
+
+bool serviceEvents::get(size_t pos, eventData &evt) const
+{
+	if (m_store)
+	{
+		evt.refer(*m_store->byTime[pos].second);
+		return true;
+	}
+	const epgImageEvent &ev = m_image->events()[m_first + pos];
+	if (!m_image->isValid(ev))
+	{
+		eventData::cacheCorrupt("serviceEvents::get");
+		return false;
+	}
+	evt.refer(m_image->eventPayload(ev), ev.len, ev.type);
+	return true;
+}
+
+bool serviceEvents::findId(__u16 event_id, eventData &evt) const
+{
+	if (m_store)
+	{
+		eventData *data = m_store->findId(event_id);
+		if (data)
+			evt.refer(*data);
+		return data != NULL;
+	}
+	const epgImageEvent *ev = m_image->findEventId(m_service, event_id);
+	if (!ev)
+		return false;
+	return get(ev - (m_image->events() + m_first), evt);
+}
+
 
 eEPGCache* eEPGCache::instance;
 pthread_mutex_t eEPGCache::cache_lock=
 	PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 pthread_mutex_t eEPGCache::channel_map_lock=
 	PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+pthread_rwlock_t eEPGCache::event_lock=
+	PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+int eEPGCache::write_depth;
+
+eEPGCache::writeLock::writeLock()
+	:m_lock(cache_lock)
+{
+	// cache_lock is recursive, event_lock is taken by the outermost writeLock only
+	if (!write_depth++)
+		pthread_rwlock_wrlock(&event_lock);
+}
+
+eEPGCache::writeLock::~writeLock()
+{
+	if (!--write_depth)
+		pthread_rwlock_unlock(&event_lock);
+}
 
 DEFINE_REF(eEPGCache)
 
 eEPGCache::eEPGCache()
-	:messages(this,1), cleanTimer(eTimer::create(this)), m_running(false)
+	:messages(this,1), cleanTimer(eTimer::create(this)), m_batchTimer(eTimer::create(this)),
+	m_batch_sections(32), m_batch_latency(100), m_batch_commits(0), m_running(false), m_image(NULL),
+	m_snapshot(this)
 {
 	eDebug("[EPGC] Initialized EPGCache (wait for setCacheFile call now)");
 
@@ -348,6 +956,7 @@ eEPGCache::eEPGCache()
 	CONNECT(messages.recv_msg, eEPGCache::gotMessage);
 	CONNECT(eDVBLocalTimeHandler::getInstance()->m_timeUpdated, eEPGCache::timeUpdated);
 	CONNECT(cleanTimer->timeout, eEPGCache::cleanLoop);
+	CONNECT(m_batchTimer->timeout, eEPGCache::commitQueued);
 
 	std::ifstream onid_file;
 	onid_file.open("/etc/enigma2/blacklist.onid");
@@ -369,8 +978,13 @@ eEPGCache::eEPGCache()
 
 void eEPGCache::setCacheFile(const char *path)
 {
+	singleLock s(cache_lock);
 	bool inited = !m_filename.empty();
+	bool moved = m_filename != path;
 	m_filename = path;
+	// the journal continues next to the new file, the next save writes the snapshot there
+	if (moved && m_journal.isOpen())
+		m_journal.open(m_filename, m_journal.number() + 1);
 	if (!inited)
 	{
 		eDebug("[EPGC] setCacheFile read/write epg data from/to '%s'", m_filename.c_str());
@@ -594,26 +1208,245 @@ void eEPGCache::DVBChannelStateChanged(iDVBChannel *chan)
 	}
 }
 
+/**
+ * @brief Find the events of a service for reading. Services which are still
+ * only present in the mmap'ed epg.dat are read from there, without pulling
+ * them into the heap cache. Hold event_lock or the cache lock while calling.
+ *
+ * @param key the DVB triplet that identifies the service
+ * @param events set to the events of the service
+ * @return false when there are no events for the service
+ */
+bool eEPGCache::readService(const uniqueEPGKey &key, serviceEvents &events)
+{
+	eventCache::iterator it = eventDB.find(key);
+	if (it != eventDB.end())
+		events.setStore(&it->second);
+	else
+	{
+		int index = m_image ? m_image->findService(key) : -1;
+		if (index < 0 || m_image->isClaimed(index))
+			return false;
+		events.setImage(m_image, index);
+	}
+	return !events.empty();
+}
+
+/**
+ * @brief Find the cache entry of a service to change it. Services which are
+ * still only present in the mmap'ed epg.dat are pulled into the heap cache
+ * first, use readService() to only read them. Hold a writeLock while calling.
+ *
+ * @param key the DVB triplet that identifies the service
+ * @return iterator into eventDB, eventDB.end() when there is no EPG for the service
+ */
+eventCache::iterator eEPGCache::findService(const uniqueEPGKey &key)
+{
+	eventCache::iterator it = eventDB.find(key);
+	if (it == eventDB.end() && m_image)
+	{
+		int index = m_image->findService(key);
+		if (index >= 0 && !m_image->isClaimed(index))
+		{
+			materializeService(index);
+			it = eventDB.find(key);
+		}
+	}
+	return it;
+}
+
+/**
+ * @brief Like findService(), but creates an empty entry when the service has no EPG yet.
+ */
+eventStore &eEPGCache::getService(const uniqueEPGKey &key)
+{
+	eventCache::iterator it = findService(key);
+	if (it != eventDB.end())
+	{
+		touchService(it->first, it->second);
+		return it->second;
+	}
+	if (m_image)
+	{
+		int index = m_image->findService(key);
+		if (index >= 0)
+			m_image->claim(index);
+	}
+	eventStore &store = eventDB[key];
+	store.service = key;
+	touchService(key, store);
+	return store;
+}
+
+/**
+ * @brief Build the event store of one service of the image, before it is
+ * changed. The events keep pointing into the mapping, so no event data is
+ * copied, and the order by event id is taken from EPG_IMAGE_EVENTIDS.
+ *
+ * @param index index of the service in the image
+ */
+void eEPGCache::materializeService(int index)
+{
+	const epgImageService &svc = m_image->services()[index];
+	const epgImageEvent *ev = m_image->events() + svc.first_event;
+	uniqueEPGKey key(svc.sid, svc.onid, svc.tsid);
+	m_image->claim(index);
+	if (eventDB.find(key) != eventDB.end())
+		return;
+	eventStore &servicemap = eventDB[key];
+	servicemap.service = key;
+	servicemap.reserve(svc.event_count);
+	std::vector<eventData*> events(svc.event_count, (eventData*)NULL);
+	for (unsigned int i = 0; i < svc.event_count; ++i, ++ev)
+	{
+		if (!m_image->isValid(*ev))
+		{
+			eventData::cacheCorrupt("eEPGCache::materializeService");
+			continue;
+		}
+		eventData *event = new eventData();
+		event->refer(m_image->eventPayload(*ev), ev->len, ev->type);
+		servicemap.indexTitles(event, true);
+		events[i] = event;
+		// events are stored sorted by start time, so always append
+		servicemap.byTime.push_back(timeEntry(ev->start_time, event));
+	}
+	const uint32_t *ids = m_image->eventIds() + svc.first_event;
+	for (unsigned int i = 0; i < svc.event_count; ++i)
+	{
+		unsigned int pos = ids[i] - svc.first_event;
+		if (pos >= svc.event_count)
+		{
+			eventData::cacheCorrupt("eEPGCache::materializeService");
+			continue;
+		}
+		if (events[pos])
+			servicemap.byId.push_back(idEntry(events[pos]->getEventID(), events[pos]));
+	}
+	if (servicemap.byId.size() != servicemap.byTime.size())
+	{
+		// a broken id index, don't lose the events over it
+		servicemap.byId.clear();
+		for (timeMap::iterator it(servicemap.byTime.begin()); it != servicemap.byTime.end(); ++it)
+			servicemap.byId.push_back(idEntry(it->second->getEventID(), it->second));
+		std::sort(servicemap.byId.begin(), servicemap.byId.end());
+	}
+	touchService(key, servicemap);
+}
+
+/**
+ * @brief Release the mmap'ed epg.dat. Events still referencing the image are
+ * copied to the heap first. Hold a writeLock while calling.
+ */
+void eEPGCache::dropImage()
+{
+	if (!m_image)
+		return;
+	for (eventCache::iterator it(eventDB.begin()); it != eventDB.end(); ++it)
+		for (eventMap::iterator i(it->second.byId.begin()); i != it->second.byId.end(); ++i)
+			i->second->detach();
+	closeImage();
+}
+
+/**
+ * @brief Unmap the epg.dat image without looking at the events, only call
+ * this when no event references the image anymore.
+ */
+void eEPGCache::closeImage()
+{
+	indexImageTitles(false);
+	delete m_image;
+	m_image = NULL;
+}
+
+/**
+ * @brief Add the titles of the mmap'ed image to the title index, or remove them
+ * again. Only the title descriptors listed in EPG_IMAGE_TITLES are read, the
+ * events of a title are looked up in that section when searching.
+ */
+void eEPGCache::indexImageTitles(bool add)
+{
+	if (!m_image)
+		return;
+	const epgImageTitle *t = m_image->titles();
+	for (int i = 0; i < m_image->titleCount(); ++i, ++t)
+	{
+		if (i && t[-1].crc == t->crc)
+			continue;
+		const __u8 *data = m_image->findDescriptor(t->crc);
+		if (!data)
+			continue;
+		if (add)
+			eventData::titles.add(t->crc, data);
+		else
+			eventData::titles.remove(t->crc, data);
+	}
+}
+
+/**
+ * @brief Number of events using the title @crc, in the heap cache and in the
+ * image, (size_t)-1 if @crc is no title.
+ */
+size_t eEPGCache::titleEventCount(__u32 crc)
+{
+	const std::vector<__u64> *heap = eventData::titles.events(crc);
+	if (!heap)
+		return (size_t)-1;
+	size_t count = heap->size();
+	if (m_image)
+	{
+		const epgImageTitle *begin, *end;
+		m_image->findTitle(crc, begin, end);
+		count += end - begin;
+	}
+	return count;
+}
+
+/**
+ * @brief Append the events using the title @crc to @keys, as eEPGTitleIndex::eventKey.
+ * Events of services which were claimed from the image are taken from the heap cache.
+ */
+void eEPGCache::titleEvents(__u32 crc, std::vector<__u64> &keys)
+{
+	const std::vector<__u64> *heap = eventData::titles.events(crc);
+	if (heap)
+		keys.insert(keys.end(), heap->begin(), heap->end());
+	if (!m_image)
+		return;
+	const epgImageTitle *t, *end;
+	m_image->findTitle(crc, t, end);
+	for (; t != end; ++t)
+	{
+		int index = m_image->serviceOfEvent(t->event);
+		if (index < 0 || m_image->isClaimed(index))
+			continue;
+		const epgImageService &svc = m_image->services()[index];
+		keys.push_back(eEPGTitleIndex::eventKey(svc.sid, svc.onid, svc.tsid, m_image->events()[t->event].event_id));
+	}
+}
+
 /**
  * @brief Removes any existing events that overlap the new event by more than OVERLAP_TIME (100) seconds.
  *
- * @param servicemap an eventMap, timeMap pair
+ * @param servicemap the events of the service
  * @param TM start time of the event
  * @param duration duration (in seconds) of the event
- * @param tm_it iterator pointing to the old version of the event in the timeMap
  * @param service the DVB triplet that identifies the service
  * @return bool true if there were any deletions performed.
  */
-bool eEPGCache::FixOverlapping(serviceMap &servicemap, time_t TM, int duration, const timeMap::iterator &tm_it, const uniqueEPGKey &service)
+bool eEPGCache::FixOverlapping(eventStore &servicemap, time_t TM, int duration, const uniqueEPGKey &service)
 {
-//	eDebug("[EPGC] FixOverlapping TM=%ld, duration=%d, tm_it=%ld", (long)TM, duration, (long)tm_it->first);
+//	eDebug("[EPGC] FixOverlapping TM=%ld, duration=%d", (long)TM, duration);
 	static const int OVERLAP_TIME = 100;
-	bool ret = false;
+	timeMap &times = servicemap.byTime;
+	timeMap::iterator tm_it = servicemap.lowerBound(TM);
+	if (tm_it == times.end() || tm_it->first != TM)
+		return false;
+	std::vector<time_t> victims;
 	timeMap::iterator tmp = tm_it;
 	// while end of old is OVERLAP_TIME or more after start of new
 	while ((tmp->first+tmp->second->getDuration()-OVERLAP_TIME) > TM)
 	{
-//		eDebug("[EPGC] check front against %ld", (long)tmp->first);
 		if(tmp->first != TM
 #ifdef ENABLE_PRIVATE_EPG
 			&& tmp->second->type != PRIVATE
@@ -622,39 +1455,15 @@ bool eEPGCache::FixOverlapping(serviceMap &servicemap, time_t TM, int duration,
 			&& tmp->second->type != MHW
 #endif
 			)
-		{
-			// Remove from both maps and delete the old event
-			__u16 event_id = tmp->second->getEventID();
-			servicemap.first.erase(event_id);
-#ifdef EPG_DEBUG
-			Event evt((uint8_t*)tmp->second->get());
-			eServiceEvent event;
-			event.parseFrom(&evt, service.sid<<16|service.onid);
-			eDebug("[EPGC] (1) erase svc(%x:%x:%x) evt=%04x\n"
-				"old event start=%ld, end=%ld\n"
-				"new event start=%ld, end=%ld\n"
-				"%s %s\n%s",
-				service.onid, service.tsid, service.sid, event_id,
-				(long)event.getBeginTime(), (long)(event.getBeginTime()) + event.getDuration(),
-				(long)TM, (long)TM + duration,
-				event.getBeginTimeString().c_str(),
-				event.getEventName().c_str(),
-				event.getExtendedDescription().c_str());
-#endif
-			delete tmp->second;
-			ret = true;
-			servicemap.second.erase(tmp++);
-		}
-		if (tmp == servicemap.second.begin())
+			victims.push_back(tmp->first);
+		if (tmp == times.begin())
 			break;
 		--tmp;
 	}
 
-	tmp = tm_it;
 	// while start of old is OVERLAP_TIME or more before end of new
-	while(tmp->first < (TM+duration-OVERLAP_TIME))
+	for (tmp = tm_it; tmp != times.end() && tmp->first < (TM+duration-OVERLAP_TIME); ++tmp)
 	{
-//		eDebug("[EPGC] check back against %ld", (long)tmp->first);
 		if (tmp->first != TM
 #ifdef ENABLE_PRIVATE_EPG
 			&& tmp->second->type != PRIVATE
@@ -663,36 +1472,48 @@ bool eEPGCache::FixOverlapping(serviceMap &servicemap, time_t TM, int duration,
 			&& tmp->second->type != MHW
 #endif
 			)
-		{
-			__u16 event_id = tmp->second->getEventID();
-			servicemap.first.erase(event_id);
+			victims.push_back(tmp->first);
+	}
+
+	for (std::vector<time_t>::iterator it(victims.begin()); it != victims.end(); ++it)
+	{
+		eventData *old = servicemap.remove(*it);
+		journalRemove(service, *it);
 #ifdef EPG_DEBUG
-			Event evt((uint8_t*)tmp->second->get());
-			eServiceEvent event;
-			event.parseFrom(&evt, service.sid<<16|service.onid);
-			eDebug("[EPGC] (2) erase svc(%x:%x:%x) evt=%04x\n"
-				"old event start=%ld, end=%ld\n"
-				"new event start=%ld, end=%ld\n"
-				"%s %s\n%s",
-				service.onid, service.tsid, service.sid, event_id,
-				(long)event.getBeginTime(), (long)(event.getBeginTime()) + event.getDuration(),
-				(long)TM, (long)TM + duration,
-				event.getBeginTimeString().c_str(),
-				event.getEventName().c_str(),
-				event.getExtendedDescription().c_str());
+		Event evt((uint8_t*)old->get());
+		eServiceEvent event;
+		event.parseFrom(&evt, service.sid<<16|service.onid);
+		eDebug("[EPGC] erase svc(%x:%x:%x) evt=%04x\n"
+			"old event start=%ld, end=%ld\n"
+			"new event start=%ld, end=%ld\n"
+			"%s %s\n%s",
+			service.onid, service.tsid, service.sid, old->getEventID(),
+			(long)event.getBeginTime(), (long)(event.getBeginTime()) + event.getDuration(),
+			(long)TM, (long)TM + duration,
+			event.getBeginTimeString().c_str(),
+			event.getEventName().c_str(),
+			event.getExtendedDescription().c_str());
 #endif
-			delete tmp->second;
-			ret = true;
-			servicemap.second.erase(tmp++);
-		}
-		else
-			++tmp;
-		if (tmp == servicemap.second.end())
-			break;
+		delete old;
 	}
-	return ret;
+	return !victims.empty();
+}
+
+
+eEPGCache::sectionBatch::~sectionBatch()
+{
+	clear();
 }
 
+void eEPGCache::sectionBatch::clear()
+{
+	for (std::vector<pendingEvent*>::iterator it(events.begin()); it != events.end(); ++it)
+		delete *it;
+	for (std::vector<__u8*>::iterator it(sections.begin()); it != sections.end(); ++it)
+		delete [] *it;
+	events.clear();
+	sections.clear();
+}
 
 /**
  * @brief Parse EIT section data and update the EPG cache timeMap and eventMap
@@ -704,13 +1525,59 @@ bool eEPGCache::FixOverlapping(serviceMap &servicemap, time_t TM, int duration,
  */
 void eEPGCache::sectionRead(const __u8 *data, eit_type_t source, channel_data *channel)
 {
-	eit_t *eit = (eit_t*) data;
+	sectionBatch batch;
+	stageSection(data, source, channel, batch);
+	commitBatch(batch);
+	m_journal.flush(false);
+}
+
+/**
+ * @brief Queue EIT section data for the EPG cache. Sections are parsed right
+ * away, but added to the cache in batches, so the cache lock is taken once
+ * per batch instead of once per section. A batch is committed when it holds
+ * m_batch_sections sections or m_batch_latency ms after its first section.
+ * Only call this from the EPG thread.
+ */
+void eEPGCache::queueSection(const __u8 *data, eit_type_t source, channel_data *channel)
+{
+	if (m_batch_sections <= 1)
+	{
+		sectionRead(data, source, channel);
+		return;
+	}
+	stageSection(data, source, channel, m_batch);
+	if ((int)m_batch.sections.size() >= m_batch_sections)
+		commitQueued();
+	else if (m_batch.sections.size() == 1)
+		m_batchTimer->start(m_batch_latency, true);
+}
+
+void eEPGCache::commitQueued()
+{
+	m_batchTimer->stop();
+	if (!m_batch.sections.empty())
+		commitBatch(m_batch);
+	m_journal.flush(false);
+}
 
-	int len=HILO(eit->section_length)-1;//+3-4;
+/**
+ * @brief Parse the events of an EIT section into @p batch. The section is
+ * copied, the cache isn't touched and no lock is needed.
+ */
+void eEPGCache::stageSection(const __u8 *section, eit_type_t source, channel_data *channel, sectionBatch &batch)
+{
+	int section_size = HILO(((eit_t*)section)->section_length)+3;
+	int len=section_size-4;//+3-4;
 	int ptr=EIT_SIZE;
 	if ( ptr >= len )
 		return;
 
+	// the parsed events point into the section, keep a copy as long as the batch lives
+	__u8 *data = new __u8[section_size];
+	memcpy(data, section, section_size);
+	batch.sections.push_back(data);
+	eit_t *eit = (eit_t*) data;
+
 #if 0
 		/*
 		 * disable for now, as this hack breaks EIT parsing for
@@ -737,7 +1604,7 @@ void eEPGCache::sectionRead(const __u8 *data, eit_type_t source, channel_data *c
 	 */
 	bool use_transponder_chid = onid != 0x101 && onid != 0x100 && (source == SCHEDULE || (source == NOWNEXT && data[0] == 0x4E));
 
-	if (use_transponder_chid && channel)
+	if (use_transponder_chid && channel && channel->channel)
 	{
 		eDVBChannelID chid = channel->channel->getChannelID();
 
@@ -762,12 +1629,10 @@ void eEPGCache::sectionRead(const __u8 *data, eit_type_t source, channel_data *c
 	if ( TM != 3599 && TM > -1 && channel)
 		channel->haveData |= source;
 
-	singleLock s(cache_lock);
-	// here an eventMap is always given back to results .. either an existing one or one generated by []
-	serviceMap &servicemap = eventDB[service];
-	eventMap::iterator prevEventIt = servicemap.first.end();
-	timeMap::iterator prevTimeIt = servicemap.second.end();
-
+	/*
+	 * Parse and convert all events of the section before taking the cache
+	 * lock, so readers are only blocked while the events are linked in.
+	 */
 	while (ptr<len)
 	{
 		__u16 event_hash;
@@ -782,8 +1647,6 @@ void eEPGCache::sectionRead(const __u8 *data, eit_type_t source, channel_data *c
 			eit_event->start_time_5,
 			&event_hash);
 
-		bool isOld = ((TM + duration) < now);
-
 		std::vector<int>::iterator m_it=find(onid_blacklist.begin(),onid_blacklist.end(),onid);
 		if (m_it != onid_blacklist.end())
 			goto next;
@@ -796,9 +1659,6 @@ void eEPGCache::sectionRead(const __u8 *data, eit_type_t source, channel_data *c
 		   )
 		{
 			__u16 event_id = HILO(eit_event->event_id);
-			eventData *evt = 0;
-			int ev_erase_count = 0;
-			int tm_erase_count = 0;
 
 			if (event_id == 0) {
 				// hack for some polsat services on 13.0E..... but this also replaces other valid event_ids with value 0..
@@ -808,188 +1668,162 @@ void eEPGCache::sectionRead(const __u8 *data, eit_type_t source, channel_data *c
 				eit_event->event_id_lo = event_hash & 0xFF;
 			}
 
-			// search in eventmap
-			eventMap::iterator ev_it = servicemap.first.find(event_id);
+			pendingEvent *p = new pendingEvent;
+			p->service = service;
+			p->source = source;
+			p->TM = TM;
+			p->duration = duration;
+			p->event_id = event_id;
+			eventData::parse(eit_event, eit_event_size, (tsid<<16)|onid, p->data);
+			batch.events.push_back(p);
+		}
+next:
+		ptr += eit_event_size;
+		eit_event=(eit_event_struct*)(((__u8*)eit_event)+eit_event_size);
+	}
+	// an empty service entry is created even if no event is added
+	if (batch.events.empty() || !(batch.events.back()->service == service))
+	{
+		pendingEvent *p = new pendingEvent;
+		p->service = service;
+		p->source = source;
+		p->TM = -1;
+		batch.events.push_back(p);
+	}
+}
 
-//			eDebug("svc(%x:%x:%x) event_id %04x", service.onid, service.tsid, service.sid, event_id);
+/**
+ * @brief Add the events of a batch of staged sections to the cache, all under
+ * a single acquisition of the cache lock. event_lock is taken for one service
+ * at a time, so the readers don't wait for the whole batch. The batch is emptied.
+ */
+void eEPGCache::commitBatch(sectionBatch &batch)
+{
+	time_t now = ::time(0) - historySeconds;
+	singleLock s(cache_lock);
+	++m_batch_commits;
+	std::vector<pendingEvent*>::iterator it(batch.events.begin());
+	while (it != batch.events.end())
+	{
+		std::vector<pendingEvent*>::iterator end(it);
+		while (end != batch.events.end() && (*end)->service == (*it)->service)
+			++end;
+		writeLock w;
+		commitService(it, end, now);
+		it = end;
+	}
+	batch.clear();
+}
 
-			// entry with this event_id is already exist ?
-			if ( ev_it != servicemap.first.end() )
-			{
-//				eDebug("[EPGC] event %04x in eventMap with start time %ld", event_id, (long)ev_it->second->getStartTime());
-				if ( (source & ~EPG_IMPORT) > ev_it->second->type )  // update needed ?
-				{
-#ifdef EPG_DEBUG
-					eDebug("[EPGC] event %04x skip update: source=0x%x > type=0x%x", event_id, source, ev_it->second->type);
-#endif
-					goto next; // when not.. then skip this entry
-				}
+/**
+ * @brief Add the staged events [@p it, @p end) of a single service to the cache.
+ * Hold a writeLock while calling.
+ */
+void eEPGCache::commitService(std::vector<pendingEvent*>::iterator it, std::vector<pendingEvent*>::iterator end, time_t now)
+{
+	uniqueEPGKey service = (*it)->service;
+	// here an eventStore is always given back to results .. either an existing one or one generated by getService
+	eventStore &servicemap = getService(service);
 
-				// search this event in timemap
-				timeMap::iterator tm_it_tmp = servicemap.second.find(ev_it->second->getStartTime());
-				if ( tm_it_tmp != servicemap.second.end() )
-				{
-					if ( tm_it_tmp->first == TM ) // just update eventdata
-					{
-//						eDebug("[EPGC] event %04x in timeMap with same start time - update and FixOverlap", event_id);
-						// exempt memory
-						eventData *tmp = ev_it->second;
-						ev_it->second = tm_it_tmp->second =
-							new eventData(eit_event, eit_event_size, source, (tsid<<16)|onid);
-						if (FixOverlapping(servicemap, TM, duration, tm_it_tmp, service))
-						{
-							prevEventIt = servicemap.first.end();
-							prevTimeIt = servicemap.second.end();
-						}
-						delete tmp;
-						goto next;
-					}
-					else  // event has new event begin time
-					{
-#ifdef EPG_DEBUG
-						eDebug("[EPGC] event %04x in timeMap with a different start time - delete from timeMap", event_id);
-#endif
-						tm_erase_count++;
-						// delete the found record from timemap
-						servicemap.second.erase(tm_it_tmp);
-						prevTimeIt=servicemap.second.end();
-					}
-				}
-				else
-				{
-#ifdef EPG_DEBUG
-					eDebug("[EPGC] event %04x not found in timeMap at time %ld", event_id, (long)ev_it->second->getStartTime());
-#endif
-				}
-			}
-			else
-			{
-#ifdef EPG_DEBUG
-				eDebug("[EPGC] event %04x not found in eventMap", event_id);
-#endif
-			}
+	for (; it != end; ++it)
+	{
+		pendingEvent &p = **it;
+		if (p.TM == -1) // placeholder for a section without events
+			continue;
+		eit_type_t source = p.source;
+		time_t TM = p.TM;
+		int duration = p.duration;
+		__u16 event_id = p.event_id;
+		bool isOld = ((TM + duration) < now);
+		eventData *evt = 0;
 
-			// search in timemap, for check of a case if new time has coincided with time of other event
-			// or event was is not found in eventmap
-			timeMap::iterator tm_it = servicemap.second.find(TM);
-			if ( tm_it != servicemap.second.end() )
-			{
-//				eDebug("[EPGC] event at time %ld in timeMap with id %04x", (long)TM, tm_it->second->getEventID());
-				// event with same start time but another event_id...
-				if ( source > tm_it->second->type &&
-					ev_it == servicemap.first.end() )
-				{
-#ifdef EPG_DEBUG
-					eDebug("[EPGC] event at time %ld skip update: source=0x%x > type=0x%x && event %04x not found in eventMap", (long)TM, source, tm_it->second->type, event_id);
-#endif
-					goto next; // when not.. then skip this entry
-				}
+		// search in eventmap
+		eventData *ev_old = servicemap.findId(event_id);
 
-				// search this time in eventmap
-				eventMap::iterator ev_it_tmp = servicemap.first.find(tm_it->second->getEventID());
-				if ( ev_it_tmp != servicemap.first.end() )
-				{
-#ifdef EPG_DEBUG
-					eDebug("[EPGC] event at time %ld found in event map as %04x - delete from eventMap", (long)TM, tm_it->second->getEventID());
-#endif
-					ev_erase_count++;
-					// delete the found record from eventmap
-					servicemap.first.erase(ev_it_tmp);
-					prevEventIt=servicemap.first.end();
-				}
-				else
-				{
-#ifdef EPG_DEBUG
-					eDebug("[EPGC] event at time %ld not found in eventMap as %04x", (long)TM, tm_it->second->getEventID());
-#endif
-				}
-			}
-			else
-			{
-#ifdef EPG_DEBUG
-				eDebug("[EPGC] event at time %ld not found in timeMap", (long)TM);
-#endif
-			}
+//		eDebug("svc(%x:%x:%x) event_id %04x", service.onid, service.tsid, service.sid, event_id);
 
-			evt = new eventData(eit_event, eit_event_size, source, (tsid<<16)|onid);
-#ifdef EPG_DEBUG
-			bool consistencyCheck=true;
-#endif
-			if (ev_erase_count > 0 && tm_erase_count > 0) // 2 different pairs have been removed
-			{
-				// exempt memory
-				delete ev_it->second;
-				delete tm_it->second;
-				ev_it->second=evt;
-				tm_it->second=evt;
-			}
-			else if (ev_erase_count == 0 && tm_erase_count > 0)
+		// entry with this event_id is already exist ?
+		if ( ev_old )
+		{
+//			eDebug("[EPGC] event %04x in eventMap with start time %ld", event_id, (long)ev_old->getStartTime());
+			if ( (source & ~EPG_IMPORT) > ev_old->type )  // update needed ?
 			{
-				// exempt memory
-				delete ev_it->second;
-				tm_it=prevTimeIt=servicemap.second.insert( prevTimeIt, timeMap::value_type(TM, evt));
-				ev_it->second=evt;
+#ifdef EPG_DEBUG
+				eDebug("[EPGC] event %04x skip update: source=0x%x > type=0x%x", event_id, source, ev_old->type);
+#endif
+				goto skip; // when not.. then skip this entry
 			}
-			else if (ev_erase_count > 0 && tm_erase_count == 0)
+
+			if ( ev_old->getStartTime() == TM && servicemap.findTime(TM) == ev_old ) // just update eventdata
 			{
+//				eDebug("[EPGC] event %04x in timeMap with same start time - update and FixOverlap", event_id);
+				evt = new eventData(p.data, source);
+				servicemap.replace(TM, evt);
+				journalEvent(service, evt);
+				FixOverlapping(servicemap, TM, duration, service);
 				// exempt memory
-				delete tm_it->second;
-				ev_it=prevEventIt=servicemap.first.insert( prevEventIt, eventMap::value_type( event_id, evt) );
-				tm_it->second=evt;
+				delete ev_old;
+				goto skip;
 			}
-			else // added new eventData
-			{
 #ifdef EPG_DEBUG
-				consistencyCheck=false;
+			eDebug("[EPGC] event %04x has a new start time - delete it", event_id);
 #endif
-				if (isOld)
-				{
-					delete evt;
-					goto next;
-				}
-				else
+		}
+		else
+		{
+#ifdef EPG_DEBUG
+			eDebug("[EPGC] event %04x not found in eventMap", event_id);
+#endif
+		}
+
+		{
+			// search in timemap, for check of a case if new time has coincided with time of other event
+			// or event was is not found in eventmap
+			eventData *tm_old = servicemap.findTime(TM);
+			if ( tm_old )
+			{
+//				eDebug("[EPGC] event at time %ld in timeMap with id %04x", (long)TM, tm_old->getEventID());
+				// event with same start time but another event_id...
+				if ( source > tm_old->type && !ev_old )
 				{
 #ifdef EPG_DEBUG
-					eDebug("[EPGC] add new event %04x at time %ld", event_id, (long)TM);
+					eDebug("[EPGC] event at time %ld skip update: source=0x%x > type=0x%x && event %04x not found in eventMap", (long)TM, source, tm_old->type, event_id);
 #endif
-					ev_it=prevEventIt=servicemap.first.insert( prevEventIt, eventMap::value_type( event_id, evt) );
-					tm_it=prevTimeIt=servicemap.second.insert( prevTimeIt, timeMap::value_type( TM, evt ) );
+					goto skip; // when not.. then skip this entry
 				}
 			}
-
-#ifdef EPG_DEBUG
-			if ( consistencyCheck )
+			else
 			{
-				if ( tm_it->second != evt || ev_it->second != evt )
-					eFatal("tm_it->second != ev_it->second");
-				else if ( tm_it->second->getStartTime() != tm_it->first )
-					eFatal("event start_time(%ld) non equal timemap key(%ld)",
-						(long)tm_it->second->getStartTime(), (long)tm_it->first );
-				else if ( tm_it->first != TM )
-					eFatal("timemap key(%ld) non equal TM(%ld)",
-						(long)tm_it->first, (long)TM);
-				else if ( ev_it->second->getEventID() != ev_it->first )
-					eFatal("event_id (%04x) non equal event_map key(%04x)",
-						ev_it->second->getEventID(), ev_it->first);
-				else if ( ev_it->first != event_id )
-					eFatal("eventmap key(%04x) non equal event_id(%04x)",
-						ev_it->first, event_id );
-			}
+#ifdef EPG_DEBUG
+				eDebug("[EPGC] event at time %ld not found in timeMap", (long)TM);
 #endif
-			if (FixOverlapping(servicemap, TM, duration, tm_it, service))
-			{
-				prevEventIt = servicemap.first.end();
-				prevTimeIt = servicemap.second.end();
 			}
+
+			if (!ev_old && !tm_old && isOld) // nothing to replace, and too old to add
+				goto skip;
+
+			// the new event replaces the old one with the same event id and the one at the same time
+			if (ev_old)
+				delete servicemap.remove(ev_old->getStartTime());
+			if (tm_old)
+				delete servicemap.remove(TM);
+
+			evt = new eventData(p.data, source);
+#ifdef EPG_DEBUG
+			eDebug("[EPGC] add new event %04x at time %ld", event_id, (long)TM);
+#endif
+			servicemap.insert(TM, event_id, evt);
+			journalEvent(service, evt);
+			FixOverlapping(servicemap, TM, duration, service);
 		}
-next:
+skip:
 #ifdef EPG_DEBUG
-		if ( servicemap.first.size() != servicemap.second.size() )
+		if ( servicemap.byId.size() != servicemap.byTime.size() )
 		{
 			{
 				CFile f("/hdd/event_map.txt", "w+");
 				int i = 0;
-				for (eventMap::iterator it(servicemap.first.begin()); it != servicemap.first.end(); ++it )
+				for (eventMap::iterator it(servicemap.byId.begin()); it != servicemap.byId.end(); ++it )
 				{
 					fprintf(f, "%d(key %d) -> time %d, event_id %d, data %p\n",
 					i++, (int)it->first, (int)it->second->getStartTime(), (int)it->second->getEventID(), it->second );
@@ -998,7 +1832,7 @@ next:
 			{
 				CFile f("/hdd/time_map.txt", "w+");
 				int i = 0;
-				for (timeMap::iterator it(servicemap.second.begin()); it != servicemap.second.end(); ++it )
+				for (timeMap::iterator it(servicemap.byTime.begin()); it != servicemap.byTime.end(); ++it )
 				{
 					fprintf(f, "%d(key %d) -> time %d, event_id %d, data %p\n",
 						i++, (int)it->first, (int)it->second->getStartTime(), (int)it->second->getEventID(), it->second );
@@ -1006,29 +1840,30 @@ next:
 			}
 			eFatal("[EPGC] (1) map sizes not equal :( sid %04x tsid %04x onid %04x size %d size2 %d",
 				service.sid, service.tsid, service.onid,
-				servicemap.first.size(), servicemap.second.size() );
+				servicemap.byId.size(), servicemap.byTime.size() );
 		}
 #endif
-		ptr += eit_event_size;
-		eit_event=(eit_event_struct*)(((__u8*)eit_event)+eit_event_size);
+		;
 	}
 }
 
 void eEPGCache::flushEPG(const uniqueEPGKey & s)
 {
-	singleLock l(cache_lock);
+	writeLock l;
+	m_journal.flushService(s.sid, s.onid, s.tsid);
 	if (s)  // clear only this service
 	{
 		eDebug("[EPGC] flushEPG svc(%x:%x:%x)", s.onid, s.tsid, s.sid);
+		if (m_image)
+		{
+			int index = m_image->findService(s);
+			if (index >= 0)
+				m_image->claim(index);
+		}
 		eventCache::iterator it = eventDB.find(s);
 		if ( it != eventDB.end() )
 		{
-			eventMap &evMap = it->second.first;
-			timeMap &tmMap = it->second.second;
-			tmMap.clear();
-			for (eventMap::iterator i = evMap.begin(); i != evMap.end(); ++i)
-				delete i->second;
-			evMap.clear();
+			it->second.clear();
 			eventDB.erase(it);
 
 			// TODO .. search corresponding channel for removed service and remove this channel from lastupdated map
@@ -1048,15 +1883,11 @@ void eEPGCache::flushEPG(const uniqueEPGKey & s)
 		eDebug("[EPGC] flushEPG all services");
 		for (eventCache::iterator it(eventDB.begin());
 			it != eventDB.end(); ++it)
-		{
-			eventMap &evMap = it->second.first;
-			timeMap &tmMap = it->second.second;
-			for (eventMap::iterator i = evMap.begin(); i != evMap.end(); ++i)
-				delete i->second;
-			evMap.clear();
-			tmMap.clear();
-		}
+			it->second.clear();
 		eventDB.clear();
+		m_expiry.clear();
+		m_touched.clear();
+		closeImage();
 #ifdef ENABLE_PRIVATE_EPG
 		content_time_tables.clear();
 #endif
@@ -1067,78 +1898,161 @@ void eEPGCache::flushEPG(const uniqueEPGKey & s)
 	}
 }
 
+/**
+ * @brief Record a new or updated event in the journal. Acquire the cache lock before calling.
+ */
+void eEPGCache::journalEvent(const uniqueEPGKey &key, const eventData *evt)
+{
+	if (!m_journal.isOpen())
+		return;
+	const __u8 *descr[64];
+	const __u32 *p = (const __u32*)(evt->EITdata + 10);
+	for (int i = 0; i < (evt->ByteSize - 10) / 4; ++i)
+	{
+		descr[i] = eventData::getDescriptor(p[i]);
+		if (!descr[i])
+		{
+			eventData::cacheCorrupt("eEPGCache::journalEvent");
+			return;
+		}
+	}
+	m_journal.addEvent(key.sid, key.onid, key.tsid, evt->type, evt->EITdata, evt->ByteSize, descr);
+}
+
+void eEPGCache::journalRemove(const uniqueEPGKey &key, time_t start)
+{
+	m_journal.removeEvent(key.sid, key.onid, key.tsid, start);
+}
+
+/**
+ * @brief Note that @p store may have got events which end earlier than the
+ * one it is scheduled for. Acquire the cache lock before calling.
+ */
+void eEPGCache::touchService(const uniqueEPGKey &key, eventStore &store)
+{
+	if (store.touched)
+		return;
+	store.touched = true;
+	m_touched.push_back(key);
+}
+
+/**
+ * @brief Enter the service into the expiry schedule at the bucket its first
+ * event ends in, unless it is already scheduled for that bucket or earlier.
+ */
+void eEPGCache::scheduleExpiry(const uniqueEPGKey &key, eventStore &store)
+{
+	if (store.empty())
+		return;
+	time_t bucket = store.firstEnd() / EXPIRY_BUCKET;
+	if (store.expiry && store.expiry <= bucket)
+		return;
+	store.expiry = bucket;
+	m_expiry[bucket].push_back(key);
+}
+
+void eEPGCache::expireService(const uniqueEPGKey &key, eventStore &store, time_t now)
+{
+	if (!store.removeExpired(now))
+		return;
+#ifdef ENABLE_PRIVATE_EPG
+	contentMaps::iterator x =
+		content_time_tables.find( key );
+	if ( x != content_time_tables.end() )
+	{
+		for ( contentMap::iterator i = x->second.begin(); i != x->second.end(); )
+		{
+			for ( contentTimeMap::iterator it(i->second.begin());
+				it != i->second.end(); )
+			{
+				if ( !store.findTime(it->second.first) )
+					i->second.erase(it++);
+				else
+					++it;
+			}
+			if ( i->second.size() )
+				++i;
+			else
+				x->second.erase(i++);
+		}
+	}
+#endif
+}
+
 /**
  * @brief Remove old events from the cache. An event is considered old
  * if it's end time is earlier than @p eEPGCache::historySeconds ago.
  *
+ * Services are kept in a schedule by the end time of their first event,
+ * so a run only visits the services which actually have expired events.
+ * A run holds the cache lock for at most EXPIRY_SLICE ms, the rest of the
+ * work is continued EXPIRY_YIELD ms later.
+ *
  * @return void
  */
 void eEPGCache::cleanLoop()
 {
-	singleLock s(cache_lock);
-	if (!eventDB.empty())
+	// sync the changes of the last minute, without holding the cache lock
+	m_journal.flush(false);
+	writeLock s;
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	time_t now = ::time(0) - historySeconds;
+	int work = 0;
+
+	for (std::vector<uniqueEPGKey>::iterator it(m_touched.begin()); it != m_touched.end(); ++it)
 	{
-		time_t now = ::time(0) - historySeconds;
+		eventCache::iterator DBIt = eventDB.find(*it);
+		if (DBIt == eventDB.end())
+			continue;
+		DBIt->second.touched = false;
+		scheduleExpiry(DBIt->first, DBIt->second);
+	}
+	m_touched.clear();
 
-		for (eventCache::iterator DBIt = eventDB.begin(); DBIt != eventDB.end(); DBIt++)
+	// only buckets which are completely in the past, a service holding an
+	// event which ends in the current minute would otherwise be rescheduled
+	// into the bucket being processed
+	while (!m_expiry.empty() && m_expiry.begin()->first < now / EXPIRY_BUCKET)
+	{
+		time_t bucket = m_expiry.begin()->first;
+		std::vector<uniqueEPGKey> &services = m_expiry.begin()->second;
+		while (!services.empty())
 		{
-			bool updated = false;
-			for (timeMap::iterator It = DBIt->second.second.begin(); It != DBIt->second.second.end() && It->first < now;)
-			{
-				if ( now > (It->first+It->second->getDuration()) )  // outdated normal entry (nvod references to)
-				{
-#ifdef EPG_DEBUG
-					eDebug("[EPGC] cleanLoop: svc(%x:%x:%x) delete old event %04x at time %ld",
-						DBIt->first.onid, DBIt->first.tsid, DBIt->first.sid,
-						It->second->getEventID(), (long) It->first);
-#endif
-					// remove entry from eventMap
-					eventMap::iterator b(DBIt->second.first.find(It->second->getEventID()));
-					if ( b != DBIt->second.first.end() )
-					{
-						// release Heap Memory for this entry   (new ....)
-//						eDebug("[EPGC] delete old event (evmap)");
-						DBIt->second.first.erase(b);
-					}
-
-					// remove entry from timeMap
-//					eDebug("[EPGC] release heap mem");
-					delete It->second;
-					DBIt->second.second.erase(It++);
-//					eDebug("[EPGC] delete old event (timeMap)");
-					updated = true;
-				}
-				else
-					++It;
-			}
-#ifdef ENABLE_PRIVATE_EPG
-			if ( updated )
+			if (++work % 16 == 0)
 			{
-				contentMaps::iterator x =
-					content_time_tables.find( DBIt->first );
-				if ( x != content_time_tables.end() )
+				timespec cur;
+				clock_gettime(CLOCK_MONOTONIC, &cur);
+				if ((cur.tv_sec - start.tv_sec) * 1000 + (cur.tv_nsec - start.tv_nsec) / 1000000 >= EXPIRY_SLICE)
 				{
-					timeMap &tmMap = DBIt->second.second;
-					for ( contentMap::iterator i = x->second.begin(); i != x->second.end(); )
-					{
-						for ( contentTimeMap::iterator it(i->second.begin());
-							it != i->second.end(); )
-						{
-							if ( tmMap.find(it->second.first) == tmMap.end() )
-								i->second.erase(it++);
-							else
-								++it;
-						}
-						if ( i->second.size() )
-							++i;
-						else
-							x->second.erase(i++);
-					}
+					cleanTimer->start(EXPIRY_YIELD, true);
+					return;
 				}
 			}
-#endif
+			uniqueEPGKey key = services.back();
+			services.pop_back();
+			eventCache::iterator DBIt = eventDB.find(key);
+			// gone or rescheduled since it was put into this bucket
+			if (DBIt == eventDB.end() || DBIt->second.expiry != bucket)
+				continue;
+			DBIt->second.expiry = 0;
+			expireService(key, DBIt->second, now);
+			scheduleExpiry(key, DBIt->second);
 		}
+		m_expiry.erase(m_expiry.begin());
 	}
+
+	// the pages of released descriptors are reclaimed a bit at a time, so a
+	// single run doesn't stall the readers for long
+	int moved = eventData::descriptors.compact(COMPACT_BUDGET);
+	if (moved)
+		eDebug("[EPGC] compacted %d descriptor bytes, %d descriptors in %d pages, %d of %d bytes live",
+			moved, eventData::descriptors.size(), eventData::descriptors.pages(),
+			eventData::descriptors.liveBytes(), eventData::descriptors.usedBytes());
+
+	// fold a grown journal into a new epg.dat, replaying it would get slow
+	if (m_journal.isOpen() && m_journal.size() > std::max(JOURNAL_COMPACT, eventData::CacheSize / 4))
+		startSnapshot();
 	cleanTimer->start(CLEAN_INTERVAL,true);
 }
 
@@ -1146,10 +2060,11 @@ eEPGCache::~eEPGCache()
 {
 	messages.send(Message::quit);
 	kill(); // waiting for thread shutdown
-	singleLock s(cache_lock);
+	m_snapshot.kill();
+	writeLock s;
 	for (eventCache::iterator evIt = eventDB.begin(); evIt != eventDB.end(); evIt++)
-		for (eventMap::iterator It = evIt->second.first.begin(); It != evIt->second.first.end(); It++)
-			delete It->second;
+		evIt->second.clear();
+	delete m_image;
 }
 
 void eEPGCache::gotMessage( const Message &msg )
@@ -1157,6 +2072,8 @@ void eEPGCache::gotMessage( const Message &msg )
 	switch (msg.type)
 	{
 		case Message::flush:
+			// queued events would otherwise be added again after the flush
+			commitQueued();
 			flushEPG(msg.service);
 			break;
 		case Message::startChannel:
@@ -1288,6 +2205,7 @@ void eEPGCache::thread()
 	cleanLoop();
 	runLoop();
 	save();
+	m_snapshot.kill(); // wait for the snapshot to complete
 	m_running = false;
 }
 
@@ -1298,19 +2216,17 @@ void eEPGCache::clear()
 	flushEPG();
 }
 
-const static unsigned int EPG_MAGIC = 0x98765432;
-
-void eEPGCache::load()
+/**
+ * @brief Read the epg.dat snapshot. Acquire the cache lock before calling.
+ *
+ * @return the first journal with changes which are not in the snapshot
+ */
+unsigned int eEPGCache::loadSnapshot()
 {
-#ifdef EPG_DEBUG
-	eDebug("[EPGC] load()");
-#endif
-	if (m_filename.empty())
-		m_filename = "/hdd/epg.dat";
+	unsigned int journal = 0;
 	const char* EPGDAT = m_filename.c_str();
 	std::string filenamex = m_filename + ".loading";
 	const char* EPGDATX = filenamex.c_str();
-	singleLock s(cache_lock);
 	FILE *f = fopen(EPGDAT, "rb");
 	int renameResult;
 	if (f == NULL)
@@ -1322,7 +2238,7 @@ void eEPGCache::load()
 		if (f == NULL)
 		{
 			eDebug("[EPGC] %s not found, giving up", EPGDAT);
-			return;
+			return 0;
 		}
 		renameResult = -1;
 	}
@@ -1342,21 +2258,45 @@ void eEPGCache::load()
 		{
 			eDebug("[EPGC] epg file load failed magic test expected 0x%08x, got 0x%08x (%m)", EPG_MAGIC, magic);
 			fclose(f);
-			return;
+			return 0;
 		}
 		char text1[13];
 		fread( text1, 13, 1, f);
-		if ( !memcmp( text1, "ENIGMA_EPG_V7", 13) )
+		if ( !memcmp( text1, EPG_IMAGE_VERSION, 13) )
+		{
+			eEPGImage *image = eEPGImage::open(fileno(f), EPGDAT);
+			fclose(f);
+			if (!image)
+				return 0;
+			dropImage(); // reload, forget the previous mapping
+			m_image = image;
+			// searches find the events of the image through its titles
+			indexImageTitles(true);
+			// services we already have in the heap cache take precedence
+			for (eventCache::iterator it(eventDB.begin()); it != eventDB.end(); ++it)
+			{
+				int index = m_image->findService(it->first);
+				if (index >= 0)
+					m_image->claim(index);
+			}
+			loadImagePrivate();
+			journal = m_image->journal();
+			eDebug("[EPGC] %d events of %d services mapped from %s (%d bytes)",
+				m_image->eventCount(), m_image->serviceCount(), EPGDAT, (int)m_image->size());
+			f = NULL;
+		}
+		else if ( !memcmp( text1, "ENIGMA_EPG_V7", 13) )
 		{
 			fread( &size, sizeof(int), 1, f);
 			while(size--)
 			{
 				uniqueEPGKey key;
-				eventMap evMap;
-				timeMap tmMap;
 				int size=0;
 				fread( &key, sizeof(uniqueEPGKey), 1, f);
 				fread( &size, sizeof(int), 1, f);
+				eventStore &servicemap = eventDB[key];
+				servicemap.service = key;
+				servicemap.reserve(size);
 				while(size--)
 				{
 					__u8 len=0;
@@ -1365,16 +2305,28 @@ void eEPGCache::load()
 					fread( &type, sizeof(__u8), 1, f);
 					fread( &len, sizeof(__u8), 1, f);
 					event = new eventData(0, len, type);
-					event->EITdata = new __u8[len];
+					event->EITdata = eventData::allocData(len);
 					eventData::CacheSize+=len;
 					fread( event->EITdata, len, 1, f);
-					evMap[ event->getEventID() ]=event;
-					tmMap[ event->getStartTime() ]=event;
+					if (servicemap.findId(event->getEventID()) || servicemap.findTime(event->getStartTime()))
+					{
+						// duplicate entry, its descriptors are not loaded yet so don't release them
+						eventData::freeData(event->EITdata, len);
+						eventData::CacheSize-=len;
+						event->ByteSize = 0;
+						delete event;
+						continue;
+					}
+					servicemap.insert(event->getStartTime(), event->getEventID(), event);
 					++cnt;
 				}
-				eventDB[key]=serviceMap(evMap,tmMap);
+				touchService(key, servicemap);
 			}
 			eventData::load(f);
+			// the titles are only known now, enter the events again
+			for (eventCache::iterator it(eventDB.begin()); it != eventDB.end(); ++it)
+				for (eventMap::iterator i(it->second.byId.begin()); i != it->second.byId.end(); ++i)
+					it->second.indexTitles(i->second, true);
 			eDebug("[EPGC] %d events read from %s", cnt, EPGDAT);
 #ifdef ENABLE_PRIVATE_EPG
 			char text2[11];
@@ -1385,83 +2337,567 @@ void eEPGCache::load()
 				fread( &size, sizeof(int), 1, f);
 				while(size--)
 				{
-					int size=0;
-					uniqueEPGKey key;
-					fread( &key, sizeof(uniqueEPGKey), 1, f);
-					eventMap &evMap=eventDB[key].first;
-					fread( &size, sizeof(int), 1, f);
-					while(size--)
+					int size=0;
+					uniqueEPGKey key;
+					fread( &key, sizeof(uniqueEPGKey), 1, f);
+					eventStore &servicemap=eventDB[key];
+					servicemap.service = key;
+					fread( &size, sizeof(int), 1, f);
+					while(size--)
+					{
+						int size;
+						int content_id;
+						fread( &content_id, sizeof(int), 1, f);
+						fread( &size, sizeof(int), 1, f);
+						while(size--)
+						{
+							time_t time1, time2;
+							__u16 event_id;
+							fread( &time1, sizeof(time_t), 1, f);
+							fread( &time2, sizeof(time_t), 1, f);
+							fread( &event_id, sizeof(__u16), 1, f);
+							content_time_tables[key][content_id][time1]=std::pair<time_t, __u16>(time2, event_id);
+							eventData *evt = servicemap.findId(event_id);
+							if (evt)
+								evt->type = PRIVATE;
+						}
+					}
+				}
+			}
+#endif // ENABLE_PRIVATE_EPG
+		}
+		else
+			eDebug("[EPGC] don't read old epg database");
+		if (f)
+		{
+			posix_fadvise(fileno(f), 0, 0, POSIX_FADV_DONTNEED);
+			fclose(f);
+		}
+		// We got this far, so the EPG file is okay.
+		if (renameResult == 0)
+		{
+			renameResult = rename(EPGDATX, EPGDAT);
+			if (renameResult) eDebug("[EPGC] failed to rename epg.dat back");
+		}
+	}
+	return journal;
+}
+
+void eEPGCache::load()
+{
+#ifdef EPG_DEBUG
+	eDebug("[EPGC] load()");
+#endif
+	if (m_filename.empty())
+		m_filename = "/hdd/epg.dat";
+	writeLock s;
+	unsigned int journal = loadSnapshot();
+	// a reload keeps the running journal, the cache already has its changes
+	if (!m_journal.isOpen())
+		openJournal(journal);
+#ifdef EPG_DEBUG
+	eDebug("[EPGC] load() - finished");
+#endif
+}
+
+/**
+ * @brief Apply the journals written after the snapshot to the cache and
+ * start a new one. Acquire the cache lock before calling.
+ *
+ * @param first the first journal which is not in the loaded snapshot
+ */
+void eEPGCache::openJournal(unsigned int first)
+{
+	std::vector<unsigned int> numbers;
+	eEPGJournal::list(m_filename, numbers);
+	unsigned int next = std::max(first, 1U);
+	off_t pending = 0;
+	for (std::vector<unsigned int>::iterator it(numbers.begin()); it != numbers.end(); ++it)
+	{
+		std::string name = eEPGJournal::filename(m_filename, *it);
+		if (*it < first)
+		{
+			unlink(name.c_str()); // already in the snapshot
+			continue;
+		}
+		std::vector<__u8> payload;
+		if (eEPGJournal::read(name, payload))
+		{
+			replayJournal(payload);
+			eDebug("[EPGC] replayed %d bytes of %s", (int)payload.size(), name.c_str());
+		}
+		struct stat st;
+		if (!stat(name.c_str(), &st))
+			pending += st.st_size;
+		next = *it + 1;
+	}
+	m_journal.open(m_filename, next, pending);
+}
+
+/**
+ * @brief Redo the changes recorded in a journal. Acquire the cache lock before calling.
+ */
+void eEPGCache::replayJournal(const std::vector<__u8> &payload)
+{
+	if (payload.empty())
+		return;
+	eEPGJournal::record r;
+	const __u8 *end = &payload[0] + payload.size();
+	for (const __u8 *p = &payload[0]; (p = eEPGJournal::next(p, end, r)); )
+	{
+		uniqueEPGKey key(r.sid, r.onid, r.tsid);
+		switch (r.op)
+		{
+		case eEPGJournal::EVENT:
+		{
+			eventData::staged event;
+			memcpy(event.header, r.eit, 10);
+			for (int i = 0; i < r.count; ++i)
+			{
+				__u32 crc;
+				memcpy(&crc, r.eit + 10 + i * 4, 4);
+				event.add(crc, r.descr[i], false);
+			}
+			eventStore &servicemap = getService(key);
+			__u16 event_id = (r.eit[0] << 8) | r.eit[1];
+			time_t TM = parseDVBtime(r.eit[2], r.eit[3], r.eit[4], r.eit[5], r.eit[6]);
+			// like commitBatch, the event replaces the one with its id and the one at its time
+			eventData *old = servicemap.findId(event_id);
+			if (old)
+				delete servicemap.remove(old->getStartTime());
+			delete servicemap.remove(TM);
+			servicemap.insert(TM, event_id, new eventData(event, r.type));
+			break;
+		}
+		case eEPGJournal::REMOVE:
+		{
+			eventCache::iterator it = findService(key);
+			if (it != eventDB.end())
+				delete it->second.remove(r.start);
+			break;
+		}
+		case eEPGJournal::FLUSH:
+			flushEPG(key);
+			break;
+		}
+	}
+}
+
+static void writePadding(FILE *f, off_t page_size)
+{
+	static const char zero[512] = { 0 };
+	off_t pad = (page_size - ftello(f) % page_size) % page_size;
+	while (pad > 0)
+	{
+		size_t n = pad > (off_t)sizeof(zero) ? sizeof(zero) : pad;
+		fwrite(zero, n, 1, f);
+		pad -= n;
+	}
+}
+
+static void beginSection(FILE *f, epgImageHeader &header, int which)
+{
+	writePadding(f, header.page_size);
+	header.section[which].offset = ftello(f);
+}
+
+static void endSection(FILE *f, epgImageHeader &header, int which, uint32_t count)
+{
+	header.section[which].size = ftello(f) - header.section[which].offset;
+	header.section[which].count = count;
+}
+
+struct less_event_id
+{
+	const std::vector<epgImageEvent> &events;
+	less_event_id(const std::vector<epgImageEvent> &events): events(events) {}
+	bool operator()(uint32_t a, uint32_t b) const
+	{
+		return events[a].event_id < events[b].event_id;
+	}
+};
+
+struct less_title_event
+{
+	bool operator()(const epgImageTitle &a, const epgImageTitle &b) const
+	{
+		return a.crc < b.crc || (a.crc == b.crc && a.event < b.event);
+	}
+};
+
+/**
+ * @brief Write the cache as ENIGMA_EPG_V9 image. Services which are still
+ * served from the current image are copied over without being materialized.
+ * The cache lock is only held while a chunk of events is copied, the image
+ * is a consistent snapshot together with the journals written after it: the
+ * journal is rotated first and replaying a change again has no effect.
+ *
+ * @param f file to write to, positioned at the start
+ * @param descr scratch file for the descriptors, which are only known at the end
+ * @param journal receives the first journal which is not in the image
+ * @return number of events written
+ */
+int eEPGCache::writeImage(FILE *f, FILE *descr, unsigned int &journal)
+{
+	epgImageHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = EPG_MAGIC;
+	memcpy(header.version, "UNFINISHED_V9", 13);
+	header.page_size = sysconf(_SC_PAGESIZE);
+	header.sections = EPG_IMAGE_SECTIONS;
+	fwrite(&header, sizeof(header), 1, f);
+
+	// all services sorted by key, the ones in the heap cache and the unclaimed ones of the image
+	std::set<uniqueEPGKey> order;
+	{
+		singleLock s(cache_lock);
+		if (m_journal.isOpen())
+			m_journal.rotate();
+		header.journal = journal = m_journal.isOpen() ? m_journal.number() : 0;
+		for (eventCache::iterator it(eventDB.begin()); it != eventDB.end(); ++it)
+			order.insert(it->first);
+		if (m_image)
+		{
+			const epgImageService *svc = m_image->services();
+			for (int i = 0; i < m_image->serviceCount(); ++i)
+			{
+				if (!m_image->isClaimed(i))
+					order.insert(uniqueEPGKey(svc[i].sid, svc[i].onid, svc[i].tsid));
+			}
+		}
+	}
+
+	time_t now = ::time(0) - historySeconds;
+	std::vector<epgImageService> services;
+	std::vector<epgImageEvent> events;
+	std::map<__u32, uint32_t> descriptors; // crc -> offset in descr
+	std::set<__u32> title_crcs; // the descriptors which are titles
+	std::vector<epgImageTitle> titles;
+	uint32_t data_offset = 0, descr_offset = 0;
+	std::vector<__u8> data, descr_data;
+
+	beginSection(f, header, EPG_IMAGE_EVENTDATA);
+	std::set<uniqueEPGKey>::iterator it(order.begin());
+	while (it != order.end())
+	{
+		{
+			singleLock s(cache_lock);
+			// whole services, until the chunk is full
+			for (size_t chunk = events.size(); it != order.end() && events.size() - chunk < SAVE_CHUNK; ++it)
+			{
+				epgImageService svc;
+				svc.sid = it->sid;
+				svc.onid = it->onid;
+				svc.tsid = it->tsid;
+				svc.first_event = events.size();
+
+				std::vector<std::pair<const __u8*, epgImageEvent> > source;
+				eventCache::iterator DBIt = eventDB.find(*it);
+				int index = (DBIt == eventDB.end() && m_image) ? m_image->findService(*it) : -1;
+				if (DBIt != eventDB.end())
+				{
+					timeMap &timemap = DBIt->second.byTime;
+					for (timeMap::iterator time_it(timemap.begin()); time_it != timemap.end(); ++time_it)
 					{
-						int size;
-						int content_id;
-						fread( &content_id, sizeof(int), 1, f);
-						fread( &size, sizeof(int), 1, f);
-						while(size--)
+						epgImageEvent ev;
+						ev.start_time = time_it->first;
+						ev.type = time_it->second->type;
+						ev.len = time_it->second->ByteSize;
+						source.push_back(std::make_pair((const __u8*)time_it->second->EITdata, ev));
+					}
+				}
+				else if (index >= 0 && !m_image->isClaimed(index))
+				{
+					const epgImageService &isvc = m_image->services()[index];
+					const epgImageEvent *iev = m_image->events() + isvc.first_event;
+					for (unsigned int i = 0; i < isvc.event_count; ++i, ++iev)
+					{
+						if (!m_image->isValid(*iev))
+							continue;
+						const __u8 *d = m_image->eventPayload(*iev);
+						int duration = fromBCD(d[7])*3600+fromBCD(d[8])*60+fromBCD(d[9]);
+						if (iev->start_time + duration < now)
+							continue; // outdated, nobody will clean it up in the image
+						source.push_back(std::make_pair(d, *iev));
+					}
+				}
+				// else flushed since the start of the snapshot
+
+				for (unsigned int i = 0; i < source.size(); ++i)
+				{
+					const __u8 *d = source[i].first;
+					epgImageEvent &ev = source[i].second;
+					ev.event_id = (d[0] << 8) | d[1];
+					ev.data_offset = data_offset;
+					data.insert(data.end(), d, d + ev.len);
+					data_offset += ev.len;
+					events.push_back(ev);
+					const __u32 *p = (const __u32*)(d + 10);
+					for (int tmp = ev.len - 10; tmp > 3; tmp -= 4, ++p)
+					{
+						if (descriptors.find(*p) != descriptors.end())
 						{
-							time_t time1, time2;
-							__u16 event_id;
-							fread( &time1, sizeof(time_t), 1, f);
-							fread( &time2, sizeof(time_t), 1, f);
-							fread( &event_id, sizeof(__u16), 1, f);
-							content_time_tables[key][content_id][time1]=std::pair<time_t, __u16>(time2, event_id);
-							eventMap::iterator it =
-								evMap.find(event_id);
-							if (it != evMap.end())
-								it->second->type = PRIVATE;
+							if (title_crcs.count(*p))
+							{
+								epgImageTitle title = { *p, (uint32_t)events.size() - 1 };
+								titles.push_back(title);
+							}
+							continue;
+						}
+						const __u8 *descr = eventData::getDescriptor(*p);
+						if (!descr)
+						{
+							eventData::cacheCorrupt("eEPGCache::writeImage");
+							continue;
+						}
+						// the same test as eEPGTitleIndex::add()
+						if (descr[0] == 0x4D && descr[5])
+						{
+							epgImageTitle title = { *p, (uint32_t)events.size() - 1 };
+							titles.push_back(title);
+							title_crcs.insert(*p);
 						}
+						descriptors[*p] = descr_offset;
+						descr_data.insert(descr_data.end(), descr, descr + descr[1] + 2);
+						descr_offset += descr[1] + 2;
 					}
 				}
+				svc.event_count = events.size() - svc.first_event;
+				if (svc.event_count)
+					services.push_back(svc);
 			}
-#endif // ENABLE_PRIVATE_EPG
 		}
-		else
-			eDebug("[EPGC] don't read old epg database");
-		posix_fadvise(fileno(f), 0, 0, POSIX_FADV_DONTNEED);
-		fclose(f);
-		// We got this far, so the EPG file is okay.
-		if (renameResult == 0)
+		// the copies are written without the lock
+		if (!data.empty())
+			fwrite(&data[0], data.size(), 1, f);
+		if (!descr_data.empty())
+			fwrite(&descr_data[0], descr_data.size(), 1, descr);
+		data.clear();
+		descr_data.clear();
+	}
+	endSection(f, header, EPG_IMAGE_EVENTDATA, events.size());
+
+	beginSection(f, header, EPG_IMAGE_EVENTS);
+	if (!events.empty())
+		fwrite(&events[0], sizeof(epgImageEvent), events.size(), f);
+	endSection(f, header, EPG_IMAGE_EVENTS, events.size());
+
+	beginSection(f, header, EPG_IMAGE_EVENTIDS);
+	std::vector<uint32_t> ids;
+	for (unsigned int i = 0; i < services.size(); ++i)
+	{
+		ids.clear();
+		for (uint32_t ev = services[i].first_event; ev < services[i].first_event + services[i].event_count; ++ev)
+			ids.push_back(ev);
+		std::sort(ids.begin(), ids.end(), less_event_id(events));
+		fwrite(&ids[0], sizeof(uint32_t), ids.size(), f);
+	}
+	endSection(f, header, EPG_IMAGE_EVENTIDS, events.size());
+
+	beginSection(f, header, EPG_IMAGE_SERVICES);
+	if (!services.empty())
+		fwrite(&services[0], sizeof(epgImageService), services.size(), f);
+	endSection(f, header, EPG_IMAGE_SERVICES, services.size());
+	header.service_count = services.size();
+
+	beginSection(f, header, EPG_IMAGE_DESCRIPTORDATA);
+	char buf[16384];
+	size_t rd;
+	fflush(descr);
+	rewind(descr);
+	while ((rd = fread(buf, 1, sizeof(buf), descr)) > 0)
+		fwrite(buf, rd, 1, f);
+	endSection(f, header, EPG_IMAGE_DESCRIPTORDATA, descriptors.size());
+
+	std::vector<epgImageDescriptor> descr_index;
+	for (std::map<__u32, uint32_t>::iterator it(descriptors.begin()); it != descriptors.end(); ++it)
+	{
+		epgImageDescriptor d;
+		d.crc = it->first;
+		d.data_offset = it->second;
+		descr_index.push_back(d);
+	}
+
+	beginSection(f, header, EPG_IMAGE_DESCRIPTORS);
+	if (!descr_index.empty())
+		fwrite(&descr_index[0], sizeof(epgImageDescriptor), descr_index.size(), f);
+	endSection(f, header, EPG_IMAGE_DESCRIPTORS, descr_index.size());
+
+	beginSection(f, header, EPG_IMAGE_PRIVATE);
+	int private_count = 0;
+#ifdef ENABLE_PRIVATE_EPG
+	// serialized under the lock, written after it like the event chunks
+	std::vector<__u8> private_data;
+#define PUT(var) \
+	private_data.insert(private_data.end(), (const __u8*)&(var), (const __u8*)&(var) + sizeof(var));
+	{
+		singleLock s(cache_lock);
+		int size = private_count = content_time_tables.size();
+		PUT(size);
+		for (contentMaps::iterator a = content_time_tables.begin(); a != content_time_tables.end(); ++a)
 		{
-			renameResult = rename(EPGDATX, EPGDAT);
-			if (renameResult) eDebug("[EPGC] failed to rename epg.dat back");
+			contentMap &content_time_table = a->second;
+			PUT(a->first);
+			int size = content_time_table.size();
+			PUT(size);
+			for (contentMap::iterator i = content_time_table.begin(); i != content_time_table.end(); ++i )
+			{
+				int size = i->second.size();
+				PUT(i->first);
+				PUT(size);
+				for ( contentTimeMap::iterator it(i->second.begin());
+					it != i->second.end(); ++it )
+				{
+					PUT(it->first);
+					PUT(it->second.first);
+					PUT(it->second.second);
+				}
+			}
 		}
 	}
-#ifdef EPG_DEBUG
-	eDebug("[EPGC] load() - finished");
+#undef PUT
+	fwrite(&private_data[0], private_data.size(), 1, f);
+#endif
+	endSection(f, header, EPG_IMAGE_PRIVATE, private_count);
+
+	beginSection(f, header, EPG_IMAGE_TITLES);
+	std::sort(titles.begin(), titles.end(), less_title_event());
+	if (!titles.empty())
+		fwrite(&titles[0], sizeof(epgImageTitle), titles.size(), f);
+	endSection(f, header, EPG_IMAGE_TITLES, titles.size());
+	writePadding(f, header.page_size);
+
+	// write the header with the version string after all
+	// other data has been written to disk.
+	fflush(f);
+	fsync(fileno(f));
+	memcpy(header.version, EPG_IMAGE_VERSION, 13);
+	fseeko(f, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, f);
+	return events.size();
+}
+
+/**
+ * @brief Parse the private epg content tables of the mapped image.
+ */
+void eEPGCache::loadImagePrivate()
+{
+#ifdef ENABLE_PRIVATE_EPG
+	const __u8 *p = m_image->section(EPG_IMAGE_PRIVATE);
+	const __u8 *end = p + m_image->sectionSize(EPG_IMAGE_PRIVATE);
+#define GET(var) \
+	if (p + sizeof(var) > end) goto corrupt; \
+	memcpy(&var, p, sizeof(var)); p += sizeof(var);
+	int size = 0;
+	GET(size);
+	while (size-- > 0)
+	{
+		int size = 0;
+		uniqueEPGKey key;
+		GET(key);
+		GET(size);
+		while (size-- > 0)
+		{
+			int size = 0;
+			int content_id;
+			GET(content_id);
+			GET(size);
+			while (size-- > 0)
+			{
+				time_t time1, time2;
+				__u16 event_id;
+				GET(time1);
+				GET(time2);
+				GET(event_id);
+				content_time_tables[key][content_id][time1]=std::pair<time_t, __u16>(time2, event_id);
+			}
+		}
+	}
+#undef GET
+	return;
+corrupt:
+	eDebug("[EPGC] private epg data in image is truncated");
 #endif
 }
 
+/**
+ * @brief Make the changes to the cache durable. They are already in the
+ * journal, so only the journal is synced and a new epg.dat snapshot is
+ * written in the background.
+ */
 void eEPGCache::save()
 {
 #ifdef EPG_DEBUG
 	eDebug("[EPGC] save()");
 #endif
-	const char* EPGDAT = m_filename.c_str();
 	if (eventData::isCacheCorrupt)
 		return;
-	// only save epg.dat if it is not empty
-	if (eventData::CacheSize < 1)
-		return;
+	m_journal.flush(true);
+	startSnapshot();
+}
 
-	singleLock s(cache_lock);
-	/* create empty file */
-	FILE *f = fopen(EPGDAT, "wb");
+/**
+ * @brief Start writing a snapshot, unless one is being written already.
+ */
+void eEPGCache::startSnapshot()
+{
+	eSingleLocker l(m_snapshot_lock);
+	if (m_snapshot.runAsync())
+		eDebug("[EPGC] epg.dat snapshot still in progress");
+}
+
+void eEPGCache::snapshotThread::thread()
+{
+	hasStarted();
+	nice(4);
+	m_cache->writeSnapshot();
+}
+
+/**
+ * @brief Write the cache to a new epg.dat and drop the journals it
+ * contains. Runs without holding the cache lock for long.
+ */
+void eEPGCache::writeSnapshot()
+{
+	std::string filename;
+	off64_t needed;
+	{
+		singleLock s(cache_lock);
+		// only save epg.dat if it is not empty
+		if (eventData::isCacheCorrupt || (eventData::CacheSize < 1 && !m_image))
+			return;
+		filename = m_filename;
+		needed = eventData::CacheSize;
+		if (m_image)
+			needed += m_image->size();
+	}
+	const char* EPGDAT = filename.c_str();
+
+	/*
+	 * the current epg.dat may still be mapped, so never truncate it.
+	 * write a new file and move it over the old one when complete.
+	 */
+	std::string tmpname = std::string(EPGDAT) + ".new";
+	FILE *f = fopen(tmpname.c_str(), "wb");
 	if (!f)
 	{
-		eDebug("[EPGC] Failed to open '%s' (%m)", EPGDAT);
+		eDebug("[EPGC] Failed to open '%s' (%m)", tmpname.c_str());
 		EPGDAT = EPGDAT_IN_FLASH;
-		f = fopen(EPGDAT, "wb");
+		tmpname = std::string(EPGDAT) + ".new";
+		f = fopen(tmpname.c_str(), "wb");
 		if (!f)
 		{
-			eDebug("[EPGC] Failed to open '%s' (%m)", EPGDAT);
+			eDebug("[EPGC] Failed to open '%s' (%m)", tmpname.c_str());
 			return;
 		}
 	}
 
-	char* buf = realpath(EPGDAT, NULL);
+	char* buf = realpath(tmpname.c_str(), NULL);
 	if (!buf)
 	{
-		eDebug("[EPGC] realpath to '%s' failed in save (%m)", EPGDAT);
+		eDebug("[EPGC] realpath to '%s' failed in save (%m)", tmpname.c_str());
 		fclose(f);
+		unlink(tmpname.c_str());
 		return;
 	}
 
@@ -1474,6 +2910,7 @@ void eEPGCache::save()
 	if (statfs(buf, &st) < 0) {
 		eDebug("[EPGC] statfs '%s' failed in save (%m)", buf);
 		fclose(f);
+		unlink(tmpname.c_str());
 		free(buf);
 		return;
 	}
@@ -1481,74 +2918,44 @@ void eEPGCache::save()
 	// check for enough free space on storage
 	tmp=st.f_bfree;
 	tmp*=st.f_bsize;
-	if ( tmp < (eventData::CacheSize*12)/10 ) // 20% overhead
+	if ( tmp < (needed*12)/10 ) // 20% overhead
 	{
-		eDebug("[EPGC] not enough free space at path '%s' %lld bytes avail but %d needed", buf, tmp, (eventData::CacheSize*12)/10);
+		eDebug("[EPGC] not enough free space at path '%s' %lld bytes avail but %lld needed", buf, tmp, (needed*12)/10);
 		fclose(f);
+		unlink(tmpname.c_str());
 		free(buf);
 		return;
 	}
 	free(buf);
 
+	std::string descrname = tmpname + ".descr";
+	FILE *descr = fopen(descrname.c_str(), "w+b");
+	if (!descr)
+	{
+		eDebug("[EPGC] Failed to open '%s' (%m)", descrname.c_str());
+		fclose(f);
+		unlink(tmpname.c_str());
+		return;
+	}
+	unlink(descrname.c_str()); // only needed while it is open
 
-	int cnt=0;
-	unsigned int magic = EPG_MAGIC;
-	fwrite(&magic, sizeof(int), 1, f);
-	const char *text = "UNFINISHED_V7";
-	fwrite( text, 13, 1, f );
-	int size = eventDB.size();
-	fwrite( &size, sizeof(int), 1, f );
-	for (eventCache::iterator service_it(eventDB.begin()); service_it != eventDB.end(); ++service_it)
-	{
-		timeMap &timemap = service_it->second.second;
-		fwrite( &service_it->first, sizeof(uniqueEPGKey), 1, f);
-		size = timemap.size();
-		fwrite( &size, sizeof(int), 1, f);
-		for (timeMap::iterator time_it(timemap.begin()); time_it != timemap.end(); ++time_it)
-		{
-			__u8 len = time_it->second->ByteSize;
-			fwrite( &time_it->second->type, sizeof(__u8), 1, f );
-			fwrite( &len, sizeof(__u8), 1, f);
-			fwrite( time_it->second->EITdata, len, 1, f);
-			++cnt;
-		}
+	unsigned int journal = 0;
+	int cnt = writeImage(f, descr, journal);
+	fclose(descr);
+	if (fclose(f) || rename(tmpname.c_str(), EPGDAT))
+	{
+		eDebug("[EPGC] failed to write '%s' (%m)", EPGDAT);
+		unlink(tmpname.c_str());
+		return;
 	}
+	// load() prefers the configured file, journals can only go when it holds them
+	if (filename == EPGDAT)
+		eEPGJournal::removeOlder(filename, journal);
 #ifdef EPG_DEBUG
 	eDebug("[EPGC] %d events written to %s", cnt, EPGDAT);
+#else
+	(void)cnt;
 #endif
-	eventData::save(f);
-#ifdef ENABLE_PRIVATE_EPG
-	const char* text3 = "PRIVATE_EPG";
-	fwrite( text3, 11, 1, f );
-	size = content_time_tables.size();
-	fwrite( &size, sizeof(int), 1, f);
-	for (contentMaps::iterator a = content_time_tables.begin(); a != content_time_tables.end(); ++a)
-	{
-		contentMap &content_time_table = a->second;
-		fwrite( &a->first, sizeof(uniqueEPGKey), 1, f);
-		int size = content_time_table.size();
-		fwrite( &size, sizeof(int), 1, f);
-		for (contentMap::iterator i = content_time_table.begin(); i != content_time_table.end(); ++i )
-		{
-			int size = i->second.size();
-			fwrite( &i->first, sizeof(int), 1, f);
-			fwrite( &size, sizeof(int), 1, f);
-			for ( contentTimeMap::iterator it(i->second.begin());
-				it != i->second.end(); ++it )
-			{
-				fwrite( &it->first, sizeof(time_t), 1, f);
-				fwrite( &it->second.first, sizeof(time_t), 1, f);
-				fwrite( &it->second.second, sizeof(__u16), 1, f);
-			}
-		}
-	}
-#endif
-	// write version string after binary data
-	// has been written to disk.
-	fsync(fileno(f));
-	fseek(f, sizeof(int), SEEK_SET);
-	fwrite("ENIGMA_EPG_V7", 13, 1, f);
-	fclose(f);
 }
 
 eEPGCache::channel_data::channel_data(eEPGCache *ml)
@@ -1577,6 +2984,7 @@ bool eEPGCache::channel_data::finishEPG()
 {
 	if (!isRunning)  // epg ready
 	{
+		cache->commitQueued();
 #ifdef EPG_DEBUG
 		eDebug("[EPGC] stop caching events(%ld)", ::time(0));
 #endif
@@ -2112,7 +3520,7 @@ void eEPGCache::channel_data::readData( const __u8 *data, eit_type_t source)
 				else
 					calcedSections.insert(tmpval|(i&0xFF));
 			}
-			cache->sectionRead(data, source, this);
+			cache->queueSection(data, source, this);
 		}
 	}
 }
@@ -2231,46 +3639,43 @@ void eEPGCache::channel_data::readFreeSatScheduleOtherData( const __u8 *data)
 	{
 		m_FreesatTablesToComplete--;
 	}
-	cache->sectionRead(data, FREESAT_SCHEDULE_OTHER, this);
+	cache->queueSection(data, FREESAT_SCHEDULE_OTHER, this);
 }
 #endif
 
-RESULT eEPGCache::lookupEventTime(const eServiceReference &service, time_t t, const eventData *&result, int direction)
+RESULT eEPGCache::lookupEventTime(const eServiceReference &service, time_t t, eventData &result, int direction)
 // if t == -1 we search the current event...
 {
 	uniqueEPGKey key(handleGroup(service));
 
 	// check if EPG for this service is ready...
-	eventCache::iterator It = eventDB.find( key );
-	if ( It != eventDB.end() && !It->second.first.empty() ) // entrys cached ?
+	serviceEvents events;
+	if ( readService(key, events) ) // entrys cached ?
 	{
 		if (t==-1)
 			t = ::time(0);
-		timeMap::iterator i = direction <= 0 ? It->second.second.lower_bound(t) :  // find > or equal
-			It->second.second.upper_bound(t); // just >
-		if ( i != It->second.second.end() )
+		size_t i = direction <= 0 ? events.lowerBound(t) :  // find > or equal
+			events.upperBound(t); // just >
+		if ( i != events.size() )
 		{
-			if ( direction < 0 || (direction == 0 && i->first > t) )
+			if ( direction < 0 || (direction == 0 && events.startTime(i) > t) )
 			{
-				timeMap::iterator x = i;
-				--x;
-				if ( x != It->second.second.end() )
+				if ( i == 0 )
+					return -1;
+				size_t x = i - 1;
+				time_t start_time = events.startTime(x);
+				if (!events.get(x, result))
+					return -1;
+				if (direction >= 0)
 				{
-					time_t start_time = x->first;
-					if (direction >= 0)
-					{
-						if (t < start_time)
-							return -1;
-						if (t > (start_time+x->second->getDuration()))
-							return -1;
-					}
-					i = x;
+					if (t < start_time)
+						return -1;
+					if (t > (start_time+result.getDuration()))
+						return -1;
 				}
-				else
-					return -1;
+				return 0;
 			}
-			result = i->second;
-			return 0;
+			return events.get(i, result) ? 0 : -1;
 		}
 	}
 	return -1;
@@ -2279,57 +3684,52 @@ RESULT eEPGCache::lookupEventTime(const eServiceReference &service, time_t t, co
 RESULT eEPGCache::lookupEventTime(const eServiceReference &service, time_t t, const eit_event_struct *&result, int direction)
 {
 	singleLock s(cache_lock);
-	const eventData *data=0;
+	eventData data;
 	RESULT ret = lookupEventTime(service, t, data, direction);
-	if ( !ret && data )
-		result = data->get();
+	if ( !ret )
+		result = data.get();
 	return ret;
 }
 
 RESULT eEPGCache::lookupEventTime(const eServiceReference &service, time_t t, Event *& result, int direction)
 {
 	singleLock s(cache_lock);
-	const eventData *data=0;
+	eventData data;
 	RESULT ret = lookupEventTime(service, t, data, direction);
-	if ( !ret && data )
-		result = new Event((uint8_t*)data->get());
+	if ( !ret )
+		result = new Event((uint8_t*)data.get());
 	return ret;
 }
 
 RESULT eEPGCache::lookupEventTime(const eServiceReference &service, time_t t, ePtr<eServiceEvent> &result, int direction)
 {
-	singleLock s(cache_lock);
-	const eventData *data=0;
-	RESULT ret = lookupEventTime(service, t, data, direction);
 	result = NULL;
-	if ( !ret && data )
+	eEPGEventView view;
+	std::vector<__u8> buffer;
 	{
-		Event ev((uint8_t*)data->get());
-		result = new eServiceEvent();
-		const eServiceReferenceDVB &ref = (const eServiceReferenceDVB&)service;
-		ret = result->parseFrom(&ev, (ref.getTransportStreamID().get()<<16)|ref.getOriginalNetworkID().get());
+		readLock r;
+		eventData data;
+		if (lookupEventTime(service, t, data, direction))
+			return -1;
+		// copy the raw event out, it is decoded without holding the lock
+		data.getView(view);
+		view.detach(buffer);
 	}
-	return ret;
+	result = new eServiceEvent();
+	const eServiceReferenceDVB &ref = (const eServiceReferenceDVB&)service;
+	return result->parseFrom(view, (ref.getTransportStreamID().get()<<16)|ref.getOriginalNetworkID().get());
 }
 
-RESULT eEPGCache::lookupEventId(const eServiceReference &service, int event_id, const eventData *&result )
+RESULT eEPGCache::lookupEventId(const eServiceReference &service, int event_id, eventData &result )
 {
 	uniqueEPGKey key(handleGroup(service));
 
-	eventCache::iterator It = eventDB.find( key );
-	if ( It != eventDB.end() && !It->second.first.empty() ) // entrys cached?
+	serviceEvents events;
+	if ( readService(key, events) ) // entrys cached?
 	{
-		eventMap::iterator i( It->second.first.find( event_id ));
-		if ( i != It->second.first.end() )
-		{
-			result = i->second;
+		if ( events.findId(event_id, result) )
 			return 0;
-		}
-		else
-		{
-			result = 0;
-			eDebug("[EPGC] event %04x not found in epgcache", event_id);
-		}
+		eDebug("[EPGC] event %04x not found in epgcache", event_id);
 	}
 	return -1;
 }
@@ -2337,90 +3737,118 @@ RESULT eEPGCache::lookupEventId(const eServiceReference &service, int event_id,
 RESULT eEPGCache::lookupEventId(const eServiceReference &service, int event_id, const eit_event_struct *&result)
 {
 	singleLock s(cache_lock);
-	const eventData *data=0;
+	eventData data;
 	RESULT ret = lookupEventId(service, event_id, data);
-	if ( !ret && data )
-		result = data->get();
+	if ( !ret )
+		result = data.get();
 	return ret;
 }
 
 RESULT eEPGCache::lookupEventId(const eServiceReference &service, int event_id, Event *& result)
 {
 	singleLock s(cache_lock);
-	const eventData *data=0;
+	eventData data;
 	RESULT ret = lookupEventId(service, event_id, data);
-	if ( !ret && data )
-		result = new Event((uint8_t*)data->get());
+	if ( !ret )
+		result = new Event((uint8_t*)data.get());
 	return ret;
 }
 
 RESULT eEPGCache::lookupEventId(const eServiceReference &service, int event_id, ePtr<eServiceEvent> &result)
 {
-	singleLock s(cache_lock);
-	const eventData *data=0;
-	RESULT ret = lookupEventId(service, event_id, data);
 	result = NULL;
-	if ( !ret && data )
+	eEPGEventView view;
+	std::vector<__u8> buffer;
 	{
-		Event ev((uint8_t*)data->get());
-		result = new eServiceEvent();
-		const eServiceReferenceDVB &ref = (const eServiceReferenceDVB&)service;
-		ret = result->parseFrom(&ev, (ref.getTransportStreamID().get()<<16)|ref.getOriginalNetworkID().get());
+		readLock r;
+		eventData data;
+		if (lookupEventId(service, event_id, data))
+			return -1;
+		data.getView(view);
+		view.detach(buffer);
 	}
-	return ret;
+	result = new eServiceEvent();
+	const eServiceReferenceDVB &ref = (const eServiceReferenceDVB&)service;
+	return result->parseFrom(view, (ref.getTransportStreamID().get()<<16)|ref.getOriginalNetworkID().get());
 }
 
-RESULT eEPGCache::startTimeQuery(const eServiceReference &service, time_t begin, int minutes)
+/**
+ * @brief Start a query for the events of @p service from @p begin on, the
+ * event running at @p begin included. Hold event_lock or the cache lock while calling.
+ *
+ * @param minutes length of the queried time span, -1 for all events
+ * @return false when there are no such events
+ */
+bool eEPGCache::startQuery(const eServiceReference &service, time_t begin, int minutes, timeQuery &query)
 {
-	singleLock s(cache_lock);
 	const eServiceReferenceDVB &ref = (const eServiceReferenceDVB&)handleGroup(service);
 	if (begin == -1)
 		begin = ::time(0);
-	eventCache::iterator It = eventDB.find(ref);
-	if ( It != eventDB.end() && It->second.second.size() )
+	serviceEvents events;
+	if ( !readService(ref, events) )
+		return false;
+	size_t cursor = events.lowerBound(begin);
+	if ( cursor != events.size() && events.startTime(cursor) != begin && cursor != 0 )
 	{
-		m_timemap_cursor = It->second.second.lower_bound(begin);
-		if ( m_timemap_cursor != It->second.second.end() )
-		{
-			if ( m_timemap_cursor->first != begin )
-			{
-				timeMap::iterator x = m_timemap_cursor;
-				--x;
-				if ( x != It->second.second.end() )
-				{
-					time_t start_time = x->first;
-					if ( begin > start_time && begin < (start_time+x->second->getDuration()))
-						m_timemap_cursor = x;
-				}
-			}
-		}
+		eventData x;
+		time_t start_time = events.startTime(cursor - 1);
+		if ( events.get(cursor - 1, x) && begin > start_time && begin < (start_time+x.getDuration()))
+			--cursor;
+	}
 
-		if (minutes != -1)
-			m_timemap_end = It->second.second.lower_bound(begin+minutes*60);
-		else
-			m_timemap_end = It->second.second.end();
+	query.service = ref;
+	query.cursor = cursor != events.size() ? events.startTime(cursor) : std::numeric_limits<time_t>::max();
+	if (minutes != -1)
+		query.end = begin+minutes*60;
+	else
+		query.end = std::numeric_limits<time_t>::max();
 
-		currentQueryTsidOnid = (ref.getTransportStreamID().get()<<16) | ref.getOriginalNetworkID().get();
-		return m_timemap_cursor == m_timemap_end ? -1 : 0;
-	}
-	return -1;
+	query.tsidonid = (ref.getTransportStreamID().get()<<16) | ref.getOriginalNetworkID().get();
+	return query.cursor < query.end;
 }
 
-RESULT eEPGCache::getNextTimeEntry(const eventData *& result)
+/**
+ * @brief Advance the cursor of @p query. The cursor is kept as a start
+ * time, so events added or removed in the meantime don't invalidate it.
+ * Hold event_lock or the cache lock while calling.
+ *
+ * @param evt is set to refer to the next event, only valid while the lock is held
+ * @return false when the query is exhausted
+ */
+bool eEPGCache::nextQueryEvent(timeQuery &query, eventData &evt)
 {
-	if ( m_timemap_cursor != m_timemap_end )
+	while ( query.cursor < query.end )
 	{
-		result = m_timemap_cursor++->second;
-		return 0;
+		serviceEvents events;
+		if ( !readService(query.service, events) )
+			break;
+		size_t i = events.lowerBound(query.cursor);
+		if ( i == events.size() || events.startTime(i) >= query.end )
+			break;
+		query.cursor = events.startTime(i) + 1;
+		// skip broken events of the image
+		if ( events.get(i, evt) )
+			return true;
 	}
-	return -1;
+	query.cursor = query.end;
+	return false;
+}
+
+RESULT eEPGCache::startTimeQuery(const eServiceReference &service, time_t begin, int minutes)
+{
+	eSingleLocker q(m_query_lock);
+	readLock r;
+	return startQuery(service, begin, minutes, m_query) ? 0 : -1;
 }
 
 RESULT eEPGCache::getNextTimeEntry(const eit_event_struct *&result)
 {
-	if ( m_timemap_cursor != m_timemap_end )
+	eSingleLocker q(m_query_lock);
+	singleLock s(cache_lock);
+	eventData evt;
+	if ( nextQueryEvent(m_query, evt) )
 	{
-		result = m_timemap_cursor++->second->get();
+		result = evt.get();
 		return 0;
 	}
 	return -1;
@@ -2428,9 +3856,12 @@ RESULT eEPGCache::getNextTimeEntry(const eit_event_struct *&result)
 
 RESULT eEPGCache::getNextTimeEntry(Event *&result)
 {
-	if ( m_timemap_cursor != m_timemap_end )
+	eSingleLocker q(m_query_lock);
+	singleLock s(cache_lock);
+	eventData evt;
+	if ( nextQueryEvent(m_query, evt) )
 	{
-		result = new Event((uint8_t*)m_timemap_cursor++->second->get());
+		result = new Event((uint8_t*)evt.get());
 		return 0;
 	}
 	return -1;
@@ -2438,18 +3869,32 @@ RESULT eEPGCache::getNextTimeEntry(Event *&result)
 
 RESULT eEPGCache::getNextTimeEntry(ePtr<eServiceEvent> &result)
 {
-	if ( m_timemap_cursor != m_timemap_end )
+	eSingleLocker q(m_query_lock);
+	eEPGEventView view;
+	std::vector<__u8> buffer;
 	{
-		Event ev((uint8_t*)m_timemap_cursor++->second->get());
-		result = new eServiceEvent();
-		return result->parseFrom(&ev, currentQueryTsidOnid);
+		readLock r;
+		eventData evt;
+		if ( !nextQueryEvent(m_query, evt) )
+			return -1;
+		evt.getView(view);
+		view.detach(buffer);
 	}
-	return -1;
+	result = new eServiceEvent();
+	return result->parseFrom(view, m_query.tsidonid);
 }
 
-void fillTuple(ePyObject tuple, const char *argstring, int argcount, ePyObject service_reference, eServiceEvent *ptr, ePyObject service_name, ePyObject nowTime, eventData *evData )
+void fillTuple(ePyObject tuple, const char *argstring, int argcount, ePyObject service_reference, const eEPGEventView *view, ePyObject service_name, ePyObject nowTime, int tsidonid )
 {
-	// eDebug("[EPGC] fillTuple arg=%s argcnt=%d, ptr=%d evData=%d", argstring, argcount, ptr ? 1 : 0, evData ? 1 : 0);
+	// eDebug("[EPGC] fillTuple arg=%s argcnt=%d, view=%d", argstring, argcount, view ? 1 : 0);
+	// id, begin and duration come straight from the view, the texts need the descriptors decoded
+	eServiceEvent evt;
+	eServiceEvent *ptr = 0;
+	if (view && strpbrk(argstring, "TSEPW"))
+	{
+		evt.parseFrom(*view, tsidonid);
+		ptr = &evt;
+	}
 	ePyObject tmp;
 	int spos=0, tpos=0;
 	char c;
@@ -2462,13 +3907,13 @@ void fillTuple(ePyObject tuple, const char *argstring, int argcount, ePyObject s
 				tmp = PyLong_FromLong(0);
 				break;
 			case 'I': // Event Id
-				tmp = evData ? PyLong_FromLong(evData->getEventID()) : (ptr ? PyLong_FromLong(ptr->getEventId()) : ePyObject());
+				tmp = view ? PyLong_FromLong(view->getEventId()) : ePyObject();
 				break;
 			case 'B': // Event Begin Time
-				tmp = ptr ? PyLong_FromLong(ptr->getBeginTime()) : (evData ? PyLong_FromLong(evData->getStartTime()) : ePyObject());
+				tmp = view ? PyLong_FromLong(view->getBeginTime()) : ePyObject();
 				break;
 			case 'D': // Event Duration
-				tmp = ptr ? PyLong_FromLong(ptr->getDuration()) : (evData ? PyLong_FromLong(evData->getDuration()) : ePyObject());
+				tmp = view ? PyLong_FromLong(view->getDuration()) : ePyObject();
 				break;
 			case 'T': // Event Title
 				tmp = ptr ? PyString_FromString(ptr->getEventName().c_str()) : ePyObject();
@@ -2516,11 +3961,11 @@ void fillTuple(ePyObject tuple, const char *argstring, int argcount, ePyObject s
 	}
 }
 
-int handleEvent(eServiceEvent *ptr, ePyObject dest_list, const char* argstring, int argcount, ePyObject service, ePyObject nowTime, ePyObject service_name, ePyObject convertFunc, ePyObject convertFuncArgs)
+int handleEvent(const eEPGEventView *view, int tsidonid, ePyObject dest_list, const char* argstring, int argcount, ePyObject service, ePyObject nowTime, ePyObject service_name, ePyObject convertFunc, ePyObject convertFuncArgs)
 {
 	if (convertFunc)
 	{
-		fillTuple(convertFuncArgs, argstring, argcount, service, ptr, service_name, nowTime, 0);
+		fillTuple(convertFuncArgs, argstring, argcount, service, view, service_name, nowTime, tsidonid);
 		ePyObject result = PyObject_CallObject(convertFunc, convertFuncArgs);
 		if (!result)
 		{
@@ -2541,7 +3986,7 @@ int handleEvent(eServiceEvent *ptr, ePyObject dest_list, const char* argstring,
 	else
 	{
 		ePyObject tuple = PyTuple_New(argcount);
-		fillTuple(tuple, argstring, argcount, service, ptr, service_name, nowTime, 0);
+		fillTuple(tuple, argstring, argcount, service, view, service_name, nowTime, tsidonid);
 		PyList_Append(dest_list, tuple);
 		Py_DECREF(tuple);
 	}
@@ -2747,45 +4192,64 @@ PyObject *eEPGCache::lookupEvent(ePyObject list, ePyObject convertFunc)
 			}
 			if (minutes)
 			{
-				singleLock s(cache_lock);
-				if (!startTimeQuery(ref, stime, minutes))
+				// the events are copied out under the lock, the tuples are filled without it
+				timeQuery query;
+				bool found;
+				std::vector<eEPGEventView> views;
+				std::vector<__u8> buffer;
+				{
+					readLock r;
+					found = startQuery(ref, stime, minutes, query);
+					eventData next;
+					size_t size = 0;
+					while ( found && nextQueryEvent(query, next) )
+					{
+						eEPGEventView view;
+						next.getView(view);
+						size += view.size();
+						views.push_back(view);
+					}
+					buffer.reserve(size);
+					for (unsigned int i = 0; i < views.size(); ++i)
+						views[i].detach(buffer);
+				}
+				if (found)
 				{
-					while ( m_timemap_cursor != m_timemap_end )
+					for (unsigned int i = 0; i < views.size(); ++i)
 					{
-						Event ev((uint8_t*)m_timemap_cursor++->second->get());
-						eServiceEvent evt;
-						evt.parseFrom(&ev, currentQueryTsidOnid);
-						if (handleEvent(&evt, dest_list, argstring, argcount, service, nowTime, service_name, convertFunc, convertFuncArgs))
+						if (handleEvent(&views[i], query.tsidonid, dest_list, argstring, argcount, service, nowTime, service_name, convertFunc, convertFuncArgs))
 							return 0;  // error
 					}
 				}
-				else if (forceReturnOne && handleEvent(0, dest_list, argstring, argcount, service, nowTime, service_name, convertFunc, convertFuncArgs))
+				else if (forceReturnOne && handleEvent(0, 0, dest_list, argstring, argcount, service, nowTime, service_name, convertFunc, convertFuncArgs))
 					return 0;  // error
 			}
 			else
 			{
-				eServiceEvent evt;
-				const eventData *ev_data=0;
+				int found = -1;
+				eEPGEventView view;
+				std::vector<__u8> buffer;
 				if (stime)
 				{
-					singleLock s(cache_lock);
+					readLock r;
+					eventData ev_data;
 					if (type == 2)
-						lookupEventId(ref, event_id, ev_data);
+						found = lookupEventId(ref, event_id, ev_data);
 					else
-						lookupEventTime(ref, stime, ev_data, type);
-					if (ev_data)
+						found = lookupEventTime(ref, stime, ev_data, type);
+					if (!found)
 					{
-						const eServiceReferenceDVB &dref = (const eServiceReferenceDVB&)ref;
-						Event ev((uint8_t*)ev_data->get());
-						evt.parseFrom(&ev, (dref.getTransportStreamID().get()<<16)|dref.getOriginalNetworkID().get());
+						ev_data.getView(view);
+						view.detach(buffer);
 					}
 				}
-				if (ev_data)
+				if (!found)
 				{
-					if (handleEvent(&evt, dest_list, argstring, argcount, service, nowTime, service_name, convertFunc, convertFuncArgs))
+					const eServiceReferenceDVB &dref = (const eServiceReferenceDVB&)ref;
+					if (handleEvent(&view, (dref.getTransportStreamID().get()<<16)|dref.getOriginalNetworkID().get(), dest_list, argstring, argcount, service, nowTime, service_name, convertFunc, convertFuncArgs))
 						return 0; // error
 				}
-				else if (forceReturnOne && handleEvent(0, dest_list, argstring, argcount, service, nowTime, service_name, convertFunc, convertFuncArgs))
+				else if (forceReturnOne && handleEvent(0, 0, dest_list, argstring, argcount, service, nowTime, service_name, convertFunc, convertFuncArgs))
 					return 0; // error
 			}
 			if (service_changed)
@@ -2993,6 +4457,12 @@ void eEPGCache::setEpgHistorySeconds(time_t seconds)
 	historySeconds = seconds;
 }
 
+void eEPGCache::setEpgBatch(int sections, int latency)
+{
+	m_batch_sections = sections;
+	m_batch_latency = latency;
+}
+
 void eEPGCache::setEpgSources(unsigned int mask)
 {
 	enabledSources = mask;
@@ -3182,6 +4652,29 @@ void eEPGCache::importEvents(ePyObject serviceReferences, ePyObject list)
 //     0 = case sensitive (CASE_CHECK)
 //     1 = case insensitive (NO_CASECHECK)
 
+// an event found by search(), in the order they are returned
+struct searchHit
+{
+	__u64 key; // eEPGTitleIndex::eventKey
+	time_t start;
+	bool base; // of the reference service of a SIMILAR_BROADCASTING_SEARCH
+	bool operator<(const searchHit &a) const
+	{
+		if (base != a.base)
+			return base;
+		if ((key >> 16) != (a.key >> 16))
+			return key < a.key;
+		return start < a.start;
+	}
+};
+
+// an event found by search(), copied out of the cache
+struct searchResult
+{
+	eEPGEventView view;
+	std::vector<eServiceReference> refs;
+};
+
 PyObject *eEPGCache::search(ePyObject arg)
 {
 	ePyObject ret;
@@ -3192,7 +4685,6 @@ PyObject *eEPGCache::search(ePyObject arg)
 	char *refstr=0;
 	int argcount=0;
 	int querytype=-1;
-	bool needServiceEvent=false;
 	int maxmatches=0;
 	int must_get_service_name = 0;
 	bool must_get_service_reference = false;
@@ -3214,13 +4706,6 @@ PyObject *eEPGCache::search(ePyObject arg)
 				for (int i=0; i < argcount; ++i)
 					switch(argstring[i])
 					{
-					case 'S':
-					case 'E':
-					case 'T':
-					case 'P':
-					case 'W':
-						needServiceEvent=true;
-						break;
 					case 'N':
 						must_get_service_name = 1;
 						break;
@@ -3257,23 +4742,20 @@ PyObject *eEPGCache::search(ePyObject arg)
 					if (ref.valid())
 					{
 						eventid = PyLong_AsLong(PyTuple_GET_ITEM(arg, 4));
-						singleLock s(cache_lock);
-						const eventData *evData = 0;
-						lookupEventId(ref, eventid, evData);
-						if (evData)
+						readLock r;
+						eventData evData;
+						if (!lookupEventId(ref, eventid, evData))
 						{
-							__u8 *data = evData->EITdata;
-							int tmp = evData->ByteSize-10;
+							__u8 *data = evData.EITdata;
+							int tmp = evData.ByteSize-10;
 							__u32 *p = (__u32*)(data+10);
 							// search short and extended event descriptors
 							while(tmp>3)
 							{
 								__u32 crc = *p++;
-								descriptorMap::iterator it =
-									eventData::descriptors.find(crc);
-								if (it != eventData::descriptors.end())
+								const __u8 *descr_data = eventData::getDescriptor(crc);
+								if (descr_data)
 								{
-									__u8 *descr_data = it->second.second;
 									switch(descr_data[0])
 									{
 									case 0x4D ... 0x4E:
@@ -3326,65 +4808,8 @@ PyObject *eEPGCache::search(ePyObject arg)
 							eDebug("[EPGC] lookup events, title starting with '%s' (%s)", str, casetype?"ignore case":"case sensitive");
 							break;
 					}
-					singleLock s(cache_lock);
-					std::string title;
-					for (descriptorMap::iterator it(eventData::descriptors.begin());
-						it != eventData::descriptors.end() && descridx < 511; ++it)
-					{
-						__u8 *data = it->second.second;
-						if ( data[0] == 0x4D ) // short event descriptor
-						{
-							const char *titleptr = (const char*)&data[6];
-							int title_len = data[5];
-							if (data[6] < 0x20)
-							{
-								/* custom encoding */
-								title = convertDVBUTF8((unsigned char*)titleptr, title_len, 0x40, 0);
-								titleptr = title.data();
-								title_len = title.length();
-							}
-							if (title_len < textlen)
-								/*Doesn't fit, so cannot match anything */
-								continue;
-							if (querytype == 1)
-							{
-								/* require exact title match */
-								if (title_len != textlen)
-									continue;
-							}
-							else if (querytype == 3)
-							{
-								/* Do a "startswith" match by pretending the text isn't that long */
-								title_len = textlen;
-							}
-							if (casetype)
-							{
-								while (title_len >= textlen)
-								{
-									if (!strncasecmp(titleptr, str, textlen))
-									{
-										descr[++descridx] = it->first;
-										break;
-									}
-									title_len--;
-									titleptr++;
-								}
-							}
-							else
-							{
-								while (title_len >= textlen)
-								{
-									if (!memcmp(titleptr, str, textlen))
-									{
-										descr[++descridx] = it->first;
-										break;
-									}
-									title_len--;
-									titleptr++;
-								}
-							}
-						}
-					}
+					readLock r;
+					descridx = eventData::titles.find(str, textlen, querytype, casetype, descr, 512) - 1;
 				}
 				else
 				{
@@ -3423,141 +4848,172 @@ PyObject *eEPGCache::search(ePyObject arg)
 		int maxcount=maxmatches;
 		eServiceReferenceDVB ref(refstr?(const eServiceReferenceDVB&)handleGroup(eServiceReference(refstr)):eServiceReferenceDVB(""));
 		// ref is only valid in SIMILAR_BROADCASTING_SEARCH
-		// in this case we start searching with the base service
-		bool first = ref.valid() ? true : false;
-		singleLock s(cache_lock);
-		eventCache::iterator cit(ref.valid() ? eventDB.find(ref) : eventDB.begin());
-		while(cit != eventDB.end() && maxcount)
+		// sorted, so every descriptor of an event is looked up with a binary search
+		std::sort(descr, descr + descridx + 1);
+		// the matching events are copied out under the lock, the tuples are filled without it
+		std::vector<searchResult> results;
+		std::vector<__u8> buffer;
 		{
-			if ( ref.valid() && !first && cit->first == ref )
+			readLock r;
+			// the candidates are the events of the matching titles. Similar events
+			// must have all descriptors of the reference event, they are searched
+			// through its title with the fewest events and checked below.
+			std::vector<__u32> titles;
+			if (querytype == 0)
 			{
-				// do not scan base service twice ( only in SIMILAR BROADCASTING SEARCH )
-				++cit;
-				continue;
+				size_t fewest = 0;
+				for (int i = 0; i <= descridx; ++i)
+				{
+					size_t count = titleEventCount(descr[i]);
+					if (count != (size_t)-1 && (titles.empty() || count < fewest))
+					{
+						titles.assign(1, descr[i]);
+						fewest = count;
+					}
+				}
 			}
-			timeMap &evmap = cit->second.second;
-			// check all events
-			for (timeMap::iterator evit(evmap.begin()); evit != evmap.end() && maxcount; ++evit)
+			else
+				titles.assign(descr, descr + descridx + 1);
+
+			std::vector<__u64> keys;
+			for (unsigned int i = 0; i < titles.size(); ++i)
+				titleEvents(titles[i], keys);
+			std::sort(keys.begin(), keys.end());
+			keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+			std::vector<searchHit> hits;
+			serviceEvents events;
+			for (unsigned int i = 0; i < keys.size(); ++i)
 			{
+				int sid, onid, tsid;
+				__u16 event_id;
+				eEPGTitleIndex::splitEventKey(keys[i], sid, onid, tsid, event_id);
+				uniqueEPGKey service(sid, onid, tsid);
+				if (!i || (keys[i] >> 16) != (keys[i - 1] >> 16))
+				{
+					// the keys are sorted by service like the hits, later services
+					// are not returned once there are enough hits
+					if (querytype > 0 && maxcount > 0 && hits.size() >= (size_t)maxcount)
+						break;
+					readService(service, events);
+				}
+				eventData evt;
+				if (!events.findId(event_id, evt))
+					continue;
 				if (querytype == 0)
 				{
 					/* ignore the current event, when looking for similar events */
-					if (evit->second->getEventID() == eventid)
+					if (event_id == eventid)
+						continue;
+					// check if all of our descriptors are used by this event
+					int cnt = -1;
+					const __u32 *p = (const __u32*)(evt.EITdata + 10);
+					for (int tmp = evt.ByteSize - 10; tmp > 3; tmp -= 4)
+						if (std::binary_search(descr, descr + descridx + 1, *p++))
+							++cnt;
+					if (cnt != descridx)
 						continue;
 				}
-				__u8 *data = evit->second->EITdata;
-				int tmp = evit->second->ByteSize-10;
-				__u32 *p = (__u32*)(data+10);
-				// check if any of our descriptor used by this event
-				int cnt=-1;
-				while(tmp>3)
+				searchHit hit;
+				hit.key = keys[i];
+				hit.start = evt.getStartTime();
+				// in SIMILAR_BROADCASTING_SEARCH the base service comes first
+				hit.base = ref.valid() && service == uniqueEPGKey(ref);
+				hits.push_back(hit);
+			}
+			std::sort(hits.begin(), hits.end());
+
+			// as many events as needed for maxcount tuples
+			size_t size = 0;
+			int tuples = maxcount;
+			for (unsigned int h = 0; h < hits.size() && tuples; ++h)
+			{
+				int sid, onid, tsid;
+				__u16 event_id;
+				eEPGTitleIndex::splitEventKey(hits[h].key, sid, onid, tsid, event_id);
+				uniqueEPGKey service(sid, onid, tsid);
+				eventData evt;
+				if (!readService(service, events) || !events.findId(event_id, evt))
+					continue;
+				searchResult result;
+				eDVBDB::getInstance()->searchAllReferences(result.refs, service.tsid, service.onid, service.sid);
+				for (unsigned int i = 0; i < result.refs.size(); i++)
 				{
-					__u32 crc32 = *p++;
-					for ( int i=0; i <= descridx; ++i)
-					{
-						if (descr[i] == crc32)  // found...
-						{
-							++cnt;
-							if (querytype)
-							{
-								/* we need only one match, when we're not looking for similar broadcasting events */
-								tmp = 0;
-								break;
-							}
-						}
-					}
-					tmp-=4;
+					if (result.refs[i].valid())
+						--tuples;
 				}
-				if ( (querytype == 0 && cnt == descridx) ||
-					 ((querytype > 0) && cnt != -1) )
+				evt.getView(result.view);
+				size += result.view.size();
+				results.push_back(result);
+			}
+			buffer.reserve(size);
+			for (unsigned int h = 0; h < results.size(); ++h)
+				results[h].view.detach(buffer);
+		}
+
+		for (unsigned int h = 0; h < results.size(); ++h)
+		{
+			const std::vector<eServiceReference> &refs = results[h].refs;
+			for (unsigned int i = 0; i < refs.size(); i++)
+			{
+				eServiceReference ref = refs[i];
+				if (ref.valid())
 				{
-					const uniqueEPGKey &service = cit->first;
-					std::vector<eServiceReference> refs;
-					eDVBDB::getInstance()->searchAllReferences(refs, service.tsid, service.onid, service.sid);
-					for (unsigned int i = 0; i < refs.size(); i++)
+					ePyObject service_name;
+					ePyObject service_reference;
+				// create service name
+					if (must_get_service_name && !service_name)
 					{
-						eServiceReference ref = refs[i];
-						if (ref.valid())
+						ePtr<iStaticServiceInformation> sptr;
+						eServiceCenterPtr service_center;
+						eServiceCenter::getPrivInstance(service_center);
+						if (service_center)
 						{
-							ePyObject service_name;
-							ePyObject service_reference;
-						// create servive event
-							eServiceEvent ptr;
-							const eventData *ev_data=0;
-							if (needServiceEvent)
+							service_center->info(ref, sptr);
+							if (sptr)
 							{
-								if (lookupEventId(ref, evit->second->getEventID(), ev_data))
-									eDebug("[EPGC] event %04x not found !!!!!!!!!!!", evit->second->getEventID());
-								else
+								std::string name;
+								sptr->getName(ref, name);
+
+								if (must_get_service_name == 1)
 								{
-									const eServiceReferenceDVB &dref = (const eServiceReferenceDVB&)ref;
-									Event ev((uint8_t*)ev_data->get());
-									ptr.parseFrom(&ev, (dref.getTransportStreamID().get()<<16)|dref.getOriginalNetworkID().get());
+									size_t pos;
+									// filter short name brakets
+									while((pos = name.find("\xc2\x86")) != std::string::npos)
+										name.erase(pos,2);
+									while((pos = name.find("\xc2\x87")) != std::string::npos)
+										name.erase(pos,2);
 								}
-							}
-						// create service name
-							if (must_get_service_name && !service_name)
-							{
-								ePtr<iStaticServiceInformation> sptr;
-								eServiceCenterPtr service_center;
-								eServiceCenter::getPrivInstance(service_center);
-								if (service_center)
-								{
-									service_center->info(ref, sptr);
-									if (sptr)
-									{
-										std::string name;
-										sptr->getName(ref, name);
-
-										if (must_get_service_name == 1)
-										{
-											size_t pos;
-											// filter short name brakets
-											while((pos = name.find("\xc2\x86")) != std::string::npos)
-												name.erase(pos,2);
-											while((pos = name.find("\xc2\x87")) != std::string::npos)
-												name.erase(pos,2);
-										}
-										else
-											name = buildShortName(name);
+								else
+									name = buildShortName(name);
 
-										if (name.length())
-											service_name = PyString_FromString(name.c_str());
-									}
-								}
-								if (!service_name)
-									service_name = PyString_FromString("<n/a>");
+								if (name.length())
+									service_name = PyString_FromString(name.c_str());
 							}
-						// create servicereference string
-							if (must_get_service_reference && !service_reference)
-								service_reference = PyString_FromString(ref.toString().c_str());
-						// create list
-							if (!ret)
-								ret = PyList_New(0);
-						// create tuple
-							ePyObject tuple = PyTuple_New(argcount);
-						// fill tuple
-							ePyObject tmp = ePyObject();
-							fillTuple(tuple, argstring, argcount, service_reference, ev_data ? &ptr : 0, service_name, tmp, evit->second);
-							PyList_Append(ret, tuple);
-							Py_DECREF(tuple);
-							if (service_name)
-								Py_DECREF(service_name);
-							if (service_reference)
-								Py_DECREF(service_reference);
-							--maxcount;
 						}
+						if (!service_name)
+							service_name = PyString_FromString("<n/a>");
 					}
+				// create servicereference string
+					if (must_get_service_reference && !service_reference)
+						service_reference = PyString_FromString(ref.toString().c_str());
+				// create list
+					if (!ret)
+						ret = PyList_New(0);
+				// create tuple
+					ePyObject tuple = PyTuple_New(argcount);
+				// fill tuple
+					ePyObject tmp = ePyObject();
+					const eServiceReferenceDVB &dref = (const eServiceReferenceDVB&)ref;
+					fillTuple(tuple, argstring, argcount, service_reference, &results[h].view, service_name, tmp, (dref.getTransportStreamID().get()<<16)|dref.getOriginalNetworkID().get());
+					PyList_Append(ret, tuple);
+					Py_DECREF(tuple);
+					if (service_name)
+						Py_DECREF(service_name);
+					if (service_reference)
+						Py_DECREF(service_reference);
 				}
 			}
-			if (first)
-			{
-				// now start at first service in epgcache database ( only in SIMILAR BROADCASTING SEARCH )
-				first=false;
-				cit=eventDB.begin();
-			}
-			else
-				++cit;
 		}
 	}
 
@@ -3713,10 +5169,9 @@ struct less_datetime
 void eEPGCache::privateSectionRead(const uniqueEPGKey &current_service, const __u8 *data)
 {
 	contentMap &content_time_table = content_time_tables[current_service];
-	singleLock s(cache_lock);
+	writeLock s;
 	std::map< date_time, std::list<uniqueEPGKey>, less_datetime > start_times;
-	eventMap &evMap = eventDB[current_service].first;
-	timeMap &tmMap = eventDB[current_service].second;
+	eventStore &servicemap = getService(current_service);
 	int ptr=8;
 	int content_id = data[ptr++] << 24;
 	content_id |= data[ptr++] << 16;
@@ -3728,13 +5183,14 @@ void eEPGCache::privateSectionRead(const uniqueEPGKey &current_service, const __
 	for ( contentTimeMap::iterator it( time_event_map.begin() );
 		it != time_event_map.end(); ++it )
 	{
-		eventMap::iterator evIt( evMap.find(it->second.second) );
-		if ( evIt != evMap.end() )
+		eventData *evt = servicemap.findId(it->second.second);
+		if ( evt )
 		{
-			delete evIt->second;
-			evMap.erase(evIt);
+			journalRemove(current_service, evt->getStartTime());
+			delete servicemap.remove(evt->getStartTime());
 		}
-		tmMap.erase(it->second.first);
+		journalRemove(current_service, it->second.first);
+		delete servicemap.remove(it->second.first);
 	}
 	time_event_map.clear();
 
@@ -3855,18 +5311,18 @@ void eEPGCache::privateSectionRead(const uniqueEPGKey &current_service, const __
 		ev_struct->descriptors_loop_length_lo = (llen & 0xFF);
 
 		time_t stime = it->first.tm;
-		while( tmMap.find(stime) != tmMap.end() )
+		while( servicemap.findTime(stime) )
 			++stime;
 		event[6] += (stime - it->first.tm);
 		__u16 event_id = 0;
-		while( evMap.find(event_id) != evMap.end() )
+		while( servicemap.findId(event_id) )
 			++event_id;
 		event[0] = (event_id & 0xFF00) >> 8;
 		event[1] = (event_id & 0xFF);
 		time_event_map[it->first.tm]=std::pair<time_t, __u16>(stime, event_id);
 		eventData *d = new eventData( ev_struct, bptr, PRIVATE );
-		evMap[event_id] = d;
-		tmMap[stime] = d;
+		servicemap.insert(stime, event_id, d);
+		journalEvent(current_service, d);
 		ASSERT(bptr <= 4098);
 	}
 }
@@ -4153,7 +5609,7 @@ void eEPGCache::channel_data::storeMHWTitle(std::map<__u32, mhw_title_t>::iterat
 	packet->section_length_lo =  (packet_length - 3)&0xff;
 
 	// Feed the data to eEPGCache::sectionRead()
-	cache->sectionRead( data, MHW, this );
+	cache->queueSection( data, MHW, this );
 }
 
 void eEPGCache::channel_data::startMHWTimeout(int msec)
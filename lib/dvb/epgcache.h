@@ -23,6 +23,7 @@
 #endif
 
 #include <errno.h>
+#include <stdint.h>
 
 #include <lib/dvb/eit.h>
 #include <lib/dvb/lowlevel/eit.h>
@@ -32,6 +33,10 @@
 #include <lib/dvb/idvb.h>
 #include <lib/dvb/demux.h>
 #include <lib/dvb/dvbtime.h>
+#include <lib/dvb/epgdescriptorpool.h>
+#include <lib/dvb/epgeventview.h>
+#include <lib/dvb/epgjournal.h>
+#include <lib/dvb/epgtitleindex.h>
 #include <lib/base/ebase.h>
 #include <lib/base/thread.h>
 #include <lib/base/message.h>
@@ -39,6 +44,12 @@
 #include <lib/python/python.h>
 
 #define CLEAN_INTERVAL (60*1000)    // 1 minute
+#define COMPACT_BUDGET (256*1024)   // descriptor bytes moved per clean run
+#define EXPIRY_BUCKET 60            // seconds per bucket of the expiry schedule
+#define EXPIRY_SLICE 10             // ms a clean run may hold the cache lock
+#define EXPIRY_YIELD 50             // ms until an interrupted clean run continues
+#define JOURNAL_COMPACT (4*1024*1024) // journal bytes which start a new epg.dat snapshot
+#define SAVE_CHUNK 2000             // events copied per cache lock while writing epg.dat
 #define UPDATE_INTERVAL (5*60*1000) // Australian EIT EPG is very dynamic, updates can come less than a minute apart
 #define ZAP_DELAY (2*1000)          // 2 seconds
 
@@ -94,14 +105,13 @@ struct uniqueEPGKey
 	};
 };
 
-//eventMap is sorted by event_id
-typedef std::map<const __u16, eventData*> eventMap;
 //timeMap is sorted by beginTime
-typedef std::map<const time_t, eventData*> timeMap;
-typedef std::pair<eventMap, timeMap> serviceMap;
+typedef std::pair<time_t, eventData*> timeEntry;
+typedef std::vector<timeEntry> timeMap;
+//eventMap is sorted by event_id
+typedef std::pair<__u16, eventData*> idEntry;
+typedef std::vector<idEntry> eventMap;
 typedef std::map<const eDVBChannelID, time_t> updateMap;
-typedef std::pair<int,__u8*> descriptorPair;
-typedef std::map<const __u32, descriptorPair > descriptorMap;
 typedef std::set<__u32> tidMap;
 
 
@@ -114,37 +124,175 @@ struct hash_uniqueEPGKey
 };
 
 
-#if 0
-	typedef std::unordered_map<uniqueEPGKey, serviceMap, hash_uniqueEPGKey, uniqueEPGKey::equal> eventCache;
-	#ifdef ENABLE_PRIVATE_EPG
-		typedef std::unordered_map<time_t, std::pair<time_t, __u16> > contentTimeMap;
-		typedef std::unordered_map<int, contentTimeMap > contentMap;
-		typedef std::unordered_map<uniqueEPGKey, contentMap, hash_uniqueEPGKey, uniqueEPGKey::equal > contentMaps;
-	#endif
-#else
-	typedef __gnu_cxx::hash_map<uniqueEPGKey, serviceMap, hash_uniqueEPGKey, uniqueEPGKey::equal> eventCache;
-	#ifdef ENABLE_PRIVATE_EPG
-		typedef __gnu_cxx::hash_map<time_t, std::pair<time_t, __u16> > contentTimeMap;
-		typedef __gnu_cxx::hash_map<int, contentTimeMap > contentMap;
-		typedef __gnu_cxx::hash_map<uniqueEPGKey, contentMap, hash_uniqueEPGKey, uniqueEPGKey::equal > contentMaps;
-	#endif
-#endif
+
+/*
+ * On-disk layout of the ENIGMA_EPG_V9 cache file. The file is a page aligned
+ * image of the cache without any pointers in it, so it can be mmap'ed and
+ * used directly. Every section starts on a page boundary, offsets inside a
+ * section are relative to the start of that section.
+ */
+enum
+{
+	EPG_IMAGE_SERVICES,       // epgImageService, sorted by uniqueEPGKey
+	EPG_IMAGE_EVENTS,         // epgImageEvent, per service sorted by start time
+	EPG_IMAGE_EVENTIDS,       // __u32 event index, per service sorted by event id
+	EPG_IMAGE_EVENTDATA,      // raw eventData::EITdata blobs
+	EPG_IMAGE_DESCRIPTORS,    // epgImageDescriptor, sorted by crc
+	EPG_IMAGE_DESCRIPTORDATA, // raw descriptor blobs
+	EPG_IMAGE_PRIVATE,        // private epg content tables (V7 serialization)
+	EPG_IMAGE_TITLES,         // epgImageTitle, the events of every title, sorted by crc and event
+	EPG_IMAGE_SECTIONS
+};
+
+struct epgImageSection
+{
+	uint64_t offset;
+	uint64_t size;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct epgImageHeader
+{
+	uint32_t magic;
+	char version[13];
+	uint8_t reserved[3];
+	uint32_t page_size;
+	uint32_t sections;
+	uint32_t service_count;
+	uint32_t journal; // the first journal with changes which are not in the image
+	epgImageSection section[EPG_IMAGE_SECTIONS];
+};
+
+struct epgImageService
+{
+	int32_t sid, onid, tsid;
+	uint32_t first_event;
+	uint32_t event_count;
+};
+
+struct epgImageEvent
+{
+	int64_t start_time;
+	uint32_t data_offset;
+	uint16_t event_id;
+	uint8_t type;
+	uint8_t len;
+};
+
+struct epgImageDescriptor
+{
+	uint32_t crc;
+	uint32_t data_offset;
+};
+
+struct epgImageTitle
+{
+	uint32_t crc; // of a short event descriptor with a title
+	uint32_t event; // index into EPG_IMAGE_EVENTS
+};
+
+class eEPGImage
+{
+	int m_fd;
+	__u8 *m_base;
+	size_t m_size;
+	const epgImageHeader *m_header;
+	std::vector<bool> m_claimed;
+	eEPGImage();
+	bool validate();
+public:
+	~eEPGImage();
+	// maps the file open at fd (the descriptor is duplicated),
+	// returns NULL when it is not a valid V9 image
+	static eEPGImage *open(int fd, const char *filename);
+
+	size_t size() const { return m_size; }
+	unsigned int journal() const { return m_header->journal; }
+	int serviceCount() const { return m_header->section[EPG_IMAGE_SERVICES].count; }
+	int eventCount() const { return m_header->section[EPG_IMAGE_EVENTS].count; }
+	int descriptorCount() const { return m_header->section[EPG_IMAGE_DESCRIPTORS].count; }
+	const __u8 *section(int which) const { return m_base + m_header->section[which].offset; }
+	size_t sectionSize(int which) const { return m_header->section[which].size; }
+
+	const epgImageService *services() const { return (const epgImageService*)section(EPG_IMAGE_SERVICES); }
+	const epgImageEvent *events() const { return (const epgImageEvent*)section(EPG_IMAGE_EVENTS); }
+	const uint32_t *eventIds() const { return (const uint32_t*)section(EPG_IMAGE_EVENTIDS); }
+	const epgImageDescriptor *descriptors() const { return (const epgImageDescriptor*)section(EPG_IMAGE_DESCRIPTORS); }
+	const epgImageTitle *titles() const { return (const epgImageTitle*)section(EPG_IMAGE_TITLES); }
+	int titleCount() const { return m_header->section[EPG_IMAGE_TITLES].count; }
+	const __u8 *eventPayload(const epgImageEvent &ev) const { return section(EPG_IMAGE_EVENTDATA) + ev.data_offset; }
+	const __u8 *descriptorPayload(const epgImageDescriptor &d) const { return section(EPG_IMAGE_DESCRIPTORDATA) + d.data_offset; }
+
+	// index of the service in services(), or -1
+	int findService(const uniqueEPGKey &key) const;
+	// first event of @service starting at or after / strictly after @t,
+	// relative to the first event of the service
+	unsigned int lowerBound(int service, time_t t) const;
+	unsigned int upperBound(int service, time_t t) const;
+	// the event of @service with @event_id, looked up in EPG_IMAGE_EVENTIDS, NULL if there is none
+	const epgImageEvent *findEventId(int service, __u16 event_id) const;
+	// the range of titles() with @crc, empty if there is none
+	void findTitle(__u32 crc, const epgImageTitle *&begin, const epgImageTitle *&end) const;
+	// index of the service the event at @event in events() belongs to, or -1
+	int serviceOfEvent(uint32_t event) const;
+	const __u8 *findDescriptor(__u32 crc) const;
+	bool isValid(const epgImageEvent &ev) const;
+
+	// services which have been pulled into the heap cache (or flushed) are
+	// "claimed" and must no longer be served from the image
+	bool isClaimed(int service) const { return m_claimed[service]; }
+	void claim(int service) { m_claimed[service] = true; }
+};
 
 class eventData
 {
 	friend class eEPGCache;
+	friend class eventStore;
+	friend class serviceEvents;
+	friend class eEPGReplay; // main/enigma-epgreplay.cpp
 private:
 	__u8* EITdata;
 	__u8 ByteSize;
 	__u8 type;
-	static descriptorMap descriptors;
-	static __u8 data[];
+	__u8 mapped; // EITdata isn't owned, it points into the mmap'ed epg.dat image or at another event
+	static eEPGDescriptorPool descriptors;
+	static eEPGTitleIndex titles;
+	enum { MAX_EIT_SIZE = 2 * 4096 + 12 };
+	static __u8 data[MAX_EIT_SIZE];
 	static int CacheSize;
 	static bool isCacheCorrupt;
 	static void load(FILE *);
-	static void save(FILE *);
 	static void cacheCorrupt(const char* context);
+	static const __u8 *getDescriptor(__u32 crc);
+	/*
+	 * An EIT event with parsed descriptors, which are not yet in the shared
+	 * descriptor pool. Descriptors which had to be rebuilt are owned by it.
+	 */
+	struct staged
+	{
+		__u8 header[10];
+		int count;
+		__u32 crc[65];
+		const __u8 *descr[65];
+		bool owned[65];
+		staged() :count(0) {}
+		~staged();
+		void add(__u32 crc, const __u8 *descr, bool own);
+	private:
+		staged(const staged &);
+	};
+	static void parse(const eit_event_struct* e, int size, int tsidonid, staged &result);
+	eventData(staged &s, int type);
+	void init(staged &s);
+	static __u8 *allocData(int size);
+	static void freeData(__u8 *data, int size);
+	void detach();
+	// let the (empty) event use the data of @evt or of an image record without owning it
+	void refer(const eventData &evt) { refer(evt.EITdata, evt.ByteSize, evt.type); }
+	void refer(const __u8 *data, int size, int type);
 	const eit_event_struct* get() const;
+	void getView(eEPGEventView &view) const;
 	operator const eit_event_struct*() const
 	{
 		return get();
@@ -165,6 +313,100 @@ public:
 		return fromBCD(EITdata[7])*3600+fromBCD(EITdata[8])*60+fromBCD(EITdata[9]);
 	}
 };
+
+/*
+ * All events of one service. Instead of two trees with a node per event the
+ * events are kept in two sorted arrays, one by start time and a compact one
+ * by event id. Both hold the same set of events, an event is in both or in
+ * none. Iterators and references into the arrays are invalidated by insert
+ * and erase, the eventData pointers stay valid until the event is deleted.
+ * The events are entered into the title index with the titles they use.
+ */
+class eventStore
+{
+public:
+	uniqueEPGKey service; // set by eEPGCache when the store is created
+	timeMap byTime;
+	eventMap byId;
+	// bucket the service is scheduled for in the expiry schedule, 0 if none
+	time_t expiry;
+	// got new events since the last clean run, its expiry may be earlier now
+	bool touched;
+
+	eventStore(): expiry(0), touched(false) {}
+	bool empty() const { return byTime.empty(); }
+	size_t size() const { return byTime.size(); }
+	void reserve(size_t n) { byTime.reserve(n); byId.reserve(n); }
+
+	// first entry starting at or after t / strictly after t
+	timeMap::iterator lowerBound(time_t t);
+	timeMap::iterator upperBound(time_t t);
+	// exact matches, NULL when not found
+	eventData *findTime(time_t t);
+	eventData *findId(__u16 event_id);
+
+	// insert an event, there must be no event with the same start time or event id
+	void insert(time_t t, __u16 event_id, eventData *evt);
+	// replace the event at start time t by evt, which has the same start time and event id
+	void replace(time_t t, eventData *evt);
+	// unlink an event from both arrays, returns it so it can be deleted
+	eventData *remove(time_t t);
+	// unlink and delete all events which ended before now
+	int removeExpired(time_t now);
+	// earliest end time of the events, the store must not be empty
+	time_t firstEnd();
+	void clear();
+	// enter/remove an event of the store into/from the title index
+	void indexTitles(const eventData *evt, bool add);
+	// memory used by the index arrays, not counting the events
+	size_t indexSize() const { return byTime.capacity() * sizeof(timeEntry) + byId.capacity() * sizeof(idEntry); }
+};
+
+/*
+ * Read only access to the events of one service, wherever they are: in the
+ * heap cache or still only in the mmap'ed epg.dat. The lookups use it, so
+ * reading a service which is only in the image doesn't copy it to the heap.
+ * Events are addressed by their position in start time order and returned
+ * as eventData which refer to the cached data. Only valid as long as the
+ * cache lock is held.
+ */
+class serviceEvents
+{
+	eventStore *m_store;
+	const eEPGImage *m_image;
+	int m_service; // index in m_image
+	size_t m_first, m_count; // events of m_service in m_image->events()
+public:
+	serviceEvents(): m_store(NULL), m_image(NULL), m_service(-1), m_first(0), m_count(0) {}
+	void setStore(eventStore *store);
+	void setImage(const eEPGImage *image, int service);
+
+	bool empty() const { return !size(); }
+	size_t size() const { return m_store ? m_store->size() : m_count; }
+	// position of the first event starting at or after t / strictly after t
+	size_t lowerBound(time_t t) const;
+	size_t upperBound(time_t t) const;
+	time_t startTime(size_t pos) const;
+	// let @evt refer to the event at @pos, false if the event is broken
+	bool get(size_t pos, eventData &evt) const;
+	bool findId(__u16 event_id, eventData &evt) const;
+};
+
+#if 0
+	typedef std::unordered_map<uniqueEPGKey, eventStore, hash_uniqueEPGKey, uniqueEPGKey::equal> eventCache;
+	#ifdef ENABLE_PRIVATE_EPG
+		typedef std::unordered_map<time_t, std::pair<time_t, __u16> > contentTimeMap;
+		typedef std::unordered_map<int, contentTimeMap > contentMap;
+		typedef std::unordered_map<uniqueEPGKey, contentMap, hash_uniqueEPGKey, uniqueEPGKey::equal > contentMaps;
+	#endif
+#else
+	typedef __gnu_cxx::hash_map<uniqueEPGKey, eventStore, hash_uniqueEPGKey, uniqueEPGKey::equal> eventCache;
+	#ifdef ENABLE_PRIVATE_EPG
+		typedef __gnu_cxx::hash_map<time_t, std::pair<time_t, __u16> > contentTimeMap;
+		typedef __gnu_cxx::hash_map<int, contentTimeMap > contentMap;
+		typedef __gnu_cxx::hash_map<uniqueEPGKey, contentMap, hash_uniqueEPGKey, uniqueEPGKey::equal > contentMaps;
+	#endif
+#endif
 #endif
 
 #ifdef ENABLE_FREESAT
@@ -288,7 +530,45 @@ private:
 
 	typedef std::map<iDVBChannel*, channel_data*>::iterator channelMapIterator;
 
-	bool FixOverlapping(serviceMap &servicemap, time_t TM, int duration, const timeMap::iterator &tm_it, const uniqueEPGKey &service);
+	// an event of a section, parsed before the cache lock is taken
+	struct pendingEvent
+	{
+		uniqueEPGKey service;
+		eit_type_t source;
+		time_t TM; // -1 for a section without events
+		int duration;
+		__u16 event_id;
+		eventData::staged data;
+	};
+
+	// parsed sections waiting to be added to the cache
+	struct sectionBatch
+	{
+		std::vector<pendingEvent*> events;
+		std::vector<__u8*> sections; // copies of the sections the events point into
+		~sectionBatch();
+		void clear();
+	};
+
+	bool FixOverlapping(eventStore &servicemap, time_t TM, int duration, const uniqueEPGKey &service);
+	bool readService(const uniqueEPGKey &key, serviceEvents &events);
+	eventCache::iterator findService(const uniqueEPGKey &key);
+	eventStore &getService(const uniqueEPGKey &key);
+	void materializeService(int index);
+	void dropImage();
+	void closeImage();
+	void indexImageTitles(bool add);
+	size_t titleEventCount(__u32 crc);
+	void titleEvents(__u32 crc, std::vector<__u64> &keys);
+	int writeImage(FILE *f, FILE *descr, unsigned int &journal);
+	void writeSnapshot();
+	void startSnapshot();
+	unsigned int loadSnapshot();
+	void openJournal(unsigned int first);
+	void replayJournal(const std::vector<__u8> &payload);
+	void journalEvent(const uniqueEPGKey &key, const eventData *evt);
+	void journalRemove(const uniqueEPGKey &key, time_t start);
+	void loadImagePrivate();
 public:
 	struct Message
 	{
@@ -330,9 +610,15 @@ public:
 private:
 	friend class channel_data;
 	friend class eventData;
+	friend class eEPGReplay; // main/enigma-epgreplay.cpp
+	friend class eEPGStress; // main/enigma-epgstress.cpp
 	static eEPGCache *instance;
 
 	ePtr<eTimer> cleanTimer;
+	sectionBatch m_batch; // sections queued by the EPG thread
+	ePtr<eTimer> m_batchTimer;
+	int m_batch_sections, m_batch_latency;
+	unsigned int m_batch_commits; // number of times a batch took the cache lock
 	std::map<iDVBChannel*, channel_data*> m_knownChannels;
 	ePtr<eConnection> m_chanAddedConn;
 
@@ -341,10 +627,51 @@ private:
 
 	std::vector<int> onid_blacklist;
 	eventCache eventDB;
+	// services by the bucket their first event ends in (end time / EXPIRY_BUCKET),
+	// entries of services which were rescheduled or removed meanwhile are skipped
+	std::map<time_t, std::vector<uniqueEPGKey> > m_expiry;
+	std::vector<uniqueEPGKey> m_touched; // services with eventStore::touched set
 	updateMap channelLastUpdated;
+	/*
+	 * cache_lock serializes everything that changes the cache, and the users
+	 * of the eit_event_struct and Event lookups, which share eventData::data.
+	 * The events, their descriptors, the title index and the image are only
+	 * changed holding event_lock for writing as well (see writeLock), so the
+	 * eServiceEvent lookups, lookupEvent() and search() just take it for
+	 * reading. They copy the events out and decode them after releasing it.
+	 * event_lock prefers writers and is not recursive, never take it twice.
+	 */
 	static pthread_mutex_t cache_lock, channel_map_lock;
+	static pthread_rwlock_t event_lock;
+	static int write_depth; // writeLocks held by the thread holding cache_lock
+	class writeLock
+	{
+		singleLock m_lock;
+	public:
+		writeLock();
+		~writeLock();
+	};
+	class readLock
+	{
+	public:
+		readLock() { pthread_rwlock_rdlock(&event_lock); }
+		~readLock() { pthread_rwlock_unlock(&event_lock); }
+	};
 	std::string m_filename;
 	bool m_running;
+	eEPGImage *m_image; // its titles are in eventData::titles
+	eEPGJournal m_journal; // changes since the last epg.dat snapshot
+
+	// writes epg.dat in the background, see writeSnapshot()
+	class snapshotThread: public eThread
+	{
+		eEPGCache *m_cache;
+	public:
+		snapshotThread(eEPGCache *cache): m_cache(cache) {}
+		void thread();
+	};
+	snapshotThread m_snapshot;
+	eSingleLock m_snapshot_lock; // starting m_snapshot
 
 #ifdef ENABLE_PRIVATE_EPG
 	contentMaps content_time_tables;
@@ -356,17 +683,37 @@ private:
 	void privateSectionRead(const uniqueEPGKey &, const __u8 *);
 #endif
 	void sectionRead(const __u8 *data, eit_type_t source, channel_data *channel);
+	void queueSection(const __u8 *data, eit_type_t source, channel_data *channel);
+	void stageSection(const __u8 *data, eit_type_t source, channel_data *channel, sectionBatch &batch);
+	void commitBatch(sectionBatch &batch);
+	void commitService(std::vector<pendingEvent*>::iterator it, std::vector<pendingEvent*>::iterator end, time_t now);
+	void commitQueued();
 	void gotMessage(const Message &message);
 	void flushEPG(const uniqueEPGKey & s=uniqueEPGKey());
 	void cleanLoop();
+	void touchService(const uniqueEPGKey &key, eventStore &store);
+	void scheduleExpiry(const uniqueEPGKey &key, eventStore &store);
+	void expireService(const uniqueEPGKey &key, eventStore &store, time_t now);
 
 // called from main thread
 	void DVBChannelAdded(eDVBChannel*);
 	void DVBChannelStateChanged(iDVBChannel*);
 	void DVBChannelRunning(iDVBChannel *);
 
-	timeMap::iterator m_timemap_cursor, m_timemap_end;
-	int currentQueryTsidOnid; // needed for getNextTimeEntry.. only valid until next startTimeQuery call
+	// a time query in progress, kept as times so it survives changes of the service's events
+	struct timeQuery
+	{
+		uniqueEPGKey service;
+		time_t cursor, end;
+		int tsidonid;
+		timeQuery(): cursor(0), end(0), tsidonid(0) {}
+	};
+	// hold event_lock or cache_lock while calling these
+	bool startQuery(const eServiceReference &service, time_t begin, int minutes, timeQuery &query);
+	bool nextQueryEvent(timeQuery &query, eventData &evt);
+	// the query of startTimeQuery() and getNextTimeEntry(), only valid until the next startTimeQuery call
+	timeQuery m_query;
+	eSingleLock m_query_lock;
 #else
 	eEPGCache();
 	~eEPGCache();
@@ -402,10 +749,10 @@ public:
 
 #ifndef SWIG
 private:
-	// For internal use only. Acquire the cache lock before calling.
-	RESULT lookupEventId(const eServiceReference &service, int event_id, const eventData *&);
-	RESULT lookupEventTime(const eServiceReference &service, time_t, const eventData *&, int direction=0);
-	RESULT getNextTimeEntry(const eventData *&);
+	// For internal use only. Acquire event_lock or the cache lock before calling,
+	// the event refers to the cached data and is only valid while it is held.
+	RESULT lookupEventId(const eServiceReference &service, int event_id, eventData &);
+	RESULT lookupEventTime(const eServiceReference &service, time_t, eventData &, int direction=0);
 
 public:
 	// eit_event_struct's are plain dvb eit_events .. it's not safe to use them after cache unlock
@@ -441,6 +788,9 @@ public:
 	SWIG_VOID(RESULT) getNextTimeEntry(ePtr<eServiceEvent> &SWIG_OUTPUT);
 
 	void setEpgHistorySeconds(time_t seconds);
+	// sections received from the demux are added to the cache in batches of up to @sections sections,
+	// a batch is added at latest @latency ms after its first section was received
+	void setEpgBatch(int sections, int latency);
 	void setEpgSources(unsigned int mask);
 	unsigned int getEpgSources();
 
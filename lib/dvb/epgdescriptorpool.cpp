@@ -0,0 +1,176 @@
+#include <lib/dvb/epgdescriptorpool.h>
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+enum { INITIAL_SIZE = 1024, HEADER_SIZE = 16 };
+
+eEPGDescriptorPool::eEPGDescriptorPool()
+	:m_table(new entry[INITIAL_SIZE]), m_mask(INITIAL_SIZE - 1), m_count(0), m_current(0), m_live(0), m_used(0)
+{
+	memset(m_table, 0, sizeof(entry) * INITIAL_SIZE);
+}
+
+void eEPGDescriptorPool::grow()
+{
+	entry *old = m_table;
+	unsigned int size = m_mask + 1;
+	m_mask = size * 2 - 1;
+	m_table = new entry[size * 2];
+	memset(m_table, 0, sizeof(entry) * size * 2);
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		if (!old[i].data)
+			continue;
+		unsigned int j = hash(old[i].crc) & m_mask;
+		while (m_table[j].data)
+			j = (j + 1) & m_mask;
+		m_table[j] = old[i];
+	}
+	delete [] old;
+}
+
+void eEPGDescriptorPool::erase(entry *e)
+{
+	// backward shift deletion, keeps the probe sequences intact without tombstones
+	unsigned int i = e - m_table, j = i;
+	while (1)
+	{
+		j = (j + 1) & m_mask;
+		if (!m_table[j].data)
+			break;
+		unsigned int k = hash(m_table[j].crc) & m_mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue; // already between its home slot and j
+		m_table[i] = m_table[j];
+		i = j;
+	}
+	m_table[i].data = 0;
+	--m_count;
+}
+
+__u8 *eEPGDescriptorPool::alloc(__u32 crc, const __u8 *descr)
+{
+	int size = recordSize(descr);
+	if (!m_current || HEADER_SIZE + m_current->used + size > PAGE_SIZE)
+	{
+		void *mem = 0;
+		if (posix_memalign(&mem, PAGE_SIZE, PAGE_SIZE))
+			return 0;
+		m_current = (page*)mem;
+		m_current->index = m_pages.size();
+		m_current->used = 0;
+		m_current->live = 0;
+		m_pages.push_back(m_current);
+	}
+	__u8 *record = (__u8*)m_current + HEADER_SIZE + m_current->used;
+	memcpy(record, &crc, 4);
+	memcpy(record + 4, descr, descr[1] + 2);
+	m_current->used += size;
+	m_current->live += size;
+	m_used += size;
+	m_live += size;
+	return record + 4;
+}
+
+void eEPGDescriptorPool::freePage(page *p)
+{
+	m_used -= p->used;
+	m_live -= p->live;
+	page *last = m_pages.back();
+	m_pages[p->index] = last;
+	last->index = p->index;
+	m_pages.pop_back();
+	if (p == m_current)
+		m_current = 0;
+	free(p);
+}
+
+const __u8 *eEPGDescriptorPool::insert(__u32 crc, const __u8 *descr, int refs)
+{
+	entry *e = lookup(crc);
+	if (e)
+	{
+		e->refs += refs;
+		return e->data;
+	}
+	if ((m_count + 1) * 4 > (int)(m_mask + 1) * 3)
+		grow();
+	__u8 *data = alloc(crc, descr);
+	if (!data)
+		return 0;
+	unsigned int i = hash(crc) & m_mask;
+	while (m_table[i].data)
+		i = (i + 1) & m_mask;
+	m_table[i].crc = crc;
+	m_table[i].refs = refs;
+	m_table[i].data = data;
+	++m_count;
+	return data;
+}
+
+const __u8 *eEPGDescriptorPool::unref(__u32 crc, bool &found)
+{
+	entry *e = lookup(crc);
+	found = e;
+	if (!e || --e->refs > 0)
+		return 0;
+	__u8 *data = e->data;
+	int size = recordSize(data);
+	pageOf(data)->live -= size;
+	m_live -= size;
+	erase(e);
+	return data;
+}
+
+void eEPGDescriptorPool::clear()
+{
+	for (std::vector<page*>::iterator it(m_pages.begin()); it != m_pages.end(); ++it)
+		free(*it);
+	m_pages.clear();
+	m_current = 0;
+	m_live = m_used = 0;
+	memset(m_table, 0, sizeof(entry) * (m_mask + 1));
+	m_count = 0;
+}
+
+int eEPGDescriptorPool::compact(int budget)
+{
+	// pages which are at least half dead, the emptiest first
+	std::vector<page*> sparse;
+	for (std::vector<page*>::iterator it(m_pages.begin()); it != m_pages.end(); ++it)
+		if (*it != m_current && (*it)->live * 2 <= (*it)->used)
+			sparse.push_back(*it);
+	std::sort(sparse.begin(), sparse.end(), lessLive);
+
+	int moved = 0;
+	for (std::vector<page*>::iterator it(sparse.begin()); it != sparse.end(); ++it)
+	{
+		page *p = *it;
+		if (p->live && moved + p->live > budget)
+			break;
+		__u8 *record = (__u8*)p + HEADER_SIZE, *end = record + p->used;
+		while (p->live && record < end)
+		{
+			__u32 crc;
+			memcpy(&crc, record, 4);
+			__u8 *descr = record + 4;
+			int size = recordSize(descr);
+			entry *e = lookup(crc);
+			if (e && e->data == descr)
+			{
+				__u8 *data = alloc(crc, descr);
+				if (!data)
+					return moved;
+				e->data = data;
+				p->live -= size;
+				m_live -= size;
+				moved += size;
+			}
+			record += size;
+		}
+		freePage(p);
+	}
+	return moved;
+}
@@ -0,0 +1,100 @@
+#ifndef __lib_dvb_epgdescriptorpool_h
+#define __lib_dvb_epgdescriptorpool_h
+
+#include <vector>
+
+#include <asm/types.h>
+
+/*
+ * Reference counted store for the descriptors shared by the cached events.
+ * Descriptors are keyed by their crc in an open addressing hash table, the
+ * payloads are packed into 64KB pages instead of one heap block each.
+ * A page only ever grows, released payloads are counted as dead bytes and
+ * compact() moves the live payloads of the emptiest pages into fresh ones,
+ * so the pages stay dense over a long uptime. All access must be serialized
+ * by the caller (the epg cache lock).
+ */
+class eEPGDescriptorPool
+{
+public:
+	eEPGDescriptorPool();
+	// the table and pages are intentionally not released on destruction,
+	// events may still be deleted by the cache after static destructors ran
+
+	// the payload stored with @crc or NULL
+	const __u8 *find(__u32 crc) const
+	{
+		const entry *e = lookup(crc);
+		return e ? e->data : 0;
+	}
+	// take a reference to a known descriptor, false when @crc is unknown
+	bool ref(__u32 crc)
+	{
+		entry *e = lookup(crc);
+		if (!e)
+			return false;
+		++e->refs;
+		return true;
+	}
+	// copy @descr (with its 2 byte header) into the pool with @refs references
+	const __u8 *insert(__u32 crc, const __u8 *descr, int refs = 1);
+	/*
+	 * Drop a reference. Returns NULL while the descriptor is still used or
+	 * unknown (@found tells which), else the released payload, which stays
+	 * readable until the next insert(), compact() or clear().
+	 */
+	const __u8 *unref(__u32 crc, bool &found);
+	void clear();
+
+	// move live payloads out of sparse pages, at most about @budget bytes,
+	// returns the number of bytes moved
+	int compact(int budget);
+
+	int size() const { return m_count; }
+	int pages() const { return m_pages.size(); }
+	int liveBytes() const { return m_live; }
+	int usedBytes() const { return m_used; }
+private:
+	enum { PAGE_SIZE = 64 * 1024 };
+	struct entry
+	{
+		__u32 crc;
+		int refs;
+		__u8 *data; // NULL for an empty slot
+	};
+	// at the start of every page, the payloads follow as crc + descriptor
+	struct page
+	{
+		int index; // in m_pages
+		int used;
+		int live;
+	};
+
+	entry *m_table;
+	unsigned int m_mask;
+	int m_count;
+	std::vector<page*> m_pages;
+	page *m_current;
+	int m_live, m_used;
+
+	static unsigned int hash(__u32 crc) { return crc * 0x9E3779B1; }
+	static page *pageOf(const __u8 *data) { return (page*)((unsigned long)data & ~(unsigned long)(PAGE_SIZE - 1)); }
+	static bool lessLive(const page *a, const page *b) { return a->live < b->live; }
+	static int recordSize(const __u8 *descr) { return (4 + descr[1] + 2 + 3) & ~3; }
+	entry *lookup(__u32 crc) const
+	{
+		for (unsigned int i = hash(crc) & m_mask; m_table[i].data; i = (i + 1) & m_mask)
+			if (m_table[i].crc == crc)
+				return &m_table[i];
+		return 0;
+	}
+	void grow();
+	void erase(entry *e);
+	__u8 *alloc(__u32 crc, const __u8 *descr);
+	void freePage(page *p);
+
+	eEPGDescriptorPool(const eEPGDescriptorPool &);
+	eEPGDescriptorPool &operator=(const eEPGDescriptorPool &);
+};
+
+#endif
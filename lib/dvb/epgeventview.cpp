@@ -0,0 +1,39 @@
+#include <lib/dvb/epgeventview.h>
+#include <lib/dvb/dvbtime.h>
+
+#include <string.h>
+
+time_t eEPGEventView::getBeginTime() const
+{
+	return parseDVBtime(m_header[2], m_header[3], m_header[4], m_header[5], m_header[6]);
+}
+
+int eEPGEventView::getDuration() const
+{
+	return fromBCD(m_header[7])*3600+fromBCD(m_header[8])*60+fromBCD(m_header[9]);
+}
+
+size_t eEPGEventView::size() const
+{
+	size_t size = 10;
+	for (int i = 0; i < m_count; ++i)
+		size += m_descr[i][1] + 2;
+	return size;
+}
+
+void eEPGEventView::detach(std::vector<__u8> &buffer)
+{
+	size_t pos = buffer.size();
+	buffer.resize(pos + size());
+	__u8 *p = &buffer[pos];
+	memcpy(p, m_header, 10);
+	m_header = p;
+	p += 10;
+	for (int i = 0; i < m_count; ++i)
+	{
+		int len = m_descr[i][1] + 2;
+		memcpy(p, m_descr[i], len);
+		m_descr[i] = p;
+		p += len;
+	}
+}
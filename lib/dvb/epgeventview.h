@@ -0,0 +1,53 @@
+#ifndef __lib_dvb_epgeventview_h
+#define __lib_dvb_epgeventview_h
+
+#include <time.h>
+#include <vector>
+
+#include <asm/types.h>
+
+/*
+ * Read only view of an event in the epg cache. It points at the stored event
+ * header and at the shared descriptors of the event (in the descriptor pool
+ * or in the mmap'ed epg.dat), instead of rebuilding the EIT event like
+ * eventData::get() does. The view is only valid as long as the epg cache
+ * lock is held, use detach() or eServiceEvent::parseFrom() to keep the
+ * event longer.
+ */
+class eEPGEventView
+{
+public:
+	enum { MAX_DESCRIPTORS = 64 };
+
+	eEPGEventView(): m_header(0), m_count(0) {}
+
+	// @header are the 10 bytes of the EIT event up to the descriptor loop
+	void setHeader(const __u8 *header) { m_header = header; m_count = 0; }
+	void addDescriptor(const __u8 *descr)
+	{
+		if (m_count < MAX_DESCRIPTORS)
+			m_descr[m_count++] = descr;
+	}
+
+	bool valid() const { return m_header; }
+	int getEventId() const { return (m_header[0] << 8) | m_header[1]; }
+	time_t getBeginTime() const;
+	int getDuration() const;
+
+	// bytes of the header and the descriptors
+	size_t size() const;
+	// append the header and the descriptors to @buffer and let the view point
+	// there. The buffer must not be reallocated while the view is used, so
+	// reserve() the size() of all views first.
+	void detach(std::vector<__u8> &buffer);
+
+	// the raw descriptors, including their tag and length bytes
+	int descriptorCount() const { return m_count; }
+	const __u8 *descriptor(int i) const { return m_descr[i]; }
+private:
+	const __u8 *m_header;
+	const __u8 *m_descr[MAX_DESCRIPTORS];
+	int m_count;
+};
+
+#endif
@@ -0,0 +1,314 @@
+#include <lib/dvb/epgjournal.h>
+#include <lib/dvb/crc32.h>
+#include <lib/base/ebase.h>
+#include <lib/base/eerror.h>
+
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char journal_version[16] = "ENIGMA_EPG_J1";
+enum { FILE_HEADER_SIZE = 20, BATCH_HEADER_SIZE = 8, RECORD_HEADER_SIZE = 13 };
+
+eEPGJournal::eEPGJournal()
+	:m_fd(-1), m_enabled(false), m_number(0), m_size(0)
+{
+}
+
+eEPGJournal::~eEPGJournal()
+{
+	close();
+}
+
+std::string eEPGJournal::filename(const std::string &base, unsigned int number)
+{
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".journal.%u", number);
+	return base + suffix;
+}
+
+void eEPGJournal::list(const std::string &base, std::vector<unsigned int> &numbers)
+{
+	numbers.clear();
+	std::string dir = ".", prefix = base;
+	std::string::size_type slash = base.rfind('/');
+	if (slash != std::string::npos)
+	{
+		dir = slash ? base.substr(0, slash) : "/";
+		prefix = base.substr(slash + 1);
+	}
+	prefix += ".journal.";
+	DIR *d = opendir(dir.c_str());
+	if (!d)
+		return;
+	while (struct dirent *e = readdir(d))
+	{
+		if (strncmp(e->d_name, prefix.c_str(), prefix.size()))
+			continue;
+		const char *num = e->d_name + prefix.size();
+		char *end = 0;
+		unsigned long n = strtoul(num, &end, 10);
+		if (*num && !*end)
+			numbers.push_back(n);
+	}
+	closedir(d);
+	std::sort(numbers.begin(), numbers.end());
+}
+
+void eEPGJournal::removeOlder(const std::string &base, unsigned int number)
+{
+	std::vector<unsigned int> numbers;
+	list(base, numbers);
+	for (std::vector<unsigned int>::iterator it(numbers.begin()); it != numbers.end() && *it < number; ++it)
+		unlink(filename(base, *it).c_str());
+}
+
+bool eEPGJournal::open(const std::string &base, unsigned int number, off_t pending)
+{
+	eSingleLocker w(m_write_lock);
+	m_base = base;
+	m_number = number;
+	m_size = pending;
+	return openFile();
+}
+
+bool eEPGJournal::openFile()
+{
+	closeFile();
+	std::string name = filename(m_base, m_number);
+	m_fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (m_fd < 0)
+	{
+		eDebug("[EPGC] cannot create journal %s: %m", name.c_str());
+		return false;
+	}
+	__u8 header[FILE_HEADER_SIZE];
+	memcpy(header, journal_version, sizeof(journal_version));
+	memcpy(header + sizeof(journal_version), &m_number, 4);
+	if (::write(m_fd, header, sizeof(header)) != (ssize_t)sizeof(header) || fdatasync(m_fd))
+	{
+		eDebug("[EPGC] cannot write journal %s: %m", name.c_str());
+		::close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+	m_size += sizeof(header);
+	eSingleLocker l(m_lock);
+	m_enabled = true;
+	return true;
+}
+
+void eEPGJournal::closeFile()
+{
+	{
+		eSingleLocker l(m_lock);
+		m_enabled = false;
+	}
+	if (m_fd >= 0)
+		::close(m_fd);
+	m_fd = -1;
+}
+
+void eEPGJournal::close()
+{
+	flush(true);
+	eSingleLocker w(m_write_lock);
+	closeFile();
+}
+
+bool eEPGJournal::isOpen()
+{
+	eSingleLocker l(m_lock);
+	return m_enabled;
+}
+
+void eEPGJournal::putHeader(int op, int sid, int onid, int tsid)
+{
+	if (m_buffer.empty())
+		clock_gettime(CLOCK_MONOTONIC, &m_first);
+	__u8 o = op;
+	put(&o, 1);
+	put(&sid, 4);
+	put(&onid, 4);
+	put(&tsid, 4);
+}
+
+void eEPGJournal::addEvent(int sid, int onid, int tsid, int type, const __u8 *eit, int len, const __u8 * const *descr)
+{
+	eSingleLocker l(m_lock);
+	if (!m_enabled)
+		return;
+	putHeader(EVENT, sid, onid, tsid);
+	__u8 t[2] = { (__u8)type, (__u8)len };
+	put(t, 2);
+	put(eit, len);
+	for (int i = 0; i < (len - 10) / 4; ++i)
+		put(descr[i], descr[i][1] + 2);
+}
+
+void eEPGJournal::removeEvent(int sid, int onid, int tsid, time_t start)
+{
+	eSingleLocker l(m_lock);
+	if (!m_enabled)
+		return;
+	putHeader(REMOVE, sid, onid, tsid);
+	int64_t s = start;
+	put(&s, 8);
+}
+
+void eEPGJournal::flushService(int sid, int onid, int tsid)
+{
+	eSingleLocker l(m_lock);
+	if (!m_enabled)
+		return;
+	putHeader(FLUSH, sid, onid, tsid);
+}
+
+bool eEPGJournal::write(const std::vector<__u8> &batch)
+{
+	__u32 header[2] = { (__u32)batch.size(), crc32(0xFFFFFFFF, &batch[0], batch.size()) };
+	// a torn batch is detected by its crc on replay
+	const __u8 *chunks[2] = { (const __u8*)header, &batch[0] };
+	size_t sizes[2] = { sizeof(header), batch.size() };
+	for (int i = 0; i < 2; ++i)
+	{
+		const __u8 *p = chunks[i];
+		size_t left = sizes[i];
+		while (left)
+		{
+			ssize_t wr = ::write(m_fd, p, left);
+			if (wr < 0 && errno == EINTR)
+				continue;
+			if (wr <= 0)
+				return false;
+			p += wr;
+			left -= wr;
+		}
+	}
+	if (fdatasync(m_fd))
+		return false;
+	m_size += sizeof(header) + batch.size();
+	return true;
+}
+
+void eEPGJournal::flush(bool force)
+{
+	eSingleLocker w(m_write_lock);
+	std::vector<__u8> batch;
+	{
+		eSingleLocker l(m_lock);
+		if (m_buffer.empty())
+			return;
+		if (!force && m_buffer.size() < BATCH_SIZE && timeout_usec(m_first + (long)BATCH_LATENCY) > 0)
+			return;
+		batch.swap(m_buffer);
+	}
+	if (m_fd < 0)
+		return;
+	if (!write(batch))
+	{
+		// the next snapshot still has these changes, stop journaling until then
+		eDebug("[EPGC] journal %s write failed: %m, journal disabled", filename(m_base, m_number).c_str());
+		closeFile();
+	}
+}
+
+bool eEPGJournal::rotate()
+{
+	flush(true);
+	eSingleLocker w(m_write_lock);
+	if (m_fd < 0 && m_base.empty())
+		return false;
+	++m_number;
+	m_size = 0;
+	return openFile();
+}
+
+bool eEPGJournal::read(const std::string &filename, std::vector<__u8> &payload)
+{
+	payload.clear();
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	__u8 header[FILE_HEADER_SIZE];
+	if (fstat(fd, &st) || st.st_size < FILE_HEADER_SIZE
+		|| ::read(fd, header, sizeof(header)) != (ssize_t)sizeof(header)
+		|| memcmp(header, journal_version, sizeof(journal_version)))
+	{
+		eDebug("[EPGC] journal %s has an invalid header", filename.c_str());
+		::close(fd);
+		return false;
+	}
+	std::vector<__u8> data(st.st_size - FILE_HEADER_SIZE);
+	ssize_t rd = data.empty() ? 0 : ::read(fd, &data[0], data.size());
+	::close(fd);
+	if (rd < 0)
+		return false;
+	size_t pos = 0;
+	while (pos + BATCH_HEADER_SIZE <= (size_t)rd)
+	{
+		__u32 size, crc;
+		memcpy(&size, &data[pos], 4);
+		memcpy(&crc, &data[pos + 4], 4);
+		pos += BATCH_HEADER_SIZE;
+		if (!size || pos + size > (size_t)rd || crc32(0xFFFFFFFF, &data[pos], size) != crc)
+		{
+			eDebug("[EPGC] journal %s is truncated at %u bytes", filename.c_str(), (unsigned int)(pos - BATCH_HEADER_SIZE + FILE_HEADER_SIZE));
+			break;
+		}
+		payload.insert(payload.end(), data.begin() + pos, data.begin() + pos + size);
+		pos += size;
+	}
+	return true;
+}
+
+const __u8 *eEPGJournal::next(const __u8 *p, const __u8 *end, record &r)
+{
+	if (end - p < RECORD_HEADER_SIZE)
+		return 0;
+	r.op = p[0];
+	memcpy(&r.sid, p + 1, 4);
+	memcpy(&r.onid, p + 5, 4);
+	memcpy(&r.tsid, p + 9, 4);
+	p += RECORD_HEADER_SIZE;
+	switch (r.op)
+	{
+	case EVENT:
+	{
+		if (end - p < 2)
+			return 0;
+		r.type = p[0];
+		r.len = p[1];
+		p += 2;
+		if (r.len < 10 || (r.len - 10) % 4 || end - p < r.len)
+			return 0;
+		r.eit = p;
+		p += r.len;
+		r.count = (r.len - 10) / 4;
+		for (int i = 0; i < r.count; ++i)
+		{
+			if (end - p < 2 || end - p < p[1] + 2)
+				return 0;
+			r.descr[i] = p;
+			p += p[1] + 2;
+		}
+		return p;
+	}
+	case REMOVE:
+		if (end - p < 8)
+			return 0;
+		memcpy(&r.start, p, 8);
+		return p + 8;
+	case FLUSH:
+		return p;
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,105 @@
+#ifndef __lib_dvb_epgjournal_h
+#define __lib_dvb_epgjournal_h
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <asm/types.h>
+#include <lib/base/elock.h>
+
+/*
+ * Append-only log of the changes to the epg cache since the last epg.dat
+ * snapshot, so the cache can be saved without writing all of it each time.
+ *
+ * The journals live next to epg.dat as <epg.dat>.journal.<number>. A file
+ * starts with a 16 byte version string and its number, followed by batches:
+ * the payload size, the crc32 of the payload and the payload, a sequence of
+ * records. Each flush() writes one batch, a torn batch at the end of a file
+ * (crash during the write) is ignored on replay together with everything
+ * after it.
+ *
+ * Records start with the operation and the service (sid, onid, tsid as
+ * 32 bit values):
+ *  EVENT   type, size and the EITdata of the event (header and descriptor
+ *          crcs), followed by the descriptors in the order of their crcs
+ *  REMOVE  the 64 bit start time of the event
+ *  FLUSH   nothing, a service of -1/-1/-1 flushes the complete cache
+ *
+ * Recording is serialized by the caller (the epg cache lock), flush(),
+ * rotate() and close() may run concurrently to it.
+ */
+class eEPGJournal
+{
+public:
+	enum { EVENT = 1, REMOVE = 2, FLUSH = 3 };
+	// a batch is written when it holds that many bytes or is that old
+	enum { BATCH_SIZE = 64 * 1024, BATCH_LATENCY = 1000 };
+
+	struct record
+	{
+		int op;
+		int sid, onid, tsid;
+		int type;
+		const __u8 *eit; // EITdata, header and crcs
+		int len;
+		const __u8 *descr[64]; // the descriptors of the crcs in eit
+		int count;
+		int64_t start;
+	};
+
+	eEPGJournal();
+	~eEPGJournal();
+
+	// start journal @number for @base, @pending is the size of older journals still to be compacted
+	bool open(const std::string &base, unsigned int number, off_t pending = 0);
+	void close();
+	bool isOpen();
+	unsigned int number() const { return m_number; }
+	// bytes in the journals which are not part of a snapshot yet
+	off_t size() const { return m_size; }
+
+	void addEvent(int sid, int onid, int tsid, int type, const __u8 *eit, int len, const __u8 * const *descr);
+	void removeEvent(int sid, int onid, int tsid, time_t start);
+	void flushService(int sid, int onid, int tsid);
+
+	// write the recorded changes as one batch, unless @force is false and
+	// the batch is still small and young
+	void flush(bool force);
+	// continue in a new journal with the next number, the previous one is
+	// kept until a snapshot containing it is complete
+	bool rotate();
+	// remove the journals of @base numbered below @number
+	static void removeOlder(const std::string &base, unsigned int number);
+
+	// the journal numbers of @base in ascending order
+	static void list(const std::string &base, std::vector<unsigned int> &numbers);
+	static std::string filename(const std::string &base, unsigned int number);
+	// read the valid batches of a journal, returns false if it can't be used at all
+	static bool read(const std::string &filename, std::vector<__u8> &payload);
+	// parse the record at @p, returns the start of the next one or NULL at the end
+	static const __u8 *next(const __u8 *p, const __u8 *end, record &r);
+private:
+	int m_fd;
+	bool m_enabled; // m_fd is open, changed under both locks
+	std::string m_base;
+	unsigned int m_number;
+	off_t m_size;
+	std::vector<__u8> m_buffer;
+	timespec m_first; // when the oldest record in m_buffer was added
+	eSingleLock m_lock; // m_buffer, m_enabled
+	eSingleLock m_write_lock; // m_fd, m_size
+
+	void put(const void *data, int len) { m_buffer.insert(m_buffer.end(), (const __u8*)data, (const __u8*)data + len); }
+	void putHeader(int op, int sid, int onid, int tsid);
+	bool write(const std::vector<__u8> &batch);
+	bool openFile();
+	void closeFile();
+
+	eEPGJournal(const eEPGJournal &);
+	eEPGJournal &operator=(const eEPGJournal &);
+};
+
+#endif
@@ -0,0 +1,227 @@
+#include <lib/dvb/epgtitleindex.h>
+#include <lib/base/estring.h>
+
+#include <algorithm>
+#include <iterator>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+static inline __u32 trigram(const char *p)
+{
+	return ((__u32)(__u8)tolower((__u8)p[0]) << 16) | ((__u32)(__u8)tolower((__u8)p[1]) << 8) | (__u8)tolower((__u8)p[2]);
+}
+
+eEPGTitleIndex::eEPGTitleIndex()
+{
+}
+
+std::string eEPGTitleIndex::getTitle(const __u8 *descriptor)
+{
+	int title_len = descriptor[5];
+	if (!title_len)
+		return std::string();
+	const char *title = (const char*)&descriptor[6];
+	if (descriptor[6] < 0x20)
+		/* custom encoding */
+		return convertDVBUTF8((const unsigned char*)title, title_len, 0x40, 0);
+	return std::string(title, title_len);
+}
+
+void eEPGTitleIndex::getTrigrams(const std::string &title, std::vector<__u32> &trigrams)
+{
+	trigrams.clear();
+	for (size_t i = 0; i + 3 <= title.length(); ++i)
+		trigrams.push_back(trigram(title.data() + i));
+	std::sort(trigrams.begin(), trigrams.end());
+	trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+}
+
+void eEPGTitleIndex::add(__u32 crc, const __u8 *descriptor)
+{
+	// short event descriptors without title hold the event text only
+	if (descriptor[0] != 0x4D || !descriptor[5])
+		return;
+	crcMap::iterator it = m_crcs.find(crc);
+	if (it != m_crcs.end())
+	{
+		++m_entries[it->second].refs;
+		return;
+	}
+	int slot;
+	if (m_free.empty())
+	{
+		slot = m_entries.size();
+		m_entries.push_back(entry());
+	}
+	else
+	{
+		slot = m_free.back();
+		m_free.pop_back();
+	}
+	entry &e = m_entries[slot];
+	e.crc = crc;
+	e.refs = 1;
+	e.title = getTitle(descriptor);
+	m_crcs[crc] = slot;
+
+	std::vector<__u32> trigrams;
+	getTrigrams(e.title, trigrams);
+	for (std::vector<__u32>::iterator t(trigrams.begin()); t != trigrams.end(); ++t)
+	{
+		posting &p = m_trigrams[*t];
+		// slots are mostly handed out in ascending order, keep the postings sorted
+		if (p.empty() || p.back() < slot)
+			p.push_back(slot);
+		else
+			p.insert(std::lower_bound(p.begin(), p.end(), slot), slot);
+	}
+}
+
+void eEPGTitleIndex::remove(__u32 crc, const __u8 *descriptor)
+{
+	if (descriptor[0] != 0x4D || !descriptor[5])
+		return;
+	crcMap::iterator it = m_crcs.find(crc);
+	if (it == m_crcs.end())
+		return;
+	int slot = it->second;
+	entry &e = m_entries[slot];
+	if (--e.refs)
+		return;
+
+	std::vector<__u32> trigrams;
+	getTrigrams(e.title, trigrams);
+	for (std::vector<__u32>::iterator t(trigrams.begin()); t != trigrams.end(); ++t)
+	{
+		trigramMap::iterator i = m_trigrams.find(*t);
+		if (i == m_trigrams.end())
+			continue;
+		posting &p = i->second;
+		posting::iterator pos = std::lower_bound(p.begin(), p.end(), slot);
+		if (pos != p.end() && *pos == slot)
+			p.erase(pos);
+		if (p.empty())
+			m_trigrams.erase(i);
+	}
+	std::string().swap(e.title);
+	std::vector<__u64>().swap(e.events);
+	m_crcs.erase(it);
+	m_free.push_back(slot);
+}
+
+void eEPGTitleIndex::addEvent(__u32 crc, __u64 event)
+{
+	crcMap::iterator it = m_crcs.find(crc);
+	if (it == m_crcs.end())
+		return;
+	std::vector<__u64> &events = m_entries[it->second].events;
+	if (events.empty() || events.back() < event)
+		events.push_back(event);
+	else
+	{
+		std::vector<__u64>::iterator pos = std::lower_bound(events.begin(), events.end(), event);
+		if (*pos != event)
+			events.insert(pos, event);
+	}
+}
+
+void eEPGTitleIndex::removeEvent(__u32 crc, __u64 event)
+{
+	crcMap::iterator it = m_crcs.find(crc);
+	if (it == m_crcs.end())
+		return;
+	std::vector<__u64> &events = m_entries[it->second].events;
+	std::vector<__u64>::iterator pos = std::lower_bound(events.begin(), events.end(), event);
+	if (pos != events.end() && *pos == event)
+		events.erase(pos);
+}
+
+const std::vector<__u64> *eEPGTitleIndex::events(__u32 crc) const
+{
+	crcMap::const_iterator it = m_crcs.find(crc);
+	return it != m_crcs.end() ? &m_entries[it->second].events : NULL;
+}
+
+void eEPGTitleIndex::clear()
+{
+	m_entries.clear();
+	m_free.clear();
+	m_crcs.clear();
+	m_trigrams.clear();
+}
+
+bool eEPGTitleIndex::matches(const std::string &title, const char *text, int textlen, int querytype, int casetype)
+{
+	const char *titleptr = title.data();
+	int title_len = title.length();
+	if (title_len < textlen)
+		/* doesn't fit, so cannot match anything */
+		return false;
+	if (querytype == EXACT)
+	{
+		/* require exact title match */
+		if (title_len != textlen)
+			return false;
+	}
+	else if (querytype == STARTS_WITH)
+		/* do a "startswith" match by pretending the text isn't that long */
+		title_len = textlen;
+	for (; title_len >= textlen; --title_len, ++titleptr)
+	{
+		if (casetype ? !strncasecmp(titleptr, text, textlen) : !memcmp(titleptr, text, textlen))
+			return true;
+	}
+	return false;
+}
+
+struct less_posting_size
+{
+	bool operator()(const std::vector<int> *a, const std::vector<int> *b) const
+	{
+		return a->size() < b->size();
+	}
+};
+
+int eEPGTitleIndex::find(const char *text, int textlen, int querytype, int casetype, __u32 *result, int max) const
+{
+	int count = 0;
+	if (textlen < 3)
+	{
+		/* too short for a trigram, compare all titles */
+		for (std::vector<entry>::const_iterator it(m_entries.begin()); it != m_entries.end() && count < max; ++it)
+		{
+			if (it->refs && matches(it->title, text, textlen, querytype, casetype))
+				result[count++] = it->crc;
+		}
+		return count;
+	}
+
+	std::vector<__u32> trigrams;
+	getTrigrams(std::string(text, textlen), trigrams);
+	std::vector<const posting*> postings;
+	for (std::vector<__u32>::iterator t(trigrams.begin()); t != trigrams.end(); ++t)
+	{
+		trigramMap::const_iterator i = m_trigrams.find(*t);
+		if (i == m_trigrams.end())
+			return 0;
+		postings.push_back(&i->second);
+	}
+	// intersect starting with the rarest trigram, that keeps the candidate set small
+	std::sort(postings.begin(), postings.end(), less_posting_size());
+	posting candidates(*postings[0]), tmp;
+	for (size_t i = 1; i < postings.size() && !candidates.empty(); ++i)
+	{
+		tmp.clear();
+		std::set_intersection(candidates.begin(), candidates.end(),
+			postings[i]->begin(), postings[i]->end(), std::back_inserter(tmp));
+		candidates.swap(tmp);
+	}
+	for (posting::iterator it(candidates.begin()); it != candidates.end() && count < max; ++it)
+	{
+		const entry &e = m_entries[*it];
+		if (matches(e.title, text, textlen, querytype, casetype))
+			result[count++] = e.crc;
+	}
+	return count;
+}
@@ -0,0 +1,85 @@
+#ifndef __lib_dvb_epgtitleindex_h
+#define __lib_dvb_epgtitleindex_h
+
+#include <string>
+#include <vector>
+#include <ext/hash_map>
+
+#include <asm/types.h>
+
+/*
+ * Trigram index over the titles of the cached short event descriptors.
+ * Titles are keyed by the crc the descriptor is stored with in the epg cache,
+ * every trigram of the case folded title points to the titles containing it.
+ * A query intersects the postings of the trigrams of the search text and only
+ * compares the remaining candidates, so it doesn't depend on the cache size.
+ *
+ * The same descriptor can be added more than once (heap and mmap'ed epg.dat),
+ * it stays in the index until it was removed as often as it was added.
+ *
+ * Every title also keeps the events of the heap cache using it, so a search
+ * goes from the matching titles straight to the events. Events are packed
+ * into a 64 bit key by eventKey(). The events of the mmap'ed epg.dat are
+ * found through its own title section instead.
+ */
+class eEPGTitleIndex
+{
+public:
+	enum { EXACT = 1, PARTIAL = 2, STARTS_WITH = 3 };
+
+	eEPGTitleIndex();
+
+	// add/remove a cached descriptor, anything but a short event descriptor is ignored
+	void add(__u32 crc, const __u8 *descriptor);
+	void remove(__u32 crc, const __u8 *descriptor);
+	void clear();
+
+	static __u64 eventKey(int sid, int onid, int tsid, __u16 event_id)
+	{
+		return ((__u64)(sid & 0xFFFF) << 48) | ((__u64)(onid & 0xFFFF) << 32) | ((__u64)(tsid & 0xFFFF) << 16) | event_id;
+	}
+	static void splitEventKey(__u64 key, int &sid, int &onid, int &tsid, __u16 &event_id)
+	{
+		sid = (key >> 48) & 0xFFFF;
+		onid = (key >> 32) & 0xFFFF;
+		tsid = (key >> 16) & 0xFFFF;
+		event_id = key & 0xFFFF;
+	}
+	// add/remove an event using the descriptor @crc, ignored if it is no title in the index
+	void addEvent(__u32 crc, __u64 event);
+	void removeEvent(__u32 crc, __u64 event);
+	// the events using the title @crc, sorted, NULL if it is no title in the index
+	const std::vector<__u64> *events(__u32 crc) const;
+
+	/*
+	 * Collect the crcs of all titles matching @text, using the semantics of
+	 * eEPGCache::search(): querytype EXACT, PARTIAL or STARTS_WITH, casetype
+	 * != 0 for a case insensitive (ASCII) comparison. Returns the number of
+	 * crcs stored in @result, at most @max.
+	 */
+	int find(const char *text, int textlen, int querytype, int casetype, __u32 *result, int max) const;
+
+	int size() const { return m_crcs.size(); }
+private:
+	struct entry
+	{
+		__u32 crc;
+		int refs; // 0 for a free slot
+		std::string title;
+		std::vector<__u64> events;
+	};
+	typedef std::vector<int> posting;
+	typedef __gnu_cxx::hash_map<__u32, int> crcMap;
+	typedef __gnu_cxx::hash_map<__u32, posting> trigramMap;
+
+	std::vector<entry> m_entries;
+	std::vector<int> m_free;
+	crcMap m_crcs;
+	trigramMap m_trigrams;
+
+	static std::string getTitle(const __u8 *descriptor);
+	static void getTrigrams(const std::string &title, std::vector<__u32> &trigrams);
+	static bool matches(const std::string &title, const char *text, int textlen, int querytype, int casetype);
+};
+
+#endif
@@ -40,7 +40,13 @@ public:
 		/* for saving additional meta data. */
 	virtual RESULT setTargetFilename(const std::string& filename) = 0;
 	virtual RESULT setBoundary(off_t max) = 0;
+		/* write the first @size bytes of the target over and over (a timeshift ring), 0 for a normal file. */
+		/* needs a target filename, readers find the ring by it. */
+	virtual RESULT setRingSize(off_t size) = 0;
 	virtual RESULT enableAccessPoints(bool enable) = 0;
+		/* timeshift data yields to recordings when they share a disk. */
+	enum write_priority { priorityRecording, priorityTimeshift };
+	virtual RESULT setWritePriority(write_priority priority) = 0;
 	
 	virtual RESULT stop() = 0;
 
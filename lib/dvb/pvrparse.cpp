@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <byteswap.h>
 #include <sys/mman.h>
+#include <algorithm>
 
 #ifndef BYTE_ORDER
 #	error no byte order defined!
@@ -49,6 +50,17 @@ void eMPEGStreamInformation::close()
 		m_structure_read_fd = -1;
 		m_structure_file_entries = 0;
 	}
+	m_ring = 0;
+}
+
+namespace
+{
+	struct AccessPointOffsetLess
+	{
+		template <class T> bool operator()(const T &a, off_t b) const { return a.off < b; }
+		template <class T> bool operator()(off_t a, const T &b) const { return a < b.off; }
+		template <class T> bool operator()(const T &a, const T &b) const { return a.off < b.off; }
+	};
 }
 
 int eMPEGStreamInformation::load(const char *filename)
@@ -56,66 +68,107 @@ int eMPEGStreamInformation::load(const char *filename)
 	//eDebug("[eMPEGStreamInformation] {%d} load(%s)", gettid(), filename);
 	close();
 	std::string s_filename(filename);
+	eRingFileState::lookup(s_filename, m_ring);
 	m_structure_read_fd = ::open((s_filename + ".sc").c_str(), O_RDONLY);
-	m_access_points.clear();
-	m_pts_to_offset.clear();
+	std::vector<AccessPoint>().swap(m_access_points);
 	m_timestamp_deltas.clear();
+	std::vector<pts_t>().swap(m_fixed_pts_max);
+	std::vector<unsigned int>().swap(m_pts_order);
 	CFile f((s_filename + ".ap").c_str(), "rb");
 	if (!f)
 		return -1;
-	while (1)
+	struct stat st;
+	if (!fstat(fileno(f), &st))
+		m_access_points.reserve(st.st_size / 16);
+	bool sorted = true;
+	unsigned long long d[512][2];
+	size_t count;
+	while ((count = fread(d, sizeof(d[0]), 512, f)) > 0)
 	{
-		unsigned long long d[2];
-		if (fread(d, sizeof(d), 1, f) < 1)
-			break;
-		d[0] = be64toh(d[0]);
-		d[1] = be64toh(d[1]);
-		m_access_points[d[0]] = d[1];
-		m_pts_to_offset.insert(std::pair<pts_t,off_t>(d[1], d[0]));
+		for (size_t i = 0; i < count; ++i)
+		{
+			AccessPoint ap;
+			ap.off = be64toh(d[i][0]);
+			ap.pts = be64toh(d[i][1]);
+			if (!m_access_points.empty() && ap.off <= m_access_points.back().off)
+				sorted = false;
+			m_access_points.push_back(ap);
+		}
+	}
+	if (!sorted)
+	{
+		/* the writer only appends, but keep what the old map made of broken files: */
+		/* ordered by offset, the last entry wins for an offset */
+		std::stable_sort(m_access_points.begin(), m_access_points.end(), AccessPointOffsetLess());
+		std::vector<AccessPoint>::iterator out = m_access_points.begin();
+		for (std::vector<AccessPoint>::iterator i = m_access_points.begin(); i != m_access_points.end(); ++i)
+		{
+			if (i + 1 != m_access_points.end() && (i + 1)->off == i->off)
+				continue;
+			*out++ = *i;
+		}
+		m_access_points.erase(out, m_access_points.end());
 	}
 	/* assume the accesspoints are in streamtime, if they start with a 0 timestamp */
-	m_streamtime_accesspoints = (!m_access_points.empty() && m_access_points.begin()->second == 0);
+	m_streamtime_accesspoints = (!m_access_points.empty() && m_access_points.front().pts == 0);
 	fixupDiscontinuties();
 	return 0;
 }
 
+int eMPEGStreamInformation::loadStructure(const char *filename)
+{
+	close();
+	std::string s_filename(filename);
+	eRingFileState::lookup(s_filename, m_ring);
+	m_structure_read_fd = ::open((s_filename + ".sc").c_str(), O_RDONLY);
+	return m_structure_read_fd < 0 ? -1 : 0;
+}
+
 void eMPEGStreamInformation::fixupDiscontinuties()
 {
 	if (m_access_points.empty())
 		return;
 		/* if we have no delta at the beginning, extrapolate it */
-	if ((m_access_points.find(0) == m_access_points.end()) && (m_access_points.size() > 1))
+	if ((m_access_points.front().off != 0) && (m_access_points.size() > 1))
 	{
-		std::map<off_t,pts_t>::const_iterator second = m_access_points.begin();
-		std::map<off_t,pts_t>::const_iterator first  = second++;
-		if (first->first < second->first) /* i.e., not equal or broken */
+		const AccessPoint &first = m_access_points[0], &second = m_access_points[1];
+		if (first.off < second.off) /* i.e., not equal or broken */
 		{
-			off_t diff = second->first - first->first;
-			pts_t tdiff = second->second - first->second;
-			tdiff *= first->first;
+			off_t diff = second.off - first.off;
+			pts_t tdiff = second.pts - first.pts;
+			tdiff *= first.off;
 			tdiff /= diff;
-			m_timestamp_deltas[0] = first->second - tdiff;
-//			eDebug("first delta is %08llx", first->second - tdiff);
+			AccessPoint delta;
+			delta.off = 0;
+			delta.pts = first.pts - tdiff;
+			m_timestamp_deltas.push_back(delta);
+//			eDebug("first delta is %08llx", first.pts - tdiff);
 		}
 	}
 
 	if (m_timestamp_deltas.empty())
-		m_timestamp_deltas[m_access_points.begin()->first] = m_access_points.begin()->second;
+		m_timestamp_deltas.push_back(m_access_points.front());
 
-	pts_t currentDelta = m_timestamp_deltas.begin()->second, lastpts_t = 0;
-	for (std::map<off_t,pts_t>::const_iterator i(m_access_points.begin()); i != m_access_points.end(); ++i)
+	pts_t currentDelta = m_timestamp_deltas.front().pts, lastpts_t = 0;
+	for (std::vector<AccessPoint>::const_iterator i(m_access_points.begin()); i != m_access_points.end(); ++i)
 	{
-		pts_t current = i->second - currentDelta;
+		pts_t current = i->pts - currentDelta;
 		pts_t diff = current - lastpts_t;
 		
 		if (llabs(diff) > (90000*10)) // 10sec diff
 		{
-//			eDebug("%llx < %llx, have discont. new timestamp is %llx (diff is %llx)!", current, lastpts_t, i->second, diff);
-			currentDelta = i->second - lastpts_t; /* FIXME: should be the extrapolated new timestamp, based on the current rate */
-//			eDebug("current delta now %llx, making current to %llx", currentDelta, i->second - currentDelta);
-			m_timestamp_deltas[i->first] = currentDelta;
+//			eDebug("%llx < %llx, have discont. new timestamp is %llx (diff is %llx)!", current, lastpts_t, i->pts, diff);
+			currentDelta = i->pts - lastpts_t; /* FIXME: should be the extrapolated new timestamp, based on the current rate */
+//			eDebug("current delta now %llx, making current to %llx", currentDelta, i->pts - currentDelta);
+			AccessPoint delta;
+			delta.off = i->off;
+			delta.pts = currentDelta;
+			if (m_timestamp_deltas.back().off == i->off)
+				m_timestamp_deltas.back() = delta;
+			else
+				m_timestamp_deltas.push_back(delta);
 		}
-		lastpts_t = i->second - currentDelta;
+		lastpts_t = i->pts - currentDelta;
 	}
 }
 
@@ -123,11 +176,47 @@ pts_t eMPEGStreamInformation::getDelta(off_t offset)
 {
 	if (!m_timestamp_deltas.size())
 		return 0;
-	std::map<off_t,pts_t>::iterator i = m_timestamp_deltas.upper_bound(offset);
+	std::vector<AccessPoint>::const_iterator i = std::upper_bound(m_timestamp_deltas.begin(), m_timestamp_deltas.end(), offset, AccessPointOffsetLess());
 	/* i can be the first when you query for something before the first PTS */
 	if (i != m_timestamp_deltas.begin())
 		--i;
-	return i->second;
+	return i->pts;
+}
+
+void eMPEGStreamInformation::buildFixedPTSIndex()
+{
+	m_fixed_pts_max.resize(m_access_points.size());
+	std::vector<AccessPoint>::const_iterator delta = m_timestamp_deltas.begin();
+	pts_t max = 0;
+	for (size_t i = 0; i < m_access_points.size(); ++i)
+	{
+		const AccessPoint &ap = m_access_points[i];
+		/* same as getDelta(ap.off), the access points come in offset order */
+		while (delta + 1 < m_timestamp_deltas.end() && (delta + 1)->off <= ap.off)
+			++delta;
+		pts_t c = ap.pts - (delta != m_timestamp_deltas.end() ? delta->pts : 0);
+		if (!i || c > max)
+			max = c;
+		m_fixed_pts_max[i] = max;
+	}
+}
+
+struct eMPEGStreamInformation::PTSLess
+{
+	const std::vector<AccessPoint> &ap;
+	PTSLess(const std::vector<AccessPoint> &a): ap(a) {}
+	bool operator()(unsigned int a, unsigned int b) const { return ap[a].pts < ap[b].pts; }
+	bool operator()(unsigned int a, pts_t b) const { return ap[a].pts < b; }
+	bool operator()(pts_t a, unsigned int b) const { return a < ap[b].pts; }
+};
+
+void eMPEGStreamInformation::buildPTSIndex()
+{
+	m_pts_order.resize(m_access_points.size());
+	for (size_t i = 0; i < m_pts_order.size(); ++i)
+		m_pts_order[i] = i;
+	/* stable, so equal timestamps stay in offset order like in the old multimap */
+	std::stable_sort(m_pts_order.begin(), m_pts_order.end(), PTSLess(m_access_points));
 }
 
 // fixupPTS is apparently called to get UI time information and such
@@ -147,21 +236,24 @@ int eMPEGStreamInformation::fixupPTS(const off_t &offset, pts_t &ts)
 	if (m_timestamp_deltas.empty())
 		return -1;
 
-	std::multimap<pts_t, off_t>::const_iterator 
-		l = m_pts_to_offset.upper_bound(ts - 60 * 90000), 
-		u = m_pts_to_offset.upper_bound(ts + 60 * 90000), 
-		nearest = m_pts_to_offset.end();
+	if (m_pts_order.size() != m_access_points.size())
+		buildPTSIndex();
+	PTSLess less(m_access_points);
+	std::vector<unsigned int>::const_iterator 
+		l = std::upper_bound(m_pts_order.begin(), m_pts_order.end(), ts - 60 * 90000, less), 
+		u = std::upper_bound(m_pts_order.begin(), m_pts_order.end(), ts + 60 * 90000, less), 
+		nearest = m_pts_order.end();
 
 	while (l != u)
 	{
-		if ((nearest == m_pts_to_offset.end()) || (llabs(l->first - ts) < llabs(nearest->first - ts)))
+		if ((nearest == m_pts_order.end()) || (llabs(m_access_points[*l].pts - ts) < llabs(m_access_points[*nearest].pts - ts)))
 			nearest = l;
 		++l;
 	}
-	if (nearest == m_pts_to_offset.end())
+	if (nearest == m_pts_order.end())
 		return 1;
 
-	ts -= getDelta(nearest->second);
+	ts -= getDelta(m_access_points[*nearest].off);
 
 	return 0;
 }
@@ -170,7 +262,7 @@ int eMPEGStreamInformation::fixupPTS(const off_t &offset, pts_t &ts)
 int eMPEGStreamInformation::getPTS(off_t &offset, pts_t &pts)
 {
 	//eDebug("[eMPEGStreamInformation] {%d} getPTS(offset=%llu, pts=%llu)", gettid(), offset, pts);
-	std::map<off_t,pts_t>::iterator before = m_access_points.lower_bound(offset);
+	std::vector<AccessPoint>::const_iterator before = std::lower_bound(m_access_points.begin(), m_access_points.end(), offset, AccessPointOffsetLess());
 
 		/* usually, we prefer the AP before the given offset. however if there is none, we take any. */
 	if (before != m_access_points.begin())
@@ -182,8 +274,8 @@ int eMPEGStreamInformation::getPTS(off_t &offset, pts_t &pts)
 		return -1;
 	}
 	
-	offset = before->first;
-	pts = before->second - getDelta(offset);
+	offset = before->off;
+	pts = before->pts - getDelta(offset);
 	
 	return 0;
 }
@@ -191,8 +283,8 @@ int eMPEGStreamInformation::getPTS(off_t &offset, pts_t &pts)
 pts_t eMPEGStreamInformation::getInterpolated(off_t offset)
 {
 		/* get the PTS values before and after the offset. */
-	std::map<off_t,pts_t>::iterator before, after;
-	after = m_access_points.upper_bound(offset);
+	std::vector<AccessPoint>::const_iterator before, after;
+	after = std::upper_bound(m_access_points.begin(), m_access_points.end(), offset, AccessPointOffsetLess());
 	before = after;
 
 	if (before != m_access_points.begin())
@@ -205,19 +297,19 @@ pts_t eMPEGStreamInformation::getInterpolated(off_t offset)
 		return 0;
 
 		/* if after == end, then we need to extrapolate ... FIXME */
-	if ((before->first == offset) || (after == m_access_points.end()))
-		return before->second - getDelta(offset);
+	if ((before->off == offset) || (after == m_access_points.end()))
+		return before->pts - getDelta(offset);
 	
-	pts_t before_ts = before->second - getDelta(before->first);
-	pts_t after_ts = after->second - getDelta(after->first);
+	pts_t before_ts = before->pts - getDelta(before->off);
+	pts_t after_ts = after->pts - getDelta(after->off);
 	
 //	eDebug("%08llx .. ? .. %08llx", before_ts, after_ts);
-//	eDebug("%08llx .. %08llx .. %08llx", before->first, offset, after->first);
+//	eDebug("%08llx .. %08llx .. %08llx", before->off, offset, after->off);
 	
 	pts_t diff = after_ts - before_ts;
-	off_t diff_off = after->first - before->first;
+	off_t diff_off = after->off - before->off;
 	
-	diff = (offset - before->first) * diff / diff_off;
+	diff = (offset - before->off) * diff / diff_off;
 //	eDebug("%08llx .. %08llx .. %08llx", before_ts, before_ts + diff, after_ts);
 	return before_ts + diff;
 }
@@ -225,24 +317,22 @@ pts_t eMPEGStreamInformation::getInterpolated(off_t offset)
 off_t eMPEGStreamInformation::getAccessPoint(pts_t ts, int marg)
 {
 	//eDebug("eMPEGStreamInformation::getAccessPoint(ts=%llu, marg=%d)", ts, marg);
-		/* FIXME: more efficient implementation */
-	off_t last = 0;
-	off_t last2 = 0;
+	if (m_fixed_pts_max.size() != m_access_points.size())
+		buildFixedPTSIndex();
 	ts += 1; // Add rounding error margin
-	for (std::map<off_t, pts_t>::const_iterator i(m_access_points.begin()); i != m_access_points.end(); ++i)
+	/* the first access point with a fixed up pts above ts is the first one */
+	/* where the running maximum exceeds it */
+	size_t i = std::upper_bound(m_fixed_pts_max.begin(), m_fixed_pts_max.end(), ts) - m_fixed_pts_max.begin();
+	off_t last = i > 0 ? m_access_points[i - 1].off : 0;
+	off_t last2 = i > 1 ? m_access_points[i - 2].off : 0;
+	if (i < m_access_points.size())
 	{
-		pts_t delta = getDelta(i->first);
-		pts_t c = i->second - delta;
-		if (c > ts) {
-			if (marg > 0)
-				return (last + i->first)/376*188;
-			else if (marg < 0)
-				return (last + last2)/376*188;
-			else
-				return last;
-		}
-		last2 = last;
-		last = i->first;
+		if (marg > 0)
+			return (last + m_access_points[i].off)/376*188;
+		else if (marg < 0)
+			return (last + last2)/376*188;
+		else
+			return last;
 	}
 	if (marg < 0)
 		return (last + last2)/376*188;
@@ -258,24 +348,26 @@ int eMPEGStreamInformation::getNextAccessPoint(pts_t &ts, const pts_t &start, in
 		return -1;
 	}
 	off_t offset = getAccessPoint(start);
-	std::map<off_t, pts_t>::const_iterator i = m_access_points.find(offset);
-	if (i == m_access_points.end())
+	std::vector<AccessPoint>::const_iterator i = std::lower_bound(m_access_points.begin(), m_access_points.end(), offset, AccessPointOffsetLess());
+	if (i == m_access_points.end() || i->off != offset)
 	{
 		eDebug("getNextAccessPoint: initial AP not found");
 		return -1;
 	}
-	pts_t c1 = i->second - getDelta(i->first);
+	pts_t c1 = i->pts - getDelta(i->off);
 	while (direction)
 	{
 		while (direction > 0)
 		{
-			if (i == m_access_points.end())
+			if (i + 1 == m_access_points.end())
 				return -1;
 			++i;
-			pts_t c2 = i->second - getDelta(i->first);
+			pts_t c2 = i->pts - getDelta(i->off);
 			if (c1 == c2) { // Discontinuity
+				if (i + 1 == m_access_points.end())
+					return -1;
 				++i;
-				c2 = i->second - getDelta(i->first);
+				c2 = i->pts - getDelta(i->off);
 			}
 			c1 = c2;
 			direction--;
@@ -288,17 +380,22 @@ int eMPEGStreamInformation::getNextAccessPoint(pts_t &ts, const pts_t &start, in
 				return -1;
 			}
 			--i;
-			pts_t c2 = i->second - getDelta(i->first);
+			pts_t c2 = i->pts - getDelta(i->off);
 			if (c1 == c2) { // Discontinuity
+				if (i == m_access_points.begin())
+				{
+					eDebug("getNextAccessPoint at start");
+					return -1;
+				}
 				--i;
-				c2 = i->second - getDelta(i->first);
+				c2 = i->pts - getDelta(i->off);
 			}
 			c1 = c2;
 			direction++;
 		}
 	}
-	ts = i->second - getDelta(i->first);
-	eDebug("getNextAccessPoint fine, at %lld - %lld = %lld", ts, i->second, getDelta(i->first));
+	ts = i->pts - getDelta(i->off);
+	eDebug("getNextAccessPoint fine, at %lld - %lld = %lld", ts, i->pts, getDelta(i->off));
 	return 0;
 }
 
@@ -307,17 +404,38 @@ int eMPEGStreamInformation::getNextAccessPoint(pts_t &ts, const pts_t &start, in
 
 static const int entry_size = 16;
 
+int eMPEGStreamInformation::structureBegin()
+{
+	return m_ring ? m_ring->structureBegin() : 0;
+}
+
+int eMPEGStreamInformation::structureEnd()
+{
+	if (m_ring)
+		return m_ring->structureEnd();
+	return ::lseek(m_structure_read_fd, 0, SEEK_END) / entry_size;
+}
+
+	/* where entry @index is in the structure file */
+off_t eMPEGStreamInformation::structurePosition(int index)
+{
+	if (m_ring)
+		return (off_t)(index % m_ring->structureSize()) * entry_size;
+	return (off_t)index * entry_size;
+}
+
 int eMPEGStreamInformation::moveCache(int index)
 {
 	//eDebug("[eMPEGStreamInformation::moveCache] index=%d m_cache_index=%d m_structure_cache_entries=%d", index, m_cache_index, m_structure_cache_entries);
 	// Check if index falls inside current range.
-	if ((m_structure_cache_entries != 0) && (index >= m_cache_index) && (index < m_cache_index + m_structure_cache_entries))
+	if ((m_structure_cache_entries != 0) && (index >= m_cache_index) && (index < m_cache_index + m_structure_cache_entries) &&
+		(!m_ring || m_cache_index >= structureBegin()))
 	{
 		// Request for the same data. If the request is at the end of the stream,
 		// check if the file has become larger.
 		if (index + m_structure_cache_entries >= m_structure_file_entries)
 		{
-			int l = ::lseek(m_structure_read_fd, 0, SEEK_END) / entry_size;
+			int l = structureEnd();
 			if (l == m_structure_file_entries)
 			{
 				// No change to file, just return
@@ -348,8 +466,9 @@ int eMPEGStreamInformation::loadCache(int index)
 		m_structure_cache_entries = 0;
 		m_cache_index = -1;
 	}
-	off_t where = ROUND_TO_PAGESIZE(index * entry_size);
-	off_t until = ::lseek(m_structure_read_fd, 0, SEEK_END);
+	int first = index - index % (PAGESIZE / entry_size);
+	off_t where = (off_t)first * entry_size;
+	off_t until = (off_t)structureEnd() * entry_size;
 	size_t bytes;
 	if (where + MAPSIZE <= until)
 	{
@@ -357,7 +476,7 @@ int eMPEGStreamInformation::loadCache(int index)
 	}
 	else
 	{
-		if (index * entry_size >= until)
+		if ((off_t)index * entry_size >= until)
 		{
 			eDebug("[eMPEGStreamInformation] index %d is past EOF", index);
 			return 0;
@@ -369,8 +488,15 @@ int eMPEGStreamInformation::loadCache(int index)
 			return 0;
 		}
 	}
+	if (m_ring)
+	{
+		// a window ends at the end of the ring file
+		off_t left = (off_t)m_ring->structureSize() * entry_size - structurePosition(first);
+		if ((off_t)bytes > left)
+			bytes = left;
+	}
 	//eDebug("[eMPEGStreamInformation] mmap offset=%lld size %d", where, bytes);
-	m_structure_cache = (unsigned long long*) ::mmap(NULL, bytes, PROT_READ, MAP_SHARED, m_structure_read_fd, where);
+	m_structure_cache = (unsigned long long*) ::mmap(NULL, bytes, PROT_READ, MAP_SHARED, m_structure_read_fd, structurePosition(first));
 	if (m_structure_cache == NULL)
 	{
 		eDebug("[eMPEGStreamInformation] failed to mmap cache: %m");
@@ -378,10 +504,12 @@ int eMPEGStreamInformation::loadCache(int index)
 		m_structure_cache_entries = 0;
 		return -1;
 	}
-	m_cache_index = (int)(where / entry_size);
+	m_cache_index = first;
 	//eDebug("[eMPEGStreamInformation] cache index %d starts at %d (%lld) bytes: %d", index, m_cache_index, where, bytes);
 	int num = (int)bytes / entry_size;
 	m_structure_cache_entries = num;
+	// moveCache maps again when the file has grown since
+	m_structure_file_entries = (int)(until / entry_size);
 	return num;
 }
 
@@ -396,26 +524,29 @@ int eMPEGStreamInformation::getStructureEntryFirst(off_t &offset, unsigned long
 
 	if ((m_structure_cache_entries == 0) ||
 	    (structureCacheOffset(0) > offset) ||
-	    (structureCacheOffset(m_structure_cache_entries - 1) <= offset))
+	    (structureCacheOffset(m_structure_cache_entries - 1) <= offset) ||
+	    (m_ring && m_cache_index < structureBegin()))
 	{
-		int l = ::lseek(m_structure_read_fd, 0, SEEK_END) / entry_size;
-		if (l == 0)
+		int l = structureEnd();
+		int first = structureBegin();
+		if (l <= first)
 		{
 			eDebug("getStructureEntryFirst failed because file size is zero");
 			return -1;
 		}
-		m_structure_file_entries = l;
 
 		/* do a binary search */
-		int count = l;
-		int i = 0;
+		int count = l - first;
+		int i = first;
 		const int structure_cache_size = MAPSIZE / entry_size;
-		while (count > (structure_cache_size/4))
+		// a window in a ring can be cut short by the end of the file, so search
+		// a ring down to the entry itself
+		const int search_until = m_ring ? 0 : structure_cache_size/4;
+		while (count > search_until)
 		{
 			int step = count >> 1;
-			::lseek(m_structure_read_fd, (i + step) * entry_size, SEEK_SET);
 			unsigned long long d;
-			if (::read(m_structure_read_fd, &d, sizeof(d)) < (ssize_t)sizeof(d))
+			if (::pread(m_structure_read_fd, &d, sizeof(d), structurePosition(i + step)) < (ssize_t)sizeof(d))
 			{
 				eDebug("getStructureEntryFirst read error at entry %d", i+step);
 				return -1;
@@ -430,14 +561,22 @@ int eMPEGStreamInformation::getStructureEntryFirst(off_t &offset, unsigned long
 		}
 		//eDebug("[eMPEGStreamInformation] getStructureEntryFirst i=%d size=%d count=%d", i, l, count);
 
-		if (i + structure_cache_size > l)
+		if (m_ring)
+		{
+			// i is the first entry past offset, the one before it is wanted
+			if (i > first)
+				--i;
+		}
+		else if (i + structure_cache_size > l)
 		{
 			i = l - structure_cache_size; // Near end of file, just fetch the last
 		}
-		if (i < 0)
-			i = 0;
+		if (i < first)
+			i = first;
 		int num = moveCache(i);
-		if ((num < structure_cache_size) && (structureCacheOffset(num - 1) <= offset))
+		if (num <= 0)
+			return -1;
+		if ((m_ring ? m_cache_index + num >= l : num < structure_cache_size) && (structureCacheOffset(num - 1) <= offset))
 		{
 			eDebug("[eMPEGStreamInformation] offset %lld is past EOF of structure file", offset);
 			data = 0;
@@ -474,7 +613,7 @@ int eMPEGStreamInformation::getStructureEntryNext(off_t &offset, unsigned long l
 {
 	//eDebug("[eMPEGStreamInformation] {%d} getStructureEntryNext(offset=%llu, delta=%d)", gettid(), offset, delta);
 	int next = m_current_entry + delta;
-	if (next < 0)
+	if (next < structureBegin())
 	{
 		eDebug("getStructureEntryNext before start-of-file");
 		return -1;
@@ -489,15 +628,20 @@ int eMPEGStreamInformation::getStructureEntryNext(off_t &offset, unsigned long l
 			// When moving backwards, take a bigger step back (but we will probably be moving forward later...)
 			const int structure_cache_size = MAPSIZE / entry_size;
 			where = next - structure_cache_size/2;
-			if (where < 0)
-				where = 0;
+			if (where < structureBegin())
+				where = structureBegin();
 		}
 		else
 		{
 			where = next;
 		}
 		int num = moveCache(where);
-		if (num <= 0)
+		if (num > 0 && next - m_cache_index >= num)
+		{
+			// the window ended at the end of the ring file before it got to next
+			num = moveCache(next);
+		}
+		if (num <= 0 || next - m_cache_index >= num)
 		{
 			eDebug("getStructureEntryNext failed, no data");
 			return -1;
@@ -516,15 +660,36 @@ int eMPEGStreamInformation::getStructureEntryNext(off_t &offset, unsigned long l
 int eMPEGStreamInformation::getFirstFrame(off_t &offset, pts_t& pts)
 {
 	//eDebug("{%d} eMPEGStreamInformation::getFirstFrame", gettid());
-	std::map<off_t,pts_t>::const_iterator entry = m_access_points.begin();
-	if (entry != m_access_points.end())
+	if (!m_access_points.empty())
 	{
-		offset = entry->first;
-		pts = entry->second;
+		offset = m_access_points.front().off;
+		pts = m_access_points.front().pts;
 		return 0;
 	}
 	// No access points (yet?) use the .sc data instead
-	if (m_structure_read_fd >= 0)
+	if (m_structure_read_fd >= 0 && m_ring)
+	{
+		// the oldest entries of a ring may describe data that is gone already
+		offset = m_ring->begin();
+		unsigned long long data;
+		if (getStructureEntryFirst(offset, data) != 0)
+		{
+			offset = 0;
+			pts = 0;
+			return 1;
+		}
+		for (int i = 0; i < 20; ++i)
+		{
+			if (offset >= m_ring->begin() && (data & 0x1000000) != 0)
+			{
+				pts = data >> 31;
+				return 0;
+			}
+			if (getStructureEntryNext(offset, data, 1) != 0)
+				break;
+		}
+	}
+	else if (m_structure_read_fd >= 0)
 	{
 		int num = moveCache(0);
 		if (num <= 0)
@@ -551,18 +716,17 @@ int eMPEGStreamInformation::getFirstFrame(off_t &offset, pts_t& pts)
 int eMPEGStreamInformation::getLastFrame(off_t &offset, pts_t& pts)
 {
 	//eDebug("{%d} eMPEGStreamInformation::getLastFrame", gettid());
-	std::map<off_t,pts_t>::const_reverse_iterator entry = m_access_points.rbegin();
-	if (entry != m_access_points.rend())
+	if (!m_access_points.empty())
 	{
-		offset = entry->first;
-		pts = entry->second;
+		offset = m_access_points.back().off;
+		pts = m_access_points.back().pts;
 		return 0;
 	}
 	// No access points (yet?) use the .sc data instead
 	if (m_structure_read_fd >= 0)
 	{
-		int l = ::lseek(m_structure_read_fd, 0, SEEK_END) / entry_size;
-		if (l <= 0)
+		int l = structureEnd();
+		if (l <= structureBegin())
 		{
 			eDebug("eMPEGStreamInformation::getLastFrame - no data (yet?)");
 			offset = 0;
@@ -626,10 +790,20 @@ eMPEGStreamInformationWriter::~eMPEGStreamInformationWriter()
 	close();
 }
 
-int eMPEGStreamInformationWriter::startSave(const std::string& filename)
+int eMPEGStreamInformationWriter::startSave(const std::string& filename, eRingFileState *ring)
 {
 	m_filename = filename;
-	m_structure_write_fd = ::open((m_filename + ".sc").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	m_ring = ring;
+	if (m_ring)
+	{
+		// the ring is written over from the start, it keeps its size and blocks
+		m_structure_write_fd = ::open((m_filename + ".sc").c_str(), O_WRONLY | O_CREAT, 0644);
+		if (m_structure_write_fd >= 0 && ::fallocate(m_structure_write_fd, 0, 0, (off_t)m_ring->structureSize() * 16) < 0)
+			eDebug("[eMPEGStreamInformationWriter] can't preallocate %s.sc: %m", m_filename.c_str());
+	}
+	else
+		m_structure_write_fd = ::open((m_filename + ".sc").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	m_structure_pos = 0;
 	m_buffer_filled = 0;
 	m_write_buffer = NULL;
 	return 0;
@@ -806,12 +980,44 @@ void eMPEGStreamInformationWriter::commit()
 	}
 	if (m_write_buffer != NULL)
 	{
+		off_t where = m_structure_pos;
+		size_t len = m_buffer_filled;
+		void *rest = NULL;
+		if (m_ring)
+		{
+			// the entries beyond the end of the ring file go to its start
+			off_t ring = (off_t)m_ring->structureSize() * 16;
+			where = m_structure_pos % ring;
+			if (where + (off_t)len > ring)
+			{
+				size_t first = ring - where;
+				rest = malloc(len - first);
+				if (rest)
+					memcpy(rest, (char*)m_write_buffer + first, len - first);
+				else
+					eWarning("malloc fail");
+				len = first;
+			}
+		}
 		m_pending_writes.push_back(PendingWrite()); // calls copy constructor, so don't initialize it
-		m_pending_writes.back().start(m_structure_write_fd, m_structure_pos, m_write_buffer, m_buffer_filled);
+		m_pending_writes.back().start(m_structure_write_fd, where, m_write_buffer, len);
+		if (rest)
+		{
+			m_pending_writes.push_back(PendingWrite());
+			m_pending_writes.back().start(m_structure_write_fd, 0, rest, m_buffer_filled - len);
+		}
 		m_structure_pos += m_buffer_filled;
 		m_write_buffer = NULL;
 		m_buffer_filled = 0;
 	}
+	if (m_ring)
+	{
+		// readers may use the entries up to the first write that is still pending
+		off_t pending = 0;
+		for (std::deque<PendingWrite>::const_iterator i(m_pending_writes.begin()); i != m_pending_writes.end(); ++i)
+			pending += i->m_aio.aio_nbytes;
+		m_ring->setStructurePosition(m_structure_pos / 16, (m_structure_pos - pending) / 16);
+	}
 }
 
 
@@ -823,7 +1029,9 @@ void eMPEGStreamInformationWriter::close()
 		m_pending_writes.clear(); // this waits for all IO to complete
 		::close(m_structure_write_fd);
 		m_structure_write_fd = -1;
-		if ((m_structure_pos == 0) && !m_filename.empty())
+		if (m_ring)
+			m_ring->setStructurePosition(m_structure_pos / 16, m_structure_pos / 16);
+		else if ((m_structure_pos == 0) && !m_filename.empty())
 		{
 			// If the file is empty, attempt to delete it.
 			::unlink((m_filename + ".sc").c_str());
@@ -1028,6 +1236,65 @@ inline int eMPEGStreamParserTS::wantPacket(const unsigned char *pkt) const
 	return m_streamtype == 0; /* we need all packets for MPEG2, but only PUSI packets for H.264 */
 }
 
+static inline __u32 packetHeader(const unsigned char *hdr)
+{
+	__u32 w;
+	memcpy(&w, hdr, 4);
+	return w;
+}
+
+/*
+ * The number of complete packets at pkt (at most count) which are in sync and
+ * not wanted on the timing pid, i.e. which parseData can skip without looking
+ * at them any further. This is where almost all of the recorded data goes, so
+ * the first 4 bytes of each header are tested as one word against a mask (in
+ * memory byte order, so it works on either endianness). Eight packets are
+ * tested at a time into a bit mask without branching per packet, a dense
+ * timing pid would otherwise cost a mispredicted branch for every run.
+ */
+unsigned int eMPEGStreamParserTS::skipPackets(const unsigned char *pkt, unsigned int count) const
+{
+	const unsigned char sync_mask_bytes[4] = { 0xFF, 0, 0, 0 };
+	const unsigned char sync_bytes[4] = { 0x47, 0, 0, 0 };
+	const unsigned char pid_mask_bytes[4] = { 0xFF, 0x1F, 0xFF, 0 };
+	const unsigned char pid_bytes[4] = { 0x47, (unsigned char)((m_pid >> 8) & 0x1F), (unsigned char)(m_pid & 0xFF), 0 };
+	__u32 sync_mask = packetHeader(sync_mask_bytes), sync = packetHeader(sync_bytes);
+	__u32 pid_mask = packetHeader(pid_mask_bytes), pid = packetHeader(pid_bytes);
+	if (m_pid < 0)
+	{
+		/* no timing pid, only the sync matters */
+		pid_mask = 0;
+		pid = 1;
+	}
+	else if (m_streamtype != 0 && !m_need_next_packet)
+	{
+		/* like wantPacket, only the pusi packets of H.264 are needed */
+		const unsigned char pusi_mask_bytes[4] = { 0xFF, 0x5F, 0xFF, 0 };
+		const unsigned char pusi_bytes[4] = { 0x47, (unsigned char)(0x40 | ((m_pid >> 8) & 0x1F)), (unsigned char)(m_pid & 0xFF), 0 };
+		pid_mask = packetHeader(pusi_mask_bytes);
+		pid = packetHeader(pusi_bytes);
+	}
+
+	const unsigned char *hdr = pkt + m_header_offset;
+	const unsigned int step = m_packetsize;
+	unsigned int i = 0;
+	for (; i + 8 <= count; i += 8, hdr += 8 * step)
+	{
+#define STOP(k) ((((packetHeader(hdr + k * step) & sync_mask) != sync) | ((packetHeader(hdr + k * step) & pid_mask) == pid)) << k)
+		unsigned int stop = STOP(0) | STOP(1) | STOP(2) | STOP(3) | STOP(4) | STOP(5) | STOP(6) | STOP(7);
+#undef STOP
+		if (stop)
+			return i + __builtin_ctz(stop);
+	}
+	for (; i < count; ++i, hdr += step)
+	{
+		__u32 w = packetHeader(hdr);
+		if ((w & sync_mask) != sync || (w & pid_mask) == pid)
+			break;
+	}
+	return i;
+}
+
 void eMPEGStreamParserTS::parseData(off_t offset, const void *data, unsigned int len)
 {
 	const unsigned char *packet = (const unsigned char*)data;
@@ -1044,21 +1311,28 @@ void eMPEGStreamParserTS::parseData(off_t offset, const void *data, unsigned int
 			   
 			   if this is a false 0x47, the packet will be dropped by wantPacket, and the
 			   next time, sync will be re-established. */
-		int skipped = 0;
-		while (!m_pktptr && len)
+		if (!m_pktptr && len > (unsigned int)m_header_offset && packet[m_header_offset] != 0x47)
 		{
-			if (packet[m_header_offset] == 0x47)
-				break;
-			len--;
-			packet++;
-			skipped++;
-		}
-		
-		if (skipped)
+			const unsigned char *sync = (const unsigned char*)memchr(packet + m_header_offset, 0x47, len - m_header_offset);
+			unsigned int skipped = sync ? sync - m_header_offset - packet : len;
 			eDebug("SYNC LOST: skipped %d bytes.", skipped);
+			len -= skipped;
+			packet += skipped;
+		}
 		
 		if (!len)
 			break;
+
+			/* fast path: skip the whole packets which are of no interest in one go,
+			   the timing pid packets and sync losses take the way below */
+		if (!m_pktptr)
+		{
+			unsigned int skip = skipPackets(packet, len / m_packetsize) * m_packetsize;
+			packet += skip;
+			len -= skip;
+			if (!len || (len > (unsigned int)m_header_offset && packet[m_header_offset] != 0x47))
+				continue; /* resync */
+		}
 		
 		if (m_pktptr)
 		{
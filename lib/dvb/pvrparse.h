@@ -3,9 +3,11 @@
 
 #include <lib/dvb/idvb.h>
 #include <lib/dvb/idemux.h>
+#include <lib/base/ringfile.h>
 #include <map>
 #include <set>
 #include <deque>
+#include <vector>
 #include <aio.h>
 
 	/* This module parses TS data and collects valuable information  */
@@ -18,6 +20,8 @@ public:
 	~eMPEGStreamInformation();
 
 	int load(const char *filename);
+		/* only the structure file, for walking it without the access points */
+	int loadStructure(const char *filename);
 	
 		/* fixup timestamp near offset, i.e. convert to zero-based */
 	int fixupPTS(const off_t &offset, pts_t &ts);
@@ -45,6 +49,10 @@ public:
 	
 private:
 	void close();
+	/* entries [structureBegin(), structureEnd()) of the structure file can be read */
+	int structureBegin();
+	int structureEnd();
+	off_t structurePosition(int index);
 	int loadCache(int index);
 	int moveCache(int index);
 	/* inter/extrapolate timestamp from offset */
@@ -53,15 +61,30 @@ private:
 	pts_t getDelta(off_t offset);
 	/* recalculates timestampDeltas */
 	void fixupDiscontinuties();
+	/* builds the lazy indices below */
+	void buildFixedPTSIndex();
+	void buildPTSIndex();
+	struct AccessPoint
+	{
+		off_t off;
+		pts_t pts;
+	};
+	struct PTSLess;
 	/* we order by off_t here, since the timestamp may */
 	/* wrap around. */
 	/* we only record sequence start's pts values here. */
-	std::map<off_t, pts_t> m_access_points;
+	/* a packed array instead of a tree, a few bytes per access point */
+	std::vector<AccessPoint> m_access_points;
 	/* timestampDelta is in fact the difference between */
-	/* the PTS in the stream and a real PTS from 0..max */
-	std::map<off_t, pts_t> m_timestamp_deltas;
-	/* these are non-fixed up pts value (like m_access_points), just used to accelerate stuff. */
-	std::multimap<pts_t, off_t> m_pts_to_offset;
+	/* the PTS in the stream and a real PTS from 0..max, */
+	/* one entry per discontinuity with the delta in pts */
+	std::vector<AccessPoint> m_timestamp_deltas;
+	/* built on first use: the highest fixed up pts up to each */
+	/* access point, so getAccessPoint can bisect... */
+	std::vector<pts_t> m_fixed_pts_max;
+	/* ...and the access points ordered by their non-fixed up pts, */
+	/* just used to accelerate fixupPTS. */
+	std::vector<unsigned int> m_pts_order;
 
 	int m_structure_read_fd;
 	int m_cache_index;   // Location of cache
@@ -70,6 +93,7 @@ private:
 	int m_structure_file_entries; // Also to detect changes to file
 	unsigned long long* m_structure_cache;
 	bool m_streamtime_accesspoints;
+	ePtr<eRingFileState> m_ring; /* of a timeshift ring, the .sc is a ring of entries then */
 };
 
 class eMPEGStreamInformationWriter
@@ -77,8 +101,8 @@ class eMPEGStreamInformationWriter
 public:
 	eMPEGStreamInformationWriter();
 	~eMPEGStreamInformationWriter();
-	/* Used by parser */
-	int startSave(const std::string& filename);
+	/* Used by parser. with @ring, the .sc is written as a ring of entries */
+	int startSave(const std::string& filename, eRingFileState *ring = NULL);
 	int stopSave(void);
 	virtual void addAccessPoint(off_t offset, pts_t pts, bool streamtime);
 	void writeStructureEntry(off_t offset, unsigned long long data);
@@ -104,6 +128,7 @@ private:
 	};
 	std::deque<PendingWrite> m_pending_writes;
 	std::string m_filename;
+	ePtr<eRingFileState> m_ring;
 	int m_structure_write_fd;
 	off_t m_structure_pos;
 	void* m_write_buffer;
@@ -125,6 +150,7 @@ private:
 	int m_pktptr;
 	int processPacket(const unsigned char *pkt, off_t offset);
 	inline int wantPacket(const unsigned char *pkt) const;
+	unsigned int skipPackets(const unsigned char *pkt, unsigned int count) const;
 	void addAccessPoint(off_t offset, pts_t pts, bool streamtime = false);
 	void addAccessPoint(off_t offset, pts_t pts, timespec &now, bool streamtime = false);
 	int m_pid;
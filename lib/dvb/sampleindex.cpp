@@ -0,0 +1,204 @@
+#include <lib/dvb/sampleindex.h>
+#include <lib/dvb/tstools.h>
+#include <lib/base/cfile.h>
+#include <lib/base/eerror.h>
+#include <lib/base/ioprio.h>
+
+#include <algorithm>
+#include <vector>
+#include <endian.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace
+{
+	const char index_magic[8] = { 'E', '2', 'S', 'M', 'P', 'L', '0', '1' };
+
+	struct index_header
+	{
+		char magic[8];
+		unsigned long long size, mtime; // of the recording
+		unsigned long long complete, count;
+	};
+}
+
+int eTSSampleIndex::load(const std::string &filename, std::map<pts_t, off_t> &samples)
+{
+	struct stat st;
+	if (::stat(filename.c_str(), &st) < 0)
+		return -1;
+	CFile f(indexFilename(filename).c_str(), "rb");
+	if (!f)
+		return -1;
+	index_header h;
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, index_magic, sizeof(index_magic)))
+	{
+		eDebug("[eTSSampleIndex] %s is not a sample index", indexFilename(filename).c_str());
+		return -1;
+	}
+	if ((off_t)be64toh(h.size) != st.st_size || (time_t)be64toh(h.mtime) != st.st_mtime)
+	{
+		eDebug("[eTSSampleIndex] %s changed since it was indexed", filename.c_str());
+		return -1;
+	}
+	unsigned long long count = be64toh(h.count);
+	if (count > 2 * eTSSampleIndexBuilder::MAX_SAMPLES)
+		return -1;
+	std::vector<unsigned long long> d(count * 2);
+	if (count && fread(&d[0], sizeof(d[0]), d.size(), f) != d.size())
+		return -1;
+	samples.clear();
+	for (unsigned int i = 0; i < count; ++i)
+		samples[be64toh(d[i * 2])] = be64toh(d[i * 2 + 1]);
+	return be64toh(h.complete) ? 1 : 0;
+}
+
+int eTSSampleIndex::save(const std::string &filename, const struct stat &st, const std::map<pts_t, off_t> &samples, bool complete)
+{
+	std::string name = indexFilename(filename);
+	std::string tmp = name + ".writing";
+	{
+		CFile f(tmp.c_str(), "wb");
+		if (!f)
+		{
+			eDebug("[eTSSampleIndex] can't write %s: %m", tmp.c_str());
+			return -1;
+		}
+		index_header h;
+		memcpy(h.magic, index_magic, sizeof(index_magic));
+		h.size = htobe64(st.st_size);
+		h.mtime = htobe64(st.st_mtime);
+		h.complete = htobe64(complete ? 1 : 0);
+		h.count = htobe64(samples.size());
+		std::vector<unsigned long long> d;
+		d.reserve(samples.size() * 2);
+		for (std::map<pts_t, off_t>::const_iterator i(samples.begin()); i != samples.end(); ++i)
+		{
+			d.push_back(htobe64(i->first));
+			d.push_back(htobe64(i->second));
+		}
+		if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+			(!d.empty() && fwrite(&d[0], sizeof(d[0]), d.size(), f) != d.size()) ||
+			fflush(f))
+		{
+			eDebug("[eTSSampleIndex] writing %s failed: %m", tmp.c_str());
+			::unlink(tmp.c_str());
+			return -1;
+		}
+	}
+	if (::rename(tmp.c_str(), name.c_str()) < 0)
+	{
+		eDebug("[eTSSampleIndex] can't rename %s: %m", tmp.c_str());
+		::unlink(tmp.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+eTSSampleIndexBuilder::eTSSampleIndexBuilder()
+	:m_generation(0)
+{
+}
+
+eTSSampleIndexBuilder *eTSSampleIndexBuilder::create()
+{
+	eTSSampleIndexBuilder *builder = new eTSSampleIndexBuilder;
+	builder->run();
+	return builder;
+}
+
+eTSSampleIndexBuilder *eTSSampleIndexBuilder::getInstance()
+{
+	// never destroyed, like the recording writers. the pvr thread and the
+	// main thread may both ask first, the static initializer runs once
+	static eTSSampleIndexBuilder *instance = create();
+	return instance;
+}
+
+int eTSSampleIndexBuilder::request(const std::string &filename)
+{
+	eSingleLocker l(m_lock);
+	if (m_failed.find(filename) != m_failed.end())
+		return -1;
+	if (filename == m_current || std::find(m_queue.begin(), m_queue.end(), filename) != m_queue.end())
+		return 0;
+	m_queue.push_back(filename);
+	m_work.signal();
+	return 0;
+}
+
+bool eTSSampleIndexBuilder::isBusy(const std::string &filename)
+{
+	eSingleLocker l(m_lock);
+	return filename == m_current || std::find(m_queue.begin(), m_queue.end(), filename) != m_queue.end();
+}
+
+int eTSSampleIndexBuilder::getGeneration()
+{
+	eSingleLocker l(m_lock);
+	return m_generation;
+}
+
+int eTSSampleIndexBuilder::build(const std::string &filename)
+{
+	struct stat st;
+	if (::stat(filename.c_str(), &st) < 0)
+		return -1;
+	eDVBTSTools tools;
+	if (tools.openFile(filename.c_str(), 1) < 0)
+		return -1;
+
+	int max_parts = st.st_size / MIN_STEP;
+	if (max_parts > MAX_SAMPLES)
+		max_parts = MAX_SAMPLES;
+	for (int parts = FIRST_SAMPLES, refine = 0; ; parts *= 2, refine = 1)
+	{
+		int taken = tools.takeSamplePass(parts, refine);
+		if (taken < 0)
+		{
+			eDebug("[eTSSampleIndexBuilder] no begin or end in %s", filename.c_str());
+			return -1;
+		}
+		// an index of a recording that changed meanwhile is of no use
+		struct stat now;
+		if (::stat(filename.c_str(), &now) < 0 || now.st_size != st.st_size || now.st_mtime != st.st_mtime)
+		{
+			eDebug("[eTSSampleIndexBuilder] %s changed while indexing", filename.c_str());
+			return -1;
+		}
+		bool complete = parts * 2 > max_parts;
+		if (eTSSampleIndex::save(filename, st, tools.getSamples(), complete) < 0)
+			return -1;
+		eDebug("[eTSSampleIndexBuilder] %s: %d samples, %d in this pass", filename.c_str(), (int)tools.getSamples().size(), taken);
+		{
+			eSingleLocker l(m_lock);
+			++m_generation;
+		}
+		if (complete)
+			return 0;
+	}
+}
+
+void eTSSampleIndexBuilder::thread()
+{
+	// only use the disk when nobody else does
+	setIoPrio(IOPRIO_CLASS_IDLE);
+	hasStarted();
+	eSingleLocker l(m_lock);
+	while (1)
+	{
+		while (m_queue.empty())
+			m_work.wait(m_lock);
+		std::string filename = m_current = m_queue.front();
+		m_queue.pop_front();
+
+		m_lock.unlock();
+		eDebug("[eTSSampleIndexBuilder] indexing %s", filename.c_str());
+		int res = build(filename);
+		m_lock.lock();
+
+		if (res < 0)
+			m_failed.insert(filename);
+		m_current.clear();
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef __lib_dvb_sampleindex_h
+#define __lib_dvb_sampleindex_h
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <lib/base/elock.h>
+#include <lib/base/thread.h>
+
+typedef long long pts_t;
+
+/*
+ * Sample index of a recording without access points: the (zero-based) pts
+ * to offset samples eDVBTSTools interpolates between when seeking, kept in
+ * <recording>.samples so they are taken only once.
+ *
+ * The file starts with a header holding the size and modification time of
+ * the recording it was made for, an index that doesn't match them anymore
+ * is ignored. Like the .ap file, all values are stored big endian.
+ */
+class eTSSampleIndex
+{
+public:
+	// -1 when there is no usable index, 0 when it is incomplete, 1 when complete
+	static int load(const std::string &filename, std::map<pts_t, off_t> &samples);
+	static int save(const std::string &filename, const struct stat &st, const std::map<pts_t, off_t> &samples, bool complete);
+	static std::string indexFilename(const std::string &filename) { return filename + ".samples"; }
+};
+
+/*
+ * Builds sample indexes in the background, one recording after the other.
+ * Each pass halves the distance between the samples of the previous one and
+ * saves the index, so a seek can use the coarse samples of the first passes
+ * while the later ones are still being taken.
+ */
+class eTSSampleIndexBuilder: public eThread
+{
+	eSingleLock m_lock;
+	eCondition m_work;
+	std::list<std::string> m_queue;
+	std::set<std::string> m_failed;
+	std::string m_current;
+	int m_generation;
+
+	eTSSampleIndexBuilder();
+	static eTSSampleIndexBuilder *create();
+	void thread();
+	int build(const std::string &filename);
+public:
+	enum {
+		SETTLE_TIME = 60, // s without changes before a recording is indexed
+		FIRST_SAMPLES = 32, // samples taken by the first pass
+		MAX_SAMPLES = 4096,
+		MIN_STEP = 4 * 1024 * 1024 // bytes between samples of the last pass
+	};
+
+	static eTSSampleIndexBuilder *getInstance();
+	// queue @filename, -1 when indexing it failed before
+	int request(const std::string &filename);
+	// whether @filename is queued or being indexed
+	bool isBusy(const std::string &filename);
+	// changes whenever an index was saved
+	int getGeneration();
+};
+
+#endif
@@ -1,6 +1,11 @@
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <openssl/evp.h>
 #include <sys/types.h>
 #include <pwd.h>
@@ -10,6 +15,7 @@
 #include <lib/base/eerror.h>
 #include <lib/base/init.h>
 #include <lib/base/init_num.h>
+#include <lib/base/metrics.h>
 #include <lib/base/wrappers.h>
 #include <lib/base/nconfig.h>
 #include <lib/base/cfile.h>
@@ -17,21 +23,26 @@
 #include <lib/dvb/streamserver.h>
 #include <lib/dvb/encoder.h>
 
+static eMetricGauge stream_clients("stream.clients");
+static eMetricCounter stream_bytes("stream.bytes");
+static eMetricCounter stream_dropped("stream.dropped");
+
+DEFINE_REF(eStreamClient);
+
 eStreamClient::eStreamClient(eStreamServer *handler, int socket)
- : parent(handler), encoderFd(-1), streamFd(socket), streamThread(NULL)
+ : parent(handler), encoderFd(-1), streamFd(socket), fileFd(-1), fileThread(NULL)
 {
 	running = false;
+	keepAlive = false;
 }
 
 eStreamClient::~eStreamClient()
 {
 	rsn->stop();
 	stop();
-	if (streamThread)
-	{
-		streamThread->stop();
-		delete streamThread;
-	}
+	if (fileThread)
+		fileThread->stop();
+	stopFile();
 	if (encoderFd >= 0)
 	{
 		if (eEncoder::getInstance()) eEncoder::getInstance()->freeEncoder(encoderFd);
@@ -45,6 +56,15 @@ void eStreamClient::start()
 	CONNECT(rsn->activated, eStreamClient::notifier);
 }
 
+void eStreamClient::stop()
+{
+	if (feed)
+	{
+		parent->leaveFeed(feed, this);
+		feed = 0;
+	}
+}
+
 void eStreamClient::notifier(int what)
 {
 	if (!(what & eSocketNotifier::Read))
@@ -64,6 +84,11 @@ void eStreamClient::notifier(int what)
 	if (running || (request.find('\n') == std::string::npos))
 		return;
 
+	processRequest();
+}
+
+void eStreamClient::processRequest()
+{
 	if (request.substr(0, 5) == "GET /")
 	{
 		size_t pos;
@@ -142,7 +167,21 @@ void eStreamClient::notifier(int what)
 		if (pos != std::string::npos)
 		{
 			std::string serviceref = urlDecode(request.substr(5, pos - 5));
-			if (!serviceref.empty())
+			int result = -1;
+			if (serviceref.substr(0, 10) == "file?file=")
+				result = startFile(serviceref.substr(10));
+			if (result > 0)
+			{
+				/* answered already */
+				rsn->stop();
+				parent->connectionLost(this);
+				return;
+			}
+			if (!result)
+			{
+				running = true;
+			}
+			else if (!serviceref.empty())
 			{
 				const char *reply = "HTTP/1.0 200 OK\r\nConnection: Close\r\nContent-Type: video/mpeg\r\nServer: streamserver\r\n\r\n";
 				writeAll(streamFd, reply, strlen(reply));
@@ -151,7 +190,8 @@ void eStreamClient::notifier(int what)
 				pos = serviceref.find('?');
 				if (pos == std::string::npos)
 				{
-					if (eDVBServiceStream::start(serviceref.c_str(), streamFd) >= 0)
+					feed = parent->joinFeed(serviceref, this, streamFd);
+					if (feed)
 						running = true;
 				}
 				else
@@ -189,12 +229,9 @@ void eStreamClient::notifier(int what)
 						if (encoderFd >= 0)
 						{
 							running = true;
-							streamThread = new eDVBRecordStreamThread(188);
-							if (streamThread)
-							{
-								streamThread->setTargetFD(streamFd);
-								streamThread->start(encoderFd);
-							}
+							fileThread = new eStreamFileThread(encoderFd, streamFd, 0, -1);
+							CONNECT(fileThread->finished, eStreamClient::fileFinished);
+							fileThread->start();
 						}
 					}
 				}
@@ -212,10 +249,110 @@ void eStreamClient::notifier(int what)
 	request.clear();
 }
 
+	/* a recording is sent as it is, with range requests for seeking. -1 if @path
+	   isn't one (it's played then), 1 if the request was answered with an error */
+int eStreamClient::startFile(const std::string &path)
+{
+	size_t ext = path.rfind('.');
+	if (ext == std::string::npos || (path.substr(ext) != ".ts" && path.substr(ext) != ".trp"))
+		return -1;
+	int fd = ::open(path.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+	{
+		::close(fd);
+		return -1;
+	}
+
+	off_t size = st.st_size, from = 0, to = size;
+	bool partial = false;
+	size_t pos = request.find("Range: bytes=");
+	if (pos != std::string::npos)
+	{
+		const char *range = request.c_str() + pos + 13;
+		long long first = -1, last = -1;
+		if (*range == '-')
+		{
+			/* the last bytes */
+			if (sscanf(range + 1, "%lld", &last) == 1 && last > 0)
+				from = last < size ? size - last : 0;
+			else
+				from = size;
+		}
+		else if (sscanf(range, "%lld-%lld", &first, &last) >= 1)
+		{
+			from = first;
+			if (last >= first && last < size)
+				to = last + 1;
+		}
+		if (from < 0 || from >= size)
+		{
+			char reply[128];
+			snprintf(reply, sizeof(reply), "HTTP/1.1 416 Requested Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\nConnection: Close\r\n\r\n", (long long)size);
+			writeAll(streamFd, reply, strlen(reply));
+			::close(fd);
+			return 1;
+		}
+		partial = true;
+	}
+
+	/* HTTP/1.1 clients keep the connection for the next range */
+	std::string firstline = request.substr(0, request.find('\n'));
+	keepAlive = firstline.find("HTTP/1.1") != std::string::npos
+		&& request.find("Connection: close") == std::string::npos
+		&& request.find("Connection: Close") == std::string::npos;
+
+	char reply[512], range[128] = "";
+	if (partial)
+		snprintf(range, sizeof(range), "Content-Range: bytes %lld-%lld/%lld\r\n", (long long)from, (long long)to - 1, (long long)size);
+	snprintf(reply, sizeof(reply), "HTTP/1.1 %s\r\nConnection: %s\r\nContent-Type: video/mpeg\r\nServer: streamserver\r\nAccept-Ranges: bytes\r\nContent-Length: %lld\r\n%s\r\n",
+		partial ? "206 Partial Content" : "200 OK", keepAlive ? "Keep-Alive" : "Close", (long long)(to - from), range);
+	writeAll(streamFd, reply, strlen(reply));
+
+	fileFd = fd;
+	fileThread = new eStreamFileThread(fileFd, streamFd, from, to);
+	CONNECT(fileThread->finished, eStreamClient::fileFinished);
+	fileThread->start();
+	return 0;
+}
+
+void eStreamClient::stopFile()
+{
+	if (fileThread)
+	{
+		delete fileThread;
+		fileThread = NULL;
+	}
+	if (fileFd >= 0)
+	{
+		::close(fileFd);
+		fileFd = -1;
+	}
+}
+
+void eStreamClient::fileFinished(int result)
+{
+	ePtr<eStreamClient> ref = this;
+	stopFile();
+	if (!result && keepAlive)
+	{
+		/* ready for the next request, which may be here already */
+		running = false;
+		if (request.find('\n') != std::string::npos)
+			processRequest();
+		return;
+	}
+	rsn->stop();
+	parent->connectionLost(this);
+}
+
 void eStreamClient::streamStopped()
 {
 	ePtr<eStreamClient> ref = this;
 	rsn->stop();
+	stop();
 	parent->connectionLost(this);
 }
 
@@ -223,9 +360,371 @@ void eStreamClient::tuneFailed()
 {
 	ePtr<eStreamClient> ref = this;
 	rsn->stop();
+	stop();
 	parent->connectionLost(this);
 }
 
+eStreamFileThread::eStreamFileThread(int source, int target, off_t from, off_t to)
+ : sourceFd(source), targetFd(target), position(from), end(to), stopping(0), messagePump(eApp, 0)
+{
+	CONNECT(messagePump.recv_msg, eStreamFileThread::recvEvent);
+}
+
+eStreamFileThread::~eStreamFileThread()
+{
+	kill();
+}
+
+void eStreamFileThread::start()
+{
+	run();
+}
+
+void eStreamFileThread::stop()
+{
+	/* wakes up a thread waiting for the client */
+	stopping = 1;
+	::shutdown(targetFd, SHUT_RDWR);
+	kill();
+}
+
+void eStreamFileThread::thread()
+{
+	hasStarted();
+	int result = end < 0 ? spliceStream() : sendFile();
+	messagePump.send(result);
+}
+
+void eStreamFileThread::recvEvent(const int &result)
+{
+	/*emit*/ finished(result);
+}
+
+int eStreamFileThread::sendFile()
+{
+	while (!stopping && position < end)
+	{
+		size_t count = CHUNK_SIZE;
+		if ((off_t)count > end - position)
+			count = end - position;
+		ssize_t n = ::sendfile(targetFd, sourceFd, &position, count);
+		if (n < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			eDebug("[eStreamFileThread] sendfile: %m");
+			return -1;
+		}
+		if (!n)
+		{
+			eDebug("[eStreamFileThread] file got shorter");
+			return -1;
+		}
+		stream_bytes.add(n);
+	}
+	return position < end ? -1 : 0;
+}
+
+	/* 1 when there's data, 0 when stopped, -1 on error */
+int eStreamFileThread::waitForData()
+{
+	while (!stopping)
+	{
+		struct pollfd pfd;
+		pfd.fd = sourceFd;
+		pfd.events = POLLIN;
+		/* with a timeout, to notice when we're stopped */
+		int r = ::poll(&pfd, 1, 200);
+		if (r > 0)
+			return 1;
+		if (r < 0 && errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+int eStreamFileThread::spliceStream()
+{
+	int pipeFd[2];
+	if (pipe(pipeFd) < 0)
+		return copyStream();
+	int result = -1;
+	bool spliced = false;
+	while (waitForData() > 0)
+	{
+		ssize_t n = ::splice(sourceFd, NULL, pipeFd[1], NULL, CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			if (errno == EINVAL && !spliced)
+			{
+				/* the driver can't splice */
+				::close(pipeFd[0]);
+				::close(pipeFd[1]);
+				return copyStream();
+			}
+			eDebug("[eStreamFileThread] splice: %m");
+			break;
+		}
+		if (!n)
+		{
+			result = 0;
+			break;
+		}
+		spliced = true;
+		while (n > 0)
+		{
+			ssize_t w = ::splice(pipeFd[0], NULL, targetFd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w <= 0)
+				break;
+			stream_bytes.add(w);
+			n -= w;
+		}
+		if (n > 0)
+		{
+			eDebug("[eStreamFileThread] client gone");
+			break;
+		}
+	}
+	::close(pipeFd[0]);
+	::close(pipeFd[1]);
+	return result;
+}
+
+int eStreamFileThread::copyStream()
+{
+	unsigned char buffer[COPY_SIZE];
+	while (waitForData() > 0)
+	{
+		ssize_t n = ::read(sourceFd, buffer, sizeof(buffer));
+		if (n < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			eDebug("[eStreamFileThread] read: %m");
+			return -1;
+		}
+		if (!n)
+			return 0;
+		if (writeAll(targetFd, buffer, n) != n)
+			return -1;
+		stream_bytes.add(n);
+	}
+	return -1;
+}
+
+DEFINE_REF(eStreamFeed::buffer);
+
+eStreamFeed::eStreamFeed(const std::string &ref)
+ : serviceref(ref), failed(false), stopping(0), lastClientId(0), messagePump(eApp, 0)
+{
+	pipeFd[0] = pipeFd[1] = -1;
+	CONNECT(messagePump.recv_msg, eStreamFeed::clientDropped);
+}
+
+eStreamFeed::~eStreamFeed()
+{
+	/* the recorder must not write into a pipe nobody reads anymore */
+	stop();
+	stopping = 1;
+	kill();
+	if (pipeFd[0] >= 0) ::close(pipeFd[0]);
+	if (pipeFd[1] >= 0) ::close(pipeFd[1]);
+}
+
+int eStreamFeed::start()
+{
+	if (pipe(pipeFd) < 0)
+	{
+		eDebug("[eStreamFeed] can't create pipe: %m");
+		return -1;
+	}
+	/* some slack for when the thread is late */
+	fcntl(pipeFd[1], F_SETPIPE_SZ, PIPE_SIZE);
+	run();
+	if (eDVBServiceStream::start(serviceref.c_str(), pipeFd[1]) < 0 || failed)
+		return -1;
+	return 0;
+}
+
+void eStreamFeed::addClient(eStreamClient *owner, int fd)
+{
+	eSingleLocker lock(clientLock);
+	client c;
+	c.owner = owner;
+	c.id = ++lastClientId;
+	c.fd = fd;
+	c.dropped = false;
+	c.offset = 0;
+	c.queued = 0;
+	clients.push_back(c);
+	eDebug("[eStreamFeed] %s: %d client(s)", serviceref.c_str(), (int)clients.size());
+}
+
+int eStreamFeed::removeClient(eStreamClient *owner)
+{
+	eSingleLocker lock(clientLock);
+	for (std::list<client>::iterator i(clients.begin()); i != clients.end(); ++i)
+	{
+		if (i->owner == owner)
+		{
+			clients.erase(i);
+			break;
+		}
+	}
+	return clients.size();
+}
+
+/* with clientLock held */
+void eStreamFeed::dropClient(client &c)
+{
+	c.dropped = true;
+	c.queue.clear();
+	c.queued = 0;
+	messagePump.send(c.id);
+}
+
+void eStreamFeed::distribute(const ePtr<buffer> &data)
+{
+	eSingleLocker lock(clientLock);
+	for (std::list<client>::iterator i(clients.begin()); i != clients.end(); ++i)
+	{
+		if (i->dropped)
+			continue;
+		if (i->queued + data->size > MAX_QUEUE)
+		{
+			eDebug("[eStreamFeed] %s: dropping a client that doesn't keep up", serviceref.c_str());
+			dropClient(*i);
+			stream_dropped.inc();
+			continue;
+		}
+		i->queue.push_back(data);
+		i->queued += data->size;
+	}
+}
+
+void eStreamFeed::sendQueued()
+{
+	eSingleLocker lock(clientLock);
+	for (std::list<client>::iterator i(clients.begin()); i != clients.end(); ++i)
+	{
+		while (!i->queue.empty())
+		{
+			buffer *b = i->queue.front();
+			ssize_t n = ::send(i->fd, b->data + i->offset, b->size - i->offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n < 0)
+			{
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					dropClient(*i);
+				break;
+			}
+			stream_bytes.add(n);
+			i->offset += n;
+			i->queued -= n;
+			if (i->offset < b->size)
+				break;
+			i->offset = 0;
+			i->queue.pop_front();
+		}
+	}
+}
+
+void eStreamFeed::thread()
+{
+	hasStarted();
+	ePtr<buffer> current = new buffer;
+	std::vector<struct pollfd> pfd;
+	while (!stopping)
+	{
+		pfd.resize(1);
+		pfd[0].fd = pipeFd[0];
+		pfd[0].events = POLLIN;
+		{
+			eSingleLocker lock(clientLock);
+			for (std::list<client>::iterator i(clients.begin()); i != clients.end(); ++i)
+			{
+				if (i->queue.empty())
+					continue;
+				struct pollfd p;
+				p.fd = i->fd;
+				p.events = POLLOUT;
+				pfd.push_back(p);
+			}
+		}
+		/* with a timeout, to notice when we're stopped */
+		if (poll(&pfd[0], pfd.size(), 200) <= 0)
+			continue;
+		if (pfd[0].revents & POLLIN)
+		{
+			ssize_t n = ::read(pipeFd[0], current->data + current->size, BUFFER_SIZE - current->size);
+			if (n > 0)
+			{
+				current->size += n;
+				/* the clients get whole packets only, the rest goes into the next buffer */
+				size_t packets = current->size - current->size % 188;
+				if (packets)
+				{
+					ePtr<buffer> next = new buffer;
+					next->size = current->size - packets;
+					memcpy(next->data, current->data + packets, next->size);
+					current->size = packets;
+					distribute(current);
+					current = next;
+				}
+			}
+		}
+		sendQueued();
+	}
+}
+
+void eStreamFeed::clientDropped(const int &id)
+{
+	eStreamClient *owner = NULL;
+	{
+		eSingleLocker lock(clientLock);
+		for (std::list<client>::iterator i(clients.begin()); i != clients.end(); ++i)
+		{
+			if (i->id == id)
+			{
+				owner = i->owner;
+				break;
+			}
+		}
+	}
+	if (owner)
+		owner->streamStopped();
+}
+
+void eStreamFeed::streamStopped()
+{
+	ePtr<eStreamFeed> ref = this;
+	std::list<ePtr<eStreamClient> > owners;
+	{
+		eSingleLocker lock(clientLock);
+		for (std::list<client>::iterator i(clients.begin()); i != clients.end(); ++i)
+			owners.push_back(i->owner);
+	}
+	for (std::list<ePtr<eStreamClient> >::iterator i(owners.begin()); i != owners.end(); ++i)
+		(*i)->streamStopped();
+}
+
+void eStreamFeed::tuneFailed()
+{
+	ePtr<eStreamFeed> ref = this;
+	failed = true;
+	std::list<ePtr<eStreamClient> > owners;
+	{
+		eSingleLocker lock(clientLock);
+		for (std::list<client>::iterator i(clients.begin()); i != clients.end(); ++i)
+			owners.push_back(i->owner);
+	}
+	for (std::list<ePtr<eStreamClient> >::iterator i(owners.begin()); i != owners.end(); ++i)
+		(*i)->tuneFailed();
+}
+
 DEFINE_REF(eStreamServer);
 
 eStreamServer::eStreamServer()
@@ -239,12 +738,14 @@ eStreamServer::~eStreamServer()
 	{
 		it = clients.erase(it);
 	}
+	stream_clients.set(0);
 }
 
 void eStreamServer::newConnection(int socket)
 {
 	ePtr<eStreamClient> client = new eStreamClient(this, socket);
 	clients.push_back(client);
+	stream_clients.set(clients.size());
 	client->start();
 }
 
@@ -255,6 +756,41 @@ void eStreamServer::connectionLost(eStreamClient *client)
 	{
 		clients.erase(it);
 	}
+	stream_clients.set(clients.size());
+}
+
+ePtr<eStreamFeed> eStreamServer::joinFeed(const std::string &serviceref, eStreamClient *client, int fd)
+{
+	ePtr<eStreamFeed> feed;
+	std::map<std::string, ePtr<eStreamFeed> >::iterator it = feeds.find(serviceref);
+	if (it != feeds.end())
+	{
+		feed = it->second;
+	}
+	else
+	{
+		feed = new eStreamFeed(serviceref);
+		if (feed->start() < 0)
+			return 0;
+		feeds[serviceref] = feed;
+	}
+	feed->addClient(client, fd);
+	return feed;
+}
+
+void eStreamServer::leaveFeed(eStreamFeed *feed, eStreamClient *client)
+{
+	if (feed->removeClient(client))
+		return;
+	/* the last one out, stop recording */
+	for (std::map<std::string, ePtr<eStreamFeed> >::iterator it = feeds.begin(); it != feeds.end(); ++it)
+	{
+		if (it->second == feed)
+		{
+			feeds.erase(it);
+			break;
+		}
+	}
 }
 
 eAutoInitPtr<eStreamServer> init_eStreamServer(eAutoInitNumbers::service + 1, "Stream server");
@@ -1,35 +1,150 @@
 #ifndef __DVB_STREAMSERVER_H_
 #define __DVB_STREAMSERVER_H_
 
+#include <deque>
+#include <list>
+#include <map>
+
+#include <lib/base/message.h>
+#include <lib/base/thread.h>
 #include <lib/network/serversocket.h>
 #include <lib/service/servicedvbstream.h>
 #include <lib/nav/core.h>
 
 class eStreamServer;
+class eStreamFeed;
+
+/*
+ * Copies a recording (or the output of an encoder) into a client socket,
+ * without the data passing through user space: sendfile() for a file,
+ * splice() through a pipe for a device.
+ */
+class eStreamFileThread: public eThread, public Object
+{
+public:
+	/* @to is -1 for a device, which is read until it ends */
+	eStreamFileThread(int source, int target, off_t from, off_t to);
+	~eStreamFileThread();
+
+	void start();
+	void stop();
+
+	/* 0 when everything was sent */
+	Signal1<void, int> finished;
+
+private:
+	enum { CHUNK_SIZE = 1024 * 1024, COPY_SIZE = 188 * 256 };
 
-class eStreamClient: public eDVBServiceStream
+	int sourceFd, targetFd;
+	off_t position, end;
+	int stopping;
+	eFixedMessagePump<int> messagePump;
+
+	void thread();
+	int sendFile();
+	int spliceStream();
+	int copyStream();
+	int waitForData();
+	void recvEvent(const int &result);
+};
+
+class eStreamClient: public iObject, public Object
 {
+	DECLARE_REF(eStreamClient);
 protected:
 	eStreamServer *parent;
 	int encoderFd;
 	int streamFd;
-	eDVBRecordStreamThread *streamThread;
+	int fileFd;
+	eStreamFileThread *fileThread;
+	ePtr<eStreamFeed> feed;
 
 	bool running;
+	bool keepAlive;
 
 	void notifier(int);
 	ePtr<eSocketNotifier> rsn;
 
 	std::string request;
 
-	void streamStopped();
-	void tuneFailed();
+	void processRequest();
+	int startFile(const std::string &path);
+	void fileFinished(int result);
+	void stopFile();
+	void stop();
 
 public:
 	eStreamClient(eStreamServer *handler, int socket);
 	~eStreamClient();
 
 	void start();
+
+	/* called by the feed */
+	void streamStopped();
+	void tuneFailed();
+};
+
+/*
+ * The data of one service, recorded once and sent to all clients that
+ * stream it. The recorder writes into a pipe, the thread reads whole
+ * packets from it into reference counted buffers and queues those for
+ * every client, so no client gets a copy of its own. A client that
+ * doesn't keep up is dropped when its queue reaches MAX_QUEUE, instead of
+ * holding up the others.
+ */
+class eStreamFeed: public eDVBServiceStream, public eThread
+{
+public:
+	eStreamFeed(const std::string &serviceref);
+	~eStreamFeed();
+
+	int start();
+	bool hasFailed() { return failed; }
+	void addClient(eStreamClient *client, int fd);
+	/* returns the number of clients left */
+	int removeClient(eStreamClient *client);
+
+private:
+	enum { BUFFER_SIZE = 188 * 256, MAX_QUEUE = 4 * 1024 * 1024, PIPE_SIZE = 1024 * 1024 };
+
+	class buffer: public iObject
+	{
+		DECLARE_REF(buffer);
+	public:
+		buffer(): size(0) {}
+		size_t size;
+		unsigned char data[BUFFER_SIZE];
+	};
+
+	struct client
+	{
+		eStreamClient *owner;
+		int id;
+		int fd;
+		bool dropped;
+		size_t offset; /* sent of the first buffer */
+		size_t queued; /* bytes */
+		std::deque<ePtr<buffer> > queue;
+	};
+
+	std::string serviceref;
+	int pipeFd[2];
+	bool failed;
+	int stopping;
+	int lastClientId;
+
+	eSingleLock clientLock;
+	std::list<client> clients;
+	eFixedMessagePump<int> messagePump;
+
+	void thread();
+	void distribute(const ePtr<buffer> &data);
+	void sendQueued();
+	void dropClient(client &c);
+	void clientDropped(const int &id);
+
+	void streamStopped();
+	void tuneFailed();
 };
 
 class eStreamServer: public eServerSocket
@@ -37,6 +152,7 @@ class eStreamServer: public eServerSocket
 	DECLARE_REF(eStreamServer);
 
 	eSmartPtrList<eStreamClient> clients;
+	std::map<std::string, ePtr<eStreamFeed> > feeds;
 
 	void newConnection(int socket);
 
@@ -45,6 +161,10 @@ public:
 	~eStreamServer();
 
 	void connectionLost(eStreamClient *client);
+
+	/* the feed of @serviceref, started when nobody streams it yet */
+	ePtr<eStreamFeed> joinFeed(const std::string &serviceref, eStreamClient *client, int fd);
+	void leaveFeed(eStreamFeed *feed, eStreamClient *client);
 };
 
 #endif /* __DVB_STREAMSERVER_H_ */
@@ -0,0 +1,216 @@
+#include <lib/dvb/trickplan.h>
+#include <lib/dvb/pvrparse.h>
+#include <lib/base/eerror.h>
+
+#include <stdlib.h>
+#include <time.h>
+
+	/* with @lock held, like eCondition::wait, but for at most @ms */
+static void waitFor(eCondition &cond, eSingleLock &lock, int ms)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&(pthread_cond_t&)cond, &(pthread_mutex_t&)lock, &ts);
+}
+
+eDVBTrickPlanner::eDVBTrickPlanner(const std::string &filename)
+	:m_filename(filename), m_offset(0), m_frames(0), m_generation(0), m_exhausted(0),
+	m_last_begin(-1), m_last_end(-1), m_stop(0)
+{
+}
+
+eDVBTrickPlanner::~eDVBTrickPlanner()
+{
+	{
+		eSingleLocker l(m_lock);
+		m_stop = 1;
+		m_work.signal();
+	}
+	kill();
+}
+
+	/* with m_lock held */
+void eDVBTrickPlanner::restart(off_t offset, int frames)
+{
+	m_offset = offset;
+	m_frames = frames;
+	++m_generation;
+	m_spans.clear();
+	m_exhausted = 0;
+	m_last_begin = m_last_end = -1;
+	m_work.signal();
+}
+
+int eDVBTrickPlanner::next(off_t current_offset, int frames, off_t &offset, size_t &len)
+{
+	eSingleLocker l(m_lock);
+	if (frames != m_frames || current_offset <= m_last_begin || current_offset > m_last_end)
+		restart(current_offset, frames);
+	if (m_spans.empty() && !m_exhausted)
+		waitFor(m_planned, m_lock, WAIT_NEXT);
+	if (m_spans.empty())
+		return -1;
+	offset = m_spans.front().offset;
+	len = m_spans.front().len;
+	m_spans.pop_front();
+	m_work.signal();
+		/* the caller aligns the span to whole packets */
+	m_last_begin = offset - 188;
+	m_last_end = offset + len + 188;
+	return 0;
+}
+
+void eDVBTrickPlanner::stop()
+{
+	eSingleLocker l(m_lock);
+	restart(0, 0);
+}
+
+bool eDVBTrickPlanner::current(int generation)
+{
+	eSingleLocker l(m_lock);
+	return !m_stop && generation == m_generation;
+}
+
+	/* queue the I-frame from @offset to @end, waiting while the queue is full. -1 when the plan changed meanwhile */
+int eDVBTrickPlanner::queue(int generation, off_t offset, off_t end)
+{
+	if (end <= offset)
+		return 0;
+	eSingleLocker l(m_lock);
+	while (!m_stop && generation == m_generation && m_spans.size() >= MAX_PLANNED)
+		m_work.wait(m_lock);
+	if (m_stop || generation != m_generation)
+		return -1;
+	span s;
+	s.offset = offset;
+	s.len = end - offset;
+	m_spans.push_back(s);
+	m_exhausted = 0;
+	m_planned.signal();
+	return 0;
+}
+
+	/* plan from @offset on, until the plan changes or the begin of the file is reached */
+void eDVBTrickPlanner::walk(eMPEGStreamInformation &info, off_t offset, int frames, int generation)
+{
+	int direction = frames < 0 ? -1 : 1;
+	int stride = abs(frames) ? abs(frames) : 1;
+	off_t where = offset;
+	unsigned long long longdata;
+	if (info.getStructureEntryFirst(where, longdata) != 0)
+		return;
+
+	int count = 0; // pictures since the last I-frame that was queued
+	off_t sequence = -1; // forward: the sequence header before the picture
+	off_t iframe = -1, iframe_end = -1; // found, but its end (forward) or sequence header (backward) is still to come
+	off_t after = -1; // backward: the picture after this entry
+	for (int n = 0; ; ++n)
+	{
+		if (!(n & 255) && !current(generation))
+			return;
+		unsigned int data = (unsigned int)longdata; // only the lower bits are interesting
+			/* like findFrame: a H.264 access unit delimiter or MPEG2 picture start, and whether it is an I-frame */
+		unsigned int code = data & 0xFF;
+		bool picture = code == 0x09 || code == 0x00;
+		bool intra = (data & 0xE0FF) == 0x0009 || (data & 0x3800FF) == 0x080000;
+		if (direction > 0)
+		{
+			if (picture)
+			{
+				if (iframe >= 0)
+				{
+					if (queue(generation, iframe, where))
+						return;
+					iframe = -1;
+				}
+				if (n && ++count >= stride && intra)
+				{
+						/* MPEG2 starts at the sequence header before it */
+					iframe = sequence >= 0 ? sequence : where;
+					count -= stride;
+					if (count > stride)
+						count = stride; /* longer GOPs than the speed asks for, show every I-frame */
+				}
+				sequence = -1;
+			}
+			else if (code == 0xB3)
+				sequence = where;
+		}
+		else
+		{
+			if (iframe >= 0 && (picture || code == 0xB3))
+			{
+				if (queue(generation, code == 0xB3 ? where : iframe, iframe_end))
+					return;
+				iframe = -1;
+			}
+			if (picture)
+			{
+				if (n && ++count >= stride && intra && after >= 0)
+				{
+					iframe = where;
+					iframe_end = after;
+					count -= stride;
+					if (count > stride)
+						count = stride;
+				}
+				after = where;
+			}
+		}
+
+		while (info.getStructureEntryNext(where, longdata, direction) != 0)
+		{
+			if (direction < 0)
+				return; /* at the begin */
+				/* at the end, for now. a recording that goes on adds to its structure file */
+			eSingleLocker l(m_lock);
+			if (m_stop || generation != m_generation)
+				return;
+			m_exhausted = 1;
+			m_planned.signal();
+			waitFor(m_work, m_lock, WAIT_GROW);
+			if (m_stop || generation != m_generation)
+				return;
+		}
+	}
+}
+
+void eDVBTrickPlanner::thread()
+{
+	hasStarted();
+	eMPEGStreamInformation info;
+	if (info.loadStructure(m_filename.c_str()) < 0)
+		eDebug("[eDVBTrickPlanner] no structure file for %s, can't plan", m_filename.c_str());
+	eSingleLocker l(m_lock);
+	int planned = m_generation;
+	while (!m_stop)
+	{
+		while (!m_stop && (!m_frames || planned == m_generation))
+			m_work.wait(m_lock);
+		if (m_stop)
+			break;
+		int generation = planned = m_generation;
+		off_t offset = m_offset;
+		int frames = m_frames;
+
+		m_lock.unlock();
+		if (info.hasStructure())
+			walk(info, offset, frames, generation);
+		m_lock.lock();
+
+		if (generation == m_generation)
+		{
+				/* nothing more to plan, the pvr thread finds frames itself */
+			m_exhausted = 1;
+			m_planned.signal();
+		}
+	}
+}
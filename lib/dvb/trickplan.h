@@ -0,0 +1,63 @@
+#ifndef __lib_dvb_trickplan_h
+#define __lib_dvb_trickplan_h
+
+#include <deque>
+#include <string>
+#include <sys/types.h>
+
+#include <lib/base/elock.h>
+#include <lib/base/thread.h>
+
+class eMPEGStreamInformation;
+
+/*
+ * Plans fast forward and rewind of a recording with a structure (.sc) file:
+ * a thread walks the structure file from where playback is and queues the
+ * I-frames to show at the current speed, a bit ahead of the pvr thread. The
+ * pvr thread then takes the next one instead of searching the structure
+ * file for every span it plays.
+ */
+class eDVBTrickPlanner: public eThread
+{
+public:
+	enum {
+		MAX_PLANNED = 32, // I-frames queued ahead
+		WAIT_NEXT = 40, // ms the pvr thread waits for an I-frame that isn't planned yet
+		WAIT_GROW = 500 // ms before looking again at the end of a file that is still recorded
+	};
+
+	eDVBTrickPlanner(const std::string &filename);
+	~eDVBTrickPlanner();
+
+	/* the I-frame to play after @current_offset, one every @frames pictures,
+	   backwards when @frames is negative. -1 when there is none (yet), the
+	   caller finds one itself then. playing from anywhere else than the
+	   I-frame that was returned last starts a new plan from there. */
+	int next(off_t current_offset, int frames, off_t &offset, size_t &len);
+	/* back to normal play, forget the plan */
+	void stop();
+private:
+	struct span
+	{
+		off_t offset;
+		size_t len;
+	};
+	std::string m_filename;
+	eSingleLock m_lock;
+	eCondition m_work, m_planned;
+	std::deque<span> m_spans;
+	off_t m_offset; // where the plan starts
+	int m_frames;
+	int m_generation; // changes with every new plan
+	int m_exhausted; // the plan reached the begin or (for now) the end
+	off_t m_last_begin, m_last_end; // around the I-frame returned last
+	int m_stop;
+
+	void thread();
+	void walk(eMPEGStreamInformation &info, off_t offset, int frames, int generation);
+	int queue(int generation, off_t offset, off_t end);
+	bool current(int generation);
+	void restart(off_t offset, int frames);
+};
+
+#endif
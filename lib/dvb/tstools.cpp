@@ -1,9 +1,12 @@
 #include <lib/dvb/tstools.h>
 #include <lib/dvb/specs.h>
+#include <lib/dvb/sampleindex.h>
 #include <lib/base/eerror.h>
 #include <lib/base/cachedtssource.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include <stdio.h>
 
@@ -57,6 +60,8 @@ eDVBTSTools::eDVBTSTools():
 	m_begin_valid (0),
 	m_end_valid(0),
 	m_samples_taken(0),
+	m_samples_pending(0),
+	m_samples_generation(0),
 	m_last_filelength(0),
 	m_futile(0)
 {
@@ -95,8 +100,12 @@ void eDVBTSTools::setSource(ePtr<iTsSource> &source, const char *stream_info_fil
 	{
 		eDebug("loading streaminfo for %s", stream_info_filename);
 		m_streaminfo.load(stream_info_filename);
+		m_filename = stream_info_filename;
 	}
+	else
+		m_filename.clear();
 	m_samples_taken = 0;
+	m_samples_pending = 0;
 }
 
 	/* getPTS extracts a pts value from any PID at a given offset. */
@@ -366,8 +375,13 @@ int eDVBTSTools::getOffset(off_t &offset, pts_t &pts, int marg)
 			return -1;
 
 		if (!m_samples_taken)
-			takeSamples();
-		
+		{
+			if (m_filename.empty() || useSampleIndex() < 0)
+				takeSamples();
+		}
+		else if (m_samples_pending)
+			updateSampleIndex();
+
 		if (!m_samples.empty())
 		{
 			int maxtries = 5;
@@ -481,6 +495,15 @@ void eDVBTSTools::calcBegin()
 	if (!m_source || !m_source->valid())
 		return;
 
+	if (m_begin_valid && m_offset_begin < m_source->begin())
+	{
+		/* a timeshift ring dropped its oldest data, and with it the begin and the samples */
+		m_begin_valid = 0;
+		m_futile = 0;
+		m_samples_taken = 0;
+		m_samples.clear();
+	}
+
 	if (!(m_begin_valid || m_futile))
 	{
 		// Just ask streaminfo
@@ -497,7 +520,7 @@ void eDVBTSTools::calcBegin()
 		}
 		else
 		{
-			m_offset_begin = 0;
+			m_offset_begin = m_source->begin();
 			if (!getPTS(m_offset_begin, m_pts_begin))
 				m_begin_valid = 1;
 			else
@@ -662,6 +685,89 @@ void eDVBTSTools::takeSamples()
 	m_samples[m_pts_end - m_pts_begin] = m_offset_end;
 }
 
+int eDVBTSTools::takeSamplePass(int parts, int refine)
+{
+	m_samples_taken = 1;
+	calcBeginAndEnd();
+	if (!(m_begin_valid && m_end_valid))
+		return -1;
+
+	if (!refine)
+	{
+		m_samples.clear();
+		m_samples[0] = m_offset_begin;
+		m_samples[m_pts_end - m_pts_begin] = m_offset_end;
+	}
+
+	int taken = 0;
+	off_t length = m_offset_end - m_offset_begin;
+	for (int i = refine ? 1 : 0; i < parts; i += refine ? 2 : 1)
+	{
+		off_t offset = m_offset_begin + length * i / parts;
+		offset -= offset % 188;
+		pts_t p;
+		if (!takeSample(offset, p))
+			++taken;
+	}
+	return taken;
+}
+
+	/* use the sample index of the file, and have it built in the background when
+	   there is none yet. returns -1 when there is none and none can be built. */
+int eDVBTSTools::useSampleIndex()
+{
+	int res = loadSampleIndex();
+	if (res == 1)
+		return 0;
+
+		/* a file that is still growing (timeshift) would outdate its index right away */
+	struct stat st;
+	if (::stat(m_filename.c_str(), &st) < 0 || st.st_mtime > ::time(0) - eTSSampleIndexBuilder::SETTLE_TIME)
+		return res;
+	if (eTSSampleIndexBuilder::getInstance()->request(m_filename) < 0)
+		return res;
+	m_samples_pending = 1;
+	if (res < 0)
+	{
+			/* until the first pass is done, start with begin and end only,
+			   the refinement of each seek then adds its samples. */
+		m_samples_taken = 1;
+		m_samples.clear();
+		m_samples[0] = m_offset_begin;
+		m_samples[m_pts_end - m_pts_begin] = m_offset_end;
+	}
+	return 0;
+}
+
+	/* -1 when there is no usable index, 0 when it is incomplete, 1 when complete */
+int eDVBTSTools::loadSampleIndex()
+{
+	eTSSampleIndexBuilder *builder = eTSSampleIndexBuilder::getInstance();
+	bool busy = builder->isBusy(m_filename);
+	m_samples_generation = builder->getGeneration();
+	std::map<pts_t, off_t> samples;
+	int res = eTSSampleIndex::load(m_filename, samples);
+	if (res >= 0)
+	{
+		eDebug("using %d samples from the sample index of %s", (int)samples.size(), m_filename.c_str());
+		m_samples.swap(samples);
+		m_samples_taken = 1;
+	}
+	m_samples_pending = res != 1 && busy;
+	return res;
+}
+
+	/* pick up the samples of the passes done since the last seek */
+void eDVBTSTools::updateSampleIndex()
+{
+	eTSSampleIndexBuilder *builder = eTSSampleIndexBuilder::getInstance();
+	bool busy = builder->isBusy(m_filename);
+	if (builder->getGeneration() != m_samples_generation)
+		loadSampleIndex();
+	else if (!busy)
+		m_samples_pending = 0;
+}
+
 	/* returns 0 when a sample was taken. */
 int eDVBTSTools::takeSample(off_t off, pts_t &p)
 {
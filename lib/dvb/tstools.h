@@ -74,6 +74,13 @@ public:
 	/* Retrieve PMT. Returns 0 on success. */
 	int findPMT(eDVBPMTParser::program &program);
 
+		/* take a sample at the start of each of @parts equal parts of the file,
+		   only of every other part when @refine is set (the rest were taken by
+		   the pass with half the parts). returns the number of samples taken,
+		   -1 when begin or end are unknown. used to build the sample index. */
+	int takeSamplePass(int parts, int refine);
+	const std::map<pts_t, off_t> &getSamples() const { return m_samples; }
+
 protected:
 	void closeSource();
 
@@ -88,6 +95,10 @@ protected:
 	void takeSamples();
 	int takeSample(off_t off, pts_t &p);
 
+	int useSampleIndex();
+	int loadSampleIndex();
+	void updateSampleIndex();
+
 private:
 	int m_pid;
 
@@ -101,6 +112,9 @@ private:
 		/* for simple linear interpolation */
 	std::map<pts_t, off_t> m_samples;
 	int m_samples_taken;
+		/* the sample index is still being built, and the last generation of it we've seen */
+	int m_samples_pending, m_samples_generation;
+	std::string m_filename;
 	
 	eMPEGStreamInformation m_streaminfo;
 	off_t m_last_filelength;
@@ -0,0 +1,24 @@
+#include <unistd.h>
+
+#include <lib/base/init.h>
+#include <lib/base/init_num.h>
+#include <lib/base/metrics.h>
+#include <lib/base/wrappers.h>
+#include <lib/network/metricsserver.h>
+
+DEFINE_REF(eMetricsServer);
+
+eMetricsServer::eMetricsServer()
+ : eServerSocket(METRICS_SERVER_SOCKET, eApp)
+{
+}
+
+void eMetricsServer::newConnection(int socket)
+{
+	std::string text = eMetrics::getInstance()->text();
+	if (writeAll(socket, text.data(), text.size()) != (ssize_t)text.size())
+		eDebug("[eMetricsServer] write failed: %m");
+	::close(socket);
+}
+
+eAutoInitPtr<eMetricsServer> init_eMetricsServer(eAutoInitNumbers::service + 1, "Metrics server");
@@ -0,0 +1,23 @@
+#ifndef __metricsserver_h
+#define __metricsserver_h
+
+#include <lib/network/serversocket.h>
+
+#define METRICS_SERVER_SOCKET "/tmp/enigma2-metrics.socket"
+
+/*
+ * Writes a snapshot of eMetrics as text to everyone who connects, then
+ * hangs up, so "socat - UNIX-CONNECT:/tmp/enigma2-metrics.socket" or a
+ * monitoring script can watch the box without the python side.
+ */
+class eMetricsServer: public eServerSocket
+{
+	DECLARE_REF(eMetricsServer);
+
+	void newConnection(int socket);
+
+public:
+	eMetricsServer();
+};
+
+#endif /* __metricsserver_h */
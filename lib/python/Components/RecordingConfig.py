@@ -14,3 +14,6 @@ def InitRecordingConfig():
 		("long", _("Long filenames")) ] )
 	config.recording.offline_decode_delay = ConfigSelectionNumber(min = 1, max = 10000, stepwidth = 10, default = 1000, wraparound = True)
 	config.recording.ecm_data = ConfigSelection(choices = [("normal", _("normal")), ("descrambled+ecm", _("descramble and record ecm")), ("scrambled+ecm", _("don't descramble, record ecm"))], default = "normal")
+	config.recording.io_writer = ConfigSelection(default = "aio", choices = [("aio", _("POSIX aio")), ("io_uring", _("io_uring")), ("shared", _("shared writer per disk"))])
+	config.recording.direct_io = ConfigYesNo(default = False)
+	config.recording.preallocate = ConfigYesNo(default = False)
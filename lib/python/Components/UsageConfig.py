@@ -163,6 +163,10 @@ def InitUsageConfig():
 
 	config.usage.timeshift_path.addNotifier(timeshiftpathChanged, immediate_feedback=False)
 	config.usage.allowed_timeshift_paths = ConfigLocations(default=[resolveFilename(SCOPE_TIMESHIFT)])
+	# in MB, a fixed size file that is written over and over instead of one that grows
+	config.usage.timeshift_ring_size = ConfigSelection(default="0", choices=[("0", _("off")), ("2048", "2 GB"), ("4096", "4 GB"), ("8192", "8 GB"), ("16384", "16 GB")])
+	# in kB, for the small reads done when seeking in recordings
+	config.usage.ts_read_cache = ConfigSelection(default="1024", choices=[("256", "256 kB"), ("1024", "1 MB"), ("4096", "4 MB"), ("16384", "16 MB")])
 
 	config.usage.movielist_trashcan = ConfigYesNo(default=True)
 	config.usage.movielist_trashcan_network_clean = ConfigYesNo(default=False)
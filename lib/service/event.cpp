@@ -3,6 +3,7 @@
 #include <lib/base/encoding.h>
 #include <lib/dvb/dvbtime.h>
 #include <lib/dvb/idvb.h>
+#include <lib/dvb/epgeventview.h>
 #include <dvbsi++/event_information_section.h>
 #include <dvbsi++/short_event_descriptor.h>
 #include <dvbsi++/extended_event_descriptor.h>
@@ -169,6 +170,140 @@ bool eServiceEvent::loadLanguage(Event *evt, const std::string &lang, int tsidon
 	return retval;
 }
 
+/* same as above, but reads the raw descriptors of an event in the epg cache */
+bool eServiceEvent::loadLanguage(const eEPGEventView &view, const std::string &lang, int tsidonid)
+{
+	bool retval=0;
+	std::string language = lang;
+	for (int i = 0; i < view.descriptorCount(); ++i)
+	{
+		const __u8 *descr = view.descriptor(i);
+		int len = descr[1];
+		switch (descr[0])
+		{
+			case LINKAGE_DESCRIPTOR:
+				m_linkage_services.clear();
+				break;
+			case SHORT_EVENT_DESCRIPTOR:
+			{
+				if (len < 5 || 5 + descr[5] > len)
+					break;
+				std::string cc((const char*)&descr[2], 3);
+				std::transform(cc.begin(), cc.end(), cc.begin(), tolower);
+				int table=encodingHandler.getCountryCodeDefaultMapping(cc);
+				if (language == "---" || language.find(cc) != std::string::npos)
+				{
+					/* stick to this language, avoid merging or mixing descriptors of different languages */
+					language = cc;
+					int name_len = descr[5];
+					int text_len = descr[6 + name_len];
+					if (5 + name_len + text_len > len)
+						text_len = len - 5 - name_len;
+					m_event_name += replace_all(replace_all(convertDVBUTF8(&descr[6], name_len, table, tsidonid), "\n", " "), "\t", " ");
+					m_short_description += convertDVBUTF8(&descr[7 + name_len], text_len, table, tsidonid);
+					retval=1;
+				}
+				break;
+			}
+			case EXTENDED_EVENT_DESCRIPTOR:
+			{
+				if (len < 6 || 6 + descr[6] > len)
+					break;
+				std::string cc((const char*)&descr[3], 3);
+				std::transform(cc.begin(), cc.end(), cc.begin(), tolower);
+				int table=encodingHandler.getCountryCodeDefaultMapping(cc);
+				if (language == "---" || language.find(cc) != std::string::npos)
+				{
+					/* stick to this language, avoid merging or mixing descriptors of different languages */
+					language = cc;
+					/* see above, a long short description is continued in the extended one */
+					if (m_extended_description.empty() && m_short_description.size() >= 180)
+					{
+						m_extended_description = m_short_description;
+						m_short_description = "";
+					}
+					int items_len = descr[6];
+					int text_len = descr[7 + items_len];
+					if (6 + items_len + text_len > len)
+						text_len = len - 6 - items_len;
+					m_extended_description += convertDVBUTF8(&descr[8 + items_len], text_len, table, tsidonid);
+					retval=1;
+				}
+				break;
+			}
+			default:
+				break;
+		}
+	}
+	if ( retval == 1 )
+	{
+		for (int i = 0; i < view.descriptorCount(); ++i)
+		{
+			const __u8 *descr = view.descriptor(i);
+			int len = descr[1];
+			switch (descr[0])
+			{
+				case COMPONENT_DESCRIPTOR:
+				{
+					if (len < 6)
+						break;
+					eComponentData data;
+					data.m_streamContent = descr[2] & 0x0F;
+					data.m_componentType = descr[3];
+					data.m_componentTag = descr[4];
+					data.m_iso639LanguageCode.assign((const char*)&descr[5], 3);
+					std::transform(data.m_iso639LanguageCode.begin(), data.m_iso639LanguageCode.end(), data.m_iso639LanguageCode.begin(), tolower);
+					int table=encodingHandler.getCountryCodeDefaultMapping(data.m_iso639LanguageCode);
+					data.m_text = convertDVBUTF8(&descr[8], len - 6, table, tsidonid);
+					m_component_data.push_back(data);
+					break;
+				}
+				case LINKAGE_DESCRIPTOR:
+				{
+					if (len < 7 || descr[8] != 0xB0)
+						break;
+					eServiceReferenceDVB dvb_ref;
+					dvb_ref.type = eServiceReference::idDVB;
+					dvb_ref.setServiceType(1);
+					dvb_ref.setTransportStreamID((descr[2] << 8) | descr[3]);
+					dvb_ref.setOriginalNetworkID((descr[4] << 8) | descr[5]);
+					dvb_ref.setServiceID((descr[6] << 8) | descr[7]);
+					dvb_ref.name = convertDVBUTF8(&descr[9], len - 7, 1, tsidonid);
+					m_linkage_services.push_back(dvb_ref);
+					break;
+				}
+				case CONTENT_DESCRIPTOR:
+				{
+					for (int pos = 2; pos + 1 < len + 2; pos += 2)
+					{
+						eGenreData data;
+						data.m_level1 = descr[pos] >> 4;
+						data.m_level2 = descr[pos] & 0x0F;
+						data.m_user1  = descr[pos + 1] >> 4;
+						data.m_user2  = descr[pos + 1] & 0x0F;
+						m_genres.push_back(data);
+					}
+					break;
+				}
+				case PARENTAL_RATING_DESCRIPTOR:
+				{
+					for (int pos = 2; pos + 3 < len + 2; pos += 4)
+					{
+						eParentalData data;
+						data.m_country_code.assign((const char*)&descr[pos], 3);
+						data.m_rating = descr[pos + 3];
+						m_ratings.push_back(data);
+					}
+					break;
+				}
+			}
+		}
+	}
+	if ( m_extended_description.find(m_short_description) == 0 )
+		m_short_description="";
+	return retval;
+}
+
 RESULT eServiceEvent::parseFrom(Event *evt, int tsidonid)
 {
 	uint16_t stime_mjd = evt->getStartTimeMjd();
@@ -194,6 +329,22 @@ RESULT eServiceEvent::parseFrom(Event *evt, int tsidonid)
 	return 0;
 }
 
+RESULT eServiceEvent::parseFrom(const eEPGEventView &view, int tsidonid)
+{
+	m_begin = view.getBeginTime();
+	m_event_id = view.getEventId();
+	m_duration = view.getDuration();
+	if (m_language != "---" && loadLanguage(view, m_language, tsidonid))
+		return 0;
+	if (m_language_alternative != "---" && loadLanguage(view, m_language_alternative, tsidonid))
+		return 0;
+	if (loadLanguage(view, "eng", tsidonid))
+		return 0;
+	if (loadLanguage(view, "---", tsidonid))
+		return 0;
+	return 0;
+}
+
 RESULT eServiceEvent::parseFrom(const std::string& filename, int tsidonid)
 {
 	if (!filename.empty())
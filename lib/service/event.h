@@ -6,6 +6,7 @@
 #include <list>
 #include <string>
 class Event;
+class eEPGEventView;
 #endif
 
 #include <lib/base/object.h>
@@ -74,6 +75,7 @@ class eServiceEvent: public iObject
 {
 	DECLARE_REF(eServiceEvent);
 	bool loadLanguage(Event *event, const std::string &lang, int tsidonid);
+	bool loadLanguage(const eEPGEventView &view, const std::string &lang, int tsidonid);
 	std::list<eComponentData> m_component_data;
 	std::list<eServiceReference> m_linkage_services;
 	std::list<eGenreData> m_genres;
@@ -88,6 +90,7 @@ public:
 #ifndef SWIG
 	RESULT parseFrom(Event *evt, int tsidonid=0);
 	RESULT parseFrom(const std::string& filename, int tsidonid=0);
+	RESULT parseFrom(const eEPGEventView &view, int tsidonid=0);
 	static void setEPGLanguage(const std::string& language) { m_language = language; }
 	static void setEPGLanguageAlternative(const std::string& language) { m_language_alternative = language; }
 #endif
@@ -18,12 +18,14 @@
 #include <lib/python/python.h>
 #include <lib/base/nconfig.h> // access to python config
 #include <lib/base/httpstream.h>
+#include <lib/base/ringfile.h>
 
 		/* for subtitles */
 #include <lib/gui/esubtitle.h>
 
 #include <sys/vfs.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 
 #include <byteswap.h>
 #include <netinet/in.h>
@@ -543,6 +545,7 @@ RESULT eDVBPVRServiceOfflineOperations::getListOfFilenames(std::list<std::string
 	res.push_back(m_ref.path + ".ap");
 	res.push_back(m_ref.path + ".sc");
 	res.push_back(m_ref.path + ".cuts");
+	res.push_back(m_ref.path + ".samples");
 	std::string tmp = m_ref.path;
 	tmp.erase(m_ref.path.length()-3);
 	res.push_back(tmp + ".eit");
@@ -1020,6 +1023,7 @@ eDVBServicePlay::eDVBServicePlay(const eServiceReference &ref, eDVBService *serv
 	m_timeshift_changed(0),
 	m_save_timeshift(0),
 	m_timeshift_fd(-1),
+	m_timeshift_ring_size(0),
 	m_skipmode(0),
 	m_fastforward(0),
 	m_slowmotion(0),
@@ -1209,6 +1213,13 @@ void eDVBServicePlay::serviceEvent(int event)
 			m_first_program_info &= ~1;
 			seekTo(0);
 		}
+		if (m_first_program_info & 1 && m_is_stream)
+		{
+				/* the connection is up, we know whether we can seek now */
+			m_first_program_info &= ~1;
+			if (isSeekableStream())
+				m_event((iPlayableService*)this, evSeekableStatusChanged);
+		}
 		if (!m_timeshift_active)
 			m_event((iPlayableService*)this, evUpdatedInfo);
 
@@ -1355,10 +1366,14 @@ RESULT eDVBServicePlay::start()
 		 */
 		scrambled = (m_reference.type == eServiceFactoryDVB::id + 0x100);
 		type = eDVBServicePMTHandler::streamclient;
+			/* for when the stream turns out to be seekable */
+		m_cue = new eCueSheet();
 	}
 
 	m_first_program_info = 1;
 	ePtr<iTsSource> source = createTsSource(service, packetsize);
+	if (m_is_stream)
+		m_stream_source = source;
 	m_service_handler.tuneExt(service, m_is_pvr, source, service.path.c_str(), m_cue, false, m_dvb_service, type, scrambled);
 
 	if (m_is_pvr)
@@ -1443,7 +1458,7 @@ RESULT eDVBServicePlay::pause(ePtr<iPauseableService> &ptr)
 		/* note: we check for timeshift to be enabled,
 		   not neccessary active. if you pause when timeshift
 		   is not active, you should activate it when unpausing */
-	if ((!m_is_pvr) && (!m_timeshift_enabled))
+	if ((!m_is_pvr) && (!m_timeshift_enabled) && !isSeekableStream())
 	{
 		ptr = 0;
 		return -1;
@@ -1532,7 +1547,7 @@ RESULT eDVBServicePlay::setFastForward_internal(int ratio, bool final_seek)
 
 RESULT eDVBServicePlay::seek(ePtr<iSeekableService> &ptr)
 {
-	if (m_is_pvr || m_timeshift_enabled)
+	if (m_is_pvr || m_timeshift_enabled || isSeekableStream())
 	{
 		ptr = this;
 		return 0;
@@ -1662,7 +1677,7 @@ RESULT eDVBServicePlay::setTrickmode(int trick)
 
 RESULT eDVBServicePlay::isCurrentlySeekable()
 {
-	return (m_is_pvr || m_timeshift_active) ? 3 : 0; // fast forward/backward possible and seeking possible
+	return (m_is_pvr || m_timeshift_active || isSeekableStream()) ? 3 : 0; // fast forward/backward possible and seeking possible
 }
 
 RESULT eDVBServicePlay::frontendInfo(ePtr<iFrontendInformation> &ptr)
@@ -2388,12 +2403,22 @@ RESULT eDVBServicePlay::startTimeshift()
 	}
 	if (tspath[tspath.length()-1] != '/')
 		tspath.append("/");
-	tspath.append("timeshift.XXXXXX");
-	char* templ = new char[tspath.length() + 1];
-	strcpy(templ, tspath.c_str());
-	m_timeshift_fd = mkstemp(templ);
-	m_timeshift_file = std::string(templ);
-	eDebug("[eDVBServicePlay] recording to %s", templ);
+
+		/* config in MB, 0 for a file that grows as long as the timeshift runs */
+	m_timeshift_ring_size = (off_t)eConfigManager::getConfigIntValue("config.usage.timeshift_ring_size") * 1024 * 1024;
+	if (m_timeshift_ring_size)
+		m_timeshift_fd = openTimeshiftRing(tspath, m_timeshift_ring_size);
+	if (m_timeshift_fd < 0)
+	{
+		m_timeshift_ring_size = 0;
+		tspath.append("timeshift.XXXXXX");
+		char* templ = new char[tspath.length() + 1];
+		strcpy(templ, tspath.c_str());
+		m_timeshift_fd = mkstemp(templ);
+		m_timeshift_file = std::string(templ);
+		delete [] templ;
+	}
+	eDebug("[eDVBServicePlay] recording to %s", m_timeshift_file.c_str());
 
 	ofstream fileout;
 	fileout.open("/proc/stb/lcd/symbol_timeshift");
@@ -2402,8 +2427,6 @@ RESULT eDVBServicePlay::startTimeshift()
 		fileout << "1";
 	}
 
-	delete [] templ;
-
 	if (m_timeshift_fd < 0)
 	{
 		m_record = 0;
@@ -2412,7 +2435,9 @@ RESULT eDVBServicePlay::startTimeshift()
 
 	m_record->setTargetFD(m_timeshift_fd);
 	m_record->setTargetFilename(m_timeshift_file);
+	m_record->setRingSize(m_timeshift_ring_size);
 	m_record->enableAccessPoints(false); // no need for AP information during shift
+	m_record->setWritePriority(iDVBTSRecorder::priorityTimeshift);
 	m_timeshift_enabled = 1;
 
 	updateTimeshiftPids();
@@ -2447,7 +2472,12 @@ RESULT eDVBServicePlay::stopTimeshift(bool swToLive)
 		fileout << "0";
 	}
 
-	if (!m_save_timeshift)
+	if (!m_save_timeshift && m_timeshift_ring_size)
+	{
+		eDebug("[eDVBServicePlay] keep the timeshift ring for the next timeshift");
+		eBackgroundFileEraser::getInstance()->erase(m_timeshift_file + ".cuts");
+	}
+	else if (!m_save_timeshift)
 	{
 		eDebug("[eDVBServicePlay] remove timeshift files");
 		eBackgroundFileEraser::getInstance()->erase(m_timeshift_file);
@@ -2462,6 +2492,49 @@ RESULT eDVBServicePlay::stopTimeshift(bool swToLive)
 	return 0;
 }
 
+	/* ring.timeshift, or ring.timeshift.N while another timeshift has that one. the
+	   ring files stay for the next timeshift, so they are allocated only once. they
+	   don't start with "timeshift", the permanent timeshift would take them for
+	   growing timeshift files to link or to clean up. */
+int eDVBServicePlay::openTimeshiftRing(const std::string &tspath, off_t size)
+{
+	for (int i = 0; i < 4; ++i)
+	{
+		char name[32];
+		if (i)
+			snprintf(name, sizeof(name), "ring.timeshift.%d", i);
+		else
+			strcpy(name, "ring.timeshift");
+		std::string filename = tspath + name;
+		int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_LARGEFILE, 0644);
+		if (fd < 0)
+		{
+			eDebug("[eDVBServicePlay] can't open %s: %m", filename.c_str());
+			return -1;
+		}
+		if (::flock(fd, LOCK_EX | LOCK_NB) < 0)
+		{
+			::close(fd);
+			continue;
+		}
+		struct stat st;
+		if (!::fstat(fd, &st) && st.st_size > size)
+			::ftruncate(fd, size);
+		if (::fallocate(fd, 0, 0, size) < 0)
+		{
+			eDebug("[eDVBServicePlay] can't allocate %s (%m), timeshift to a growing file", filename.c_str());
+			::close(fd);
+			::unlink(filename.c_str());
+			::unlink((filename + ".sc").c_str());
+			return -1;
+		}
+		m_timeshift_file = filename;
+		return fd;
+	}
+	eDebug("[eDVBServicePlay] all timeshift rings are in use");
+	return -1;
+}
+
 int eDVBServicePlay::isTimeshiftActive()
 {
 	return m_timeshift_enabled && m_timeshift_active;
@@ -2477,6 +2550,10 @@ RESULT eDVBServicePlay::saveTimeshiftFile()
 	if (!m_timeshift_enabled)
                 return -1;
 
+		/* a ring doesn't start at the start of its file, it can't become a recording */
+	if (m_timeshift_ring_size)
+		return -1;
+
 	m_save_timeshift = 1;
 
 	return 0;
@@ -2707,6 +2784,10 @@ ePtr<iTsSource> eDVBServicePlay::createTsSource(eServiceReferenceDVB &ref, int p
 	}
 	else
 	{
+		eRingFile *ring = new eRingFile(packetsize);
+		ePtr<iTsSource> source = ring;
+		if (ring->open(ref.path.c_str()) >= 0)
+			return source;
 		eRawFile *f = new eRawFile(packetsize);
 		f->open(ref.path.c_str());
 		return ePtr<iTsSource>(f);
@@ -220,6 +220,10 @@ protected:
 	Signal2<void,iPlayableService*,int> m_event;
 
 	int m_is_stream;
+		/* the source of a stream, which can be seeked in when the server
+		   serves a file (see eHttpStream) */
+	ePtr<iTsSource> m_stream_source;
+	bool isSeekableStream() { return m_stream_source && !m_stream_source->isStream(); }
 
 		/* pvr */
 	int m_is_pvr, m_is_paused, m_timeshift_enabled, m_timeshift_active, m_timeshift_changed, m_save_timeshift;
@@ -227,6 +231,7 @@ protected:
 
 	std::string m_timeshift_file, m_timeshift_file_next;
 	int m_timeshift_fd;
+	off_t m_timeshift_ring_size; /* 0 when the timeshift file grows */
 	ePtr<iDVBDemux> m_decode_demux;
 
 	int m_current_audio_stream;
@@ -241,6 +246,7 @@ protected:
 
 	void resetTimeshift(int start);
 	void switchToTimeshift();
+	int openTimeshiftRing(const std::string &tspath, off_t size);
 
 	void updateDecoder(bool sendSeekableStateChanged=false);
 
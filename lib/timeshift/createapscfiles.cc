@@ -17,20 +17,35 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <byteswap.h>
 #include <errno.h>
 #include <iostream>
+#include <string>
+#include <vector>
 
 #define LEN 24064
 
+// The file is scanned in chunks of blocks of LEN bytes by several threads.
+// Within a chunk everything is as if the whole file was scanned block after
+// block, so the result is the same however many threads there are.
+#ifndef CHUNKBLOCKS
+#define CHUNKBLOCKS 512
+#endif
+#define CHUNK (LEN*CHUNKBLOCKS)
+
+// the video pid from before a chunk, not known yet when the chunk is scanned
+#define NOPID -2
+
 using namespace std;
 
 char* makefilename(const char* dir, const char* base, const char* ext, const char* post)
 {
-  static char buf[256];
+  static char buf[PATH_MAX];
   int len1, len2, len3;
   len1 = (dir ? strlen(dir) : 0);
   len2 = (base ? strlen(base) : 0);
@@ -53,23 +68,24 @@ char* makefilename(const char* dir, const char* base, const char* ext, const cha
   return buf;
 }
 
-int writebufinternal(int f, off64_t sz, off64_t tm)
+int writebufinternal(int f, const vector<off64_t>& entries)
 {
-  off64_t buf[2];
-  buf[0] = (off64_t)bswap_64((unsigned long long int)sz);
-  buf[1] = (off64_t)bswap_64((unsigned long long int)tm);
-  if (write(f, buf, 16) != 16)
+  vector<off64_t> buf(entries.size());
+  for (size_t i = 0; i < entries.size(); i++)
+    buf[i] = (off64_t)bswap_64((unsigned long long int)entries[i]);
+  size_t len = buf.size() * sizeof(off64_t);
+  if (len && write(f, &buf[0], len) != (ssize_t)len)
     return 1;
   else
     return 0;
 }
 
-int framepid(unsigned char* buf, int pos)
+int framepid(const unsigned char* buf, int pos)
 {
   return ((buf[pos+1] & 0x1f) << 8) + buf[pos+2];
 }
 
-off64_t framepts(unsigned char* buf, int pos)
+off64_t framepts(const unsigned char* buf, int pos)
 {
   int tmp = (buf[pos+3] & 0x20 ? pos+buf[pos+4]+5 : pos+4);
   off64_t pts;
@@ -87,126 +103,239 @@ off64_t framepts(unsigned char* buf, int pos)
   return pts;
 }
 
-int framesearch(int fts, int first, off64_t& retpos, off64_t& retpts, off64_t& retpos2, off64_t& retdat, int filesize)
+struct chunkresult {
+  vector<off64_t> ap;  // offset and pts pairs
+  vector<off64_t> sc;  // offset and start code data pairs
+  int pid;             // the video pid after the chunk, NOPID when the chunk didn't set it
+  int depends;         // the pid from before was needed, scan again when it is known
+  int done;
+  chunkresult() : pid(NOPID), depends(0), done(0) {}
+};
+
+// Start codes in one block of num bytes at file offset pos. Like it always
+// was, a start code in the last 6 bytes of a block isn't looked at, and an
+// MPEG2 start code turns off H264 for the rest of the block. Returns 1 when
+// pid is NOPID and a start code had to be matched against it.
+int blocksearch(const unsigned char* buf, int num, off64_t pos, int& pid, chunkresult& r)
 {
-  static unsigned char buf[LEN];
-  static int ind;
-  static off64_t pos = -1;
-  static off64_t num;
-  static int pid = -1;
-  static int st = 0;
-  static double bytecount = 0;
-  static double progress = 0.00;
-  static int sdflag = 0;
-  unsigned char* p;
-  if (pos == -1 || first) {
-    num = read(fts, buf, LEN);
-    ind = 0;
-    pos = 0;
-    st = 0;
-    sdflag = 0;
-    pid = -1;
-  }
-  while (1) {
-    p = buf+ind+st;
-    ind = -1;
-    for (; p < buf+num-6; p++) {
-
-      bytecount = bytecount + 1;
-
-      if (p[0]==0 && p[1]==0 && p[2]==1) {
-        ind = ((p - buf)/188)*188;
-        if ((p[3] & 0xf0) == 0xe0 && (buf[ind+1] & 0x40) &&
-            (p-buf)-ind == (buf[ind+3] & 0x20 ? buf[ind+4] + 5 : 4)) {
-          pid = framepid(buf, ind);
-        } else if (pid != -1 && pid != framepid(buf, ind)) {
-          ind = -1;
-          continue;
-        }
+  int sdflag = 0;
+  int last = num - 6;
+  int i = 0;
+  while (i < last) {
+    // the 1 of 00 00 01, memchr looks at a word or vector at a time
+    const unsigned char* q = (const unsigned char*)memchr(buf + i + 2, 1, last - i);
+    if (!q)
+      break;
+    i = q - buf - 2;
+    const unsigned char* p = buf + i;
+    if (p[0] != 0 || p[1] != 0) {
+      i++;
+      continue;
+    }
+    int ind = (i/188)*188;
+    if ((p[3] & 0xf0) == 0xe0 && (buf[ind+1] & 0x40) &&
+        i-ind == (buf[ind+3] & 0x20 ? buf[ind+4] + 5 : 4)) {
+      pid = framepid(buf, ind);
+    } else if (p[3]!=0 && p[3]!=0xb3 && p[3]!=0xb8 && p[3]!=0x09) {
+      i++; // not wanted whatever the pid is
+      continue;
+    } else if (pid == NOPID) {
+      return 1;
+    } else if (pid != -1 && pid != framepid(buf, ind)) {
+      i++;
+      continue;
+    }
 
-        if (p[3]==0 || p[3]==0xb3 || p[3]==0xb8) { // MPEG2
-          if (p[3]==0xb3) {
-            retpts = framepts(buf, ind);
-            retpos = pos + ind;
-          } else {
-            retpts = -1;
-            retpos = -1;
-          }
-          retdat = (unsigned int) p[3] | (p[4]<<8) | (p[5]<<16) | (p[6]<<24);
-          retpos2 = pos + (p - buf);
-          st = (p - buf) - ind + 1;
-          sdflag = 1;
-          return 1; 
-        } else if (!sdflag && p[3]==0x09 && (buf[ind+1] & 0x40)) { // H264
-          if ((p[4] >> 5)==0) {
-            retpts = framepts(buf, ind);
-            retpos = pos + ind;
-          } else {
-            retpts = -1;
-            retpos = -1;
-          }
-          retdat = p[3] | (p[4]<<8);
-          retpos2 = pos + (p - buf);
-          st = (p - buf) - ind + 1;
-          return 1; 
-        } else {
-          ind = -1;
-          continue;
+    if (p[3]==0 || p[3]==0xb3 || p[3]==0xb8) { // MPEG2
+      if (p[3]==0xb3) {
+        off64_t pts = framepts(buf, ind);
+        if (pts >= 0) {
+          r.ap.push_back(pos + ind);
+          r.ap.push_back(pts);
+        }
+      }
+      r.sc.push_back(pos + i);
+      r.sc.push_back((unsigned int) p[3] | (p[4]<<8) | (p[5]<<16) | (p[6]<<24));
+      sdflag = 1;
+    } else if (!sdflag && p[3]==0x09 && (buf[ind+1] & 0x40)) { // H264
+      if ((p[4] >> 5)==0) {
+        off64_t pts = framepts(buf, ind);
+        if (pts >= 0) {
+          r.ap.push_back(pos + ind);
+          r.ap.push_back(pts);
         }
       }
+      r.sc.push_back(pos + i);
+      r.sc.push_back(p[3] | (p[4]<<8));
     }
+    i++;
+  }
+  return 0;
+}
 
-    progress = bytecount/filesize*100;
-    cout << "\rcreating ap&sc files: ";
-    cout.width(2);
-    cout << (int)progress << "%";
-
-    st = 0;
-    sdflag = 0; // reset to get some fault tolerance
-    if (num == LEN) {
-      pos += num;
-      num = read(fts, buf, LEN);
-      ind = 0;
-    } else if (num) {
-      ind = num;
-      retpts = 0;
-      retdat = 0;
-      retpos = pos + num;
-      num = 0;
-      return -1;
-    } else {
-      retpts = 0;
-      retdat = 0;
-      retpos = 0;
+// returns 1 when the chunk has to be scanned again with the pid from before
+int chunksearch(const unsigned char* buf, int num, off64_t pos, int& pid, chunkresult& r)
+{
+  for (int i = 0; i < num; i += LEN) {
+    if (blocksearch(buf + i, (num - i < LEN ? num - i : LEN), pos + i, pid, r))
+      return 1;
+  }
+  return 0;
+}
+
+// Reads chunk k into buf, which has room for CHUNK+LEN bytes. What is past
+// the data is cleared, a PES header is looked for a bit past a block.
+int readchunk(int fts, int k, unsigned char* buf)
+{
+  int len = 0;
+  while (len < CHUNK) {
+    ssize_t n = pread64(fts, buf + len, CHUNK - len, (off64_t)k * CHUNK + len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
       return -1;
-    }
+    if (n == 0)
+      break;
+    len += n;
   }
+  memset(buf + len, 0, CHUNK + LEN - len);
+  return len;
 }
 
-int do_one(int fts, int fap, int fsc, int filesize)
+struct indexer {
+  int fts;
+  int chunks;
+  int next;     // chunk for the next worker
+  int written;  // chunks that were written out
+  int ahead;    // chunks that can be scanned before they are written
+  int error;
+  vector<chunkresult> results;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+void* worker(void* arg)
 {
-  off64_t pos;
-  off64_t pos2;
-  off64_t pts;
-  off64_t dat;
-  int first = 1;
-  while (framesearch(fts, first, pos, pts, pos2, dat, filesize) >= 0) {
-    first = 0;
-    if (pos >= 0 && pts >= 0)
-      if (fap >= 0 && writebufinternal(fap, pos, pts))
-        return 1;
-    if (fsc >= 0 && writebufinternal(fsc, pos2, dat))
-      return 1;
+  indexer* ix = (indexer*)arg;
+  unsigned char* buf = (unsigned char*)malloc(CHUNK + LEN);
+  pthread_mutex_lock(&ix->lock);
+  while (buf) {
+    while (ix->next < ix->chunks && ix->next >= ix->written + ix->ahead)
+      pthread_cond_wait(&ix->cond, &ix->lock);
+    if (ix->next >= ix->chunks)
+      break;
+    int k = ix->next++;
+    chunkresult& r = ix->results[k];
+    pthread_mutex_unlock(&ix->lock);
+
+    // the workers read one chunk after the other, let the next ones come in
+    posix_fadvise64(ix->fts, (off64_t)(k + ix->ahead) * CHUNK, CHUNK, POSIX_FADV_WILLNEED);
+    int num = readchunk(ix->fts, k, buf);
+    int pid = (k ? NOPID : -1);
+    int error = 0;
+    if (num < 0)
+      error = 1;
+    else
+      r.depends = chunksearch(buf, num, (off64_t)k * CHUNK, pid, r);
+    r.pid = pid;
+
+    pthread_mutex_lock(&ix->lock);
+    if (error)
+      ix->error = 1;
+    r.done = 1;
+    pthread_cond_broadcast(&ix->cond);
   }
+  if (!buf)
+    ix->error = 1;
+  ix->next = ix->chunks;
+  pthread_cond_broadcast(&ix->cond);
+  pthread_mutex_unlock(&ix->lock);
+  free(buf);
   return 0;
 }
 
-int do_movie(char* inname)
+int do_one(int fts, int fap, int fsc, off64_t filesize, int threads, int verbose)
+{
+  indexer ix;
+  ix.fts = fts;
+  ix.chunks = (filesize + CHUNK - 1) / CHUNK;
+  ix.next = 0;
+  ix.written = 0;
+  ix.ahead = 2 * threads;
+  ix.error = 0;
+  ix.results.resize(ix.chunks);
+  pthread_mutex_init(&ix.lock, 0);
+  pthread_cond_init(&ix.cond, 0);
+  posix_fadvise64(fts, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  vector<pthread_t> workers;
+  for (int i = 0; i < threads && i < ix.chunks; i++) {
+    pthread_t t;
+    if (pthread_create(&t, 0, worker, &ix) == 0)
+      workers.push_back(t);
+  }
+  int ret = (ix.chunks && workers.empty() ? 1 : 0);
+  unsigned char* buf = 0;
+  int pid = -1;
+  for (int k = 0; k < ix.chunks && !ret; k++) {
+    pthread_mutex_lock(&ix.lock);
+    while (!ix.results[k].done && !ix.error)
+      pthread_cond_wait(&ix.cond, &ix.lock);
+    ret = ix.error;
+    pthread_mutex_unlock(&ix.lock);
+    if (ret)
+      break;
+
+    chunkresult& r = ix.results[k];
+    if (r.depends) {
+      // the chunk has start codes before its first video PES header
+      if (!buf)
+        buf = (unsigned char*)malloc(CHUNK + LEN);
+      int num = (buf ? readchunk(fts, k, buf) : -1);
+      if (num < 0) {
+        ret = 1;
+        break;
+      }
+      chunkresult again;
+      chunksearch(buf, num, (off64_t)k * CHUNK, pid, again);
+      r.ap.swap(again.ap);
+      r.sc.swap(again.sc);
+    } else if (r.pid != NOPID)
+      pid = r.pid;
+    if ((fap >= 0 && writebufinternal(fap, r.ap)) ||
+        (fsc >= 0 && writebufinternal(fsc, r.sc)))
+      ret = 1;
+    vector<off64_t>().swap(r.ap);
+    vector<off64_t>().swap(r.sc);
+
+    if (verbose) {
+      cout << "\rcreating ap&sc files: ";
+      cout.width(2);
+      cout << (int)((k + 1) * 100LL / ix.chunks) << "%" << flush;
+    }
+    pthread_mutex_lock(&ix.lock);
+    ix.written = k + 1;
+    pthread_cond_broadcast(&ix.cond);
+    pthread_mutex_unlock(&ix.lock);
+  }
+
+  pthread_mutex_lock(&ix.lock);
+  ix.next = ix.chunks;
+  pthread_cond_broadcast(&ix.cond);
+  pthread_mutex_unlock(&ix.lock);
+  for (size_t i = 0; i < workers.size(); i++)
+    pthread_join(workers[i], 0);
+  free(buf);
+  pthread_cond_destroy(&ix.cond);
+  pthread_mutex_destroy(&ix.lock);
+  return ret;
+}
+
+int do_movie(const char* inname, int threads, int verbose)
 {
   int f_ts=-1, f_sc=-1, f_ap=-1, f_tmp=-1;
   char* tmpname;
-  long filesize;
-  FILE *fp;
+  struct stat64 st;
   tmpname = makefilename(0, inname, ".ts", 0);
   f_ts = open(tmpname, O_RDONLY | O_LARGEFILE);
 
@@ -236,20 +365,22 @@ int do_movie(char* inname)
 
   //printf("  Processing .ap and .sc of \"%s\" ... ", inname);
 
-  fp=fopen(inname,"rb");
-  fseek(fp,0L,SEEK_END);
-  filesize=ftell(fp);
-  fclose(fp);
+  if (fstat64(f_ts, &st) == -1) {
+    printf("Failed to get the size of \"%s\"\n", inname);
+    goto failure;
+  }
 
   fflush(stdout);
-  if (do_one(f_ts, f_ap, f_sc, filesize)) {
+  if (do_one(f_ts, f_ap, f_sc, st.st_size, threads, verbose)) {
     printf("\nFailed to reconstruct files for \"%s\"\n", inname);
     goto failure;
   }
 
-  cout << "\rcreating ap&sc files: ";
-  cout.width(3);
-  cout << "100" << "%\n";
+  if (verbose) {
+    cout << "\rcreating ap&sc files: ";
+    cout.width(3);
+    cout << "100" << "%\n";
+  }
 
   close(f_ts);
   close(f_ap);
@@ -271,14 +402,73 @@ int do_movie(char* inname)
   return 1;
 }
 
+int exists(const string& name)
+{
+  struct stat64 st;
+  return stat64(name.c_str(), &st) == 0;
+}
+
+// every recording below dir that has no .ap or .sc, or all with force
+int do_tree(const string& dir, int threads, int force)
+{
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    printf("Failed to open directory \"%s\"\n", dir.c_str());
+    return 1;
+  }
+  vector<string> subdirs, movies;
+  struct dirent* e;
+  while ((e = readdir(d)) != 0) {
+    if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+      continue;
+    string name = dir + (dir[dir.size()-1] == '/' ? "" : "/") + e->d_name;
+    struct stat64 st;
+    if (lstat64(name.c_str(), &st) == -1)
+      continue;
+    if (S_ISDIR(st.st_mode))
+      subdirs.push_back(name);
+    else if (S_ISREG(st.st_mode) && name.size() > 3 && !name.compare(name.size() - 3, 3, ".ts") &&
+             (force || !exists(name + ".ap") || !exists(name + ".sc") || exists(name + ".reconstruct_apsc")))
+      movies.push_back(name);
+  }
+  closedir(d);
+  int ret = 0;
+  for (size_t i = 0; i < movies.size(); i++) {
+    printf("%s\n", movies[i].c_str());
+    fflush(stdout);
+    if (do_movie(movies[i].c_str(), threads, 0))
+      ret = 1;
+  }
+  for (size_t i = 0; i < subdirs.size(); i++)
+    if (do_tree(subdirs[i], threads, force))
+      ret = 1;
+  return ret;
+}
+
 int main(int argc, char* argv[])
 {
-  if (argc == 2 && *argv[1] != '-') {
-    if (do_movie(argv[1]))
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int force = 0, tree = 0, usage = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:fr")) != -1) {
+    switch (opt) {
+    case 'j': threads = atoi(optarg); break;
+    case 'f': force = 1; break;
+    case 'r': tree = 1; break;
+    default: usage = 1; break;
+    }
+  }
+  if (threads < 1)
+    threads = 1;
+  if (!usage && optind == argc - 1) {
+    if (tree ? do_tree(argv[optind], threads, force) : do_movie(argv[optind], threads, 1))
       exit(1);
   } else {
-    printf("Usage: reconstruct_apsc movie_file\n");
+    printf("Usage: createapscfiles [-j threads] movie_file\n"
+           "       createapscfiles [-j threads] [-f] -r directory\n"
+           "  -j  threads scanning a file, default one per cpu\n"
+           "  -r  every movie below directory that has no .ap or .sc file\n"
+           "  -f  with -r, all movies\n");
     exit(1);
   }
 }
-
@@ -0,0 +1,368 @@
+/*
+ * Offline EPG cache benchmark: replays a capture of raw EIT, Freesat and
+ * MHW sections through the same code the section readers use, then runs
+ * a mix of lookups, searches and save/load against the filled cache.
+ *
+ * usage: enigma-epgreplay [options] capture
+ *   -b sections    batch size for queued sections (default 32, 1 = no batching)
+ *   -H seconds     epg history, use the age of the capture to keep its events
+ *   -n count       number of lookups of each kind (default 100000)
+ *   -s count       number of title searches (default 1000)
+ *   -f file        save the cache to file, load it again and repeat the lookups and searches
+ *
+ * The capture is a sequence of records, each made of the PID (2 bytes, big
+ * endian) followed by one complete section (3 + section_length bytes).
+ * PID 0x12 and 0x39 are fed to the EIT reader, 0xF02 to the Freesat reader,
+ * 0xD2/0xD3 and the MHW2 PIDs to the MHW readers when their filter matches.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <libsig_comp.h>
+#include <lib/base/ebase.h>
+#include <lib/base/eerror.h>
+#include <lib/base/init.h>
+#include <lib/base/init_num.h>
+#include <lib/dvb/db.h>
+#include <lib/dvb/dvb.h>
+#include <lib/dvb/dvbtime.h>
+#include <lib/dvb/epgcache.h>
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* section reader which only remembers its filter, the replay feeds the data */
+class eReplaySectionReader: public iDVBSectionReader
+{
+	DECLARE_REF(eReplaySectionReader);
+public:
+	eDVBSectionFilterMask mask;
+	bool running;
+	eReplaySectionReader(): running(false) { memset(&mask, 0, sizeof(mask)); }
+	RESULT setBufferSize(int size) { return 0; }
+	RESULT start(const eDVBSectionFilterMask &m) { mask = m; running = true; return 0; }
+	RESULT stop() { running = false; return 0; }
+	RESULT connectRead(const Slot1<void,const __u8*> &read, ePtr<eConnection> &conn) { return -1; }
+	bool matches(int pid, const __u8 *data) const
+	{
+		if (!running || mask.pid != pid)
+			return false;
+		for (int i = 0; i < 2; ++i)
+			if ((data[i ? 3 : 0] & mask.mask[i]) != (mask.data[i] & mask.mask[i]))
+				return false;
+		return true;
+	}
+};
+DEFINE_REF(eReplaySectionReader);
+
+class eLatency
+{
+	std::vector<int> m_samples; // nanoseconds
+	long long m_start;
+public:
+	void start() { m_start = now_ns(); }
+	void stop() { m_samples.push_back(now_ns() - m_start); }
+	void report(const char *name)
+	{
+		if (m_samples.empty())
+			return;
+		std::sort(m_samples.begin(), m_samples.end());
+		size_t n = m_samples.size();
+		long long total = 0;
+		for (size_t i = 0; i < n; ++i)
+			total += m_samples[i];
+		printf("%-16s %8d ops %10.0f ops/s  p50 %7.1f us  p99 %7.1f us  p99.9 %7.1f us  max %7.1f us\n",
+			name, (int)n, n * 1e9 / total,
+			m_samples[n / 2] / 1000.0, m_samples[std::min(n - 1, n * 99 / 100)] / 1000.0,
+			m_samples[std::min(n - 1, n * 999 / 1000)] / 1000.0, m_samples[n - 1] / 1000.0);
+	}
+};
+
+class eEPGReplay
+{
+	eEPGCache *m_cache;
+	eEPGCache::channel_data *m_channel;
+	ePtr<eReplaySectionReader> m_mhw, m_mhw2;
+	std::vector<eServiceReferenceDVB> m_services;
+	std::vector<std::pair<time_t, int> > m_events; // start time, event id of some cached events
+	std::vector<std::string> m_titles;
+public:
+	eEPGReplay(eEPGCache *cache)
+		:m_cache(cache), m_mhw(new eReplaySectionReader), m_mhw2(new eReplaySectionReader)
+	{
+		m_channel = new eEPGCache::channel_data(cache);
+		m_channel->isRunning = eEPGCache::NOWNEXT | eEPGCache::SCHEDULE | eEPGCache::SCHEDULE_OTHER;
+#ifdef ENABLE_MHW_EPG
+		m_channel->m_MHWReader = m_mhw;
+		m_channel->m_MHWReader2 = m_mhw2;
+		m_channel->startMHWReader(0xD3, 0x91);
+		m_channel->startMHWReader2(0x231, 0xC8, 0);
+#endif
+	}
+
+	int feed(int pid, const __u8 *data)
+	{
+		switch (pid)
+		{
+		case 0x12:
+		case 0x39:
+			if (data[0] == 0x4E || data[0] == 0x4F)
+				m_channel->readData(data, eEPGCache::NOWNEXT);
+			else if (data[0] >= 0x50 && data[0] <= 0x5F)
+				m_channel->readData(data, pid == 0x39 ? eEPGCache::VIASAT : eEPGCache::SCHEDULE);
+			else if (data[0] >= 0x60 && data[0] <= 0x6F)
+				m_channel->readData(data, eEPGCache::SCHEDULE_OTHER);
+			else
+				return 0;
+			return 1;
+#ifdef ENABLE_FREESAT
+		case 0xF02:
+			m_channel->readFreeSatScheduleOtherData(data);
+			return 1;
+#endif
+		default:
+#ifdef ENABLE_MHW_EPG
+			if (m_mhw->matches(pid, data))
+			{
+				m_channel->readMHWData(data);
+				return 1;
+			}
+			if (m_mhw2->matches(pid, data))
+			{
+				m_channel->readMHWData2(data);
+				return 1;
+			}
+#endif
+			return 0;
+		}
+	}
+
+	void replay(const std::vector<__u8> &capture)
+	{
+		int sections = 0, used = 0;
+		long long start = now_ns();
+		// MHW switches tables while reading, so feed the capture until nothing is taken anymore
+		for (int pass = 0; pass < 8; ++pass)
+		{
+			int taken = 0;
+			for (size_t pos = 0; pos + 5 <= capture.size(); )
+			{
+				int pid = (capture[pos] << 8) | capture[pos + 1];
+				const __u8 *data = &capture[pos + 2];
+				size_t size = 3 + (((data[1] & 0x0F) << 8) | data[2]);
+				pos += 2 + size;
+				if (pos > capture.size())
+					break;
+				if (pass && pid != 0xD2 && pid != 0xD3 && pid < 0x231)
+					continue;
+				if (!pass)
+					++sections;
+				taken += feed(pid, data);
+			}
+			used += taken;
+			if (!taken)
+				break;
+		}
+		m_cache->commitQueued();
+		long long elapsed = now_ns() - start;
+		printf("replayed %d sections (%d used) in %.3f s: %.0f sections/s, %u lock acquisitions\n",
+			sections, used, elapsed / 1e9, sections * 1e9 / elapsed, m_cache->m_batch_commits);
+		collect();
+	}
+
+	void collect()
+	{
+		singleLock s(eEPGCache::cache_lock);
+		// services still only in the image are read from there, like the lookups do
+		std::vector<uniqueEPGKey> keys;
+		for (eventCache::iterator it(m_cache->eventDB.begin()); it != m_cache->eventDB.end(); ++it)
+			keys.push_back(it->first);
+		for (int i = 0; m_cache->m_image && i < m_cache->m_image->serviceCount(); ++i)
+		{
+			const epgImageService &svc = m_cache->m_image->services()[i];
+			if (!m_cache->m_image->isClaimed(i))
+				keys.push_back(uniqueEPGKey(svc.sid, svc.onid, svc.tsid));
+		}
+		int events = 0;
+		for (std::vector<uniqueEPGKey>::iterator it(keys.begin()); it != keys.end(); ++it)
+		{
+			serviceEvents service;
+			if (!m_cache->readService(*it, service))
+				continue;
+			const uniqueEPGKey &key = *it;
+			m_services.push_back(eServiceReferenceDVB(eDVBNamespace(0), eTransportStreamID(key.tsid), eOriginalNetworkID(key.onid), eServiceID(key.sid), 1));
+			events += service.size();
+			for (size_t e = 0; e < service.size(); e += 1 + service.size() / 16)
+			{
+				eventData evt;
+				if (!service.get(e, evt))
+					continue;
+				m_events.push_back(std::make_pair(service.startTime(e), evt.getEventID()));
+				if (m_titles.size() < 256)
+				{
+					eEPGEventView view;
+					evt.getView(view);
+					eServiceEvent event;
+					event.parseFrom(view, (key.tsid << 16) | key.onid);
+					if (event.getEventName().length() > 4)
+						m_titles.push_back(event.getEventName().substr(1, 4));
+				}
+			}
+		}
+		printf("%d services, %d events, %d bytes cached (eventData::CacheSize)\n",
+			(int)m_services.size(), events, eventData::CacheSize);
+	}
+
+	void lookups(int count)
+	{
+		if (m_services.empty())
+			return;
+		eLatency byTime, byId, query, nownext;
+		unsigned int seed = 1;
+		for (int i = 0; i < count; ++i)
+		{
+			int n = rand_r(&seed) % m_events.size();
+			const eServiceReferenceDVB &ref = m_services[rand_r(&seed) % m_services.size()];
+			ePtr<eServiceEvent> evt;
+			byTime.start();
+			m_cache->lookupEventTime(ref, m_events[n].first + 60, evt);
+			byTime.stop();
+			byId.start();
+			m_cache->lookupEventId(ref, m_events[n].second, evt);
+			byId.stop();
+			nownext.start();
+			if (!m_cache->lookupEventTime(ref, m_events[n].first, evt))
+				m_cache->lookupEventTime(ref, evt->getBeginTime() + evt->getDuration(), evt);
+			nownext.stop();
+			if (i % 16 == 0)
+			{
+				query.start();
+				if (!m_cache->startTimeQuery(ref, m_events[n].first, 24 * 60))
+					while (!m_cache->getNextTimeEntry(evt))
+						;
+				query.stop();
+			}
+		}
+		byTime.report("lookupEventTime");
+		byId.report("lookupEventId");
+		nownext.report("now/next");
+		query.report("timeQuery 24h");
+	}
+
+	void searches(int count)
+	{
+		if (m_titles.empty())
+			return;
+		eLatency latency;
+		for (int i = 0; i < count; ++i)
+		{
+			ePyObject arg = PyTuple_New(5);
+			PyTuple_SET_ITEM(arg, 0, PyString_FromString("IBDT"));
+			PyTuple_SET_ITEM(arg, 1, PyInt_FromLong(100));
+			PyTuple_SET_ITEM(arg, 2, PyInt_FromLong(eEPGCache::PARTIAL_TITLE_SEARCH));
+			PyTuple_SET_ITEM(arg, 3, PyString_FromString(m_titles[i % m_titles.size()].c_str()));
+			PyTuple_SET_ITEM(arg, 4, PyInt_FromLong(eEPGCache::NO_CASE_CHECK));
+			latency.start();
+			PyObject *result = m_cache->search(arg);
+			latency.stop();
+			Py_XDECREF(result);
+			Py_DECREF(arg);
+		}
+		latency.report("search");
+	}
+
+	static int cacheSize() { return eventData::CacheSize; }
+
+	void saveLoad(const char *filename)
+	{
+		eLatency save, load;
+		m_cache->m_filename = filename;
+		save.start();
+		m_cache->writeSnapshot(); // save() would write it in the background
+		save.stop();
+		m_cache->flushEPG();
+		load.start();
+		m_cache->load();
+		load.stop();
+		save.report("save");
+		load.report("load");
+		m_services.clear();
+		m_events.clear();
+		collect();
+	}
+};
+
+int main(int argc, char **argv)
+{
+	int batch = 32, count = 100000, searches = 1000, history = 0;
+	const char *file = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:H:n:s:f:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b': batch = atoi(optarg); break;
+		case 'H': history = atoi(optarg); break;
+		case 'n': count = atoi(optarg); break;
+		case 's': searches = atoi(optarg); break;
+		case 'f': file = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-b batch] [-H history] [-n lookups] [-s searches] [-f epg.dat] capture\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc)
+	{
+		fprintf(stderr, "no capture given\n");
+		return 1;
+	}
+
+	std::vector<__u8> capture;
+	FILE *f = fopen(argv[optind], "rb");
+	if (!f)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	__u8 buffer[65536];
+	size_t rd;
+	while ((rd = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		capture.insert(capture.end(), buffer, buffer + rd);
+	fclose(f);
+
+	Py_Initialize();
+	eInit init;
+	init.setRunlevel(eAutoInitNumbers::main);
+	ePtr<eDVBLocalTimeHandler> time_handler = new eDVBLocalTimeHandler();
+	ePtr<eEPGCache> cache = new eEPGCache();
+	cache->setEpgSources(0xFFFFFFFF);
+	cache->setEpgHistorySeconds(history);
+	cache->setEpgBatch(batch, 100);
+
+	eEPGReplay replay(cache);
+	replay.replay(capture);
+	replay.lookups(count);
+	replay.searches(searches);
+	if (file)
+	{
+		replay.saveLoad(file);
+		// the same lookups and searches, now served from the mapped file
+		replay.lookups(count);
+		replay.searches(searches);
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("peak RSS %ld kB, eventData::CacheSize %d bytes\n", usage.ru_maxrss, eEPGReplay::cacheSize());
+	return 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * EPG cache stress test: one thread keeps feeding EIT schedule sections
+ * through channel_data::readData(), the path the section readers take,
+ * while several reader threads do now/next lookups like the service list
+ * does. Reports the ingest rate and the latency distribution seen by the
+ * readers.
+ *
+ * usage: enigma-epgstress [seconds] [readers] [services] [pause]
+ *
+ * pause is the time in us a reader sleeps after a lookup, like a list that
+ * is repainted now and then. Without it the readers keep the CPUs busy, and
+ * on a single core their latency is mostly waiting for their turn.
+ *
+ * Every round sends 7 days of 30 minute events for all services, with a
+ * different short text each round, so the events are really replaced.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+#include <libsig_comp.h>
+#include <lib/base/ebase.h>
+#include <lib/base/eerror.h>
+#include <lib/base/init.h>
+#include <lib/base/init_num.h>
+#include <lib/base/thread.h>
+#include <lib/dvb/crc32.h>
+#include <lib/dvb/db.h>
+#include <lib/dvb/dvb.h>
+#include <lib/dvb/dvbtime.h>
+#include <lib/dvb/epgcache.h>
+
+static volatile bool stop;
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static eServiceReferenceDVB makeRef(int i)
+{
+	return eServiceReferenceDVB(eDVBNamespace(0x00c00000), eTransportStreamID(1 + i / 16), eOriginalNetworkID(1), eServiceID(100 + i), 1);
+}
+
+/* feeds generated schedule sections to a channel_data, like its section readers would */
+class eEPGStress
+{
+	enum { EVENTS = 7 * 48, EVENTS_PER_SECTION = 4 };
+	eEPGCache *m_cache;
+	eEPGCache::channel_data *m_channel;
+	time_t m_base;
+
+	static __u8 *putTime(__u8 *p, time_t t)
+	{
+		int mjd = t / 86400 + 40587, s = t % 86400;
+		*p++ = mjd >> 8;
+		*p++ = mjd & 0xFF;
+		*p++ = toBCD(s / 3600);
+		*p++ = toBCD(s % 3600 / 60);
+		*p++ = toBCD(s % 60);
+		return p;
+	}
+
+	int buildSection(__u8 *section, int service, int number, int round)
+	{
+		static const char *words[] = { "News", "Weather", "Football", "Cooking", "Drama", "Movie", "Quiz", "Nature", "History", "Music" };
+		int sid = 100 + service, tsid = 1 + service / 16, onid = 1;
+		int sections = EVENTS / EVENTS_PER_SECTION;
+		__u8 *p = section + 14;
+		for (int e = number * EVENTS_PER_SECTION; e < (number + 1) * EVENTS_PER_SECTION; ++e)
+		{
+			char title[32], text[64];
+			int titlelen = snprintf(title, sizeof(title), "%s %d", words[(e + service) % 10], e % 97);
+			int textlen = snprintf(text, sizeof(text), "Episode %d of service %d, round %d", e, sid, round);
+			int descrlen = 2 + 3 + 1 + titlelen + 1 + textlen;
+			*p++ = (e + 1) >> 8;
+			*p++ = (e + 1) & 0xFF;
+			p = putTime(p, m_base + e * 1800);
+			*p++ = 0x00; // 00:30:00
+			*p++ = 0x30;
+			*p++ = 0x00;
+			*p++ = 0x80 | (descrlen >> 8);
+			*p++ = descrlen & 0xFF;
+			*p++ = 0x4D;
+			*p++ = descrlen - 2;
+			memcpy(p, "eng", 3);
+			p += 3;
+			*p++ = titlelen;
+			memcpy(p, title, titlelen);
+			p += titlelen;
+			*p++ = textlen;
+			memcpy(p, text, textlen);
+			p += textlen;
+		}
+		int length = p - section + 4 - 3;
+		section[0] = 0x50;
+		section[1] = 0xF0 | (length >> 8);
+		section[2] = length & 0xFF;
+		section[3] = sid >> 8;
+		section[4] = sid & 0xFF;
+		section[5] = 0xC1 | ((round & 0x1F) << 1);
+		section[6] = number;
+		section[7] = sections - 1;
+		section[8] = tsid >> 8;
+		section[9] = tsid & 0xFF;
+		section[10] = onid >> 8;
+		section[11] = onid & 0xFF;
+		section[12] = std::min(number / 8 * 8 + 7, sections - 1);
+		section[13] = 0x50;
+		uint32_t crc = crc32(0xFFFFFFFF, section, p - section);
+		*p++ = crc >> 24;
+		*p++ = crc >> 16;
+		*p++ = crc >> 8;
+		*p++ = crc;
+		return p - section;
+	}
+public:
+	eEPGStress(eEPGCache *cache)
+		:m_cache(cache), m_base(::time(0) / 1800 * 1800 - 3600)
+	{
+		m_channel = new eEPGCache::channel_data(cache);
+		m_channel->isRunning = eEPGCache::SCHEDULE;
+	}
+
+	/* sends all sections of one round, returns the number of events */
+	int round(int services, int round)
+	{
+		// the channel only takes sections it hasn't seen yet
+		for (unsigned int i = 0; i < sizeof(m_channel->seenSections) / sizeof(m_channel->seenSections[0]); ++i)
+		{
+			m_channel->seenSections[i].clear();
+			m_channel->calcedSections[i].clear();
+		}
+		__u8 section[4096];
+		int events = 0;
+		for (int s = 0; s < services && !stop; ++s)
+		{
+			for (int n = 0; n < EVENTS / EVENTS_PER_SECTION && !stop; ++n)
+			{
+				buildSection(section, s, n, round);
+				m_channel->readData(section, eEPGCache::SCHEDULE);
+				events += EVENTS_PER_SECTION;
+			}
+		}
+		m_cache->commitQueued();
+		return events;
+	}
+};
+
+class eIngestThread: public eThread
+{
+	eEPGStress &m_stress;
+	int m_services;
+public:
+	int events, rounds;
+	eIngestThread(eEPGStress &stress, int services): m_stress(stress), m_services(services), events(0), rounds(0) {}
+	void thread()
+	{
+		hasStarted();
+		while (!stop)
+			events += m_stress.round(m_services, rounds++);
+	}
+};
+
+class eLookupThread: public eThread
+{
+	int m_services, m_pause;
+public:
+	std::vector<int> samples; // microseconds
+	eLookupThread(int services, int pause): m_services(services), m_pause(pause) {}
+	void thread()
+	{
+		hasStarted();
+		unsigned int seed = (unsigned long)this;
+		while (!stop)
+		{
+			eServiceReferenceDVB ref = makeRef(rand_r(&seed) % m_services);
+			ePtr<eServiceEvent> now, next;
+			long long start = now_ns();
+			if (!eEPGCache::getInstance()->lookupEventTime(ref, -1, now))
+				eEPGCache::getInstance()->lookupEventTime(ref, now->getBeginTime() + now->getDuration(), next);
+			samples.push_back((now_ns() - start) / 1000);
+			if (m_pause)
+				usleep(m_pause);
+		}
+	}
+};
+
+static int percentile(const std::vector<int> &sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+int main(int argc, char **argv)
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : 10;
+	int readers = argc > 2 ? atoi(argv[2]) : 4;
+	int services = argc > 3 ? atoi(argv[3]) : 200;
+	int pause = argc > 4 ? atoi(argv[4]) : 0;
+
+	eInit init;
+	init.setRunlevel(eAutoInitNumbers::main);
+	ePtr<eDVBLocalTimeHandler> time_handler = new eDVBLocalTimeHandler();
+	ePtr<eEPGCache> cache = new eEPGCache();
+	cache->setEpgSources(0xFFFFFFFF);
+
+	eEPGStress stress(cache);
+	// fill the cache once, so the readers find something from the start
+	stress.round(services, 0);
+
+	eIngestThread ingest(stress, services);
+	ingest.rounds = 1;
+	std::vector<eLookupThread*> lookups;
+	for (int i = 0; i < readers; ++i)
+		lookups.push_back(new eLookupThread(services, pause));
+
+	ingest.run();
+	for (int i = 0; i < readers; ++i)
+		lookups[i]->run();
+	sleep(seconds);
+	stop = true;
+	ingest.kill();
+
+	std::vector<int> all;
+	for (int i = 0; i < readers; ++i)
+	{
+		lookups[i]->kill();
+		all.insert(all.end(), lookups[i]->samples.begin(), lookups[i]->samples.end());
+		delete lookups[i];
+	}
+	std::sort(all.begin(), all.end());
+	printf("%d events in %d rounds ingested (%d events/s), %d lookups by %d readers in %d s\n",
+		ingest.events, ingest.rounds - 1, ingest.events / seconds, (int)all.size(), readers, seconds);
+	printf("reader latency (us): p50 %d  p90 %d  p99 %d  p99.9 %d  p99.99 %d  max %d\n",
+		percentile(all, 0.5), percentile(all, 0.9), percentile(all, 0.99), percentile(all, 0.999),
+		percentile(all, 0.9999), all.empty() ? 0 : all.back());
+	return 0;
+}
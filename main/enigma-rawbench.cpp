@@ -0,0 +1,194 @@
+/*
+ * Split recording read benchmark: reads a recording that is split into
+ * parts (file.ts, file.ts.001, ...) through eRawFile at random offsets, the
+ * way seeking and eDVBTSTools sampling do, from one or more threads.
+ *
+ * usage: enigma-rawbench [options] file.ts
+ *   -c parts       create the recording first with this many parts (default 0, use an existing one)
+ *   -S mb          size of a created part (default 64)
+ *   -b bytes       bytes per read (default 188 * 16)
+ *   -n reads       reads per thread (default 100000)
+ *   -j threads     threads reading from the same eRawFile (default 1)
+ *
+ * Created parts hold packets numbered by their offset, every read is
+ * checked against that, so the benchmark also fails on reads from the
+ * wrong part.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <lib/base/eerror.h>
+#include <lib/base/rawfile.h>
+#include <lib/base/thread.h>
+
+static double now_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::string partName(const char *basename, int nr)
+{
+	std::string name = basename;
+	if (nr)
+	{
+		char suffix[5];
+		snprintf(suffix, 5, ".%03d", nr);
+		name += suffix;
+	}
+	return name;
+}
+
+/* packets of 188 bytes, each with its own offset after the sync byte */
+static int createParts(const char *basename, int parts, off_t partsize)
+{
+	std::vector<unsigned char> packet(188, 0xFF);
+	for (int nr = 0; nr < parts; ++nr)
+	{
+		FILE *f = fopen(partName(basename, nr).c_str(), "wb");
+		if (!f)
+		{
+			perror(partName(basename, nr).c_str());
+			return -1;
+		}
+		off_t base = partsize * nr;
+		for (off_t pos = 0; pos < partsize; pos += 188)
+		{
+			unsigned long long offset = base + pos;
+			packet[0] = 0x47;
+			memcpy(&packet[1], &offset, sizeof(offset));
+			fwrite(&packet[0], 1, 188, f);
+		}
+		fclose(f);
+	}
+	return 0;
+}
+
+class eRawBench: public eThread
+{
+	eRawFile &m_file;
+	off_t m_length;
+	int m_blocksize, m_reads;
+	bool m_check;
+	unsigned int m_seed;
+public:
+	double seconds;
+	long long bytes;
+	int errors;
+	eRawBench(eRawFile &file, off_t length, int blocksize, int reads, bool check, unsigned int seed)
+		:m_file(file), m_length(length), m_blocksize(blocksize), m_reads(reads), m_check(check), m_seed(seed), seconds(0), bytes(0), errors(0)
+	{
+	}
+	void thread()
+	{
+		hasStarted();
+		std::vector<unsigned char> buffer(m_blocksize);
+		off_t packets = m_length / 188;
+		double start = now_seconds();
+		for (int i = 0; i < m_reads; ++i)
+		{
+			off_t packet = (((off_t)rand_r(&m_seed) << 31) ^ rand_r(&m_seed)) % packets;
+			off_t offset = packet * 188;
+			ssize_t ret = m_file.read(offset, &buffer[0], m_blocksize);
+			if (ret < 0)
+			{
+				++errors;
+				continue;
+			}
+			bytes += ret;
+			if (m_check && ret >= 9)
+			{
+				unsigned long long got;
+				memcpy(&got, &buffer[1], sizeof(got));
+				if (buffer[0] != 0x47 || got != (unsigned long long)offset)
+					++errors;
+			}
+		}
+		seconds = now_seconds() - start;
+	}
+};
+
+int main(int argc, char **argv)
+{
+	int create = 0, partmb = 64, blocksize = 188 * 16, reads = 100000, threads = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:S:b:n:j:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'c': create = atoi(optarg); break;
+		case 'S': partmb = atoi(optarg); break;
+		case 'b': blocksize = atoi(optarg); break;
+		case 'n': reads = atoi(optarg); break;
+		case 'j': threads = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-c parts] [-S mb] [-b bytes] [-n reads] [-j threads] file.ts\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc)
+	{
+		fprintf(stderr, "no ts file given\n");
+		return 1;
+	}
+	if (blocksize < 1)
+		blocksize = 188;
+	if (threads < 1)
+		threads = 1;
+	const char *basename = argv[optind];
+	if (create > 0)
+	{
+		/* a whole number of packets per part, like the recorder splits */
+		off_t partsize = (off_t)partmb * 1024 * 1024 / 188 * 188;
+		if (createParts(basename, create, partsize) < 0)
+			return 1;
+	}
+
+	eRawFile file;
+	if (file.open(basename) < 0)
+	{
+		perror(basename);
+		return 1;
+	}
+	off_t length = file.length();
+	if (length < 188)
+	{
+		fprintf(stderr, "%s is empty\n", basename);
+		return 1;
+	}
+	int parts = 0;
+	while (access(partName(basename, parts).c_str(), F_OK) == 0)
+		++parts;
+	printf("%s: %d parts, %lld bytes, %d threads doing %d reads of %d bytes\n",
+		basename, parts, (long long)length, threads, reads, blocksize);
+
+	std::vector<eRawBench*> bench;
+	for (int i = 0; i < threads; ++i)
+		bench.push_back(new eRawBench(file, length, blocksize, reads, create > 0, 1234 + i));
+	double start = now_seconds();
+	for (int i = 0; i < threads; ++i)
+		bench[i]->run();
+	int errors = 0;
+	for (int i = 0; i < threads; ++i)
+	{
+		bench[i]->kill();
+		printf("thread %d: %.0f reads/s, %.1f MB/s\n", i,
+			bench[i]->seconds > 0 ? reads / bench[i]->seconds : 0,
+			bench[i]->seconds > 0 ? bench[i]->bytes / bench[i]->seconds / (1024 * 1024) : 0);
+		errors += bench[i]->errors;
+		delete bench[i];
+	}
+	double total = now_seconds() - start;
+	printf("total: %.0f reads/s\n", total > 0 ? (double)reads * threads / total : 0);
+	if (errors)
+	{
+		printf("%d reads failed or returned the wrong data\n", errors);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Recording write benchmark: feeds a transport stream file into several
+ * recorder threads at once, each through a pipe standing in for the demux,
+ * and lets them write their recordings into a directory.
+ *
+ * usage: enigma-recbench [options] file.ts directory
+ *   -n count       recordings (default 4)
+ *   -T count       timeshift buffers on top of the recordings (default 0)
+ *   -w writer      aio (default), io_uring or shared
+ *   -d             O_DIRECT
+ *   -a             preallocate the recordings
+ *   -r mbit        bitrate of each recording, 0 = as fast as it is written (default 16)
+ *   -s seconds     duration (default 30)
+ *   -B buffers     write buffers per recording (default 20)
+ *
+ * Like the demux, a feeder drops data when its 1MB pipe is full, each drop
+ * is counted as an overflow. The worst-case buffer occupancy is the largest
+ * number of write buffers of one recording that were busy at the same time.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <lib/base/ebase.h>
+#include <lib/base/eerror.h>
+#include <lib/dvb/demux.h>
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* writes the stream into the pipe at the bitrate, or as fast as it is read */
+class eRecFeeder: public eThread
+{
+	const std::vector<unsigned char> &m_data;
+	int m_fd;
+	double m_rate; // bytes per ns, 0 = unpaced
+	long long m_end;
+public:
+	long long sent;
+	int overflows;
+	eRecFeeder(const std::vector<unsigned char> &data, int fd, int mbit, long long end)
+		:m_data(data), m_fd(fd), m_rate(mbit / 8e3), m_end(end), sent(0), overflows(0)
+	{
+		if (m_rate > 0)
+			fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+	}
+	void thread()
+	{
+		hasStarted();
+		// below PIPE_BUF, so a write is never split
+		const size_t chunk = 188 * 21;
+		long long start = now_ns();
+		long long offered = 0;
+		size_t pos = 0;
+		while (now_ns() < m_end)
+		{
+			if (pos + chunk > m_data.size())
+				pos = 0;
+			if (m_rate > 0)
+			{
+				long long due = start + (long long)(offered / m_rate);
+				long long ahead = due - now_ns();
+				if (ahead > 1000000)
+				{
+					struct timespec ts = { 0, (long)ahead };
+					nanosleep(&ts, NULL);
+				}
+			}
+			ssize_t wr = ::write(m_fd, &m_data[pos], chunk);
+			if (wr < 0 && errno == EAGAIN)
+				++overflows;
+			else if (wr < 0)
+				break;
+			else
+				sent += wr;
+			offered += chunk;
+			pos += chunk;
+		}
+		::close(m_fd);
+	}
+};
+
+int main(int argc, char **argv)
+{
+	int recordings = 4, timeshifts = 0, mbit = 16, seconds = 30, buffers = 20;
+	int writer = eDVBRecordFileThread::writerAIO;
+	bool direct = false, preallocate = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:T:w:dar:s:B:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n': recordings = atoi(optarg); break;
+		case 'T': timeshifts = atoi(optarg); break;
+		case 'w':
+			if (!strcmp(optarg, "io_uring"))
+				writer = eDVBRecordFileThread::writerURing;
+			else if (!strcmp(optarg, "shared"))
+				writer = eDVBRecordFileThread::writerShared;
+			else
+				writer = eDVBRecordFileThread::writerAIO;
+			break;
+		case 'd': direct = true; break;
+		case 'a': preallocate = true; break;
+		case 'r': mbit = atoi(optarg); break;
+		case 's': seconds = atoi(optarg); break;
+		case 'B': buffers = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n recordings] [-T timeshifts] [-w aio|io_uring|shared] [-d] [-a] [-r mbit] [-s seconds] [-B buffers] file.ts directory\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind + 2 > argc)
+	{
+		fprintf(stderr, "need a ts file and a directory\n");
+		return 1;
+	}
+	if (buffers < 2)
+		buffers = 2;
+
+	std::vector<unsigned char> data;
+	FILE *f = fopen(argv[optind], "rb");
+	if (!f)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	unsigned char buffer[65536];
+	size_t rd;
+	while ((rd = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		data.insert(data.end(), buffer, buffer + rd);
+	fclose(f);
+	if (data.size() < 188 * 21)
+	{
+		fprintf(stderr, "%s is too short\n", argv[optind]);
+		return 1;
+	}
+
+	eApplication app; // the recorders post their events to it
+	int streams = recordings + timeshifts;
+	std::vector<eDVBRecordFileThread*> recorders;
+	std::vector<eRecFeeder*> feeders;
+	std::vector<int> targets;
+	long long start = now_ns(), end = start + seconds * 1000000000LL;
+	for (int i = 0; i < streams; ++i)
+	{
+		bool timeshift = i >= recordings;
+		char name[32];
+		snprintf(name, sizeof(name), timeshift ? "/timeshift%d.ts" : "/rec%d.ts", i);
+		std::string filename = std::string(argv[optind + 1]) + name;
+		int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0666);
+		int p[2];
+		if (fd < 0 || pipe(p) < 0)
+		{
+			perror(filename.c_str());
+			return 1;
+		}
+		fcntl(p[0], F_SETPIPE_SZ, 1024 * 1024);
+		eDVBRecordFileThread *recorder = new eDVBRecordFileThread(188, buffers);
+		recorder->setTargetFD(fd);
+		recorder->setWriter(writer, direct, preallocate);
+		if (timeshift)
+			recorder->setWritePriority(eRecordIOScheduler::priorityTimeshift);
+		recorder->start(p[0]);
+		recorders.push_back(recorder);
+		feeders.push_back(new eRecFeeder(data, p[1], mbit, end));
+		targets.push_back(fd);
+	}
+	for (int i = 0; i < streams; ++i)
+		feeders[i]->run();
+	for (int i = 0; i < streams; ++i)
+		feeders[i]->kill();
+	for (int i = 0; i < streams; ++i)
+		recorders[i]->stop();
+	double elapsed = (now_ns() - start) / 1e9;
+
+	double total = 0;
+	int worst = 0;
+	for (int i = 0; i < streams; ++i)
+	{
+		struct stat st;
+		fstat(targets[i], &st);
+		const std::vector<int> &histogram = recorders[i]->getBufferUseHistogram();
+		int busy = 0;
+		for (int j = 0; j < (int)histogram.size(); ++j)
+			if (histogram[j])
+				busy = j;
+		if (busy > worst)
+			worst = busy;
+		printf("%s %d: %.1f MB written, %d overflows, at most %d of %d buffers busy\n",
+			i >= recordings ? "timeshift" : "recording", i, st.st_size / 1048576.0, feeders[i]->overflows, busy, buffers);
+		total += st.st_size;
+		::close(targets[i]);
+		delete recorders[i];
+		delete feeders[i];
+	}
+	printf("%d streams: %.1f MB/s sustained over %.1f s, worst-case occupancy %d of %d buffers\n",
+		streams, total / 1048576.0 / elapsed, elapsed, worst, buffers);
+	return 0;
+}
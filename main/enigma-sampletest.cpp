@@ -0,0 +1,325 @@
+/*
+ * Sample index test: generates a transport stream without access points,
+ * builds its .samples file the way eTSSampleIndexBuilder does and checks
+ * that eDVBTSTools picks it up, refines it and drops it once it is stale.
+ *
+ * usage: enigma-sampletest [options]
+ *   -d dir         where the recording is generated (default /tmp)
+ *   -s MB          size of the recording (default 24), from 256 MB on the
+ *                  builder needs more than one pass
+ *   -b kbit        bitrate of the recording (default 8000)
+ *
+ * Checks, in this order:
+ *  - the samples of a first pass and of a refining pass are where the pts
+ *    says, and the refining pass keeps the samples of the first one
+ *  - save() replaces a left over .samples.writing and renames it into place,
+ *    a failed rename leaves neither a broken index nor the temporary file
+ *  - load() returns what was saved, and drops the index when the size or
+ *    the mtime of the recording changed or the magic is wrong
+ *  - useSampleIndex() uses a complete index and doesn't ask the builder
+ *  - with an incomplete or stale index, useSampleIndex() starts with what
+ *    it has, the builder runs, and updateSampleIndex() picks up its passes
+ *  - getOffset() interpolates between the indexed samples
+ *
+ * Exits with 1 when a check failed.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <lib/base/eerror.h>
+#include <lib/dvb/sampleindex.h>
+#include <lib/dvb/tstools.h>
+
+enum { PES_DISTANCE = 32, PTS_BASE = 90000 * 10 }; // packets between pes headers, first pts
+
+static int failed;
+static long long bitrate = 8000000;
+
+static void check(bool ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if (!ok)
+		++failed;
+}
+
+static double now_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the offset of the pes header carrying the zero-based @pts */
+static off_t expectedOffset(pts_t pts)
+{
+	return pts * bitrate / 8 / 90000;
+}
+
+/* a video pid with a pes header every PES_DISTANCE packets, at a constant bitrate */
+static bool generate(const std::string &filename, off_t size)
+{
+	FILE *f = fopen(filename.c_str(), "wb");
+	if (!f)
+	{
+		perror(filename.c_str());
+		return false;
+	}
+	std::vector<unsigned char> chunk(188 * PES_DISTANCE * 64);
+	off_t packets = size / 188, packet = 0;
+	int cc = 0;
+	while (packet < packets)
+	{
+		size_t len = 0;
+		for (; len < chunk.size() && packet < packets; len += 188, ++packet)
+		{
+			unsigned char *p = &chunk[len];
+			memset(p, 0xFF, 188);
+			bool pusi = !(packet % PES_DISTANCE);
+			p[0] = 0x47;
+			p[1] = (pusi ? 0x40 : 0) | 0x01;
+			p[2] = 0x00;
+			p[3] = 0x10 | (cc++ & 0x0F);
+			if (!pusi)
+				continue;
+			unsigned long long pts = PTS_BASE + packet * 188 * 8 * 90000 / bitrate;
+			unsigned char *pes = p + 4;
+			pes[0] = 0x00; pes[1] = 0x00; pes[2] = 0x01; pes[3] = 0xE0;
+			pes[4] = 0x00; pes[5] = 0x00; pes[6] = 0x80; pes[7] = 0x80; pes[8] = 0x05;
+			pes[9] = 0x21 | ((pts >> 29) & 0x0E);
+			pes[10] = pts >> 22;
+			pes[11] = ((pts >> 14) & 0xFE) | 1;
+			pes[12] = pts >> 7;
+			pes[13] = ((pts << 1) & 0xFE) | 1;
+		}
+		if (fwrite(&chunk[0], len, 1, f) != 1)
+		{
+			perror(filename.c_str());
+			fclose(f);
+			return false;
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+static void setMtime(const std::string &filename, time_t mtime)
+{
+	struct timeval tv[2];
+	tv[0].tv_sec = tv[1].tv_sec = mtime;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	utimes(filename.c_str(), tv);
+}
+
+static bool exists(const std::string &filename)
+{
+	struct stat st;
+	return ::stat(filename.c_str(), &st) == 0;
+}
+
+/* every sample within a pes distance of where its pts belongs */
+static bool accurate(const std::map<pts_t, off_t> &samples)
+{
+	for (std::map<pts_t, off_t>::const_iterator i(samples.begin()); i != samples.end(); ++i)
+	{
+		off_t diff = i->second - expectedOffset(i->first);
+		if (diff < -188 * PES_DISTANCE || diff > 188 * PES_DISTANCE)
+		{
+			printf("  sample pts %lld at %lld, expected %lld\n", i->first, (long long)i->second, (long long)expectedOffset(i->first));
+			return false;
+		}
+	}
+	return samples.size() >= 2;
+}
+
+static bool contains(const std::map<pts_t, off_t> &samples, const std::map<pts_t, off_t> &subset)
+{
+	for (std::map<pts_t, off_t>::const_iterator i(subset.begin()); i != subset.end(); ++i)
+	{
+		std::map<pts_t, off_t>::const_iterator s = samples.find(i->first);
+		if (s == samples.end() || s->second != i->second)
+			return false;
+	}
+	return true;
+}
+
+/* the protected sample index interface of eDVBTSTools */
+class eSampleTestTools: public eDVBTSTools
+{
+public:
+	using eDVBTSTools::useSampleIndex;
+	using eDVBTSTools::loadSampleIndex;
+	using eDVBTSTools::updateSampleIndex;
+};
+
+/* wait until the builder is done with @filename, returns the seconds it took */
+static double waitBuilder(const std::string &filename)
+{
+	double start = now_seconds();
+	eTSSampleIndexBuilder *builder = eTSSampleIndexBuilder::getInstance();
+	while (builder->isBusy(filename) && now_seconds() - start < 300)
+		usleep(10000);
+	return now_seconds() - start;
+}
+
+int main(int argc, char **argv)
+{
+	std::string dir = "/tmp";
+	off_t size = 24 * 1024 * 1024;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:s:b:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd': dir = optarg; break;
+		case 's': size = atoll(optarg) * 1024 * 1024; break;
+		case 'b': bitrate = atoll(optarg) * 1000; break;
+		default:
+			fprintf(stderr, "usage: %s [-d dir] [-s MB] [-b kbit]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (size < 1024 * 1024 || bitrate < 100000)
+	{
+		fprintf(stderr, "recording too small or bitrate too low\n");
+		return 1;
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "/sampletest-%d.ts", (int)getpid());
+	std::string filename = dir + name;
+	std::string index = eTSSampleIndex::indexFilename(filename);
+	std::string writing = index + ".writing";
+	size -= size % 188;
+	double start = now_seconds();
+	if (!generate(filename, size))
+		return 1;
+	printf("%s: %lld bytes at %lld kbit/s, generated in %.2f s\n", filename.c_str(), (long long)size, bitrate / 1000, now_seconds() - start);
+	// the builder leaves recordings alone which changed in the last SETTLE_TIME seconds
+	time_t mtime = ::time(0) - 2 * eTSSampleIndexBuilder::SETTLE_TIME;
+	setMtime(filename, mtime);
+	struct stat st;
+	::stat(filename.c_str(), &st);
+
+	std::map<pts_t, off_t> loaded;
+	check(eTSSampleIndex::load(filename, loaded) == -1, "no index without a .samples file");
+
+	/* the passes of the builder, by hand */
+	std::map<pts_t, off_t> first, refined;
+	{
+		eDVBTSTools tools;
+		check(tools.openFile(filename.c_str(), 1) == 0, "open recording");
+		start = now_seconds();
+		int taken = tools.takeSamplePass(8, 0);
+		first = tools.getSamples();
+		printf("  first pass: %d samples taken, %d in total, %.3f s\n", taken, (int)first.size(), now_seconds() - start);
+		check(taken > 0 && accurate(first), "first pass samples");
+		start = now_seconds();
+		taken = tools.takeSamplePass(16, 1);
+		refined = tools.getSamples();
+		printf("  refining pass: %d samples taken, %d in total, %.3f s\n", taken, (int)refined.size(), now_seconds() - start);
+		check(taken > 0 && refined.size() > first.size() && accurate(refined), "refining pass samples");
+		check(contains(refined, first), "refining pass keeps the first pass");
+	}
+
+	/* saving through the temporary file */
+	FILE *f = fopen(writing.c_str(), "wb");
+	if (f)
+	{
+		fputs("left over from a crash", f);
+		fclose(f);
+	}
+	check(eTSSampleIndex::save(filename, st, first, false) == 0, "save incomplete index over a left over temporary file");
+	check(!exists(writing) && exists(index), "temporary file renamed into place");
+	check(eTSSampleIndex::load(filename, loaded) == 0 && loaded == first, "load incomplete index");
+	check(eTSSampleIndex::save(filename, st, refined, true) == 0, "save complete index");
+	check(eTSSampleIndex::load(filename, loaded) == 1 && loaded == refined, "load complete index");
+
+	std::string aside = index + ".aside";
+	std::string blocker = index + "/blocker";
+	::rename(index.c_str(), aside.c_str());
+	::mkdir(index.c_str(), 0755);
+	f = fopen(blocker.c_str(), "wb");
+	if (f)
+		fclose(f);
+	check(eTSSampleIndex::save(filename, st, refined, true) == -1, "save fails when the rename fails");
+	check(!exists(writing), "failed save removes the temporary file");
+	::unlink(blocker.c_str());
+	::rmdir(index.c_str());
+	::rename(aside.c_str(), index.c_str());
+
+	/* invalidation */
+	setMtime(filename, mtime + 1);
+	check(eTSSampleIndex::load(filename, loaded) == -1, "index of a recording with another mtime is stale");
+	setMtime(filename, mtime);
+	check(eTSSampleIndex::load(filename, loaded) == 1, "index valid again with the mtime it was made for");
+	if (truncate(filename.c_str(), size + 188) == 0)
+	{
+		setMtime(filename, mtime);
+		check(eTSSampleIndex::load(filename, loaded) == -1, "index of a recording with another size is stale");
+		truncate(filename.c_str(), size);
+		setMtime(filename, mtime);
+	}
+	f = fopen(index.c_str(), "r+b");
+	if (f)
+	{
+		fputc('X', f);
+		fclose(f);
+	}
+	check(eTSSampleIndex::load(filename, loaded) == -1, "index with a wrong magic is ignored");
+
+	/* eDVBTSTools with a complete index */
+	eTSSampleIndex::save(filename, st, refined, true);
+	{
+		eSampleTestTools tools;
+		tools.openFile(filename.c_str());
+		check(tools.useSampleIndex() == 0 && tools.getSamples() == refined, "useSampleIndex uses the complete index");
+		check(!eTSSampleIndexBuilder::getInstance()->isBusy(filename), "complete index not rebuilt");
+
+		std::map<pts_t, off_t>::const_iterator l = refined.begin(), u = l;
+		++u;
+		pts_t pts = (l->first + u->first) / 2;
+		off_t offset = 0;
+		check(tools.getOffset(offset, pts) == 0 && llabs(offset - expectedOffset(pts)) <= 2 * 188 * PES_DISTANCE,
+			"getOffset interpolates between the indexed samples");
+	}
+
+	/* eDVBTSTools with an incomplete index, the builder refines it */
+	eTSSampleIndex::save(filename, st, first, false);
+	{
+		eSampleTestTools tools;
+		tools.openFile(filename.c_str());
+		check(tools.useSampleIndex() == 0 && tools.getSamples() == first, "useSampleIndex starts with the incomplete index");
+		double took = waitBuilder(filename);
+		tools.updateSampleIndex();
+		printf("  builder: %d samples after %.2f s\n", (int)tools.getSamples().size(), took);
+		check(tools.getSamples().size() > first.size() && accurate(tools.getSamples()), "updateSampleIndex picks up the passes of the builder");
+		check(eTSSampleIndex::load(filename, loaded) == 1 && loaded == tools.getSamples(), "builder completed the index");
+	}
+
+	/* a stale index is rebuilt from scratch */
+	mtime -= 10;
+	setMtime(filename, mtime);
+	{
+		eSampleTestTools tools;
+		tools.openFile(filename.c_str());
+		check(tools.useSampleIndex() == 0 && tools.getSamples().size() == 2, "useSampleIndex starts with begin and end when the index is stale");
+		double took = waitBuilder(filename);
+		tools.updateSampleIndex();
+		printf("  builder: %d samples after %.2f s\n", (int)tools.getSamples().size(), took);
+		check(tools.getSamples().size() > 2 && accurate(tools.getSamples()), "stale index rebuilt");
+	}
+
+	::unlink(index.c_str());
+	::unlink(filename.c_str());
+	printf("%s\n", failed ? "FAILED" : "all checks passed");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * TS parser benchmark: runs eMPEGStreamParserTS, the parser every recording
+ * and timeshift passes its data through, over a captured transport stream
+ * held in memory, the way the recorder feeds it.
+ *
+ * usage: enigma-tsbench [options] file.ts
+ *   -p pid         timing (video) pid, default the most frequent pid
+ *   -t type        stream type, 0 = MPEG2 (default), 1 = H.264
+ *   -P size        packet size, 188 (default) or 192
+ *   -b bytes       bytes per parseData call (default packet size * 1024, like the recorder)
+ *   -j threads     parsers running in parallel, one per recording (default 1)
+ *   -r passes      passes over the file per thread (default 10)
+ *
+ * The throughput is reported per thread against the CPU time of that
+ * thread, so it is the MB/s one core can parse.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <lib/base/eerror.h>
+#include <lib/base/thread.h>
+#include <lib/dvb/pvrparse.h>
+
+static double cpu_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+class eTSBench: public eThread
+{
+	const std::vector<unsigned char> &m_data;
+	int m_pid, m_type, m_packetsize, m_blocksize, m_passes;
+public:
+	double cpu;
+	eTSBench(const std::vector<unsigned char> &data, int pid, int type, int packetsize, int blocksize, int passes)
+		:m_data(data), m_pid(pid), m_type(type), m_packetsize(packetsize), m_blocksize(blocksize), m_passes(passes), cpu(0)
+	{
+	}
+	void thread()
+	{
+		hasStarted();
+		double start = cpu_seconds();
+		for (int pass = 0; pass < m_passes; ++pass)
+		{
+			eMPEGStreamParserTS parser(m_packetsize);
+			parser.setPid(m_pid, iDVBTSRecorder::video_pid, m_type);
+			for (size_t pos = 0; pos < m_data.size(); pos += m_blocksize)
+			{
+				size_t len = m_data.size() - pos;
+				if (len > (size_t)m_blocksize)
+					len = m_blocksize;
+				parser.parseData(pos, &m_data[pos], len);
+			}
+		}
+		cpu = cpu_seconds() - start;
+	}
+};
+
+/* the pid with the most packets, not counting stuffing */
+static int frequentPid(const std::vector<unsigned char> &data, int packetsize)
+{
+	std::vector<int> count(0x2000);
+	int offset = packetsize - 188;
+	for (size_t pos = 0; pos + packetsize <= data.size(); pos += packetsize)
+	{
+		const unsigned char *hdr = &data[pos + offset];
+		if (hdr[0] == 0x47)
+			++count[((hdr[1] & 0x1F) << 8) | hdr[2]];
+	}
+	int best = 0;
+	for (int pid = 1; pid < 0x1FFF; ++pid)
+		if (count[pid] > count[best])
+			best = pid;
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	int pid = -1, type = 0, packetsize = 188, blocksize = 0, threads = 1, passes = 10;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:t:P:b:j:r:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'p': pid = strtol(optarg, NULL, 0); break;
+		case 't': type = atoi(optarg); break;
+		case 'P': packetsize = atoi(optarg); break;
+		case 'b': blocksize = atoi(optarg); break;
+		case 'j': threads = atoi(optarg); break;
+		case 'r': passes = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-p pid] [-t type] [-P packetsize] [-b blocksize] [-j threads] [-r passes] file.ts\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc)
+	{
+		fprintf(stderr, "no ts file given\n");
+		return 1;
+	}
+	if (packetsize != 188 && packetsize != 192)
+	{
+		fprintf(stderr, "packet size must be 188 or 192\n");
+		return 1;
+	}
+	if (blocksize <= 0)
+		blocksize = packetsize * 1024;
+	if (threads < 1)
+		threads = 1;
+
+	std::vector<unsigned char> data;
+	FILE *f = fopen(argv[optind], "rb");
+	if (!f)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	unsigned char buffer[65536];
+	size_t rd;
+	while ((rd = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		data.insert(data.end(), buffer, buffer + rd);
+	fclose(f);
+	if (data.empty())
+	{
+		fprintf(stderr, "%s is empty\n", argv[optind]);
+		return 1;
+	}
+	if (pid < 0)
+		pid = frequentPid(data, packetsize);
+	printf("%s: %zu bytes, pid 0x%x, type %d, %d byte packets, %d bytes per call\n",
+		argv[optind], data.size(), pid, type, packetsize, blocksize);
+
+	std::vector<eTSBench*> bench;
+	for (int i = 0; i < threads; ++i)
+		bench.push_back(new eTSBench(data, pid, type, packetsize, blocksize, passes));
+	for (int i = 0; i < threads; ++i)
+		bench[i]->run();
+	double total = 0;
+	for (int i = 0; i < threads; ++i)
+	{
+		bench[i]->kill();
+		double mb = data.size() * (double)passes / (1024 * 1024);
+		printf("thread %d: %.1f MB in %.3f s cpu, %.1f MB/s per core\n", i, mb, bench[i]->cpu, bench[i]->cpu > 0 ? mb / bench[i]->cpu : 0);
+		total += bench[i]->cpu > 0 ? mb / bench[i]->cpu : 0;
+		delete bench[i];
+	}
+	if (threads > 1)
+		printf("average %.1f MB/s per core\n", total / threads);
+	return 0;
+}